@@ -978,6 +978,7 @@ bool Module::installRelay(int id, const char* name, unsigned priority)
     m_relays |= id;
 
     MessageRelay* relay = new MessageRelay(name,this,id,priority);
+    relay->setTrackName(this->name());
     m_relayList.append(relay)->setDelete(false);
     Engine::install(relay);
     return true;
@@ -998,6 +999,8 @@ bool Module::installRelay(MessageRelay* relay)
     if (!relay || ((relay->id() & m_relays) != 0) || m_relayList.find(relay))
 	return false;
     m_relays |= relay->id();
+    if (relay->trackName().null())
+	relay->setTrackName(name());
     m_relayList.append(relay)->setDelete(false);
     Engine::install(relay);
     return true;
@@ -1429,6 +1432,12 @@ bool Driver::canRoute()
 {
     if (Engine::exiting())
 	return false;
+    // shed load only as asked by the engine overload control
+    Engine::CallAccept load = Engine::overload();
+    if (load >= Engine::Congestion)
+	return false;
+    if ((load == Engine::Partial) && !Engine::admit())
+	return false;
     if (m_maxroute && (m_routing >= m_maxroute))
 	return false;
     return true;
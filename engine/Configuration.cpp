@@ -27,31 +27,78 @@
 
 using namespace TelEngine;
 
+// Write a section and its content to an open file
+static void writeSection(FILE* f, const NamedList& sect)
+{
+    ::fprintf(f,"[%s]\n",sect.c_str());
+    unsigned int n = sect.length();
+    for (unsigned int i = 0; i < n; i++) {
+	NamedString *ns = sect.getParam(i);
+	if (ns) {
+	    // add a space after a line that ends with backslash
+	    const char* bk = ns->endsWith("\\",false) ? " " : "";
+	    ::fprintf(f,"%s=%s%s\n",ns->name().safe(),ns->safe(),bk);
+	}
+    }
+}
+
 Configuration::Configuration()
+    : m_index(0), m_indexed(0), m_changed(0), m_journal(0), m_entries(0)
 {
 }
 
 Configuration::Configuration(const char* filename, bool warn)
-    : String(filename)
+    : String(filename),
+      m_index(0), m_indexed(0), m_changed(0), m_journal(0), m_entries(0)
 {
     load(warn);
 }
 
-ObjList* Configuration::getSectHolder(const String& sect) const
+Configuration::~Configuration()
 {
-    if (sect.null())
-	return 0;
-    return const_cast<ObjList*>(m_sections.find(sect));
+    TelEngine::destruct(m_index);
+    TelEngine::destruct(m_changed);
+}
+
+// Add a section to the hash index, grow the index if it became too crowded
+void Configuration::indexSection(NamedList* sect)
+{
+    if (m_index && (m_indexed >= 4 * m_index->length()) && (m_index->length() < 1024))
+	TelEngine::destruct(m_index);
+    if (m_index) {
+	m_index->append(sect)->setDelete(false);
+	m_indexed++;
+	return;
+    }
+    // (re)build the index from the list of sections
+    unsigned int size = 4 * m_indexed + 1;
+    if (size < 17)
+	size = 17;
+    m_index = new HashList(size);
+    m_indexed = 0;
+    for (ObjList* o = m_sections.skipNull(); o; o = o->skipNext()) {
+	m_index->append(o->get())->setDelete(false);
+	m_indexed++;
+    }
+}
+
+void Configuration::unindexSection(NamedList* sect)
+{
+    if (m_index && m_index->remove(sect,false))
+	m_indexed--;
 }
 
-ObjList* Configuration::makeSectHolder(const String& sect)
+NamedList* Configuration::makeSection(const String& sect)
 {
     if (sect.null())
 	return 0;
-    ObjList *l = getSectHolder(sect);
-    if (!l)
-	l = m_sections.append(new NamedList(sect));
-    return l;
+    NamedList* nl = getSection(sect);
+    if (!nl) {
+	nl = new NamedList(sect);
+	m_sections.append(nl);
+	indexSection(nl);
+    }
+    return nl;
 }
 
 NamedList* Configuration::getSection(unsigned int index) const
@@ -61,8 +108,9 @@ NamedList* Configuration::getSection(unsigned int index) const
 
 NamedList* Configuration::getSection(const String& sect) const
 {
-    ObjList *l = getSectHolder(sect);
-    return l ? static_cast<NamedList *>(l->get()) : 0;
+    if (sect.null() || !m_index)
+	return 0;
+    return static_cast<NamedList *>((*m_index)[sect]);
 }
 
 NamedString* Configuration::getKey(const String& sect, const String& key) const
@@ -105,48 +153,60 @@ bool Configuration::getBoolValue(const String& sect, const String& key, bool def
 void Configuration::clearSection(const char* sect)
 {
     if (sect) {
-	ObjList *l = getSectHolder(sect);
-	if (l)
-	    l->remove();
+	NamedList* nl = getSection(sect);
+	if (nl) {
+	    sectionChanged(*nl);
+	    unindexSection(nl);
+	    m_sections.remove(nl);
+	}
     }
-    else
+    else {
+	if (m_changed) {
+	    for (ObjList* o = m_sections.skipNull(); o; o = o->skipNext())
+		sectionChanged(o->get()->toString());
+	}
+	TelEngine::destruct(m_index);
+	m_indexed = 0;
 	m_sections.clear();
+    }
 }
 
 // Make sure a section with a given name exists, create it if required
 NamedList* Configuration::createSection(const String& sect)
 {
-    ObjList* o = makeSectHolder(sect);
-    return o ? static_cast<NamedList*>(o->get()) : 0;
+    NamedList* nl = makeSection(sect);
+    if (nl)
+	sectionChanged(sect);
+    return nl;
 }
 
 void Configuration::clearKey(const String& sect, const String& key)
 {
     NamedList *l = getSection(sect);
-    if (l)
+    if (l) {
 	l->clearParam(key);
+	sectionChanged(sect);
+    }
 }
 
 void Configuration::addValue(const String& sect, const char* key, const char* value)
 {
     DDebug(DebugInfo,"Configuration::addValue(\"%s\",\"%s\",\"%s\")",sect.c_str(),key,value);
-    ObjList *l = makeSectHolder(sect);
-    if (!l)
-	return;
-    NamedList *n = static_cast<NamedList *>(l->get());
-    if (n)
+    NamedList *n = makeSection(sect);
+    if (n) {
 	n->addParam(key,value);
+	sectionChanged(sect);
+    }
 }
 
 void Configuration::setValue(const String& sect, const char* key, const char* value)
 {
     DDebug(DebugInfo,"Configuration::setValue(\"%s\",\"%s\",\"%s\")",sect.c_str(),key,value);
-    ObjList *l = makeSectHolder(sect);
-    if (!l)
-	return;
-    NamedList *n = static_cast<NamedList *>(l->get());
-    if (n)
+    NamedList *n = makeSection(sect);
+    if (n) {
 	n->setParam(key,value);
+	sectionChanged(sect);
+    }
 }
 
 void Configuration::setValue(const String& sect, const char* key, int value)
@@ -163,18 +223,95 @@ void Configuration::setValue(const String& sect, const char* key, bool value)
 
 bool Configuration::load(bool warn)
 {
-    m_sections.clear();
+    clearSection();
+    if (m_changed)
+	m_changed->clear();
+    m_entries = 0;
     if (null())
 	return false;
-    FILE *f = ::fopen(c_str(),"r");
-    if (f) {
-	String sect;
-	for (;;) {
-	    char buf[1024];
+    bool ok = loadFile(c_str(),false);
+    if (!ok && warn) {
+	int err = errno;
+	Debug(DebugNote,"Failed to open config file '%s', using defaults (%d: %s)",
+	    c_str(),err,strerror(err));
+    }
+    if (m_journal) {
+	// replay changes saved after the file was last written
+	String jrn = c_str();
+	jrn << ".journal";
+	if (loadFile(jrn,true)) {
+	    DDebug(DebugInfo,"Replayed %u journal entries of config file '%s'",
+		m_entries,c_str());
+	    ok = true;
+	}
+	if (m_changed)
+	    m_changed->clear();
+    }
+    return ok;
+}
+
+bool Configuration::loadFile(const char* file, bool journal)
+{
+    FILE *f = ::fopen(file,"r");
+    if (!f)
+	return false;
+    String sect;
+    for (;;) {
+	char buf[1024];
+	if (!::fgets(buf,sizeof(buf),f))
+	    break;
+
+	char *pc = ::strchr(buf,'\r');
+	if (pc)
+	    *pc = 0;
+	pc = ::strchr(buf,'\n');
+	if (pc)
+	    *pc = 0;
+	pc = buf;
+	while (*pc == ' ' || *pc == '\t')
+	    pc++;
+	switch (*pc) {
+	    case 0:
+	    case ';':
+		continue;
+	}
+	String s(pc);
+	if (journal && s.startsWith("![")) {
+	    // journal entry of a deleted section
+	    int r = s.find(']');
+	    if (r > 2)
+		clearSection(s.substr(2,r-2));
+	    sect.clear();
+	    m_entries++;
+	    continue;
+	}
+	if (s[0] == '[') {
+	    int r = s.find(']');
+	    if (r > 0) {
+		sect = s.substr(1,r-1);
+		NamedList* nl = createSection(sect);
+		if (journal) {
+		    // journal entries hold the entire section content
+		    if (nl)
+			nl->clearParams();
+		    m_entries++;
+		}
+	    }
+	    continue;
+	}
+	int q = s.find('=');
+	if (q <= 0)
+	    continue;
+	String key = s.substr(0,q).trimBlanks();
+	if (key.null())
+	    continue;
+	s = s.substr(q+1);
+	while (s.endsWith("\\",false)) {
+	    // line continues onto next
+	    s.assign(s,s.length()-1);
 	    if (!::fgets(buf,sizeof(buf),f))
 		break;
-
-	    char *pc = ::strchr(buf,'\r');
+	    pc = ::strchr(buf,'\r');
 	    if (pc)
 		*pc = 0;
 	    pc = ::strchr(buf,'\n');
@@ -183,54 +320,12 @@ bool Configuration::load(bool warn)
 	    pc = buf;
 	    while (*pc == ' ' || *pc == '\t')
 		pc++;
-	    switch (*pc) {
-		case 0:
-		case ';':
-		    continue;
-	    }
-	    String s(pc);
-	    if (s[0] == '[') {
-		int r = s.find(']');
-		if (r > 0) {
-		    sect = s.substr(1,r-1);
-		    createSection(sect);
-		}
-		continue;
-	    }
-	    int q = s.find('=');
-	    if (q <= 0)
-		continue;
-	    String key = s.substr(0,q).trimBlanks();
-	    if (key.null())
-		continue;
-	    s = s.substr(q+1);
-	    while (s.endsWith("\\",false)) {
-		// line continues onto next
-		s.assign(s,s.length()-1);
-		if (!::fgets(buf,sizeof(buf),f))
-		    break;
-		pc = ::strchr(buf,'\r');
-		if (pc)
-		    *pc = 0;
-		pc = ::strchr(buf,'\n');
-		if (pc)
-		    *pc = 0;
-		pc = buf;
-		while (*pc == ' ' || *pc == '\t')
-		    pc++;
-		s += pc;
-	    }
-	    addValue(sect,key,s.trimBlanks());
+	    s += pc;
 	}
-	::fclose(f);
-	return true;
-    }
-    if (warn) {
-	int err = errno;
-	Debug(DebugNote,"Failed to open config file '%s', using defaults (%d: %s)",
-	    c_str(),err,strerror(err));
+	addValue(sect,key,s.trimBlanks());
     }
-    return false;
+    ::fclose(f);
+    return true;
 }
 
 bool Configuration::save() const
@@ -247,18 +342,15 @@ bool Configuration::save() const
 		::fprintf(f,"\n");
 	    else
 		separ = true;
-	    ::fprintf(f,"[%s]\n",nl->c_str());
-	    unsigned int n = nl->length();
-	    for (unsigned int i = 0; i < n; i++) {
-		NamedString *ns = nl->getParam(i);
-		if (ns) {
-		    // add a space after a line that ends with backslash
-		    const char* bk = ns->endsWith("\\",false) ? " " : "";
-		    ::fprintf(f,"%s=%s%s\n",ns->name().safe(),ns->safe(),bk);
-		}
-	    }
+	    writeSection(f,*nl);
 	}
 	::fclose(f);
+	if (m_journal) {
+	    // the file holds everything now, the journal is obsolete
+	    String jrn = c_str();
+	    jrn << ".journal";
+	    File::remove(jrn);
+	}
 	return true;
     }
     int err = errno;
@@ -267,4 +359,77 @@ bool Configuration::save() const
     return false;
 }
 
+void Configuration::setJournal(unsigned int maxEntries)
+{
+    m_journal = maxEntries;
+    if (!m_journal) {
+	TelEngine::destruct(m_changed);
+	m_entries = 0;
+    }
+    else if (!m_changed) {
+	unsigned int size = m_journal / 8;
+	if (size < 17)
+	    size = 17;
+	m_changed = new HashList(size);
+    }
+}
+
+void Configuration::sectionChanged(const String& sect)
+{
+    if (m_changed && sect && !m_changed->find(sect))
+	m_changed->append(new String(sect));
+}
+
+bool Configuration::saveChanges()
+{
+    if (!(m_journal && m_changed))
+	return save();
+    if (null())
+	return false;
+    unsigned int n = m_changed->count();
+    if (!n)
+	return true;
+    if (m_entries + n > m_journal) {
+	// journal grew too large, compact it into the file
+	if (!save())
+	    return false;
+	m_changed->clear();
+	m_entries = 0;
+	return true;
+    }
+    String jrn = c_str();
+    jrn << ".journal";
+    FILE *f = ::fopen(jrn,"a");
+    if (!f) {
+	int err = errno;
+	Debug(DebugWarn,"Failed to open config journal '%s' (%d: %s)",
+	    jrn.c_str(),err,strerror(err));
+	return false;
+    }
+    for (unsigned int i = 0; i < m_changed->length(); i++) {
+	for (ObjList* o = m_changed->getList(i); o; o = o->next()) {
+	    const String* s = static_cast<const String*>(o->get());
+	    if (!s)
+		continue;
+	    const NamedList* nl = getSection(*s);
+	    if (nl)
+		writeSection(f,*nl);
+	    else
+		::fprintf(f,"![%s]\n",s->c_str());
+	}
+    }
+    bool ok = !::ferror(f);
+    if (::fclose(f))
+	ok = false;
+    if (!ok) {
+	int err = errno;
+	Debug(DebugWarn,"Failed to write config journal '%s' (%d: %s)",
+	    jrn.c_str(),err,strerror(err));
+	return false;
+    }
+    m_changed->clear();
+    m_entries += n;
+    return true;
+}
+
 /* vi: set ts=8 sw=4 sts=4 noet: */
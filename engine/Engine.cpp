@@ -95,9 +95,39 @@ public:
 class EngineCommand : public MessageHandler
 {
 public:
-    EngineCommand() : MessageHandler("engine.command") { }
+    EngineCommand() : MessageHandler("engine.command")
+	{ setTrackName("engine"); }
     virtual bool received(Message &msg);
     static void doCompletion(Message &msg, const String& partLine, const String& partWord);
+    static void handlersStatus(Message &msg);
+};
+
+// Overload control computing the percent of new calls admitted from the
+//  message queueing delay and the call routing time
+class EngineOverload : public Mutex
+{
+public:
+    EngineOverload();
+    void init(const NamedList& params);
+    Engine::CallAccept update(MessageDispatcher& dispatcher);
+    void routed(u_int64_t usec);
+    bool admit();
+    void status(String& str) const;
+    inline bool enabled() const
+	{ return m_enabled; }
+private:
+    bool m_enabled;
+    unsigned int m_admit;
+    u_int64_t m_queueTarget;
+    u_int64_t m_routeTarget;
+    unsigned int m_decrease;
+    unsigned int m_increase;
+    unsigned int m_congestion;
+    unsigned int m_routed;
+    u_int64_t m_routeTime;
+    u_int64_t m_queueDelay;
+    u_int64_t m_routeAvg;
+    unsigned int m_shed;
 };
 
 };
@@ -165,6 +195,14 @@ static bool s_localsymbol = false;
 static bool s_logtruncate = false;
 static const char* s_logfile = 0;
 
+// Write out queued debug output before letting the engine crash
+static void crashhandler(int signal)
+{
+    Debugger::flush();
+    ::signal(signal,SIG_DFL);
+    ::raise(signal);
+}
+
 static void sighandler(int signal)
 {
     switch (signal) {
@@ -210,6 +248,7 @@ NamedList Engine::s_params("");
 
 Engine::RunMode Engine::s_mode = Engine::Stopped;
 Engine::CallAccept Engine::s_accept = Engine::Accept;
+Engine::CallAccept Engine::s_overload = Engine::Accept;
 Engine* Engine::s_self = 0;
 int Engine::s_haltcode = -1;
 int EnginePrivate::count = 0;
@@ -257,6 +296,21 @@ static ObjList* s_cmds = 0;
 static unsigned int s_runid = 0;
 
 static EngineCheck* s_engineCheck = 0;
+static EngineOverload s_overloadCtl;
+
+// Plugin being initialized and the thread running its initialization
+static const Plugin* s_initPlugin = 0;
+static const Thread* s_initThread = 0;
+
+// Sorting order of the mutex contention statistics
+static const TokenDict s_mutexOrders[] = {
+    { "locks",     Mutex::ProfileLocks },
+    { "contended", Mutex::ProfileContended },
+    { "wait",      Mutex::ProfileWait },
+    { "hold",      Mutex::ProfileHold },
+    { 0, 0 }
+};
+static int s_mutexOrder = Mutex::ProfileWait;
 
 void EngineCheck::setChecker(EngineCheck* ptr)
 {
@@ -282,7 +336,8 @@ private:
 class EngineSuperHandler : public MessageHandler
 {
 public:
-    EngineSuperHandler() : MessageHandler("engine.timer",0), m_seq(0) { }
+    EngineSuperHandler() : MessageHandler("engine.timer",0), m_seq(0)
+	{ setTrackName("engine"); }
     virtual bool received(Message &msg)
 	{ ::write(s_super_handle,&m_seq,1); m_seq++; return false; }
     char m_seq;
@@ -291,14 +346,16 @@ public:
 class EngineStatusHandler : public MessageHandler
 {
 public:
-    EngineStatusHandler() : MessageHandler("engine.status",0) { }
+    EngineStatusHandler() : MessageHandler("engine.status",0)
+	{ setTrackName("engine"); }
     virtual bool received(Message &msg);
 };
 
 class EngineHelp : public MessageHandler
 {
 public:
-    EngineHelp() : MessageHandler("engine.help") { }
+    EngineHelp() : MessageHandler("engine.help")
+	{ setTrackName("engine"); }
     virtual bool received(Message &msg);
 };
 
@@ -318,7 +375,8 @@ private:
 class EngineEventHandler : public MessageHandler
 {
 public:
-    EngineEventHandler() : MessageHandler("module.update",0) { }
+    EngineEventHandler() : MessageHandler("module.update",0)
+	{ setTrackName("engine"); }
     virtual bool received(Message &msg);
 };
 
@@ -371,6 +429,32 @@ static void initUsrPath(String& path, const char* newPath = 0)
 bool EngineStatusHandler::received(Message &msg)
 {
     const char *sel = msg.getValue("module");
+    if (sel && !::strcmp(sel,"handlers")) {
+	EngineCommand::handlersStatus(msg);
+	return true;
+    }
+    if (sel && !::strcmp(sel,"threads")) {
+	String str;
+	unsigned int n = Thread::affinityStatus(str);
+	msg.retValue() << "name=threads,type=system,format=CPUs";
+	msg.retValue() << ";count=" << Thread::count() << ",pinned=" << n;
+	if (msg.getBoolValue("details",true) && str)
+	    msg.retValue() << ";" << str;
+	msg.retValue() << "\r\n";
+	return true;
+    }
+    if (sel && !::strcmp(sel,"mutexes")) {
+	String str;
+	unsigned int n = Mutex::profileStatus(str,(Mutex::ProfileOrder)s_mutexOrder);
+	msg.retValue() << "name=mutexes,type=system";
+	msg.retValue() << ",format=Locks|Contended|WaitMs|MaxWaitUs|HoldMs|MaxHoldUs";
+	msg.retValue() << ";enabled=" << Mutex::profile() << ",count=" << n;
+	msg.retValue() << ",order=" << lookup(s_mutexOrder,s_mutexOrders);
+	if (msg.getBoolValue("details",true) && str)
+	    msg.retValue() << ";" << str;
+	msg.retValue() << "\r\n";
+	return true;
+    }
     if (sel && ::strcmp(sel,"engine"))
 	return false;
     msg.retValue() << "name=engine,type=system";
@@ -392,6 +476,16 @@ bool EngineStatusHandler::received(Message &msg)
     msg.retValue() << ",semaphores=" << Semaphore::count();
     msg.retValue() << ",waiting=" << Semaphore::locks();
     msg.retValue() << ",acceptcalls=" << lookup(Engine::accept(),Engine::getCallAcceptStates());
+    if (s_overloadCtl.enabled()) {
+	msg.retValue() << ",overload=" << lookup(Engine::overload(),Engine::getCallAcceptStates());
+	s_overloadCtl.status(msg.retValue());
+    }
+    if (Debugger::async()) {
+	unsigned int written = 0;
+	unsigned int dropped = 0;
+	Debugger::asyncStats(written,dropped);
+	msg.retValue() << ",logwritten=" << written << ",logdropped=" << dropped;
+    }
     if (msg.getBoolValue("details",true)) {
 	NamedIterator iter(Engine::runParams());
 	char sep = ';';
@@ -449,6 +543,10 @@ static const char s_cmdsOpt[] = "  module {{load|reload} modulefile|unload modul
 static const char s_cmdsMsg[] = "Controls the modules loaded in the Telephony Engine\r\n";
 static const char s_evtsOpt[] = "  events [clear] [type]\r\n";
 static const char s_evtsMsg[] = "Show or clear events or alarms collected since the engine startup\r\n";
+static const char s_hdlrOpt[] = "  handlers {on|off|reset}\r\n";
+static const char s_hdlrMsg[] = "Controls collecting message handler statistics shown by 'status handlers'\r\n";
+static const char s_mtxOpt[] = "  mutexes {on|off|reset|sort {locks|contended|wait|hold}}\r\n";
+static const char s_mtxMsg[] = "Controls collecting mutex contention statistics shown by 'status mutexes'\r\n";
 
 // get the base name of a module file
 static String moduleBase(const String& fname)
@@ -553,9 +651,26 @@ void EngineCommand::doCompletion(Message &msg, const String& partLine, const Str
     if (partLine.null() || (partLine == YSTRING("help"))) {
 	completeOne(msg.retValue(),"module",partWord);
 	completeOne(msg.retValue(),"events",partWord);
+	completeOne(msg.retValue(),"handlers",partWord);
+	completeOne(msg.retValue(),"mutexes",partWord);
     }
-    else if (partLine == YSTRING("status"))
+    else if (partLine == YSTRING("status")) {
 	completeOne(msg.retValue(),"engine",partWord);
+	completeOne(msg.retValue(),"handlers",partWord);
+	completeOne(msg.retValue(),"mutexes",partWord);
+	completeOne(msg.retValue(),"threads",partWord);
+    }
+    else if ((partLine == YSTRING("handlers")) || (partLine == YSTRING("mutexes"))) {
+	completeOne(msg.retValue(),"on",partWord);
+	completeOne(msg.retValue(),"off",partWord);
+	completeOne(msg.retValue(),"reset",partWord);
+	if (partLine == YSTRING("mutexes"))
+	    completeOne(msg.retValue(),"sort",partWord);
+    }
+    else if (partLine == YSTRING("mutexes sort")) {
+	for (const TokenDict* d = s_mutexOrders; d->token; d++)
+	    completeOne(msg.retValue(),d->token,partWord);
+    }
     else if (partLine == YSTRING("module")) {
 	completeOne(msg.retValue(),"load",partWord);
 	if (!s_nounload) {
@@ -592,6 +707,19 @@ void EngineCommand::doCompletion(Message &msg, const String& partLine, const Str
     }
 }
 
+void EngineCommand::handlersStatus(Message &msg)
+{
+    MessageDispatcher& disp = Engine::self()->m_dispatcher;
+    String str;
+    unsigned int n = disp.profileStatus(str);
+    msg.retValue() << "name=handlers,type=system";
+    msg.retValue() << ",format=Calls|TotalMs|AvgUs|MaxUs|Under100us/1ms/10ms/100ms/1s/Over";
+    msg.retValue() << ";enabled=" << disp.profile() << ",count=" << n;
+    if (msg.getBoolValue("details",true) && str)
+	msg.retValue() << ";" << str;
+    msg.retValue() << "\r\n";
+}
+
 bool EngineCommand::received(Message &msg)
 {
     String line = msg.getValue("line");
@@ -600,6 +728,32 @@ bool EngineCommand::received(Message &msg)
 	return false;
     }
     if (!line.startSkip("module")) {
+	if (line.startSkip("handlers")) {
+	    MessageDispatcher& disp = Engine::self()->m_dispatcher;
+	    if (line == YSTRING("reset")) {
+		String tmp;
+		disp.profileStatus(tmp,true);
+	    }
+	    else if (line)
+		disp.profile(line.toBoolean(disp.profile()));
+	    (msg.retValue() = "Handler statistics ") << (disp.profile() ? "enabled" : "disabled") << "\r\n";
+	    return true;
+	}
+	if (line.startSkip("mutexes")) {
+	    if (line == YSTRING("reset")) {
+		String tmp;
+		Mutex::profileStatus(tmp,Mutex::ProfileWait,true);
+	    }
+	    else if (line.startSkip("sort"))
+		s_mutexOrder = lookup(line,s_mutexOrders,s_mutexOrder);
+	    else if (line && !Mutex::profile(line.toBoolean(Mutex::profile()))) {
+		msg.retValue() = "Mutex contention profiling is not supported\r\n";
+		return true;
+	    }
+	    (msg.retValue() = "Mutex statistics ") << (Mutex::profile() ? "enabled" : "disabled")
+		<< " sorted by " << lookup(s_mutexOrder,s_mutexOrders) << "\r\n";
+	    return true;
+	}
 	if (line.startSkip("events")) {
 	    if (line.startSkip("clear")) {
 		Engine::clearEvents(line);
@@ -688,12 +842,18 @@ bool EngineHelp::received(Message &msg)
     if (line.null()) {
 	msg.retValue() << opts;
 	msg.retValue() << s_evtsOpt;
+	msg.retValue() << s_hdlrOpt;
+	msg.retValue() << s_mtxOpt;
 	return false;
     }
     if (line == YSTRING("module"))
 	msg.retValue() << opts << s_cmdsMsg;
     else if (line == YSTRING("events"))
 	msg.retValue() << s_evtsOpt << s_evtsMsg;
+    else if (line == YSTRING("handlers"))
+	msg.retValue() << s_hdlrOpt << s_hdlrMsg;
+    else if (line == YSTRING("mutexes"))
+	msg.retValue() << s_mtxOpt << s_mtxMsg;
     return true;
 }
 
@@ -708,6 +868,86 @@ void EnginePrivate::run()
 }
 
 
+EngineOverload::EngineOverload()
+    : Mutex(false,"EngineOverload"),
+      m_enabled(false), m_admit(100),
+      m_queueTarget(0), m_routeTarget(0),
+      m_decrease(0), m_increase(0), m_congestion(0),
+      m_routed(0), m_routeTime(0), m_queueDelay(0), m_routeAvg(0), m_shed(0)
+{
+}
+
+void EngineOverload::init(const NamedList& params)
+{
+    m_queueTarget = 1000 * (u_int64_t)params.getIntValue("queue_target",20,0,10000);
+    m_routeTarget = 1000 * (u_int64_t)params.getIntValue("route_target",1000,0,60000);
+    m_decrease = params.getIntValue("decrease",25,1,100);
+    m_increase = params.getIntValue("increase",5,1,100);
+    m_congestion = params.getIntValue("congestion",10,0,100);
+    m_enabled = params.getBoolValue("enable",false) && (m_queueTarget || m_routeTarget);
+    m_admit = 100;
+}
+
+// Called once a second, decrease multiplicatively the admitted calls percent
+//  while latency targets are exceeded, increase it additively otherwise
+Engine::CallAccept EngineOverload::update(MessageDispatcher& dispatcher)
+{
+    u_int64_t minDelay = 0;
+    u_int64_t maxDelay = 0;
+    unsigned int dequeued = dispatcher.queueDelay(minDelay,maxDelay);
+    if (!m_enabled)
+	return Engine::Accept;
+    lock();
+    unsigned int routed = m_routed;
+    u_int64_t routeTime = m_routeTime;
+    m_routed = 0;
+    m_routeTime = 0;
+    unlock();
+    // a standing queue shows as a large minimum delay, bursts don't count
+    m_queueDelay = dequeued ? minDelay : 0;
+    m_routeAvg = routed ? (routeTime / routed) : 0;
+    bool overload = (m_queueTarget && (m_queueDelay > m_queueTarget)) ||
+	(m_routeTarget && (m_routeAvg > m_routeTarget));
+    unsigned int admit = m_admit;
+    if (overload)
+	admit = admit * (100 - m_decrease) / 100;
+    else if ((admit += m_increase) > 100)
+	admit = 100;
+    if (admit != m_admit)
+	Debug(DebugNote,"Admitting %u%% of new calls, queue delay " FMT64U
+	    " usec, route time " FMT64U " usec",admit,m_queueDelay,m_routeAvg);
+    m_admit = admit;
+    if (admit >= 100)
+	return Engine::Accept;
+    return (admit < m_congestion) ? Engine::Congestion : Engine::Partial;
+}
+
+void EngineOverload::routed(u_int64_t usec)
+{
+    Lock lock(this);
+    m_routed++;
+    m_routeTime += usec;
+}
+
+bool EngineOverload::admit()
+{
+    unsigned int admit = m_admit;
+    if (admit >= 100)
+	return true;
+    if ((unsigned int)(Random::random() % 100) < admit)
+	return true;
+    m_shed++;
+    return false;
+}
+
+void EngineOverload::status(String& str) const
+{
+    str << ",admitcalls=" << m_admit << ",shedcalls=" << m_shed;
+    str << ",queuedelay=" << (unsigned int)(m_queueDelay / 1000);
+    str << ",routetime=" << (unsigned int)(m_routeAvg / 1000);
+}
+
+
 static bool logFileOpen()
 {
     if (s_logfile) {
@@ -1204,6 +1444,26 @@ int Engine::run()
     s_maxevents = s_cfg.getIntValue("general","maxevents",s_maxevents);
     s_restarts = s_cfg.getIntValue("general","restarts");
     m_dispatcher.warnTime(1000*(u_int64_t)s_cfg.getIntValue("general","warntime"));
+    m_dispatcher.profile(s_cfg.getBoolValue("general","handlerstats"));
+    if (s_cfg.getBoolValue("general","mutexstats") && !Mutex::profile(true))
+	Debug(DebugWarn,"Mutex contention statistics are not supported on this platform");
+    s_overloadCtl.init(*s_cfg.createSection("overload"));
+    const NamedList* affinity = s_cfg.getSection("affinity");
+    if (affinity) {
+	Thread::setAffinityMap(*affinity);
+	const String* cpus = affinity->getParam("Main");
+	if (!TelEngine::null(cpus) && !Thread::setCurrentAffinity(*cpus))
+	    Debug(DebugWarn,"Could not set CPU affinity '%s' of the main thread",cpus->c_str());
+    }
+    if (Debugger::setAsync(s_cfg.getIntValue("general","asynclog",0,0))) {
+	::signal(SIGSEGV,crashhandler);
+	::signal(SIGILL,crashhandler);
+	::signal(SIGFPE,crashhandler);
+	::signal(SIGABRT,crashhandler);
+#ifdef SIGBUS
+	::signal(SIGBUS,crashhandler);
+#endif
+    }
     extraPath(clientMode() ? "client" : "server");
     extraPath(s_cfg.getValue("general","extrapath"));
 
@@ -1355,6 +1615,7 @@ int Engine::run()
 	    t += 1000000;
 	XDebug(DebugAll,"Sleeping for %ld",t);
 	Thread::usleep(t);
+	s_overload = s_overloadCtl.update(m_dispatcher);
 	Message* m = new Message("engine.timer",0,true);
 	m->addParam("time",String((int)m->msgTime().sec()));
 	if (nodeName())
@@ -1383,6 +1644,8 @@ int Engine::run()
     checkPoint();
     // We are occasionally doing things that can cause crashes so don't abort
     abortOnBug(s_sigabrt && s_lateabrt);
+    // the output thread must not be killed with messages still queued
+    Debugger::setAsync(0);
     Thread::killall();
     checkPoint();
     m_dispatcher.dequeue();
@@ -1608,7 +1871,10 @@ void Engine::initPlugins()
     ObjList *l = plugins.skipNull();
     for (; l; l = l->skipNext()) {
 	Plugin *p = static_cast<Plugin *>(l->get());
+	s_initThread = Thread::current();
+	s_initPlugin = p;
 	p->initialize();
+	s_initPlugin = 0;
 	if (exiting()) {
 	    Output("Initialization aborted, exiting...");
 	    return;
@@ -1692,6 +1958,9 @@ bool Engine::init(const String& name)
 
 bool Engine::install(MessageHandler* handler)
 {
+    // handlers installed while initializing a plugin are tracked by its name
+    if (handler && s_initPlugin && handler->trackName().null() && (Thread::current() == s_initThread))
+	handler->setTrackName(s_initPlugin->name());
     return s_self ? s_self->m_dispatcher.install(handler) : false;
 }
 
@@ -1707,12 +1976,24 @@ bool Engine::enqueue(Message* msg)
 
 bool Engine::dispatch(Message* msg)
 {
-    return (msg && s_self) ? s_self->m_dispatcher.dispatch(*msg) : false;
+    return msg ? dispatch(*msg) : false;
 }
 
 bool Engine::dispatch(Message& msg)
 {
-    return s_self ? s_self->m_dispatcher.dispatch(msg) : false;
+    if (!s_self)
+	return false;
+    if (!(s_overloadCtl.enabled() && (msg == YSTRING("call.route"))))
+	return s_self->m_dispatcher.dispatch(msg);
+    u_int64_t t = Time::now();
+    bool ok = s_self->m_dispatcher.dispatch(msg);
+    s_overloadCtl.routed(Time::now() - t);
+    return ok;
+}
+
+bool Engine::admit()
+{
+    return s_overloadCtl.admit();
 }
 
 bool Engine::dispatch(const char* name, bool broadcast)
@@ -1779,6 +2060,7 @@ static void usage(bool client, FILE* f)
 "     a            Abort if bugs are encountered\n"
 "     m            Attempt to debug mutex deadlocks\n"
 "     d            Disable locking debugging and safety features\n"
+"     M            Use adaptive spinning mutexes if supported\n"
 #ifdef RTLD_GLOBAL
 "     l            Try to keep module symbols local\n"
 #endif
@@ -2038,6 +2320,9 @@ int Engine::main(int argc, const char** argv, const char** env, RunMode mode, bo
 				case 'd':
 				    Lockable::disableSafety();
 				    break;
+				case 'M':
+				    Mutex::adaptive(true);
+				    break;
 #ifdef RTLD_GLOBAL
 				case 'l':
 				    s_localsymbol = true;
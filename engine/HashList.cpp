@@ -26,8 +26,12 @@
 
 using namespace TelEngine;
 
+// Number of old hash entries moved to the new table on each append while resizing
+#define HASH_MIGRATE 2
+
 HashList::HashList(unsigned int size)
-    : m_size(size), m_lists(0)
+    : m_size(size), m_lists(0),
+      m_old(0), m_oldSize(0), m_moved(0), m_maxLoad(0), m_maxSize(0), m_appends(0)
 {
     XDebug(DebugAll,"HashList::HashList(%u) [%p]",size,this);
     if (m_size < 1)
@@ -56,9 +60,12 @@ void* HashList::getObject(const String& name) const
 unsigned int HashList::count() const
 {
     unsigned int c = 0;
-    for (unsigned int i = 0; i < m_size; i++)
-	if (m_lists[i])
-	    c += m_lists[i]->count();
+    unsigned int n = length();
+    for (unsigned int i = 0; i < n; i++) {
+	ObjList* l = getList(i);
+	if (l)
+	    c += l->count();
+    }
     return c;
 }
 
@@ -73,15 +80,15 @@ ObjList* HashList::find(const GenObject* obj) const
     XDebug(DebugAll,"HashList::find(%p) [%p]",obj,this);
     if (!obj)
 	return 0;
-    unsigned int i = obj->toString().hash() % m_size;
-    return m_lists[i] ? m_lists[i]->find(obj) : 0;
+    ObjList* l = getHashList(obj->toString().hash());
+    return l ? l->find(obj) : 0;
 }
 
 ObjList* HashList::find(const String& str) const
 {
     XDebug(DebugAll,"HashList::find(\"%s\") [%p]",str.c_str(),this);
-    unsigned int i = str.hash() % m_size;
-    return m_lists[i] ? m_lists[i]->find(str) : 0;
+    ObjList* l = getHashList(str.hash());
+    return l ? l->find(str) : 0;
 }
 
 ObjList* HashList::append(const GenObject* obj)
@@ -89,10 +96,18 @@ ObjList* HashList::append(const GenObject* obj)
     XDebug(DebugAll,"HashList::append(%p) [%p]",obj,this);
     if (!obj)
 	return 0;
-    unsigned int i = obj->toString().hash() % m_size;
-    if (!m_lists[i])
-	m_lists[i] = new ObjList;
-    return m_lists[i]->append(obj);
+    if (m_old)
+	migrate(HASH_MIGRATE);
+    else if (m_maxLoad && (++m_appends >= m_size)) {
+	// Check the load only once every table length appends to keep it cheap
+	m_appends = 0;
+	if ((m_size < m_maxSize) && (count() >= m_size * m_maxLoad))
+	    grow();
+    }
+    ObjList*& l = bucket(obj->toString().hash());
+    if (!l)
+	l = new ObjList;
+    return l->append(obj);
 }
 
 GenObject* HashList::remove(GenObject* obj, bool delobj)
@@ -106,6 +121,14 @@ void HashList::clear()
     XDebug(DebugAll,"HashList::clear() [%p]",this);
     for (unsigned int i = 0; i < m_size; i++)
 	TelEngine::destruct(m_lists[i]);
+    if (m_old) {
+	for (unsigned int i = 0; i < m_oldSize; i++)
+	    TelEngine::destruct(m_old[i]);
+	delete[] m_old;
+	m_old = 0;
+	m_oldSize = m_moved = 0;
+    }
+    m_appends = 0;
 }
 
 bool HashList::resync(GenObject* obj)
@@ -113,6 +136,8 @@ bool HashList::resync(GenObject* obj)
     XDebug(DebugAll,"HashList::resync(%p) [%p]",obj,this);
     if (!obj)
 	return false;
+    if (m_old)
+	migrate(m_oldSize);
     unsigned int i = obj->toString().hash() % m_size;
     if (m_lists[i] && m_lists[i]->find(obj))
 	return false;
@@ -135,6 +160,8 @@ bool HashList::resync(GenObject* obj)
 bool HashList::resync()
 {
     XDebug(DebugAll,"HashList::resync() [%p]",this);
+    if (m_old)
+	migrate(m_oldSize);
     bool moved = false;
     for (unsigned int n = 0; n < m_size; n++) {
 	ObjList* l = m_lists[n];
@@ -158,4 +185,211 @@ bool HashList::resync()
     return moved;
 }
 
+void HashList::autoResize(unsigned int maxLoad, unsigned int maxSize)
+{
+    XDebug(DebugAll,"HashList::autoResize(%u,%u) [%p]",maxLoad,maxSize,this);
+    m_maxLoad = maxLoad;
+    m_maxSize = maxSize;
+    m_appends = 0;
+}
+
+unsigned int HashList::stats(unsigned int& buckets, unsigned int& used, unsigned int& longest) const
+{
+    buckets = m_size;
+    if (m_old)
+	buckets += m_oldSize - m_moved;
+    used = longest = 0;
+    unsigned int c = 0;
+    unsigned int n = length();
+    for (unsigned int i = 0; i < n; i++) {
+	ObjList* l = getList(i);
+	unsigned int len = l ? l->count() : 0;
+	if (!len)
+	    continue;
+	used++;
+	c += len;
+	if (longest < len)
+	    longest = len;
+    }
+    return c;
+}
+
+// Retrieve the slot holding the list for a hash value
+ObjList*& HashList::bucket(unsigned int hash)
+{
+    unsigned int i = index(hash);
+    return (i < m_size) ? m_lists[i] : m_old[i - m_size];
+}
+
+// Start moving objects to a larger table
+void HashList::grow()
+{
+    unsigned int size = m_size * 2 + 1;
+    if (size > m_maxSize)
+	size = m_maxSize;
+    DDebug(DebugInfo,"HashList growing from %u to %u entries [%p]",m_size,size,this);
+    m_old = m_lists;
+    m_oldSize = m_size;
+    m_moved = 0;
+    m_size = size;
+    m_lists = new ObjList* [m_size];
+    for (unsigned int i = 0; i < m_size; i++)
+	m_lists[i] = 0;
+}
+
+// Move objects from some old hash entries to the new table
+void HashList::migrate(unsigned int entries)
+{
+    for (; entries && (m_moved < m_oldSize); entries--) {
+	ObjList* old = m_old[m_moved];
+	// Mark the entry as moved before appending so the new table is used
+	m_old[m_moved++] = 0;
+	if (!old)
+	    continue;
+	for (ObjList* l = old->skipNull(); l; l = l->skipNext()) {
+	    GenObject* obj = l->get();
+	    bool autoDel = l->autoDelete();
+	    l->setDelete(false);
+	    ObjList*& dest = bucket(obj->toString().hash());
+	    if (!dest)
+		dest = new ObjList;
+	    dest->append(obj)->setDelete(autoDel);
+	}
+	TelEngine::destruct(old);
+    }
+    if (m_moved < m_oldSize)
+	return;
+    delete[] m_old;
+    m_old = 0;
+    m_oldSize = m_moved = 0;
+}
+
+
+SharedHashList::SharedHashList(unsigned int size, unsigned int stripes, const char* name)
+    : m_locks(stripes ? stripes : 1,false,TelEngine::null(name) ? "SharedHashList" : name),
+      m_lists(0), m_stripes(stripes ? stripes : 1)
+{
+    XDebug(DebugAll,"SharedHashList::SharedHashList(%u,%u) [%p]",size,stripes,this);
+    m_lists = new HashList* [m_stripes];
+    for (unsigned int i = 0; i < m_stripes; i++)
+	m_lists[i] = new HashList(size);
+}
+
+SharedHashList::~SharedHashList()
+{
+    XDebug(DebugAll,"SharedHashList::~SharedHashList() [%p]",this);
+    for (unsigned int i = 0; i < m_stripes; i++)
+	delete m_lists[i];
+    delete[] m_lists;
+}
+
+void* SharedHashList::getObject(const String& name) const
+{
+    if (name == YSTRING("SharedHashList"))
+	return const_cast<SharedHashList*>(this);
+    return GenObject::getObject(name);
+}
+
+void SharedHashList::autoResize(unsigned int maxLoad, unsigned int maxSize)
+{
+    for (unsigned int i = 0; i < m_stripes; i++) {
+	Lock lck(mutex(i));
+	m_lists[i]->autoResize(maxLoad,maxSize);
+    }
+}
+
+unsigned int SharedHashList::count() const
+{
+    unsigned int c = 0;
+    for (unsigned int i = 0; i < m_stripes; i++) {
+	Lock lck(mutex(i));
+	c += m_lists[i]->count();
+    }
+    return c;
+}
+
+bool SharedHashList::append(const GenObject* obj, bool autoDelete)
+{
+    if (!obj)
+	return false;
+    unsigned int i = stripe(obj->toString());
+    Lock lck(mutex(i));
+    ObjList* l = m_lists[i]->append(obj);
+    if (!l)
+	return false;
+    l->setDelete(autoDelete);
+    return true;
+}
+
+GenObject* SharedHashList::remove(const String& str, bool delobj)
+{
+    unsigned int i = stripe(str);
+    Lock lck(mutex(i));
+    ObjList* l = m_lists[i]->find(str);
+    if (!l)
+	return 0;
+    GenObject* obj = l->remove(false);
+    lck.drop();
+    // Destroy the object after releasing the stripe lock
+    if (delobj)
+	TelEngine::destruct(obj);
+    return obj;
+}
+
+GenObject* SharedHashList::remove(GenObject* obj, bool delobj)
+{
+    if (!obj)
+	return 0;
+    unsigned int i = stripe(obj->toString());
+    Lock lck(mutex(i));
+    if (!m_lists[i]->remove(obj,false))
+	return 0;
+    lck.drop();
+    if (delobj)
+	TelEngine::destruct(obj);
+    return obj;
+}
+
+RefObject* SharedHashList::find(const String& str) const
+{
+    unsigned int i = stripe(str);
+    Lock lck(mutex(i));
+    RefObject* obj = YOBJECT(RefObject,(*m_lists[i])[str]);
+    return (obj && obj->ref()) ? obj : 0;
+}
+
+bool SharedHashList::contains(const String& str) const
+{
+    unsigned int i = stripe(str);
+    Lock lck(mutex(i));
+    return m_lists[i]->find(str) != 0;
+}
+
+void SharedHashList::clear()
+{
+    for (unsigned int i = 0; i < m_stripes; i++) {
+	Lock lck(mutex(i));
+	m_lists[i]->clear();
+    }
+}
+
+unsigned int SharedHashList::stats(unsigned int& buckets, unsigned int& used, unsigned int& longest) const
+{
+    buckets = used = longest = 0;
+    unsigned int c = 0;
+    for (unsigned int i = 0; i < m_stripes; i++) {
+	unsigned int b = 0;
+	unsigned int u = 0;
+	unsigned int l = 0;
+	Lock lck(mutex(i));
+	c += m_lists[i]->stats(b,u,l);
+	lck.drop();
+	buckets += b;
+	used += u;
+	if (longest < l)
+	    longest = l;
+    }
+    return c;
+}
+
 /* vi: set ts=8 sw=4 sts=4 noet: */
@@ -22,12 +22,78 @@
 
 #include "yatengine.h"
 #include <string.h>
+#include <stdlib.h>
 
 using namespace TelEngine;
 
+namespace { // anonymous
+
+// Number of dispatch time histogram buckets, each 10 times wider than previous
+#define STATS_BUCKETS 6
+
+// Dispatch time statistics of one message handler
+class HandlerStats : public String
+{
+public:
+    inline HandlerStats(const String& key)
+	: String(key)
+	{ reset(); }
+    inline void reset()
+	{ m_calls = 0; m_total = m_max = 0; ::memset(m_buckets,0,sizeof(m_buckets)); }
+    void add(u_int64_t usec);
+    unsigned int m_calls;
+    u_int64_t m_total;
+    u_int64_t m_max;
+    unsigned int m_buckets[STATS_BUCKETS];
+};
+
+// Snapshot of handler statistics used for sorting outside the lock
+struct StatsEntry
+{
+    const HandlerStats* stats;
+    u_int64_t total;
+};
+
+}; // anonymous namespace
+
+void HandlerStats::add(u_int64_t usec)
+{
+    m_calls++;
+    m_total += usec;
+    if (m_max < usec)
+	m_max = usec;
+    unsigned int i = 0;
+    for (u_int64_t lim = 100; (i < STATS_BUCKETS - 1) && (usec >= lim); lim *= 10)
+	i++;
+    m_buckets[i]++;
+}
+
+// Find or create the statistics of a handler, dispatcher must be locked
+// Handlers receiving all messages are accounted under a single "*" name
+static HandlerStats* findStats(HashList& list, const MessageHandler* h)
+{
+    String key = h->null() ? "*" : h->c_str();
+    if (h->trackName())
+	key << ":" << h->trackName();
+    key << "@" << h->priority();
+    HandlerStats* st = static_cast<HandlerStats*>(list[key]);
+    if (!st) {
+	st = new HandlerStats(key);
+	list.append(st);
+    }
+    return st;
+}
+
+static int compareStats(const void* a, const void* b)
+{
+    u_int64_t ta = static_cast<const StatsEntry*>(a)->total;
+    u_int64_t tb = static_cast<const StatsEntry*>(b)->total;
+    return (ta > tb) ? -1 : ((ta < tb) ? 1 : 0);
+}
+
 Message::Message(const char* name, const char* retval, bool broadcast)
     : NamedList(name),
-      m_return(retval), m_data(0), m_notify(false), m_broadcast(broadcast)
+      m_return(retval), m_data(0), m_notify(false), m_broadcast(broadcast), m_queued(0)
 {
     XDebug(DebugAll,"Message::Message(\"%s\",\"%s\",%s) [%p]",
 	name,retval,String::boolText(broadcast),this);
@@ -36,7 +102,7 @@ Message::Message(const char* name, const char* retval, bool broadcast)
 Message::Message(const Message& original)
     : NamedList(original),
       m_return(original.retValue()), m_time(original.msgTime()),
-      m_data(0), m_notify(false), m_broadcast(original.broadcast())
+      m_data(0), m_notify(false), m_broadcast(original.broadcast()), m_queued(0)
 {
     XDebug(DebugAll,"Message::Message(&%p) [%p]",&original,this);
 }
@@ -44,7 +110,7 @@ Message::Message(const Message& original)
 Message::Message(const Message& original, bool broadcast)
     : NamedList(original),
       m_return(original.retValue()), m_time(original.msgTime()),
-      m_data(0), m_notify(false), m_broadcast(broadcast)
+      m_data(0), m_notify(false), m_broadcast(broadcast), m_queued(0)
 {
     XDebug(DebugAll,"Message::Message(&%p,%s) [%p]",
 	&original,String::boolText(broadcast),this);
@@ -211,9 +277,162 @@ int Message::commonDecode(const char* str, int offs)
 }
 
 
+// Binary frame helpers, all integers are 32 bit in network byte order
+static inline void putU32(unsigned char*& p, u_int32_t val)
+{
+    *p++ = (unsigned char)(val >> 24);
+    *p++ = (unsigned char)(val >> 16);
+    *p++ = (unsigned char)(val >> 8);
+    *p++ = (unsigned char)val;
+}
+
+static inline void putStr(unsigned char*& p, const char* str, unsigned int len)
+{
+    putU32(p,len);
+    if (len)
+	::memcpy(p,str,len);
+    p += len;
+}
+
+static inline bool getU32(const unsigned char*& p, const unsigned char* end, u_int32_t& val)
+{
+    if (end - p < 4)
+	return false;
+    val = ((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) | ((u_int32_t)p[2] << 8) | p[3];
+    p += 4;
+    return true;
+}
+
+static inline bool getStr(const unsigned char*& p, const unsigned char* end,
+    const char*& str, u_int32_t& len)
+{
+    if (!getU32(p,end,len) || ((u_int32_t)(end - p) < len))
+	return false;
+    str = (const char*)p;
+    p += len;
+    return true;
+}
+
+void Message::encodeFrame(DataBlock& frame, const char* id) const
+{
+    commonEncode(frame,'>',id,(u_int32_t)m_time.sec());
+}
+
+void Message::encodeFrame(DataBlock& frame, bool received, const char* id) const
+{
+    commonEncode(frame,'<',id,received ? 1 : 0);
+}
+
+int Message::decodeFrame(const void* data, unsigned int len, String& id)
+{
+    u_int32_t tm = 0;
+    int res = commonDecode(data,len,'>',0,&id,tm);
+    if (res == -2)
+	m_time = tm ? ((u_int64_t)1000000)*tm : Time::now();
+    return res;
+}
+
+int Message::decodeFrame(const void* data, unsigned int len, bool& received, const char* id)
+{
+    u_int32_t rcvd = 0;
+    int res = commonDecode(data,len,'<',c_safe(id),0,rcvd);
+    if (res == -2)
+	received = (rcvd != 0);
+    return res;
+}
+
+void Message::commonEncode(DataBlock& frame, char type, const char* id, u_int32_t value) const
+{
+    // compute the frame size first so the data is allocated only once
+    unsigned int idLen = id ? ::strlen(id) : 0;
+    unsigned int size = 21 + idLen + String::length() + m_return.length();
+    unsigned int count = 0;
+    for (NamedIterator iter(*this); const NamedString* ns = iter.get(); ) {
+	size += 8 + ns->name().length() + ns->length();
+	count++;
+    }
+    unsigned int offs = frame.length();
+    DataBlock tmp(0,size + 4);
+    frame.append(tmp);
+    unsigned char* p = frame.data(offs,size + 4);
+    putU32(p,size);
+    *p++ = (unsigned char)type;
+    putStr(p,id,idLen);
+    putU32(p,value);
+    putStr(p,c_str(),String::length());
+    putStr(p,m_return.c_str(),m_return.length());
+    putU32(p,count);
+    for (NamedIterator iter(*this); const NamedString* ns = iter.get(); ) {
+	putStr(p,ns->name().c_str(),ns->name().length());
+	putStr(p,ns->c_str(),ns->length());
+    }
+}
+
+int Message::commonDecode(const void* data, unsigned int len, char type,
+    const char* expect, String* id, u_int32_t& value)
+{
+    const unsigned char* start = static_cast<const unsigned char*>(data);
+    const unsigned char* p = start;
+    u_int32_t flen = 0;
+    if (!(p && getU32(p,start + len,flen)) || (flen > len - 4))
+	return 0;
+    const unsigned char* end = p + flen;
+    if ((p >= end) || (*p != (unsigned char)type))
+	return -1;
+    p++;
+    const char* str = 0;
+    u_int32_t slen = 0;
+    if (!getStr(p,end,str,slen))
+	return p - start;
+    if (expect) {
+	if ((::strlen(expect) != slen) || ::strncmp(expect,str,slen))
+	    return -1;
+    }
+    else if (id)
+	id->assign(str,slen);
+    if (!getU32(p,end,value))
+	return p - start;
+    if (!getStr(p,end,str,slen))
+	return p - start;
+    if (slen)
+	String::assign(str,slen);
+    if (!getStr(p,end,str,slen))
+	return p - start;
+    m_return.assign(str,slen);
+    u_int32_t count = 0;
+    if (!getU32(p,end,count))
+	return p - start;
+    for (; count; count--) {
+	const unsigned char* crt = p;
+	if (!getStr(p,end,str,slen) || !slen)
+	    return crt - start;
+	String name(str,slen);
+	u_int32_t vlen = 0;
+	if (!getU32(p,end,vlen))
+	    return p - start;
+	if (vlen == 0xffffffff) {
+	    clearParam(name);
+	    continue;
+	}
+	if ((u_int32_t)(end - p) < vlen)
+	    return p - start;
+	NamedString* ns = getParam(name);
+	if (ns)
+	    ns->assign((const char*)p,vlen);
+	else {
+	    ns = new NamedString(name);
+	    ns->assign((const char*)p,vlen);
+	    addParam(ns);
+	}
+	p += vlen;
+    }
+    return (p == end) ? -2 : (p - start);
+}
+
+
 MessageHandler::MessageHandler(const char* name, unsigned priority)
     : String(name),
-      m_priority(priority), m_unsafe(0), m_dispatcher(0), m_filter(0)
+      m_priority(priority), m_unsafe(0), m_dispatcher(0), m_filter(0), m_stats(0)
 {
     DDebug(DebugAll,"MessageHandler::MessageHandler(\"%s\",%u) [%p]",
 	name,priority,this);
@@ -255,6 +474,14 @@ bool MessageHandler::receivedInternal(Message& msg)
     return ok;
 }
 
+void MessageHandler::setTrackName(const char* name)
+{
+    Lock lock(m_dispatcher);
+    m_trackName = name;
+    // statistics will be looked up again using the new name
+    m_stats = 0;
+}
+
 void MessageHandler::setFilter(NamedString* filter)
 {
     clearFilter();
@@ -282,7 +509,9 @@ bool MessageRelay::receivedInternal(Message& msg)
 
 MessageDispatcher::MessageDispatcher()
     : Mutex(false,"MessageDispatcher"),
-      m_changes(0), m_warnTime(0)
+      m_changes(0), m_warnTime(0),
+      m_dequeued(0), m_delayMin(0), m_delayMax(0),
+      m_profile(false), m_stats(251)
 {
     XDebug(DebugInfo,"MessageDispatcher::MessageDispatcher() [%p]",this);
 }
@@ -378,20 +607,42 @@ bool MessageDispatcher::dispatch(Message& msg)
 	    unsigned int p = h->priority();
 	    // mark handler as unsafe to destroy / uninstall
 	    h->m_unsafe++;
+	    // statistics are owned by the dispatcher so they survive the handler
+	    HandlerStats* st = 0;
+	    if (m_profile) {
+		st = static_cast<HandlerStats*>(h->m_stats);
+		if (!st) {
+		    st = findStats(m_stats,h);
+		    h->m_stats = st;
+		}
+	    }
 	    unlock();
+	    u_int64_t tm = 0;
 #ifdef DEBUG
-	    u_int64_t tm = Time::now();
+	    tm = Time::now();
+#else
+	    if (st)
+		tm = Time::now();
 #endif
 	    retv = h->receivedInternal(msg) || retv;
+	    if (tm)
+		tm = Time::now() - tm;
 #ifdef DEBUG
-	    tm = Time::now() - tm;
 	    if (m_warnTime && (tm > m_warnTime))
 		Debug(DebugInfo,"Message '%s' [%p] passed through %p in " FMT64U " usec",
 		    msg.c_str(),&msg,h,tm);
 #endif
-	    if (retv && !msg.broadcast())
+	    if (retv && !msg.broadcast()) {
+		if (st) {
+		    lock();
+		    st->add(tm);
+		    unlock();
+		}
 		break;
+	    }
 	    lock();
+	    if (st)
+		st->add(tm);
 	    if (c == m_changes)
 		continue;
 	    // the handler list has changed - find again
@@ -449,6 +700,7 @@ bool MessageDispatcher::enqueue(Message* msg)
     Lock lock(this);
     if (!msg || m_messages.find(msg))
 	return false;
+    msg->m_queued = Time::now();
     m_messages.append(msg);
     return true;
 }
@@ -457,6 +709,15 @@ bool MessageDispatcher::dequeueOne()
 {
     lock();
     Message* msg = static_cast<Message *>(m_messages.remove(false));
+    if (msg) {
+	u_int64_t now = Time::now();
+	u_int64_t delay = (now > msg->m_queued) ? now - msg->m_queued : 0;
+	if (!m_dequeued || (delay < m_delayMin))
+	    m_delayMin = delay;
+	if (delay > m_delayMax)
+	    m_delayMax = delay;
+	m_dequeued++;
+    }
     unlock();
     if (!msg)
 	return false;
@@ -483,6 +744,57 @@ unsigned int MessageDispatcher::handlerCount()
     return m_handlers.count();
 }
 
+unsigned int MessageDispatcher::profileStatus(String& str, bool reset)
+{
+    lock();
+    unsigned int n = m_stats.count();
+    StatsEntry* entries = n ? new StatsEntry[n] : 0;
+    unsigned int i = 0;
+    // copy the counters so formatting and sorting is done unlocked
+    for (unsigned int b = 0; b < m_stats.length(); b++) {
+	for (ObjList* l = m_stats.getList(b); l && (i < n); l = l->skipNext()) {
+	    const HandlerStats* s = static_cast<const HandlerStats*>(l->get());
+	    if (!s || !s->m_calls)
+		continue;
+	    entries[i].stats = new HandlerStats(*s);
+	    entries[i].total = s->m_total;
+	    i++;
+	    if (reset)
+		const_cast<HandlerStats*>(s)->reset();
+	}
+    }
+    unlock();
+    n = i;
+    if (n > 1)
+	::qsort(entries,n,sizeof(StatsEntry),compareStats);
+    for (i = 0; i < n; i++) {
+	const HandlerStats* s = entries[i].stats;
+	str.append(*s,",") << "=" << s->m_calls
+	    << "|" << (unsigned int)((s->m_total + 500) / 1000)
+	    << "|" << (unsigned int)(s->m_total / s->m_calls)
+	    << "|" << (unsigned int)s->m_max << "|";
+	for (int b = 0; b < STATS_BUCKETS; b++) {
+	    if (b)
+		str << "/";
+	    str << s->m_buckets[b];
+	}
+	delete s;
+    }
+    delete[] entries;
+    return n;
+}
+
+unsigned int MessageDispatcher::queueDelay(u_int64_t& minDelay, u_int64_t& maxDelay)
+{
+    Lock lock(this);
+    unsigned int n = m_dequeued;
+    minDelay = m_delayMin;
+    maxDelay = m_delayMax;
+    m_dequeued = 0;
+    m_delayMin = m_delayMax = 0;
+    return n;
+}
+
 void MessageDispatcher::setHook(MessagePostHook* hook, bool remove)
 {
     lock();
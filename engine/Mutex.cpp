@@ -49,6 +49,25 @@ typedef sem_t HSEMAPHORE;
 
 #endif /* ! _WINDOWS */
 
+#if defined(ATOMIC_OPS) && !defined(_WINDOWS)
+#define MUTEX_PROFILE
+#include <string.h>
+#include <stdlib.h>
+#endif
+
+#if defined(ATOMIC_OPS) && defined(__linux__)
+#define MUTEX_ADAPTIVE
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifndef FUTEX_PRIVATE_FLAG
+#define FUTEX_WAIT_PRIVATE FUTEX_WAIT
+#define FUTEX_WAKE_PRIVATE FUTEX_WAKE
+#endif
+// Upper limit of the adaptive spin before sleeping in the kernel
+#define MAX_SPIN 100
+#endif
+
 #ifdef MUTEX_STATIC_UNSAFE
 #undef MUTEX_STATIC_UNSAFE
 #define MUTEX_STATIC_UNSAFE true
@@ -58,9 +77,28 @@ typedef sem_t HSEMAPHORE;
 
 namespace TelEngine {
 
+#ifdef MUTEX_PROFILE
+// Contention statistics of all mutexes sharing the same name
+class MutexStats {
+public:
+    static MutexStats* find(const char* name);
+    void locked(bool contended, u_int64_t waited);
+    void unlocked(u_int64_t held);
+    void reset();
+    volatile int m_state;
+    char m_name[48];
+    volatile unsigned int m_locks;
+    volatile unsigned int m_contended;
+    volatile u_int64_t m_waitTotal;
+    volatile u_int64_t m_waitMax;
+    volatile u_int64_t m_holdTotal;
+    volatile u_int64_t m_holdMax;
+};
+#endif
+
 class MutexPrivate {
 public:
-    MutexPrivate(bool recursive, const char* name);
+    MutexPrivate(bool recursive, const char* name, bool adaptive);
     ~MutexPrivate();
     inline void ref()
 	{ ++m_refcount; }
@@ -79,6 +117,10 @@ public:
     static volatile int s_count;
     static volatile int s_locks;
 private:
+#ifdef MUTEX_ADAPTIVE
+    bool adaptiveLock(long maxwait);
+    void adaptiveUnlock();
+#endif
     HMUTEX m_mutex;
     int m_refcount;
     volatile unsigned int m_locked;
@@ -86,6 +128,17 @@ private:
     bool m_recursive;
     const char* m_name;
     const char* m_owner;
+#ifdef MUTEX_ADAPTIVE
+    bool m_adaptive;
+    volatile int m_futex;
+    volatile pthread_t m_tid;
+    unsigned int m_depth;
+    int m_spin;
+#endif
+#ifdef MUTEX_PROFILE
+    MutexStats* m_stats;
+    u_int64_t m_holdStart;
+#endif
 };
 
 class SemaphorePrivate {
@@ -133,6 +186,26 @@ static unsigned long s_maxwait = 0;
 static bool s_unsafe = MUTEX_STATIC_UNSAFE;
 static bool s_safety = true;
 
+#ifdef MUTEX_PROFILE
+// Statistics table, a slot is claimed by the first mutex with a new name
+#define STATS_SLOTS 1024
+static MutexStats s_stats[STATS_SLOTS];
+static volatile bool s_profile = false;
+#endif
+
+#ifdef MUTEX_ADAPTIVE
+static bool s_adaptive = false;
+
+static inline void cpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+#endif
+
 volatile int MutexPrivate::s_count = 0;
 volatile int MutexPrivate::s_locks = 0;
 volatile int SemaphorePrivate::s_count = 0;
@@ -164,6 +237,98 @@ GlobalMutex::GlobalMutex()
     init();
 }
 
+
+#ifdef MUTEX_PROFILE
+// Slot states: 0 - free, 1 - being claimed, 2 - in use
+MutexStats* MutexStats::find(const char* name)
+{
+    if (!name)
+	name = "(unnamed)";
+    unsigned int idx = String::hash(name) % STATS_SLOTS;
+    for (unsigned int i = 0; i < STATS_SLOTS; i++) {
+	MutexStats* st = s_stats + ((idx + i) % STATS_SLOTS);
+	if (!st->m_state && __sync_bool_compare_and_swap(&st->m_state,0,1)) {
+	    ::strncpy(st->m_name,name,sizeof(st->m_name) - 1);
+	    st->m_name[sizeof(st->m_name) - 1] = '\0';
+	    __sync_synchronize();
+	    st->m_state = 2;
+	    return st;
+	}
+	while (st->m_state == 1)
+	    Thread::yield();
+	if (!::strncmp(st->m_name,name,sizeof(st->m_name) - 1))
+	    return st;
+    }
+    // table is full, account in the last slot
+    return s_stats + STATS_SLOTS - 1;
+}
+
+static inline void updateMax(volatile u_int64_t& max, u_int64_t val)
+{
+    u_int64_t old = max;
+    while ((val > old) && !__sync_bool_compare_and_swap(&max,old,val))
+	old = max;
+}
+
+void MutexStats::locked(bool contended, u_int64_t waited)
+{
+    __sync_add_and_fetch(&m_locks,1);
+    if (!contended)
+	return;
+    __sync_add_and_fetch(&m_contended,1);
+    __sync_add_and_fetch(&m_waitTotal,waited);
+    updateMax(m_waitMax,waited);
+}
+
+void MutexStats::unlocked(u_int64_t held)
+{
+    __sync_add_and_fetch(&m_holdTotal,held);
+    updateMax(m_holdMax,held);
+}
+
+void MutexStats::reset()
+{
+    m_locks = m_contended = 0;
+    m_waitTotal = m_waitMax = m_holdTotal = m_holdMax = 0;
+}
+
+static int compareStats(const void* a, const void* b, Mutex::ProfileOrder order)
+{
+    const MutexStats* sa = static_cast<const MutexStats*>(a);
+    const MutexStats* sb = static_cast<const MutexStats*>(b);
+    u_int64_t va = 0;
+    u_int64_t vb = 0;
+    switch (order) {
+	case Mutex::ProfileLocks:
+	    va = sa->m_locks;
+	    vb = sb->m_locks;
+	    break;
+	case Mutex::ProfileContended:
+	    va = sa->m_contended;
+	    vb = sb->m_contended;
+	    break;
+	case Mutex::ProfileWait:
+	    va = sa->m_waitTotal;
+	    vb = sb->m_waitTotal;
+	    break;
+	case Mutex::ProfileHold:
+	    va = sa->m_holdTotal;
+	    vb = sb->m_holdTotal;
+	    break;
+    }
+    return (va > vb) ? -1 : ((va < vb) ? 1 : 0);
+}
+
+#define MAKE_COMPARE(order) \
+static int compare##order(const void* a, const void* b) \
+{ return compareStats(a,b,Mutex::order); }
+MAKE_COMPARE(ProfileLocks)
+MAKE_COMPARE(ProfileContended)
+MAKE_COMPARE(ProfileWait)
+MAKE_COMPARE(ProfileHold)
+#undef MAKE_COMPARE
+#endif // MUTEX_PROFILE
+
 void GlobalMutex::lock()
 {
     init();
@@ -188,9 +353,15 @@ void GlobalMutex::unlock()
 }
 
 
-MutexPrivate::MutexPrivate(bool recursive, const char* name)
+MutexPrivate::MutexPrivate(bool recursive, const char* name, bool adaptive)
     : m_refcount(1), m_locked(0), m_waiting(0), m_recursive(recursive),
       m_name(name), m_owner(0)
+#ifdef MUTEX_ADAPTIVE
+      , m_adaptive(adaptive), m_futex(0), m_tid(0), m_depth(0), m_spin(0)
+#endif
+#ifdef MUTEX_PROFILE
+      , m_stats(0), m_holdStart(0)
+#endif
 {
     GlobalMutex::lock();
     s_count++;
@@ -223,6 +394,13 @@ MutexPrivate::~MutexPrivate()
 #ifdef _WINDOWS
 	::ReleaseMutex(m_mutex);
 #else
+#ifdef MUTEX_ADAPTIVE
+	if (m_adaptive) {
+	    m_depth = 0;
+	    adaptiveUnlock();
+	}
+	else
+#endif
 	::pthread_mutex_unlock(&m_mutex);
 #endif
     }
@@ -259,6 +437,24 @@ bool MutexPrivate::lock(long maxwait)
 	m_waiting++;
 	GlobalMutex::unlock();
     }
+#ifdef MUTEX_PROFILE
+    bool prof = s_profile && !s_unsafe;
+    bool contended = false;
+    u_int64_t waited = 0;
+    if (prof) {
+	// try first so only the contended locks are timed
+#ifdef MUTEX_ADAPTIVE
+	if (m_adaptive)
+	    rval = adaptiveLock(0);
+	else
+#endif
+	rval = !::pthread_mutex_trylock(&m_mutex);
+	if (!rval) {
+	    contended = true;
+	    waited = Time::now();
+	}
+    }
+#endif
 #ifdef _WINDOWS
     DWORD ms = 0;
     if (maxwait < 0)
@@ -267,8 +463,12 @@ bool MutexPrivate::lock(long maxwait)
 	ms = (DWORD)(maxwait / 1000);
     rval = s_unsafe || (::WaitForSingleObject(m_mutex,ms) == WAIT_OBJECT_0);
 #else
-    if (s_unsafe)
+    if (s_unsafe || rval)
 	rval = true;
+#ifdef MUTEX_ADAPTIVE
+    else if (m_adaptive)
+	rval = adaptiveLock(maxwait);
+#endif
     else if (maxwait < 0)
 	rval = !::pthread_mutex_lock(&m_mutex);
     else if (!maxwait)
@@ -299,6 +499,10 @@ bool MutexPrivate::lock(long maxwait)
 #endif // HAVE_TIMEDLOCK
     }
 #endif // _WINDOWS
+#ifdef MUTEX_PROFILE
+    if (contended)
+	waited = Time::now() - waited;
+#endif
     if (s_safety) {
 	GlobalMutex::lock();
 	m_waiting--;
@@ -309,6 +513,15 @@ bool MutexPrivate::lock(long maxwait)
 	if (s_safety)
 	    s_locks++;
 	m_locked++;
+#ifdef MUTEX_PROFILE
+	if (prof) {
+	    if (!m_stats)
+		m_stats = MutexStats::find(m_name);
+	    m_stats->locked(contended,waited);
+	    if (m_locked == 1)
+		m_holdStart = Time::now();
+	}
+#endif
 	if (thr) {
 	    thr->m_locks++;
 	    m_owner = thr->name();
@@ -340,6 +553,13 @@ bool MutexPrivate::unlock()
 		Debug(DebugFail,"MutexPrivate '%s' unlocked by '%s' but owned by '%s' [%p]",
 		    m_name,tname,m_owner,this);
 	    m_owner = 0;
+#ifdef MUTEX_PROFILE
+	    if (m_holdStart) {
+		if (m_stats)
+		    m_stats->unlocked(Time::now() - m_holdStart);
+		m_holdStart = 0;
+	    }
+#endif
 	}
 	if (s_safety) {
 	    int locks = --s_locks;
@@ -350,12 +570,18 @@ bool MutexPrivate::unlock()
 		Debug(DebugFail,"MutexPrivate::locks() is %d [%p]",locks,this);
 	    }
 	}
-	if (!s_unsafe)
+	if (!s_unsafe) {
 #ifdef _WINDOWS
 	    ::ReleaseMutex(m_mutex);
 #else
+#ifdef MUTEX_ADAPTIVE
+	    if (m_adaptive)
+		adaptiveUnlock();
+	    else
+#endif
 	    ::pthread_mutex_unlock(&m_mutex);
 #endif
+	}
 	ok = true;
     }
     else
@@ -365,6 +591,66 @@ bool MutexPrivate::unlock()
     return ok;
 }
 
+#ifdef MUTEX_ADAPTIVE
+// Futex states: 0 - unlocked, 1 - locked, 2 - locked and may have waiters
+bool MutexPrivate::adaptiveLock(long maxwait)
+{
+    pthread_t self = ::pthread_self();
+    if (m_recursive && ::pthread_equal(m_tid,self)) {
+	m_depth++;
+	return true;
+    }
+    if (!__sync_val_compare_and_swap(&m_futex,0,1)) {
+	m_tid = self;
+	return true;
+    }
+    if (!maxwait)
+	return false;
+    // spin a bit, locks are usually held for a very short time
+    int spin = 2 * m_spin + 10;
+    if (spin > MAX_SPIN)
+	spin = MAX_SPIN;
+    for (int i = 0; i < spin; i++) {
+	cpuRelax();
+	if (!m_futex && !__sync_val_compare_and_swap(&m_futex,0,1)) {
+	    m_spin += (i - m_spin) / 8;
+	    m_tid = self;
+	    return true;
+	}
+    }
+    m_spin += (spin - m_spin) / 8;
+    u_int64_t end = (maxwait > 0) ? Time::now() + maxwait : 0;
+    while (__sync_lock_test_and_set(&m_futex,2)) {
+	if (!end) {
+	    ::syscall(SYS_futex,&m_futex,FUTEX_WAIT_PRIVATE,2,0,0,0);
+	    continue;
+	}
+	u_int64_t now = Time::now();
+	if (now >= end)
+	    return false;
+	struct timespec ts;
+	ts.tv_sec = (end - now) / 1000000;
+	ts.tv_nsec = 1000 * ((end - now) % 1000000);
+	::syscall(SYS_futex,&m_futex,FUTEX_WAIT_PRIVATE,2,&ts,0,0);
+    }
+    m_tid = self;
+    return true;
+}
+
+void MutexPrivate::adaptiveUnlock()
+{
+    if (m_depth) {
+	m_depth--;
+	return;
+    }
+    m_tid = 0;
+    if (__sync_fetch_and_sub(&m_futex,1) != 1) {
+	m_futex = 0;
+	::syscall(SYS_futex,&m_futex,FUTEX_WAKE_PRIVATE,1,0,0,0);
+    }
+}
+#endif // MUTEX_ADAPTIVE
+
 
 SemaphorePrivate::SemaphorePrivate(unsigned int maxcount, const char* name)
     : m_refcount(1), m_waiting(0), m_maxcount(maxcount),
@@ -542,7 +828,15 @@ Mutex::Mutex(bool recursive, const char* name)
 {
     if (!name)
 	name = "?";
-    m_private = new MutexPrivate(recursive,name);
+    m_private = new MutexPrivate(recursive,name,adaptive());
+}
+
+Mutex::Mutex(bool recursive, const char* name, bool adaptive)
+    : m_private(0)
+{
+    if (!name)
+	name = "?";
+    m_private = new MutexPrivate(recursive,name,adaptive);
 }
 
 Mutex::Mutex(const Mutex &original)
@@ -612,6 +906,10 @@ int Mutex::locks()
 
 bool Mutex::efficientTimedLock()
 {
+#ifdef MUTEX_ADAPTIVE
+    if (s_adaptive)
+	return true;
+#endif
 #if defined(_WINDOWS) || defined(HAVE_TIMEDLOCK)
     return true;
 #else
@@ -619,6 +917,105 @@ bool Mutex::efficientTimedLock()
 #endif
 }
 
+bool Mutex::adaptive(bool enable)
+{
+#ifdef MUTEX_ADAPTIVE
+    s_adaptive = enable;
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+bool Mutex::adaptive()
+{
+#ifdef MUTEX_ADAPTIVE
+    return s_adaptive;
+#else
+    return false;
+#endif
+}
+
+bool Mutex::adaptiveSupported()
+{
+#ifdef MUTEX_ADAPTIVE
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Mutex::profile(bool enable)
+{
+#ifdef MUTEX_PROFILE
+    s_profile = enable;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Mutex::profile()
+{
+#ifdef MUTEX_PROFILE
+    return s_profile;
+#else
+    return false;
+#endif
+}
+
+unsigned int Mutex::profileStatus(String& str, ProfileOrder order, bool reset)
+{
+#ifdef MUTEX_PROFILE
+    // take a snapshot of used slots so sorting and formatting see stable values
+    MutexStats* list = new MutexStats[STATS_SLOTS];
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < STATS_SLOTS; i++) {
+	MutexStats& st = s_stats[i];
+	if ((st.m_state != 2) || !st.m_locks)
+	    continue;
+	MutexStats& c = list[n++];
+	::memcpy(c.m_name,st.m_name,sizeof(c.m_name));
+	c.m_locks = st.m_locks;
+	c.m_contended = st.m_contended;
+	c.m_waitTotal = st.m_waitTotal;
+	c.m_waitMax = st.m_waitMax;
+	c.m_holdTotal = st.m_holdTotal;
+	c.m_holdMax = st.m_holdMax;
+	if (reset)
+	    st.reset();
+    }
+    int (*cmp)(const void*,const void*) = compareProfileWait;
+    switch (order) {
+	case ProfileLocks:
+	    cmp = compareProfileLocks;
+	    break;
+	case ProfileContended:
+	    cmp = compareProfileContended;
+	    break;
+	case ProfileHold:
+	    cmp = compareProfileHold;
+	    break;
+	default:
+	    break;
+    }
+    if (n > 1)
+	::qsort(list,n,sizeof(MutexStats),cmp);
+    for (unsigned int i = 0; i < n; i++) {
+	const MutexStats& c = list[i];
+	str.append(c.m_name,",") << "=" << c.m_locks << "|" << c.m_contended
+	    << "|" << (unsigned int)((c.m_waitTotal + 500) / 1000)
+	    << "|" << (unsigned int)c.m_waitMax
+	    << "|" << (unsigned int)((c.m_holdTotal + 500) / 1000)
+	    << "|" << (unsigned int)c.m_holdMax;
+    }
+    delete[] list;
+    return n;
+#else
+    return 0;
+#endif
+}
+
 
 MutexPool::MutexPool(unsigned int len, bool recursive, const char* name)
     : m_name(0), m_data(0), m_length(len ? len : 1)
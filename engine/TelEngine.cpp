@@ -80,6 +80,7 @@ static int _localtime_s(struct tm* _tm, const time_t* time)
 
 #else // !_WINDOWS
 #include <sys/resource.h>
+#include <sys/uio.h>
 #endif
 
 
@@ -91,6 +92,9 @@ namespace TelEngine {
 
 #define OUT_BUFFER_SIZE 8192
 
+// Maximum number of queued messages written by the output thread at once
+#define OUT_BATCH_SIZE 64
+
 // RefObject mutex pool array size
 #ifndef REFOBJECT_MUTEX_COUNT
 #define REFOBJECT_MUTEX_COUNT 47
@@ -172,6 +176,167 @@ static bool reentered()
     return (Thread::current() == s_thr);
 }
 
+#ifdef ATOMIC_OPS
+#ifdef _WINDOWS
+#define OUT_CAS(ptr,oldVal,newVal) \
+    (InterlockedCompareExchange((LONG*)(ptr),(LONG)(newVal),(LONG)(oldVal)) == (LONG)(oldVal))
+#define OUT_INC(ptr) InterlockedIncrement((LONG*)(ptr))
+#define OUT_BARRIER() MemoryBarrier()
+#else
+#define OUT_CAS(ptr,oldVal,newVal) __sync_bool_compare_and_swap(ptr,oldVal,newVal)
+#define OUT_INC(ptr) __sync_add_and_fetch(ptr,1)
+#define OUT_BARRIER() __sync_synchronize()
+#endif
+#define ASYNC_OUTPUT
+#endif
+
+#ifdef ASYNC_OUTPUT
+
+// A slot of the asynchronous output queue
+struct OutSlot
+{
+    volatile unsigned int seq;
+    int level;
+    unsigned int len;
+    char* text;
+};
+
+// Thread writing the queued output messages
+class OutputThread : public Thread
+{
+public:
+    inline OutputThread()
+	: Thread("Debug Output")
+	{ }
+    virtual ~OutputThread();
+    virtual void run();
+};
+
+// Bounded lock-free multiple producers queue, messages are removed only while
+//  holding the output mutex so there is a single consumer at any time
+static OutSlot* s_outSlots = 0;
+static unsigned int s_outMask = 0;
+static volatile unsigned int s_outHead = 0;
+static unsigned int s_outTail = 0;
+static volatile bool s_async = false;
+static volatile bool s_outIdle = false;
+static volatile unsigned int s_outWritten = 0;
+static volatile unsigned int s_outDropped = 0;
+static OutputThread* volatile s_outThread = 0;
+static Semaphore s_outSem(1,"DebugOutput");
+
+// Queue a message for the output thread, return false if the queue is full
+static bool async_queue(int level, const char* buf, unsigned int len)
+{
+    unsigned int pos = s_outHead;
+    OutSlot* slot = 0;
+    for (;;) {
+	slot = s_outSlots + (pos & s_outMask);
+	int dif = (int)(slot->seq - pos);
+	if (!dif) {
+	    if (OUT_CAS(&s_outHead,pos,pos + 1))
+		break;
+	}
+	else if (dif < 0) {
+	    OUT_INC(&s_outDropped);
+	    return false;
+	}
+	pos = s_outHead;
+    }
+    slot->text = (char*)::malloc(len + 1);
+    if (slot->text)
+	::memcpy(slot->text,buf,len + 1);
+    slot->len = len;
+    slot->level = level;
+    OUT_BARRIER();
+    slot->seq = pos + 1;
+    if (s_outIdle)
+	s_outSem.unlock();
+    return true;
+}
+
+// Write out queued messages, must be called with the output mutex held
+// Return the number of messages written
+static unsigned int async_drain()
+{
+    if (!s_outSlots)
+	return 0;
+    OutSlot* batch[OUT_BATCH_SIZE];
+    unsigned int n = 0;
+    while (n < OUT_BATCH_SIZE) {
+	OutSlot* slot = s_outSlots + (s_outTail & s_outMask);
+	if ((int)(slot->seq - (s_outTail + 1)) < 0)
+	    break;
+	OUT_BARRIER();
+	batch[n++] = slot;
+	s_outTail++;
+    }
+    if (!n)
+	return 0;
+    unsigned int i;
+#ifndef _WINDOWS
+    if (s_output == dbg_stderr_func) {
+	// default output, write the entire batch with a single system call
+	struct iovec iov[OUT_BATCH_SIZE];
+	unsigned int v = 0;
+	for (i = 0; i < n; i++) {
+	    if (!batch[i]->text)
+		continue;
+	    iov[v].iov_base = batch[i]->text;
+	    iov[v].iov_len = batch[i]->len;
+	    v++;
+	}
+	if (v)
+	    ::writev(2,iov,v);
+    }
+    else
+#endif
+    if (s_output) {
+	for (i = 0; i < n; i++)
+	    if (batch[i]->text)
+		s_output(batch[i]->text,batch[i]->level);
+    }
+    for (i = 0; i < n; i++) {
+	OutSlot* slot = batch[i];
+	if (s_intout && slot->text)
+	    s_intout(slot->text,slot->level);
+	::free(slot->text);
+	slot->text = 0;
+	// release the slot to producers
+	OUT_BARRIER();
+	slot->seq = slot->seq + s_outMask;
+    }
+    s_outWritten += n;
+    return n;
+}
+
+OutputThread::~OutputThread()
+{
+    s_outThread = 0;
+}
+
+void OutputThread::run()
+{
+    while (s_async && !check(false)) {
+	out_mux.lock();
+	s_thr = Thread::current();
+	unsigned int n = async_drain();
+	s_thr = 0;
+	out_mux.unlock();
+	if (n)
+	    continue;
+	s_outIdle = true;
+	OUT_BARRIER();
+	// check again for messages queued before producers saw the idle flag
+	OutSlot* slot = s_outSlots + (s_outTail & s_outMask);
+	if ((int)(slot->seq - (s_outTail + 1)) < 0)
+	    s_outSem.lock(100000);
+	s_outIdle = false;
+    }
+}
+
+#endif // ASYNC_OUTPUT
+
 static void common_output(int level,char* buf)
 {
     if (level < -1)
@@ -181,10 +346,23 @@ static void common_output(int level,char* buf)
     int n = ::strlen(buf);
     if (n && (buf[n-1] == '\n'))
 	    n--;
+#ifdef ASYNC_OUTPUT
+    if (s_async && !CapturedEvent::capturing()) {
+	buf[n] = '\n';
+	buf[n+1] = '\0';
+	async_queue(level,buf,n+1);
+	return;
+    }
+#endif
     // serialize the output strings
     out_mux.lock();
     // TODO: detect reentrant calls from foreign threads and main thread
     s_thr = Thread::current();
+#ifdef ASYNC_OUTPUT
+    // preserve ordering with already queued messages
+    while (async_drain())
+	;
+#endif
     if (CapturedEvent::capturing()) {
 	buf[n] = '\0';
 	CapturedEvent::append(level,buf);
@@ -251,12 +429,12 @@ void Debug(int level, const char* format, ...)
     ::sprintf(buf,"<%s> ",dbg_level(level));
     va_list va;
     va_start(va,format);
-    ind_mux.lock();
     dbg_output(level,buf,format,va);
-    ind_mux.unlock();
     va_end(va);
-    if (s_abort && (level == DebugFail))
+    if (s_abort && (level == DebugFail)) {
+	Debugger::flush();
 	abort();
+    }
 }
 
 void Debug(const char* facility, int level, const char* format, ...)
@@ -273,12 +451,12 @@ void Debug(const char* facility, int level, const char* format, ...)
     ::snprintf(buf,sizeof(buf),"<%s:%s> ",facility,dbg_level(level));
     va_list va;
     va_start(va,format);
-    ind_mux.lock();
     dbg_output(level,buf,format,va);
-    ind_mux.unlock();
     va_end(va);
-    if (s_abort && (level == DebugFail))
+    if (s_abort && (level == DebugFail)) {
+	Debugger::flush();
 	abort();
+    }
 }
 
 void Debug(const DebugEnabler* local, int level, const char* format, ...)
@@ -306,18 +484,20 @@ void Debug(const DebugEnabler* local, int level, const char* format, ...)
 	::sprintf(buf,"<%s> ",dbg_level(level));
     va_list va;
     va_start(va,format);
-    ind_mux.lock();
     dbg_output(level,buf,format,va);
-    ind_mux.unlock();
     va_end(va);
-    if (s_abort && (level == DebugFail))
+    if (s_abort && (level == DebugFail)) {
+	Debugger::flush();
 	abort();
+    }
 }
 
 void abortOnBug()
 {
-    if (s_abort)
+    if (s_abort) {
+	Debugger::flush();
 	abort();
+    }
 }
 
 bool abortOnBug(bool doAbort)
@@ -454,6 +634,85 @@ void Debugger::setIntOut(void (*outFunc)(const char*,int))
     out_mux.unlock();
 }
 
+bool Debugger::setAsync(unsigned int slots)
+{
+#ifdef ASYNC_OUTPUT
+    if (slots) {
+	if (s_async)
+	    return true;
+	out_mux.lock();
+	if (!s_outSlots) {
+	    // the queue is never freed or resized as producers may still use it
+	    unsigned int size = 64;
+	    while (size < slots && size < 0x100000)
+		size <<= 1;
+	    s_outSlots = new OutSlot[size];
+	    for (unsigned int i = 0; i < size; i++) {
+		s_outSlots[i].seq = i;
+		s_outSlots[i].level = 0;
+		s_outSlots[i].len = 0;
+		s_outSlots[i].text = 0;
+	    }
+	    s_outMask = size - 1;
+	}
+	out_mux.unlock();
+	// the thread must be created without holding the mutex as it may log
+	OutputThread* thr = new OutputThread;
+	s_outThread = thr;
+	s_async = true;
+	if (thr->startup())
+	    return true;
+	s_async = false;
+	s_outThread = 0;
+	delete thr;
+	return false;
+    }
+    if (!s_async)
+	return false;
+    s_async = false;
+    s_outSem.unlock();
+    // wait for the output thread to finish its current batch and exit
+    while (s_outThread)
+	Thread::yield();
+    flush();
+#endif
+    return false;
+}
+
+bool Debugger::async()
+{
+#ifdef ASYNC_OUTPUT
+    return s_async;
+#else
+    return false;
+#endif
+}
+
+void Debugger::flush()
+{
+#ifdef ASYNC_OUTPUT
+    // don't wait forever, we may be called after a crash with the mutex held
+    bool locked = out_mux.lock(100000);
+    Thread* prev = s_thr;
+    s_thr = Thread::current();
+    while (async_drain())
+	;
+    s_thr = prev;
+    if (locked)
+	out_mux.unlock();
+#endif
+}
+
+void Debugger::asyncStats(unsigned int& written, unsigned int& dropped)
+{
+#ifdef ASYNC_OUTPUT
+    written = s_outWritten;
+    dropped = s_outDropped;
+#else
+    written = dropped = 0;
+#endif
+}
+
 void Debugger::enableOutput(bool enable, bool colorize)
 {
     s_debugging = enable;
@@ -36,6 +36,10 @@ static int pthread_attr_setinheritsched(pthread_attr_t *,int) { return 0; }
 #endif
 #endif
 
+#if defined(__linux__) && defined(CPU_SETSIZE)
+#define THREAD_AFFINITY
+#endif
+
 #ifdef HAVE_PRCTL
 #include <sys/prctl.h>
 #endif
@@ -69,6 +73,7 @@ public:
     static ThreadPrivate* create(Thread* t,const char* name,Thread::Priority prio);
     static void killall();
     static ThreadPrivate* current();
+    bool setAffinity(const String& cpus);
     Thread* m_thread;
     HTHREAD thread;
     bool m_running;
@@ -76,6 +81,7 @@ public:
     bool m_updest;
     bool m_cancel;
     const char* m_name;
+    String m_affinity;
 #ifdef _WINDOWS
     static void startFunc(void* arg);
 #else
@@ -137,6 +143,72 @@ static TokenDict s_prio[] = {
 static unsigned long s_idleMs = 1000 * THREAD_IDLE_MSEC;
 static ObjList s_threads;
 static Mutex s_tmutex(true,"Thread");
+static NamedList s_affinityMap("");
+
+#ifdef THREAD_AFFINITY
+// Parse a list of CPUs like "0-3,8" into a CPU set, empty list means all CPUs
+static bool parseCpus(const String& cpus, cpu_set_t& set)
+{
+    CPU_ZERO(&set);
+    ObjList* list = cpus.split(',',false);
+    bool ok = true;
+    for (ObjList* l = list->skipNull(); ok && l; l = l->skipNext()) {
+	String* s = static_cast<String*>(l->get());
+	s->trimBlanks();
+	int sep = s->find('-');
+	int first = (sep < 0) ? s->toInteger(-1) : s->substr(0,sep).toInteger(-1);
+	int last = (sep < 0) ? first : s->substr(sep + 1).toInteger(-1);
+	if ((first < 0) || (last < first) || (last >= CPU_SETSIZE)) {
+	    ok = false;
+	    break;
+	}
+	for (int i = first; i <= last; i++)
+	    CPU_SET(i,&set);
+    }
+    TelEngine::destruct(list);
+    if (ok && !CPU_COUNT(&set)) {
+	for (int i = 0; i < CPU_SETSIZE; i++)
+	    CPU_SET(i,&set);
+    }
+    return ok;
+}
+
+// Build a list of CPUs and CPU ranges from a CPU set
+static void printCpus(const cpu_set_t& set, String& cpus, char sep = ',')
+{
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+	if (!CPU_ISSET(i,&set))
+	    continue;
+	int j = i;
+	while ((j + 1 < CPU_SETSIZE) && CPU_ISSET(j + 1,&set))
+	    j++;
+	if (cpus)
+	    cpus << sep;
+	cpus << i;
+	if (j > i)
+	    cpus << "-" << j;
+	i = j;
+    }
+}
+#endif
+
+// Find the configured CPU list of a thread name, s_tmutex must be locked
+static const String* affinityFor(const char* name)
+{
+    if (!name)
+	return 0;
+    const String* cpus = s_affinityMap.getParam(name);
+    if (cpus)
+	return cpus;
+    unsigned int n = s_affinityMap.length();
+    for (unsigned int i = 0; i < n; i++) {
+	const NamedString* s = s_affinityMap.getParam(i);
+	if (s && s->name().endsWith("*") &&
+	    String(name).startsWith(s->name().substr(0,s->name().length() - 1)))
+	    return s;
+    }
+    return 0;
+}
 
 ThreadPrivate* ThreadPrivate::create(Thread* t,const char* name,Thread::Priority prio)
 {
@@ -343,6 +415,12 @@ void ThreadPrivate::run()
     // FIXME: possible race if public object is destroyed during thread startup
     while (!m_started)
 	Thread::usleep(10,true);
+    s_tmutex.lock();
+    const String* cpus = affinityFor(m_name);
+    String tmp(cpus ? cpus->c_str() : 0);
+    s_tmutex.unlock();
+    if (tmp && !setAffinity(tmp))
+	Debug(DebugWarn,"Could not set CPU affinity '%s' of thread '%s'",tmp.c_str(),m_name);
     if (m_thread)
 	m_thread->run();
 
@@ -351,6 +429,22 @@ void ThreadPrivate::run()
 #endif
 }
 
+bool ThreadPrivate::setAffinity(const String& cpus)
+{
+#ifdef THREAD_AFFINITY
+    cpu_set_t set;
+    if (!parseCpus(cpus,set))
+	return false;
+    if (::pthread_setaffinity_np(thread,sizeof(set),&set))
+	return false;
+    Lock lock(s_tmutex);
+    m_affinity = cpus;
+    return true;
+#else
+    return false;
+#endif
+}
+
 bool ThreadPrivate::cancel(bool hard)
 {
     DDebug(DebugAll,"ThreadPrivate::cancel(%s) '%s' [%p]",String::boolText(hard),m_name,this);
@@ -620,6 +714,75 @@ void Thread::cleanup()
     DDebug(DebugAll,"Thread::cleanup() [%p]",this);
 }
 
+bool Thread::setAffinity(const String& cpus)
+{
+    return m_private && m_private->setAffinity(cpus);
+}
+
+bool Thread::getAffinity(String& cpus) const
+{
+#ifdef THREAD_AFFINITY
+    if (!m_private)
+	return false;
+    cpu_set_t set;
+    if (::pthread_getaffinity_np(m_private->thread,sizeof(set),&set))
+	return false;
+    printCpus(set,cpus);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Thread::setCurrentAffinity(const String& cpus)
+{
+    ThreadPrivate* t = ThreadPrivate::current();
+    if (t)
+	return t->setAffinity(cpus);
+#ifdef THREAD_AFFINITY
+    cpu_set_t set;
+    return parseCpus(cpus,set) && !::pthread_setaffinity_np(::pthread_self(),sizeof(set),&set);
+#else
+    return false;
+#endif
+}
+
+void Thread::setAffinityMap(const NamedList& map, bool running)
+{
+    Lock lock(s_tmutex);
+    s_affinityMap = map;
+    if (!running)
+	return;
+    for (ObjList* l = s_threads.skipNull(); l; l = l->skipNext()) {
+	ThreadPrivate* t = static_cast<ThreadPrivate*>(l->get());
+	const String* cpus = affinityFor(t->m_name);
+	if (cpus && (*cpus != t->m_affinity) && !t->setAffinity(*cpus))
+	    Debug(DebugWarn,"Could not set CPU affinity '%s' of thread '%s'",
+		cpus->c_str(),t->m_name);
+    }
+}
+
+unsigned int Thread::affinityStatus(String& str)
+{
+    unsigned int n = 0;
+#ifdef THREAD_AFFINITY
+    Lock lock(s_tmutex);
+    for (ObjList* l = s_threads.skipNull(); l; l = l->skipNext()) {
+	const ThreadPrivate* t = static_cast<const ThreadPrivate*>(l->get());
+	if (t->m_affinity.null())
+	    continue;
+	cpu_set_t set;
+	if (!parseCpus(t->m_affinity,set))
+	    continue;
+	String cpus;
+	printCpus(set,cpus,' ');
+	str.append(t->m_name,",") << "=" << cpus;
+	n++;
+    }
+#endif
+    return n;
+}
+
 void Thread::killall()
 {
     if (!ThreadPrivate::current())
@@ -24,6 +24,7 @@
 #include "yatescript.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 
 using namespace TelEngine;
@@ -114,6 +115,743 @@ static const TokenDict s_unaryOps_sql[] =
 #undef MAKEOP
 #undef ASSIGN
 
+
+// Number of characters of a string kept inline on the bytecode machine stack
+#define BYTECODE_SHORT 40
+// Size of the machine stack and field cache kept on the thread stack
+#define BYTECODE_LOCAL 32
+
+namespace { // anonymous
+
+// A value on the bytecode machine stack
+// Numbers, booleans and short strings are held inline, other values are
+//  operations owned by the value or borrowed from constants and field cache
+class ExpValue
+{
+public:
+    enum Type {
+	Number,
+	Boolean,
+	Text,
+	Borrowed,
+	Owned,
+	Field,
+    };
+    inline ExpValue()
+	: m_type(Number), m_slot(0), m_len(0), m_number(0), m_oper(0)
+	{ }
+    inline ~ExpValue()
+	{ clear(); }
+    inline void clear() {
+	    if (Owned == m_type)
+		TelEngine::destruct(const_cast<ExpOperation*>(m_oper));
+	    m_type = Number;
+	    m_oper = 0;
+	}
+    // Move the value to another stack position, this one is left empty
+    inline void moveTo(ExpValue& dest) {
+	    dest.clear();
+	    dest.m_type = m_type;
+	    dest.m_slot = m_slot;
+	    dest.m_number = m_number;
+	    dest.m_oper = m_oper;
+	    if (Text == m_type) {
+		dest.m_len = m_len;
+		::memcpy(dest.m_buf,m_buf,m_len + 1);
+	    }
+	    m_type = Number;
+	    m_oper = 0;
+	}
+    inline void setNumber(long int val)
+	{ clear(); m_number = val; }
+    inline void setBool(bool val)
+	{ clear(); m_type = Boolean; m_number = val ? 1 : 0; }
+    inline void setOper(const ExpOperation* oper, bool owned)
+	{ clear(); m_type = owned ? Owned : Borrowed; m_oper = oper; }
+    inline void setField(const ExpOperation* oper, unsigned int slot)
+	{ clear(); m_type = Field; m_oper = oper; m_slot = slot; }
+    void setText(const char* s1, unsigned int l1, const char* s2 = 0, unsigned int l2 = 0);
+    inline Type type() const
+	{ return (Type)m_type; }
+    inline unsigned int slot() const
+	{ return m_slot; }
+    inline const ExpOperation* oper() const
+	{ return m_oper; }
+    inline long int number() const
+	{ return m_oper ? m_oper->number() : m_number; }
+    inline bool isInteger() const
+	{ return number() != ExpOperation::nonInteger(); }
+    // Retrieve the text of the value, numbers are written in the provided buffer
+    const char* text(unsigned int& len, char* buf, unsigned int bufLen) const;
+    // Build a new operation from the value
+    ExpOperation* copy(const char* name = 0) const;
+    // Build an operation from the value and clear it, owned operation is returned as is
+    ExpOperation* take(const char* name = 0);
+private:
+    unsigned char m_type;
+    unsigned short m_slot;
+    unsigned int m_len;
+    long int m_number;
+    const ExpOperation* m_oper;
+    char m_buf[BYTECODE_SHORT];
+};
+
+// Instructions of the bytecode machine that are not operations
+enum ExpInstrCode {
+    // Move the machine stack to the evaluation stack, placed at labels
+    InsSpill = 0xfff0,
+    // Jumps to the instruction index, they spill the machine stack too
+    InsJump,
+    InsJumpTrue,
+    InsJumpFalse,
+};
+
+// A single bytecode instruction: the operation code, index of the operand
+//  in constant pool or of the jump target and field slot
+struct ExpInstr
+{
+    u_int16_t code;
+    u_int16_t slot;
+    u_int32_t index;
+};
+
+}; // anonymous namespace
+
+// Compiled form of an expression run by a stack machine
+class TelEngine::ExpBytecode
+{
+public:
+    ExpBytecode();
+    ~ExpBytecode();
+    bool build(const ExpEvaluator& eval, const ObjList& opcodes);
+    bool run(const ExpEvaluator& eval, ObjList& stack, GenObject* context) const;
+    inline unsigned int length() const
+	{ return m_length; }
+    inline unsigned int constants() const
+	{ return m_pool.length(); }
+    inline unsigned int fields() const
+	{ return m_slots; }
+    inline unsigned int depth() const
+	{ return m_depth; }
+private:
+    inline const ExpOperation* constant(const ExpInstr& ins) const
+	{ return static_cast<const ExpOperation*>(m_pool[ins.index]); }
+    bool execute(const ExpEvaluator& eval, ObjList& stack, GenObject* context,
+	ExpValue* vals, ExpOperation** cache) const;
+    bool resolve(const ExpEvaluator& eval, ObjList& stack, GenObject* context,
+	ExpValue& val, ExpOperation** cache) const;
+    bool binary(const ExpEvaluator& eval, int code, ExpValue& op1, ExpValue& op2) const;
+    bool assign(const ExpEvaluator& eval, ObjList& stack, GenObject* context,
+	ExpValue& fld, ExpValue& val, ExpOperation** cache) const;
+    void flush(ExpOperation** cache) const;
+    void spill(ObjList& stack, ExpValue* vals, unsigned int& sp) const;
+    ExpInstr* m_code;
+    unsigned int m_length;
+    ObjVector m_pool;
+    unsigned int m_slots;
+    unsigned int m_depth;
+};
+
+
+void ExpValue::setText(const char* s1, unsigned int l1, const char* s2, unsigned int l2)
+{
+    clear();
+    if (l1 + l2 < BYTECODE_SHORT) {
+	m_type = Text;
+	m_number = ExpOperation::nonInteger();
+	::memcpy(m_buf,s1,l1);
+	if (l2)
+	    ::memcpy(m_buf + l1,s2,l2);
+	m_len = l1 + l2;
+	m_buf[m_len] = '\0';
+	return;
+    }
+    String val(s1,l1);
+    if (l2)
+	val += String(s2,l2);
+    m_type = Owned;
+    m_oper = new ExpOperation(val);
+}
+
+const char* ExpValue::text(unsigned int& len, char* buf, unsigned int bufLen) const
+{
+    switch (m_type) {
+	case Number:
+	    len = ::snprintf(buf,bufLen,"%d",(int)m_number);
+	    return buf;
+	case Boolean:
+	    {
+		const char* txt = String::boolText(m_number != 0);
+		len = ::strlen(txt);
+		return txt;
+	    }
+	case Text:
+	    len = m_len;
+	    return m_buf;
+	default:
+	    break;
+    }
+    len = m_oper->length();
+    return m_oper->safe();
+}
+
+ExpOperation* ExpValue::copy(const char* name) const
+{
+    switch (m_type) {
+	case Number:
+	    return new ExpOperation(m_number,name);
+	case Boolean:
+	    return new ExpOperation(m_number != 0,name);
+	case Text:
+	    return new ExpOperation(String(m_buf,m_len),name);
+	default:
+	    break;
+    }
+    return name ? m_oper->clone(name) : m_oper->clone();
+}
+
+ExpOperation* ExpValue::take(const char* name)
+{
+    ExpOperation* op = 0;
+    if (Owned == m_type && !name) {
+	op = const_cast<ExpOperation*>(m_oper);
+	m_type = Number;
+	m_oper = 0;
+    }
+    else {
+	op = copy(name);
+	clear();
+    }
+    return op;
+}
+
+
+ExpBytecode::ExpBytecode()
+    : m_code(0), m_length(0), m_slots(0), m_depth(0)
+{
+}
+
+ExpBytecode::~ExpBytecode()
+{
+    delete[] m_code;
+}
+
+// Translate the list of operations, fail on operations not supported by the machine
+bool ExpBytecode::build(const ExpEvaluator& eval, const ObjList& opcodes)
+{
+    unsigned int n = opcodes.count();
+    if (!n)
+	return false;
+    m_code = new ExpInstr[n];
+    // Label number of each label and jump instruction
+    DataBlock lbl(0,n * sizeof(long int));
+    long int* labels = (long int*)lbl.data();
+    ObjList consts;
+    ObjList names;
+    unsigned int depth = 0;
+    for (const ObjList* l = opcodes.skipNull(); l; l = l->skipNext()) {
+	const ExpOperation* o = static_cast<const ExpOperation*>(l->get());
+	if (o->barrier())
+	    return false;
+	int code = o->opcode();
+	unsigned int pops = 0;
+	unsigned int pushes = 1;
+	ExpInstr& ins = m_code[m_length];
+	ins.code = code;
+	ins.slot = 0;
+	ins.index = 0;
+	ExpEvaluator::JumpType jump = eval.jumpType(*o);
+	if (ExpEvaluator::JumpNone != jump || ExpEvaluator::OpcLabel == code) {
+	    // Values of statements before are moved to the evaluation stack so
+	    //  the machine stack is empty whichever way code reaches a label
+	    switch (jump) {
+		case ExpEvaluator::JumpAlways:
+		    ins.code = InsJump;
+		    break;
+		case ExpEvaluator::JumpTrue:
+		    ins.code = InsJumpTrue;
+		    break;
+		case ExpEvaluator::JumpFalse:
+		    ins.code = InsJumpFalse;
+		    break;
+		default:
+		    ins.code = InsSpill;
+	    }
+	    if ((InsJumpTrue == ins.code || InsJumpFalse == ins.code) && !depth)
+		return false;
+	    labels[m_length++] = o->number();
+	    depth = 0;
+	    continue;
+	}
+	switch (code) {
+	    case ExpEvaluator::OpcNone:
+		continue;
+	    case ExpEvaluator::OpcField:
+		{
+		    int slot = names.index(o->name());
+		    if (slot < 0) {
+			slot = names.count();
+			names.append(new String(o->name()));
+		    }
+		    ins.slot = slot;
+		}
+		// fall through
+	    case ExpEvaluator::OpcPush:
+	    case ExpEvaluator::OpcFunc:
+		ins.index = consts.count();
+		consts.append(o->clone());
+		if (ExpEvaluator::OpcFunc == code) {
+		    if (o->number() < 0 || o->number() > 255)
+			return false;
+		    pops = o->number();
+		}
+		break;
+	    case ExpEvaluator::OpcAnd:
+	    case ExpEvaluator::OpcOr:
+	    case ExpEvaluator::OpcXor:
+	    case ExpEvaluator::OpcShl:
+	    case ExpEvaluator::OpcShr:
+	    case ExpEvaluator::OpcAdd:
+	    case ExpEvaluator::OpcSub:
+	    case ExpEvaluator::OpcMul:
+	    case ExpEvaluator::OpcDiv:
+	    case ExpEvaluator::OpcMod:
+	    case ExpEvaluator::OpcEq:
+	    case ExpEvaluator::OpcNe:
+	    case ExpEvaluator::OpcLt:
+	    case ExpEvaluator::OpcGt:
+	    case ExpEvaluator::OpcLe:
+	    case ExpEvaluator::OpcGe:
+	    case ExpEvaluator::OpcLAnd:
+	    case ExpEvaluator::OpcLOr:
+	    case ExpEvaluator::OpcCat:
+	    case ExpEvaluator::OpcAs:
+	    case ExpEvaluator::OpcAssign:
+		pops = 2;
+		break;
+	    case ExpEvaluator::OpcNeg:
+	    case ExpEvaluator::OpcNot:
+	    case ExpEvaluator::OpcLNot:
+	    case ExpEvaluator::OpcIncPre:
+	    case ExpEvaluator::OpcDecPre:
+	    case ExpEvaluator::OpcIncPost:
+	    case ExpEvaluator::OpcDecPost:
+		pops = 1;
+		break;
+	    default:
+		switch (code & ~ExpEvaluator::OpcAssign) {
+		    case ExpEvaluator::OpcAnd:
+		    case ExpEvaluator::OpcOr:
+		    case ExpEvaluator::OpcXor:
+		    case ExpEvaluator::OpcShl:
+		    case ExpEvaluator::OpcShr:
+		    case ExpEvaluator::OpcAdd:
+		    case ExpEvaluator::OpcSub:
+		    case ExpEvaluator::OpcMul:
+		    case ExpEvaluator::OpcDiv:
+		    case ExpEvaluator::OpcMod:
+			if (code & ExpEvaluator::OpcAssign) {
+			    pops = 2;
+			    break;
+			}
+			// fall through
+		    default:
+			return false;
+		}
+	}
+	// operands must come from this expression, not from the caller's stack
+	if (depth < pops)
+	    return false;
+	depth = depth - pops + pushes;
+	if (depth > m_depth)
+	    m_depth = depth;
+	m_length++;
+    }
+    if (!m_length || m_depth > 0xffff || names.count() > 0xffff)
+	return false;
+    // Resolve jump targets to the index of their label
+    for (unsigned int i = 0; i < m_length; i++) {
+	switch (m_code[i].code) {
+	    case InsJump:
+	    case InsJumpTrue:
+	    case InsJumpFalse:
+		break;
+	    default:
+		continue;
+	}
+	unsigned int j = 0;
+	for (; j < m_length; j++) {
+	    if (InsSpill == m_code[j].code && labels[j] == labels[i])
+		break;
+	}
+	if (j >= m_length)
+	    return false;
+	m_code[i].index = j;
+    }
+    m_pool.assign(consts);
+    m_slots = names.count();
+    return true;
+}
+
+// Run the bytecode, results are left on stack like when interpreting the operations
+bool ExpBytecode::run(const ExpEvaluator& eval, ObjList& stack, GenObject* context) const
+{
+    ExpValue local[BYTECODE_LOCAL];
+    ExpOperation* cached[BYTECODE_LOCAL];
+    ExpValue* vals = (m_depth <= BYTECODE_LOCAL) ? local : new ExpValue[m_depth];
+    ExpOperation** cache = (m_slots <= BYTECODE_LOCAL) ? cached : new ExpOperation*[m_slots];
+    for (unsigned int i = 0; i < m_slots; i++)
+	cache[i] = 0;
+    bool ok = execute(eval,stack,context,vals,cache);
+    flush(cache);
+    if (vals != local)
+	delete[] vals;
+    if (cache != cached)
+	delete[] cache;
+    return ok;
+}
+
+bool ExpBytecode::execute(const ExpEvaluator& eval, ObjList& stack, GenObject* context,
+    ExpValue* vals, ExpOperation** cache) const
+{
+    unsigned int sp = 0;
+    for (unsigned int pc = 0; pc < m_length; ) {
+	const ExpInstr& ins = m_code[pc++];
+	switch (ins.code) {
+	    case InsSpill:
+		spill(stack,vals,sp);
+		continue;
+	    case InsJump:
+		spill(stack,vals,sp);
+		pc = ins.index;
+		continue;
+	    case InsJumpTrue:
+	    case InsJumpFalse:
+		{
+		    if (!sp)
+			return eval.gotError("ExpEvaluator stack underflow");
+		    ExpValue& cond = vals[--sp];
+		    if (!resolve(eval,stack,context,cond,cache))
+			return false;
+		    bool val = (cond.number() != 0);
+		    cond.clear();
+		    spill(stack,vals,sp);
+		    if (val == (InsJumpTrue == ins.code))
+			pc = ins.index;
+		}
+		continue;
+	    case ExpEvaluator::OpcPush:
+		vals[sp++].setOper(constant(ins),false);
+		continue;
+	    case ExpEvaluator::OpcField:
+		vals[sp++].setField(constant(ins),ins.slot);
+		continue;
+	    case ExpEvaluator::OpcFunc:
+		{
+		    const ExpOperation* func = constant(ins);
+		    unsigned int argc = func->number();
+		    if (sp < argc)
+			return eval.gotError("ExpEvaluator stack underflow");
+		    unsigned int before = stack.count();
+		    for (unsigned int i = sp - argc; i < sp; i++)
+			ExpEvaluator::pushOne(stack,vals[i].take());
+		    sp -= argc;
+		    bool ok = eval.runFunction(stack,*func,context);
+		    // the function may have changed any field
+		    flush(cache);
+		    if (!ok)
+			return eval.gotError("Function call failed");
+		    unsigned int after = stack.count();
+		    unsigned int n = (after > before) ? after - before : 0;
+		    if (sp + n > m_depth)
+			return eval.gotError("Bytecode stack overflow");
+		    for (unsigned int i = n; i; i--)
+			vals[sp + i - 1].setOper(ExpEvaluator::popAny(stack),true);
+		    sp += n;
+		}
+		continue;
+	    case ExpEvaluator::OpcNeg:
+	    case ExpEvaluator::OpcNot:
+	    case ExpEvaluator::OpcLNot:
+		{
+		    if (!sp)
+			return eval.gotError("ExpEvaluator stack underflow");
+		    ExpValue& op = vals[sp - 1];
+		    if (!resolve(eval,stack,context,op,cache))
+			return false;
+		    long int val = op.number();
+		    if (ExpEvaluator::OpcNeg == ins.code)
+			op.setNumber(-val);
+		    else if (ExpEvaluator::OpcNot == ins.code)
+			op.setNumber(~val);
+		    else
+			op.setBool(!val);
+		}
+		continue;
+	    case ExpEvaluator::OpcIncPre:
+	    case ExpEvaluator::OpcDecPre:
+	    case ExpEvaluator::OpcIncPost:
+	    case ExpEvaluator::OpcDecPost:
+		{
+		    if (!sp)
+			return eval.gotError("ExpEvaluator stack underflow");
+		    ExpValue& fld = vals[sp - 1];
+		    if (ExpValue::Field != fld.type())
+			return eval.gotError("Expecting LValue in operator");
+		    ExpValue tmp;
+		    tmp.setField(fld.oper(),fld.slot());
+		    if (!resolve(eval,stack,context,tmp,cache))
+			return false;
+		    long int num = tmp.number();
+		    ExpOperation* val = tmp.take();
+		    switch (ins.code) {
+			case ExpEvaluator::OpcIncPre:
+			    (*val) = ++num;
+			    break;
+			case ExpEvaluator::OpcDecPre:
+			    (*val) = --num;
+			    break;
+			case ExpEvaluator::OpcIncPost:
+			    (*val) = num++;
+			    break;
+			default:
+			    (*val) = num--;
+			    break;
+		    }
+		    ExpOperation* op = fld.oper()->clone();
+		    (*op) = num;
+		    bool ok = eval.runAssign(stack,*op,context);
+		    TelEngine::destruct(op);
+		    flush(cache);
+		    if (!ok) {
+			TelEngine::destruct(val);
+			return eval.gotError("Assignment failed");
+		    }
+		    fld.setOper(val,true);
+		}
+		continue;
+	    default:
+		break;
+	}
+	// binary operations
+	if (sp < 2)
+	    return eval.gotError("ExpEvaluator stack underflow");
+	ExpValue& op2 = vals[--sp];
+	ExpValue& op1 = vals[sp - 1];
+	switch (ins.code) {
+	    case ExpEvaluator::OpcAs:
+		{
+		    // the second operand is used just for the name
+		    char buf[24];
+		    unsigned int len = 0;
+		    const char* name = op2.text(len,buf,sizeof(buf));
+		    ExpOperation* op = op1.take(name);
+		    op1.setOper(op,true);
+		    op2.clear();
+		}
+		continue;
+	    case ExpEvaluator::OpcAssign:
+		if (!(resolve(eval,stack,context,op2,cache) &&
+			assign(eval,stack,context,op1,op2,cache)))
+		    return false;
+		op2.moveTo(op1);
+		continue;
+	    default:
+		break;
+	}
+	if (!resolve(eval,stack,context,op2,cache))
+	    return false;
+	if (ins.code & ExpEvaluator::OpcAssign) {
+	    // assignment by operation
+	    if (ExpValue::Field != op1.type())
+		return eval.gotError("Expecting LValue in assignment");
+	    ExpValue res;
+	    res.setField(op1.oper(),op1.slot());
+	    if (!(resolve(eval,stack,context,res,cache) &&
+		    binary(eval,ins.code & ~ExpEvaluator::OpcAssign,res,op2) &&
+		    assign(eval,stack,context,op1,res,cache)))
+		return false;
+	    res.moveTo(op1);
+	    continue;
+	}
+	if (!(resolve(eval,stack,context,op1,cache) && binary(eval,ins.code,op1,op2)))
+	    return false;
+    }
+    spill(stack,vals,sp);
+    return true;
+}
+
+// Replace a field with its value, fields are retrieved once until changed
+bool ExpBytecode::resolve(const ExpEvaluator& eval, ObjList& stack, GenObject* context,
+    ExpValue& val, ExpOperation** cache) const
+{
+    if (ExpValue::Field != val.type())
+	return true;
+    ExpOperation*& op = cache[val.slot()];
+    if (!op) {
+	if (eval.runField(stack,*val.oper(),context))
+	    op = ExpEvaluator::popOne(stack);
+	if (!op)
+	    return eval.gotError("ExpEvaluator stack underflow");
+    }
+    val.setOper(op,false);
+    return true;
+}
+
+// Run a binary operation, the result replaces the first operand
+bool ExpBytecode::binary(const ExpEvaluator& eval, int code, ExpValue& op1, ExpValue& op2) const
+{
+    bool concat = false;
+    switch (code) {
+	case ExpEvaluator::OpcDiv:
+	case ExpEvaluator::OpcMod:
+	    if (!op2.number())
+		return eval.gotError("Division by zero");
+	    // fall through
+	case ExpEvaluator::OpcAdd:
+	    // turn addition into concatenation
+	    concat = !(op1.isInteger() && op2.isInteger());
+	    break;
+	case ExpEvaluator::OpcCat:
+	    concat = true;
+	    break;
+	default:
+	    break;
+    }
+    char b1[24];
+    char b2[24];
+    unsigned int l1 = 0;
+    unsigned int l2 = 0;
+    if (concat) {
+	const char* t1 = op1.text(l1,b1,sizeof(b1));
+	const char* t2 = op2.text(l2,b2,sizeof(b2));
+	ExpValue res;
+	res.setText(t1,l1,t2,l2);
+	res.moveTo(op1);
+	op2.clear();
+	return true;
+    }
+    long int n1 = op1.number();
+    long int n2 = op2.number();
+    long int val = 0;
+    bool boolRes = true;
+    switch (code) {
+	case ExpEvaluator::OpcAnd:
+	    val = n1 & n2;
+	    boolRes = false;
+	    break;
+	case ExpEvaluator::OpcOr:
+	    val = n1 | n2;
+	    boolRes = false;
+	    break;
+	case ExpEvaluator::OpcXor:
+	    val = n1 ^ n2;
+	    boolRes = false;
+	    break;
+	case ExpEvaluator::OpcShl:
+	    val = n1 << n2;
+	    boolRes = false;
+	    break;
+	case ExpEvaluator::OpcShr:
+	    val = n1 >> n2;
+	    boolRes = false;
+	    break;
+	case ExpEvaluator::OpcAdd:
+	    val = n1 + n2;
+	    boolRes = false;
+	    break;
+	case ExpEvaluator::OpcSub:
+	    val = n1 - n2;
+	    boolRes = false;
+	    break;
+	case ExpEvaluator::OpcMul:
+	    val = n1 * n2;
+	    boolRes = false;
+	    break;
+	case ExpEvaluator::OpcDiv:
+	    val = n1 / n2;
+	    boolRes = false;
+	    break;
+	case ExpEvaluator::OpcMod:
+	    val = n1 % n2;
+	    boolRes = false;
+	    break;
+	case ExpEvaluator::OpcLt:
+	    val = (n1 < n2) ? 1 : 0;
+	    break;
+	case ExpEvaluator::OpcGt:
+	    val = (n1 > n2) ? 1 : 0;
+	    break;
+	case ExpEvaluator::OpcLe:
+	    val = (n1 <= n2) ? 1 : 0;
+	    break;
+	case ExpEvaluator::OpcGe:
+	    val = (n1 >= n2) ? 1 : 0;
+	    break;
+	case ExpEvaluator::OpcLAnd:
+	    val = (n1 && n2) ? 1 : 0;
+	    break;
+	case ExpEvaluator::OpcLOr:
+	    val = (n1 || n2) ? 1 : 0;
+	    break;
+	case ExpEvaluator::OpcEq:
+	case ExpEvaluator::OpcNe:
+	    {
+		const char* t1 = op1.text(l1,b1,sizeof(b1));
+		const char* t2 = op2.text(l2,b2,sizeof(b2));
+		val = (l1 == l2 && !::memcmp(t1,t2,l1)) ? 1 : 0;
+		if (ExpEvaluator::OpcNe == code)
+		    val = !val;
+	    }
+	    break;
+	default:
+	    return false;
+    }
+    op2.clear();
+    if (boolRes)
+	op1.setBool(val != 0);
+    else
+	op1.setNumber(val);
+    return true;
+}
+
+// Assign a value to a field, the value is kept to be pushed as result
+bool ExpBytecode::assign(const ExpEvaluator& eval, ObjList& stack, GenObject* context,
+    ExpValue& fld, ExpValue& val, ExpOperation** cache) const
+{
+    if (ExpValue::Field != fld.type())
+	return eval.gotError("Expecting LValue in assignment");
+    ExpOperation* op = val.copy(fld.oper()->name());
+    // cached values are dropped after assignment
+    if (ExpValue::Borrowed == val.type())
+	val.setOper(val.copy(),true);
+    bool ok = eval.runAssign(stack,*op,context);
+    TelEngine::destruct(op);
+    flush(cache);
+    fld.clear();
+    return ok || eval.gotError("Assignment failed");
+}
+
+// Move the values on the machine stack to the evaluation stack
+void ExpBytecode::spill(ObjList& stack, ExpValue* vals, unsigned int& sp) const
+{
+    for (unsigned int i = 0; i < sp; i++)
+	ExpEvaluator::pushOne(stack,vals[i].take());
+    sp = 0;
+}
+
+// Drop the cached field values
+void ExpBytecode::flush(ExpOperation** cache) const
+{
+    for (unsigned int i = 0; i < m_slots; i++) {
+	if (cache[i]) {
+	    TelEngine::destruct(cache[i]);
+	    cache[i] = 0;
+	}
+    }
+}
+
+
 RefObject* ExpExtender::refObj()
 {
     return 0;
@@ -146,12 +884,14 @@ bool ExpExtender::runAssign(ObjList& stack, const ExpOperation& oper, GenObject*
 
 
 ExpEvaluator::ExpEvaluator(const TokenDict* operators, const TokenDict* unaryOps)
-    : m_operators(operators), m_unaryOps(unaryOps), m_inError(false), m_extender(0)
+    : m_operators(operators), m_unaryOps(unaryOps), m_inError(false),
+      m_extender(0), m_bytecode(0)
 {
 }
 
 ExpEvaluator::ExpEvaluator(ExpEvaluator::Parser style)
-    : m_operators(0), m_unaryOps(0), m_inError(false), m_extender(0)
+    : m_operators(0), m_unaryOps(0), m_inError(false),
+      m_extender(0), m_bytecode(0)
 {
     switch (style) {
 	case C:
@@ -167,7 +907,7 @@ ExpEvaluator::ExpEvaluator(ExpEvaluator::Parser style)
 
 ExpEvaluator::ExpEvaluator(const ExpEvaluator& original)
     : m_operators(original.m_operators), m_unaryOps(original.unaryOps()),
-      m_inError(false), m_extender(0)
+      m_inError(false), m_extender(0), m_bytecode(0)
 {
     extender(original.extender());
     for (ObjList* l = original.m_opcodes.skipNull(); l; l = l->skipNext()) {
@@ -178,6 +918,7 @@ ExpEvaluator::ExpEvaluator(const ExpEvaluator& original)
 
 ExpEvaluator::~ExpEvaluator()
 {
+    clearBytecode();
     extender(0);
 }
 
@@ -766,9 +1507,16 @@ bool ExpEvaluator::runOperation(ObjList& stack, const ExpOperation& oper, GenObj
     bool boolRes = true;
     switch (oper.opcode()) {
 	case OpcPush:
-	case OpcField:
 	    pushOne(stack,oper.clone());
 	    break;
+	case OpcField:
+	    {
+		// the copy shares the inline cache of the compiled field
+		ExpOperation* fld = oper.clone();
+		fld->setSite(oper);
+		pushOne(stack,fld);
+	    }
+	    break;
 	case OpcNone:
 	case OpcLabel:
 	    break;
@@ -1111,6 +1859,11 @@ bool ExpEvaluator::runAssign(ObjList& stack, const ExpOperation& oper, GenObject
     return m_extender && m_extender->runAssign(stack,oper,context);
 }
 
+ExpEvaluator::JumpType ExpEvaluator::jumpType(const ExpOperation& oper) const
+{
+    return JumpNone;
+}
+
 bool ExpEvaluator::runEvaluate(const ObjList& opcodes, ObjList& stack, GenObject* context) const
 {
     DDebug(this,DebugInfo,"runEvaluate(%p,%p,%p)",&opcodes,&stack,context);
@@ -1135,6 +1888,8 @@ bool ExpEvaluator::runEvaluate(const ObjVector& opcodes, ObjList& stack, GenObje
 
 bool ExpEvaluator::runEvaluate(ObjList& stack, GenObject* context) const
 {
+    if (m_bytecode)
+	return m_bytecode->run(*this,stack,context);
     return runEvaluate(m_opcodes,stack,context);
 }
 
@@ -1164,6 +1919,7 @@ bool ExpEvaluator::runAllFields(ObjList& stack, GenObject* context) const
 
 int ExpEvaluator::compile(const char* expr, GenObject* context)
 {
+    clearBytecode();
     if (!skipComments(expr,context))
 	return 0;
     int res = 0;
@@ -1223,6 +1979,30 @@ int ExpEvaluator::evaluate(Array& results, unsigned int index, GenObject* contex
     return -1;
 }
 
+bool ExpEvaluator::buildBytecode()
+{
+    clearBytecode();
+    if (inError())
+	return false;
+    ExpBytecode* code = new ExpBytecode;
+    if (!code->build(*this,m_opcodes)) {
+	delete code;
+	DDebug(this,DebugInfo,"Expression can't be compiled to bytecode, it will be interpreted");
+	return false;
+    }
+    DDebug(this,DebugAll,"Built bytecode: %u instructions, %u constants, %u fields, stack %u",
+	code->length(),code->constants(),code->fields(),code->depth());
+    m_bytecode = code;
+    return true;
+}
+
+void ExpEvaluator::clearBytecode()
+{
+    ExpBytecode* code = m_bytecode;
+    m_bytecode = 0;
+    delete code;
+}
+
 void ExpEvaluator::dump(const ObjList& codes, String& res) const
 {
     for (const ObjList* l = codes.skipNull(); l; l = l->skipNext()) {
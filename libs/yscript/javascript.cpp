@@ -32,15 +32,24 @@ class JsContext : public JsObject, public Mutex
 {
     YCLASS(JsContext,JsObject)
 public:
-    inline JsContext()
-	: JsObject("Context",this), Mutex(true,"JsContext")
-	{ }
+    inline JsContext(JsObject* shared = 0)
+	: JsObject("Context",this), Mutex(true,"JsContext"), m_shared(0)
+	{
+	    if (shared && shared->ref()) {
+		m_shared = shared;
+		static_cast<String&>(params()) = shared->toString();
+	    }
+	}
+    virtual ~JsContext()
+	{ TelEngine::destruct(m_shared); }
     virtual bool runFunction(ObjList& stack, const ExpOperation& oper, GenObject* context);
     virtual bool runField(ObjList& stack, const ExpOperation& oper, GenObject* context);
     virtual bool runAssign(ObjList& stack, const ExpOperation& oper, GenObject* context);
 private:
-    GenObject* resolveTop(ObjList& stack, const String& name, GenObject* context);
-    GenObject* resolve(ObjList& stack, String& name, GenObject* context);
+    GenObject* resolveTop(ObjList& stack, const String& name, GenObject* context, bool write = false);
+    GenObject* resolve(ObjList& stack, String& name, GenObject* context, bool write = false);
+    GenObject* writeField(ObjList& stack, JsObject* parent, const String& name, GenObject* context);
+    JsObject* m_shared;
 };
 
 class JsCode : public ScriptCode, public ExpEvaluator
@@ -112,6 +121,7 @@ protected:
     virtual bool runFunction(ObjList& stack, const ExpOperation& oper, GenObject* context) const;
     virtual bool runField(ObjList& stack, const ExpOperation& oper, GenObject* context) const;
     virtual bool runAssign(ObjList& stack, const ExpOperation& oper, GenObject* context) const;
+    virtual JumpType jumpType(const ExpOperation& oper) const;
 private:
     ObjVector m_linked;
     bool preProcessInclude(const char*& expr, GenObject* context);
@@ -196,7 +206,7 @@ static const TokenDict s_preProc[] =
 };
 #undef MAKEOP
 
-GenObject* JsContext::resolveTop(ObjList& stack, const String& name, GenObject* context)
+GenObject* JsContext::resolveTop(ObjList& stack, const String& name, GenObject* context, bool write)
 {
     XDebug(DebugAll,"JsContext::resolveTop '%s'",name.c_str());
     for (ObjList* l = stack.skipNull(); l; l = l->skipNext()) {
@@ -204,34 +214,61 @@ GenObject* JsContext::resolveTop(ObjList& stack, const String& name, GenObject*
 	if (jso && jso->hasField(stack,name,context))
 	    return jso;
     }
+    // globals are read from the shared state unless assigned in this context
+    if (m_shared && !write && !hasField(stack,name,context) && m_shared->hasField(stack,name,context))
+	return m_shared;
     return this;
 }
 
-GenObject* JsContext::resolve(ObjList& stack, String& name, GenObject* context)
+// Retrieve an object about to be changed, replace it with a copy if it is shared
+GenObject* JsContext::writeField(ObjList& stack, JsObject* parent, const String& name, GenObject* context)
 {
-    if (name.find('.') < 0)
-	return resolveTop(stack,name,context);
-    ObjList* list = name.split('.',true);
+    NamedString* field = parent->getField(stack,name,context);
+    if (!field && parent == this && m_shared)
+	field = m_shared->getField(stack,name,context);
+    JsObject* jso = YOBJECT(JsObject,field);
+    if (!jso || !jso->shared() || jso->frozen() || parent->shared())
+	return field;
+    jso = jso->copy(mutex());
+    if (!jso)
+	return field;
+    XDebug(DebugAll,"JsContext copied shared '%s' [%p]",name.c_str(),this);
+    parent->params().setParam(new NamedPointer(name,jso,jso->toString()));
+    return parent->getField(stack,name,context);
+}
+
+GenObject* JsContext::resolve(ObjList& stack, String& name, GenObject* context, bool write)
+{
+    int pos = name.find('.');
+    if (pos < 0)
+	return resolveTop(stack,name,context,write);
+    // walk the components in place, no list is built on each access
     GenObject* obj = 0;
-    for (ObjList* l = list->skipNull(); l; ) {
-	const String* s = static_cast<const String*>(l->get());
-	l = l->skipNext();
-	if (TelEngine::null(s)) {
+    int start = 0;
+    for (;;) {
+	if (pos == start || start >= (int)name.length()) {
 	    // consecutive dots - not good
 	    obj = 0;
 	    break;
 	}
+	String s = name.substr(start,(pos < 0) ? -1 : pos - start);
 	if (!obj)
-	    obj = resolveTop(stack,*s,context);
-	if (!l) {
-	    name = *s;
+	    obj = resolveTop(stack,s,context,write);
+	if (pos < 0) {
+	    name = s;
 	    break;
 	}
-	ExpExtender* ext = YOBJECT(ExpExtender,obj);
-	if (ext)
-	    obj = ext->getField(stack,*s,context);
+	JsObject* jso = write ? YOBJECT(JsObject,obj) : 0;
+	if (jso)
+	    obj = writeField(stack,jso,s,context);
+	else {
+	    ExpExtender* ext = YOBJECT(ExpExtender,obj);
+	    if (ext)
+		obj = ext->getField(stack,s,context);
+	}
+	start = pos + 1;
+	pos = name.find('.',start);
     }
-    TelEngine::destruct(list);
     XDebug(DebugAll,"JsContext::resolve got '%s' %p for '%s'",
 	(obj ? obj->toString().c_str() : 0),obj,name.c_str());
     return obj;
@@ -246,6 +283,7 @@ bool JsContext::runFunction(ObjList& stack, const ExpOperation& oper, GenObject*
 	ExpExtender* ext = YOBJECT(ExpExtender,o);
 	if (ext) {
 	    ExpOperation op(oper,name);
+	    op.setSite(oper);
 	    return ext->runFunction(stack,op,context);
 	}
     }
@@ -266,10 +304,16 @@ bool JsContext::runField(ObjList& stack, const ExpOperation& oper, GenObject* co
     XDebug(DebugAll,"JsContext::runField '%s' [%p]",oper.name().c_str(),this);
     String name = oper.name();
     GenObject* o = resolve(stack,name,context);
+    if (o && o == m_shared) {
+	ExpOperation op(oper,name);
+	op.setSite(oper);
+	return m_shared->JsObject::runField(stack,op,context);
+    }
     if (o && o != this) {
 	ExpExtender* ext = YOBJECT(ExpExtender,o);
 	if (ext) {
 	    ExpOperation op(oper,name);
+	    op.setSite(oper);
 	    return ext->runField(stack,op,context);
 	}
     }
@@ -280,11 +324,12 @@ bool JsContext::runAssign(ObjList& stack, const ExpOperation& oper, GenObject* c
 {
     XDebug(DebugAll,"JsContext::runAssign '%s'='%s' [%p]",oper.name().c_str(),oper.c_str(),this);
     String name = oper.name();
-    GenObject* o = resolve(stack,name,context);
+    GenObject* o = resolve(stack,name,context,true);
     if (o && o != this) {
 	ExpExtender* ext = YOBJECT(ExpExtender,o);
 	if (ext) {
 	    ExpOperation op(oper,name);
+	    op.setSite(oper);
 	    return ext->runAssign(stack,op,context);
 	}
     }
@@ -305,7 +350,11 @@ bool JsCode::evaluate(ScriptRun& runner, ObjList& results) const
 {
     if (null())
 	return false;
-    bool ok = m_linked.length() ? evalVector(results,&runner) : evalList(results,&runner);
+    bool ok = false;
+    if (hasBytecode())
+	ok = runEvaluate(results,&runner);
+    else
+	ok = m_linked.length() ? evalVector(results,&runner) : evalList(results,&runner);
     if (!ok)
 	return false;
     if (static_cast<JsRunner&>(runner).m_paused)
@@ -927,6 +976,21 @@ bool JsCode::runAssign(ObjList& stack, const ExpOperation& oper, GenObject* cont
     return extender() && extender()->runAssign(stack,oper,context);
 }
 
+// Jumps to labels can be run by the bytecode machine, relative ones can't
+ExpEvaluator::JumpType JsCode::jumpType(const ExpOperation& oper) const
+{
+    switch ((JsOpcode)oper.opcode()) {
+	case OpcJump:
+	    return JumpAlways;
+	case OpcJumpTrue:
+	    return JumpTrue;
+	case OpcJumpFalse:
+	    return JumpFalse;
+	default:
+	    return JumpNone;
+    }
+}
+
 bool JsCode::evalList(ObjList& stack, GenObject* context) const
 {
     XDebug(this,DebugInfo,"evalList(%p,%p)",&stack,context);
@@ -1028,6 +1092,12 @@ ScriptContext* JsParser::createContext() const
     return new JsContext;
 }
 
+// Create Javascript context reading globals from a shared state
+ScriptContext* JsParser::createContext(JsObject* shared) const
+{
+    return new JsContext(shared);
+}
+
 ScriptRun* JsParser::createRunner(ScriptCode* code, ScriptContext* context) const
 {
     if (!code)
@@ -1045,8 +1115,13 @@ bool JsParser::parse(const char* text, bool fragment)
 {
     if (TelEngine::null(text))
 	return false;
-    if (fragment)
-	return code() && static_cast<JsCode*>(code())->compile(text,this);
+    if (fragment) {
+	JsCode* code = static_cast<JsCode*>(this->code());
+	if (!(code && code->compile(text,this)))
+	    return false;
+	code->buildBytecode();
+	return true;
+    }
     JsCode* code = new JsCode;
     setCode(code);
     code->deref();
@@ -1057,6 +1132,8 @@ bool JsParser::parse(const char* text, bool fragment)
     DDebug(DebugAll,"Compiled: %s",code->dump().c_str());
     code->simplify();
     DDebug(DebugAll,"Simplified: %s",code->dump().c_str());
+    // Expressions, conditionals and loops run faster as bytecode
+    code->buildBytecode();
     return true;
 }
 
@@ -39,6 +39,9 @@ public:
 	{ return *m_list; }
     virtual const NamedList& list() const
 	{ return *m_list; }
+    // native objects are shared read-only, a plain copy would lose their methods
+    virtual JsObject* copy(Mutex* mtx) const
+	{ return 0; }
 private:
     NamedList* m_list;
 };
@@ -51,6 +54,7 @@ public:
     inline JsArray(Mutex* mtx)
 	: JsObject("Array",mtx)
 	{ }
+    virtual JsObject* copy(Mutex* mtx) const;
 };
 
 // Object constructor
@@ -73,6 +77,8 @@ public:
 	{
 	    params().addParam(new ExpFunction("constructor"));
 	}
+    virtual JsObject* copy(Mutex* mtx) const
+	{ return 0; }
 protected:
     bool runNative(ObjList& stack, const ExpOperation& oper, GenObject* context);
 };
@@ -96,6 +102,8 @@ public:
 	    params().addParam(new ExpFunction("getSeconds"));
 	    params().addParam(new ExpFunction("getTime"));
 	}
+    virtual JsObject* copy(Mutex* mtx) const
+	{ return 0; }
 protected:
     bool runNative(ObjList& stack, const ExpOperation& oper, GenObject* context);
 };
@@ -112,6 +120,8 @@ public:
 	    params().addParam(new ExpFunction("max"));
 	    params().addParam(new ExpFunction("min"));
 	}
+    virtual JsObject* copy(Mutex* mtx) const
+	{ return 0; }
 protected:
     bool runNative(ObjList& stack, const ExpOperation& oper, GenObject* context);
 };
@@ -125,9 +135,30 @@ static inline void addObject(NamedList& params, const char* name, JsObject* obj)
     params.addParam(new NamedPointer(name,obj,obj->toString()));
 }
 
+// Copy the properties of an object, objects held are referenced by both
+static void copyProperties(NamedList& dest, const NamedList& src)
+{
+    dest.clearParams();
+    static_cast<String&>(dest) = src;
+    NamedIterator iter(src);
+    while (const NamedString* ns = iter.get()) {
+	const ExpOperation* op = YOBJECT(ExpOperation,ns);
+	if (op) {
+	    dest.addParam(op->clone());
+	    continue;
+	}
+	const NamedPointer* np = YOBJECT(NamedPointer,ns);
+	RefObject* r = np ? YOBJECT(RefObject,np->userData()) : 0;
+	if (r && r->ref())
+	    dest.addParam(new NamedPointer(ns->name(),r,*ns));
+	else
+	    dest.addParam(ns->name(),*ns);
+    }
+}
+
 JsObject::JsObject(const char* name, Mutex* mtx, bool frozen)
     : ScriptContext(String("[Object ") + name + "]"),
-      m_frozen(frozen), m_mutex(mtx)
+      m_frozen(frozen), m_shared(false), m_mutex(mtx)
 {
     XDebug(DebugAll,"JsObject::JsObject('%s',%p,%s) [%p]",
 	name,mtx,String::boolText(frozen),this);
@@ -145,7 +176,7 @@ bool JsObject::runFunction(ObjList& stack, const ExpOperation& oper, GenObject*
 {
     XDebug(DebugInfo,"JsObject::runFunction() '%s' in '%s' [%p]",
 	oper.name().c_str(),toString().c_str(),this);
-    NamedString* param = params().getParam(oper.name());
+    NamedString* param = getProperty(oper.name(),oper);
     if (!param)
 	return false;
     ExpFunction* ef = YOBJECT(ExpFunction,param);
@@ -166,7 +197,7 @@ bool JsObject::runField(ObjList& stack, const ExpOperation& oper, GenObject* con
 {
     XDebug(DebugAll,"JsObject::runField() '%s' in '%s' [%p]",
 	oper.name().c_str(),toString().c_str(),this);
-    const String* param = params().getParam(oper.name());
+    const String* param = getProperty(oper.name(),oper);
     if (param) {
 	ExpFunction* ef = YOBJECT(ExpFunction,param);
 	if (ef)
@@ -199,6 +230,10 @@ bool JsObject::runAssign(ObjList& stack, const ExpOperation& oper, GenObject* co
 	Debug(DebugNote,"Object '%s' is frozen",toString().c_str());
 	return false;
     }
+    if (shared()) {
+	Debug(DebugNote,"Object '%s' is shared",toString().c_str());
+	return false;
+    }
     ExpFunction* ef = YOBJECT(ExpFunction,&oper);
     if (ef)
 	params().setParam(new ExpFunction(oper.name(),oper.number()));
@@ -214,8 +249,14 @@ bool JsObject::runAssign(ObjList& stack, const ExpOperation& oper, GenObject* co
 	    else
 		params().clearParam(oper.name());
 	}
-	else
-	    params().setParam(oper.name(),oper);
+	else {
+	    // plain values are replaced in place, keeping the object shape
+	    NamedString* param = getProperty(oper.name(),oper);
+	    if (param && !YOBJECT(NamedPointer,param) && !YOBJECT(ExpFunction,param))
+		*param = oper.c_str();
+	    else
+		params().setParam(oper.name(),oper);
+	}
     }
     return true;
 }
@@ -229,7 +270,7 @@ bool JsObject::runNative(ObjList& stack, const ExpOperation& oper, GenObject* co
     else if (oper.name() == YSTRING("isFrozen"))
 	ExpEvaluator::pushOne(stack,new ExpOperation(frozen()));
     else if (oper.name() == YSTRING("toString"))
-	ExpEvaluator::pushOne(stack,new ExpOperation(params()));
+	ExpEvaluator::pushOne(stack,new ExpOperation(toString()));
     else
 	return false;
     return true;
@@ -245,6 +286,28 @@ ExpOperation* JsObject::popValue(ObjList& stack, GenObject* context)
     return ok ? ExpEvaluator::popOne(stack) : 0;
 }
 
+// Mark the object shared, compute its shape now as it will be read concurrently
+void JsObject::share()
+{
+    if (m_shared)
+	return;
+    m_shared = true;
+    NamedIterator iter(params());
+    while (const NamedString* ns = iter.get()) {
+	JsObject* jso = YOBJECT(JsObject,ns);
+	if (jso)
+	    jso->share();
+    }
+    shape();
+}
+
+JsObject* JsObject::copy(Mutex* mtx) const
+{
+    JsObject* jso = new JsObject("Object",mtx,frozen());
+    copyProperties(jso->params(),params());
+    return jso;
+}
+
 // Initialize standard globals in the execution context
 void JsObject::initialize(ScriptContext* context)
 {
@@ -267,6 +330,14 @@ void JsObject::initialize(ScriptContext* context)
 }
 
 
+JsObject* JsArray::copy(Mutex* mtx) const
+{
+    JsArray* jsa = new JsArray(mtx);
+    copyProperties(jsa->params(),params());
+    return jsa;
+}
+
+
 bool JsObjectObj::runNative(ObjList& stack, const ExpOperation& oper, GenObject* context)
 {
     if (oper.name() == YSTRING("constructor"))
@@ -25,8 +25,21 @@
 
 using namespace TelEngine;
 
+// Highest shape identifier and property index that fit in an inline cache
+#define SHAPE_MAX 0xffff
+
 namespace { // anonymous
 
+// Transition to the shape obtained by adding a named property to another shape
+class ShapeEdge : public String
+{
+public:
+    inline ShapeEdge(const String& key, unsigned int shape)
+	: String(key), m_shape(shape)
+	{ }
+    unsigned int m_shape;
+};
+
 class BasicContext: public ScriptContext, public Mutex
 {
     YCLASS(BasicContext,ScriptContext)
@@ -40,6 +53,32 @@ public:
 
 }; // anonymous namespace
 
+// Shape 1 holds no properties, all others are reached from it by transitions
+static HashList s_shapes(64);
+static unsigned int s_lastShape = 1;
+static Mutex s_shapeMutex(false,"ScriptShapes");
+// Inline cache counters, updated without locking
+static u_int64_t s_cacheHits = 0;
+static u_int64_t s_cacheMisses = 0;
+
+// Find or create the shape that results from adding a property, 0 if out of shapes
+static unsigned int shapeAdd(unsigned int shape, const String& name)
+{
+    String key;
+    key << shape << ":" << name;
+    Lock lock(s_shapeMutex);
+    if (!s_shapes.maxLoad())
+	s_shapes.autoResize();
+    ShapeEdge* edge = static_cast<ShapeEdge*>(s_shapes[key]);
+    if (edge)
+	return edge->m_shape;
+    if (s_lastShape >= SHAPE_MAX)
+	return 0;
+    edge = new ShapeEdge(key,++s_lastShape);
+    s_shapes.append(edge);
+    return edge->m_shape;
+}
+
 
 ScriptParser::~ScriptParser()
 {
@@ -94,6 +133,11 @@ ScriptRun* ScriptParser::createRunner(ScriptCode* code, ScriptContext* context)
 }
 
 
+ScriptContext::~ScriptContext()
+{
+    delete[] m_slots;
+}
+
 // RTTI Interface access
 void* ScriptContext::getObject(const String& name) const
 {
@@ -112,6 +156,61 @@ NamedString* ScriptContext::getField(ObjList& stack, const String& name, GenObje
     return m_params.getParam(name);
 }
 
+// Compute the shape from the properties, remember them in order for indexed access
+unsigned int ScriptContext::shape() const
+{
+    if (m_shape)
+	return m_shape;
+    unsigned int n = m_params.count();
+    if (n > m_alloc) {
+	delete[] m_slots;
+	m_alloc = n + 8;
+	m_slots = new NamedString*[m_alloc];
+    }
+    m_count = 0;
+    unsigned int shape = (n <= SHAPE_MAX) ? 1 : 0;
+    NamedIterator iter(m_params);
+    while (const NamedString* ns = iter.get()) {
+	if (m_count >= m_alloc)
+	    break;
+	m_slots[m_count++] = const_cast<NamedString*>(ns);
+	if (shape)
+	    shape = shapeAdd(shape,ns->name());
+    }
+    m_shape = shape;
+    return shape;
+}
+
+NamedString* ScriptContext::getProperty(const String& name, const ExpOperation& oper) const
+{
+    unsigned int sh = shape();
+    u_int32_t& cache = oper.siteCache();
+    u_int32_t c = cache;
+    if (sh && (c >> 16) == sh && (c & SHAPE_MAX) < m_count) {
+	NamedString* ns = m_slots[c & SHAPE_MAX];
+	if (ns->name() == name) {
+	    s_cacheHits++;
+	    return ns;
+	}
+    }
+    s_cacheMisses++;
+    if (!sh)
+	return m_params.getParam(name);
+    for (unsigned int i = 0; i < m_count; i++) {
+	if (m_slots[i]->name() == name) {
+	    cache = (sh << 16) | i;
+	    return m_slots[i];
+	}
+    }
+    return 0;
+}
+
+void ScriptContext::cacheStats(u_int64_t& hits, u_int64_t& misses)
+{
+    hits = s_cacheHits;
+    misses = s_cacheMisses;
+}
+
 bool ScriptContext::runFunction(ObjList& stack, const ExpOperation& oper, GenObject* context)
 {
     return false;
@@ -127,7 +226,7 @@ bool ScriptContext::runField(ObjList& stack, const ExpOperation& oper, GenObject
 bool ScriptContext::runAssign(ObjList& stack, const ExpOperation& oper, GenObject* context)
 {
     XDebug(DebugAll,"ScriptContext::runAssign '%s'='%s'",oper.name().c_str(),oper.c_str());
-    m_params.setParam(oper.name(),oper);
+    params().setParam(oper.name(),oper);
     return true;
 }
 
@@ -49,6 +49,7 @@ namespace TelEngine {
 
 class ExpEvaluator;
 class ExpOperation;
+class ExpBytecode;
 
 /**
  * This class allows extending ExpEvaluator to implement custom fields and functions
@@ -122,6 +123,7 @@ public:
  */
 class YSCRIPT_API ExpEvaluator : public DebugEnabler
 {
+    friend class ExpBytecode;
 public:
     /**
      * Parsing styles
@@ -201,6 +203,20 @@ public:
 	OpcPrivate = 0x1000
     };
 
+    /**
+     * Kinds of jump operations known to the bytecode compiler
+     */
+    enum JumpType {
+	// Not a jump
+	JumpNone = 0,
+	// Jump unconditionally
+	JumpAlways,
+	// Pop a value and jump if it is true
+	JumpTrue,
+	// Pop a value and jump if it is false
+	JumpFalse
+    };
+
     /**
      * Constructs an evaluator from an operator dictionary
      * @param operators Pointer to operator dictionary, longest strings first
@@ -274,7 +290,29 @@ public:
      * @return True if the expression was simplified
      */
     inline bool simplify()
-	{ return trySimplify(); }
+	{ clearBytecode(); return trySimplify(); }
+
+    /**
+     * Compile the postfix expression to a compact bytecode run by a stack machine.
+     * Constants are stored in a pool, fields are resolved to slots and numbers
+     *  or short strings are kept on the machine stack without allocating them.
+     * The expression is still interpreted if it uses operations not supported
+     *  by the bytecode machine
+     * @return True if evaluation will run the bytecode
+     */
+    bool buildBytecode();
+
+    /**
+     * Release the bytecode, the expression will be interpreted
+     */
+    void clearBytecode();
+
+    /**
+     * Check if the expression is evaluated by running its bytecode
+     * @return True if the expression has a bytecode form
+     */
+    inline bool hasBytecode() const
+	{ return m_bytecode != 0; }
 
     /**
      * Check if a parse or compile error was encountered
@@ -671,6 +709,14 @@ protected:
      */
     virtual bool runAssign(ObjList& stack, const ExpOperation& oper, GenObject* context = 0) const;
 
+    /**
+     * Classify an operation as a jump for the bytecode compiler.
+     * The jump target is the label operation holding the same number
+     * @param oper Operation to check
+     * @return Type of jump, JumpNone if the operation is not a jump
+     */
+    virtual JumpType jumpType(const ExpOperation& oper) const;
+
     /**
      * Internally used operator dictionary
      */
@@ -693,6 +739,7 @@ protected:
 
 private:
     ExpExtender* m_extender;
+    ExpBytecode* m_bytecode;
 };
 
 /**
@@ -718,7 +765,7 @@ public:
     inline ExpOperation(const ExpOperation& original)
 	: NamedString(original.name(),original),
 	  m_opcode(original.opcode()), m_number(original.number()),
-	  m_barrier(original.barrier())
+	  m_barrier(original.barrier()), m_site(original.m_site), m_cache(0)
 	{ }
 
     /**
@@ -729,7 +776,7 @@ public:
     inline ExpOperation(const ExpOperation& original, const char* name)
 	: NamedString(name,original),
 	  m_opcode(original.opcode()), m_number(original.number()),
-	  m_barrier(original.barrier())
+	  m_barrier(original.barrier()), m_site(original.m_site), m_cache(0)
 	{ }
 
     /**
@@ -742,7 +789,7 @@ public:
 	: NamedString(name,value),
 	  m_opcode(ExpEvaluator::OpcPush),
 	  m_number(autoNum ? value.toLong(nonInteger()) : nonInteger()),
-	  m_barrier(false)
+	  m_barrier(false), m_site(0), m_cache(0)
 	{ if (autoNum && value.isBoolean()) m_number = value.toBoolean() ? 1 : 0; }
 
     /**
@@ -752,7 +799,8 @@ public:
      */
     inline explicit ExpOperation(const char* value, const char* name = 0)
 	: NamedString(name,value),
-	  m_opcode(ExpEvaluator::OpcPush), m_number(nonInteger()), m_barrier(false)
+	  m_opcode(ExpEvaluator::OpcPush), m_number(nonInteger()), m_barrier(false),
+	  m_site(0), m_cache(0)
 	{ }
 
     /**
@@ -762,7 +810,8 @@ public:
      */
     inline explicit ExpOperation(long int value, const char* name = 0)
 	: NamedString(name,""),
-	  m_opcode(ExpEvaluator::OpcPush), m_number(value), m_barrier(false)
+	  m_opcode(ExpEvaluator::OpcPush), m_number(value), m_barrier(false),
+	  m_site(0), m_cache(0)
 	{ String::operator=((int)value); }
 
     /**
@@ -772,7 +821,8 @@ public:
      */
     inline explicit ExpOperation(bool value, const char* name = 0)
 	: NamedString(name,String::boolText(value)),
-	  m_opcode(ExpEvaluator::OpcPush), m_number(value ? 1 : 0), m_barrier(false)
+	  m_opcode(ExpEvaluator::OpcPush), m_number(value ? 1 : 0), m_barrier(false),
+	  m_site(0), m_cache(0)
 	{ }
 
     /**
@@ -784,7 +834,8 @@ public:
      */
     inline ExpOperation(ExpEvaluator::Opcode oper, const char* name = 0, long int value = nonInteger(), bool barrier = false)
 	: NamedString(name,""),
-	  m_opcode(oper), m_number(value), m_barrier(barrier)
+	  m_opcode(oper), m_number(value), m_barrier(barrier),
+	  m_site(0), m_cache(0)
 	{ }
 
     /**
@@ -796,7 +847,8 @@ public:
      */
     inline ExpOperation(ExpEvaluator::Opcode oper, const char* name, const char* value, bool barrier = false)
 	: NamedString(name,value),
-	  m_opcode(oper), m_number(nonInteger()), m_barrier(barrier)
+	  m_opcode(oper), m_number(nonInteger()), m_barrier(barrier),
+	  m_site(0), m_cache(0)
 	{ }
 
     /**
@@ -827,6 +879,28 @@ public:
     inline bool barrier() const
 	{ return m_barrier; }
 
+    /**
+     * Retrieve the compiled operation whose inline cache is used by this one
+     * @return Operation this one was copied from at runtime, this one if none
+     */
+    inline const ExpOperation& site() const
+	{ return m_site ? *m_site : *this; }
+
+    /**
+     * Make this operation use the inline cache of another operation site
+     * @param oper Operation to use as site, it must outlive this operation
+     */
+    inline void setSite(const ExpOperation& oper)
+	{ m_site = &oper.site(); }
+
+    /**
+     * Access the inline cache of the operation site. Script objects use it to
+     *  remember the shape and index where a property was found last time
+     * @return Reference to the cache of the site
+     */
+    inline u_int32_t& siteCache() const
+	{ return site().m_cache; }
+
     /**
      * Number assignment operator
      * @param num Numeric value to assign to the operation
@@ -854,6 +928,8 @@ private:
     ExpEvaluator::Opcode m_opcode;
     long int m_number;
     bool m_barrier;
+    const ExpOperation* m_site;
+    mutable u_int32_t m_cache;
 };
 
 /**
@@ -1010,15 +1086,21 @@ public:
      * @param name Name of the context
      */
     inline explicit ScriptContext(const char* name = 0)
-	: m_params(name)
+	: m_params(name), m_shape(0), m_slots(0), m_count(0), m_alloc(0)
 	{ }
 
     /**
-     * Access to the NamedList operator
+     * Destructor
+     */
+    virtual ~ScriptContext();
+
+    /**
+     * Access to the NamedList operator.
+     * The shape of the context is computed again after any access through it
      * @return Reference to the internal named list
      */
     inline NamedList& params()
-	{ return m_params; }
+	{ m_shape = 0; return m_params; }
 
     /**
      * Const access to the NamedList operator
@@ -1072,6 +1154,30 @@ public:
      */
     virtual NamedString* getField(ObjList& stack, const String& name, GenObject* context) const;
 
+    /**
+     * Retrieve the shape (hidden class) of the context properties.
+     * Contexts having the same properties added in the same order share the same shape
+     * @return Shape identifier, zero if properties are not cacheable
+     */
+    unsigned int shape() const;
+
+    /**
+     * Find a property using the inline cache of the operation accessing it.
+     * A hit in the cache is an indexed load, a miss searches by name and
+     *  updates the cache of the operation site
+     * @param name Name of the property to find
+     * @param oper Operation accessing the property
+     * @return Pointer to the property, NULL if not present
+     */
+    NamedString* getProperty(const String& name, const ExpOperation& oper) const;
+
+    /**
+     * Retrieve the global inline cache statistics, counters are approximate
+     * @param hits Filled with the number of property lookups found in cache
+     * @param misses Filled with the number of property lookups searched by name
+     */
+    static void cacheStats(u_int64_t& hits, u_int64_t& misses);
+
     /**
      * Try to evaluate a single function in the context
      * @param stack Evaluation stack in use, parameters are popped off this stack and results are pushed back on stack
@@ -1101,6 +1207,10 @@ public:
 
 private:
     NamedList m_params;
+    mutable unsigned int m_shape;
+    mutable NamedString** m_slots;
+    mutable unsigned int m_count;
+    mutable unsigned int m_alloc;
 };
 
 /**
@@ -1440,6 +1550,26 @@ public:
     inline void freeze()
 	{ m_frozen = true; }
 
+    /**
+     * Check if the object is part of a global state shared by several contexts.
+     * Shared objects are only read, contexts copy them before changing them
+     * @return True if the object is shared
+     */
+    inline bool shared() const
+	{ return m_shared; }
+
+    /**
+     * Mark the object and all objects it holds as shared between contexts
+     */
+    void share();
+
+    /**
+     * Create a copy of the object, the objects it holds are not copied
+     * @param mtx Pointer to the mutex that serializes the copy
+     * @return New object, NULL if the object cannot be copied
+     */
+    virtual JsObject* copy(Mutex* mtx) const;
+
     /**
      * Initialize the standard global objects in a context
      * @param context Script context to initialize
@@ -1459,6 +1589,7 @@ protected:
 
 private:
     bool m_frozen;
+    bool m_shared;
     Mutex* m_mutex;
 };
 
@@ -1489,6 +1620,14 @@ public:
      */
     virtual bool runDefined(ObjList& stack, const ExpOperation& oper, GenObject* context);
 
+    /**
+     * Functions are shared read-only between contexts and never copied
+     * @param mtx Pointer to the mutex that would serialize the copy
+     * @return Always NULL
+     */
+    virtual JsObject* copy(Mutex* mtx) const
+	{ return 0; }
+
 };
 
 /**
@@ -1513,6 +1652,16 @@ public:
      */
     virtual ScriptContext* createContext() const;
 
+    /**
+     * Create a Javascript context on top of a shared global state.
+     * Properties missing from the new context are read from the shared one,
+     *  assignments are stored in the new context and shared objects are
+     *  copied into it before being changed
+     * @param shared Global state, marked as shared by JsObject::share()
+     * @return A new Javascript context
+     */
+    ScriptContext* createContext(JsObject* shared) const;
+
     /**
      * Create a runner adequate for a block of parsed Javascript code
      * @param code Parsed code block
@@ -40,7 +40,8 @@ enum {
     CdrUpdate,
     CdrHangup,
     CdrDrop,
-    EngHalt
+    EngHalt,
+    EngTimer
 };
 
 class CdrHandler : public MessageHandler
@@ -76,7 +77,10 @@ public:
     void update(int type, u_int64_t val, const char* status = 0);
     bool update(const Message& msg, int type, u_int64_t val);
     void emit(const char *operation = 0);
+    void emitUpdate();
     String getStatus() const;
+    inline u_int64_t due() const
+	{ return m_due; }
     static CdrBuilder* find(String &id);
 private:
     u_int64_t
@@ -88,6 +92,7 @@ private:
     String m_dir;
     String m_status;
     String m_cdrId;
+    u_int64_t m_due;
     bool m_first;
     bool m_write;
 };
@@ -126,8 +131,14 @@ private:
 };
 
 
-static ObjList s_cdrs;
+static HashList s_cdrs(1021);
+// Hungup records are kept in expiration order, the hash only indexes them
 static ObjList s_hungup;
+static HashList s_hungupIndex(251);
+// CDRs with an update operation waiting to be emitted, in emit time order
+static ObjList s_pending;
+static u_int64_t s_coalesce = 0;
+static unsigned int s_coalesced = 0;
 u_int64_t Hungup::s_exp = 5000000;
 
 // This mutex protects both the CDR list and the params list
@@ -207,14 +218,37 @@ static void expireHungup()
 	if (h->expires() > t.usec())
 	    return;
 	DDebug("cdrbuild",DebugInfo,"Expiring hungup guard for '%s'",h->c_str());
+	s_hungupIndex.remove(h,false);
 	s_hungup.remove(h);
     }
 }
 
+static inline Hungup* findHungup(const String& id)
+{
+    return static_cast<Hungup*>(s_hungupIndex[id]);
+}
+
+static void addHungup(const String& id, bool emitHangup)
+{
+    Hungup* h = new Hungup(id,emitHangup);
+    s_hungup.append(h);
+    s_hungupIndex.append(h)->setDelete(false);
+}
+
+// Emit the coalesced update operations whose time has come
+static void emitPending(u_int64_t now)
+{
+    while (CdrBuilder* b = static_cast<CdrBuilder*>(s_pending.get())) {
+	if (b->due() > now)
+	    return;
+	b->emitUpdate();
+    }
+}
+
 
 CdrBuilder::CdrBuilder(const char *name)
     : NamedList(name), m_dir("unknown"), m_status("unknown"),
-      m_first(true), m_write(true)
+      m_due(0), m_first(true), m_write(true)
 {
     m_start = m_call = m_ringing = m_answer = m_hangup = 0;
     m_cdrId = ++s_seq;
@@ -227,15 +261,40 @@ CdrBuilder::~CdrBuilder()
 	if (!getParam("reason"))
 	    addParam("reason","CDR shutdown");
     }
+    // the finalize carries all the changes of a pending update
+    if (m_due) {
+	s_pending.remove(this,false);
+	s_coalesced++;
+    }
     emit("finalize");
-    if (Hungup::s_exp && !s_hungup.find(*this))
-	s_hungup.append(new Hungup(*this,false));
+    if (Hungup::s_exp && !findHungup(*this))
+	addHungup(*this,false);
+}
+
+// Emit an update operation that was delayed for coalescing
+void CdrBuilder::emitUpdate()
+{
+    if (!m_due)
+	return;
+    s_pending.remove(this,false);
+    m_due = 0;
+    emit("update");
 }
 
 void CdrBuilder::emit(const char *operation)
 {
     if (null())
 	return;
+    if (!operation && !m_first && s_coalesce) {
+	// delay the update, it will be built from the latest state when emitted
+	if (m_due)
+	    s_coalesced++;
+	else {
+	    m_due = Time::now() + s_coalesce;
+	    s_pending.append(this)->setDelete(false);
+	}
+	return;
+    }
     u_int64_t t_hangup = m_hangup ? m_hangup : Time::now();
 
     u_int64_t
@@ -339,6 +398,8 @@ bool CdrBuilder::update(const Message& msg, int type, u_int64_t val)
     if (type == CdrDrop) {
 	Debug("cdrbuild",DebugNote,"%s CDR for '%s'",
 	    (m_first ? "Dropping" : "Closing"),c_str());
+	// unlink while the name still selects our hash list
+	s_cdrs.remove(this,false);
 	// if we didn't generate an initialize generate no finalize
 	if (m_first)
 	    clear();
@@ -350,7 +411,7 @@ bool CdrBuilder::update(const Message& msg, int type, u_int64_t val)
 	    if (reason)
 		setParam("reason",reason);
 	}
-	s_cdrs.remove(this);
+	destruct();
 	return true;
     }
     // cdrwrite must be consistent over all emitted messages so we read it once
@@ -414,6 +475,11 @@ bool CdrHandler::received(Message &msg)
 	s_cdrs.clear();
 	return false;
     }
+    if (m_type == EngTimer) {
+	if (s_pending.skipNull())
+	    emitPending(msg.msgTime().usec());
+	return false;
+    }
     if ((m_type == CdrProgress) && !msg.getBoolValue(YSTRING("earlymedia"),false))
 	return false;
     bool track = true;
@@ -442,7 +508,7 @@ bool CdrHandler::received(Message &msg)
 	    case CdrAnswer:
 		{
 		    expireHungup();
-		    Hungup* h = static_cast<Hungup*>(s_hungup[id]);
+		    Hungup* h = findHungup(id);
 		    if (h) {
 			if (h->hangup())
 			    // seen hangup but not emitted call.cdr - do it now
@@ -461,9 +527,9 @@ bool CdrHandler::received(Message &msg)
 		break;
 	    case CdrHangup:
 		expireHungup();
-		if (Hungup::s_exp && !s_hungup.find(id))
+		if (Hungup::s_exp && !findHungup(id))
 		    // remember to emit a finalize if we ever see a startup
-		    s_hungup.append(new Hungup(id,true));
+		    addHungup(id,true);
 		else
 		    level = DebugMild;
 		break;
@@ -496,18 +562,21 @@ bool StatusHandler::received(Message &msg)
     s_mutex.lock();
     expireHungup();
     st << ";cdrs=" << s_cdrs.count() << ",hungup=" << s_hungup.count();
+    st << ",pending=" << s_pending.count() << ",coalesced=" << s_coalesced;
     if (msg.getBoolValue(YSTRING("details"),true)) {
 	st << ";";
-	ObjList *l = &s_cdrs;
 	bool first = true;
-	for (; l; l=l->next()) {
-	    CdrBuilder *b = static_cast<CdrBuilder *>(l->get());
-	    if (b) {
-		if (first)
-		    first = false;
-		else
-		    st << ",";
-		st << *b << "=" << b->getStatus();
+	for (unsigned int i = 0; i < s_cdrs.length(); i++) {
+	    ObjList* l = s_cdrs.getList(i);
+	    for (; l; l=l->next()) {
+		CdrBuilder *b = static_cast<CdrBuilder *>(l->get());
+		if (b) {
+		    if (first)
+			first = false;
+		    else
+			st << ",";
+		    st << *b << "=" << b->getStatus();
+		}
 	    }
 	}
     }
@@ -562,8 +631,13 @@ void CdrBuildPlugin::initialize()
 	exp = 0;
     else if (exp > 600000)
 	exp = 600000;
+    int coalesce = cfg.getIntValue("general","coalesce",0,0,60000);
     s_mutex.lock();
     Hungup::s_exp = 1000 * (u_int64_t)exp;
+    s_coalesce = 1000 * (u_int64_t)coalesce;
+    // emit now any update still waiting if coalescing got disabled
+    if (!s_coalesce)
+	emitPending((u_int64_t)-1);
     s_params.clear();
     const struct _params* params = s_defParams;
     for (; params->name; params++)
@@ -604,6 +678,7 @@ void CdrBuildPlugin::initialize()
 	Engine::install(new CdrHandler("chan.hangup",CdrHangup,150));
 	Engine::install(new CdrHandler("call.drop",CdrDrop));
 	Engine::install(new CdrHandler("engine.halt",EngHalt,150));
+	Engine::install(new CdrHandler("engine.timer",EngTimer,150));
 	Engine::install(new StatusHandler);
 	Engine::install(new CommandHandler);
     }
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <stdio.h>
 
 #ifdef _WINDOWS
 #define EOLN "\r\n"
@@ -39,48 +40,356 @@
 using namespace TelEngine;
 namespace { // anonymous
 
+class CdrFileHandler;
+
+// Thread writing the queued records to file
+class CdrWriter : public Thread
+{
+public:
+    inline CdrWriter(CdrFileHandler* handler)
+	: Thread("CDR Writer"), m_handler(handler)
+	{ }
+    virtual ~CdrWriter();
+    virtual void run();
+private:
+    CdrFileHandler* m_handler;
+};
+
 class CdrFileHandler : public MessageHandler, public Mutex
 {
+    friend class CdrWriter;
 public:
     CdrFileHandler(const char *name)
 	: MessageHandler(name), Mutex(false,"CdrFileHandler"),
-	  m_file(-1)
+	  m_file(-1), m_tabs(true), m_columns(0),
+	  m_queue(new ObjList), m_last(m_queue), m_queued(0), m_maxQueue(0),
+	  m_commitRecords(100), m_interval(0), m_sync(false),
+	  m_size(0), m_rotateSize(0), m_rotateInterval(0), m_rotateAt(0),
+	  m_written(0), m_dropped(0), m_failed(false),
+	  m_fileMutex(false,"CdrFile"), m_wake(1,"CdrFile"), m_writer(0)
 	{ }
     virtual ~CdrFileHandler();
     virtual bool received(Message &msg);
-    void init(const char *fname, bool tabsep, const char* format);
+    void init(const char *fname, const NamedList& params);
+    bool commit();
+    void stop();
 private:
+    void formatRecord(const Message& msg, String& str) const;
+    bool openFile();
+    void closeFile();
+    void checkRotate();
     int m_file;
+    String m_name;
     String m_format;
+    bool m_tabs;
+    ObjList* m_columns;
+    String m_header;
+    ObjList* m_queue;
+    ObjList* m_last;
+    unsigned int m_queued;
+    unsigned int m_maxQueue;
+    unsigned int m_commitRecords;
+    unsigned int m_interval;
+    bool m_sync;
+    u_int64_t m_size;
+    u_int64_t m_rotateSize;
+    unsigned int m_rotateInterval;
+    unsigned int m_rotateAt;
+    u_int64_t m_written;
+    u_int64_t m_dropped;
+    bool m_failed;
+    Mutex m_fileMutex;
+    Semaphore m_wake;
+    CdrWriter* m_writer;
 };
 
-CdrFileHandler::~CdrFileHandler()
+// Append a CSV field, quote it only if required
+static void appendField(String& str, const String& value, char sep)
 {
-    Lock lock(this);
-    if (m_file >= 0) {
-	::close(m_file);
-	m_file = -1;
+    const char* s = value.c_str();
+    if (!s)
+	return;
+    if (!(::strchr(s,sep) || ::strchr(s,'"') || ::strchr(s,'\n') || ::strchr(s,'\r'))) {
+	str += value;
+	return;
+    }
+    str << '"';
+    while (const char* q = ::strchr(s,'"')) {
+	str += String(s,q - s + 1);
+	str << '"';
+	s = q + 1;
     }
+    str << s << '"';
 }
 
-void CdrFileHandler::init(const char *fname, bool tabsep, const char* format)
+
+CdrWriter::~CdrWriter()
 {
+    Lock lock(m_handler);
+    if (m_handler->m_writer == this)
+	m_handler->m_writer = 0;
+}
+
+void CdrWriter::run()
+{
+    while (!check(false)) {
+	m_handler->m_wake.lock(1000 * (long)m_handler->m_interval);
+	m_handler->commit();
+    }
+    m_handler->commit();
+}
+
+
+CdrFileHandler::~CdrFileHandler()
+{
+    stop();
+    Lock lock(m_fileMutex);
+    closeFile();
+    TelEngine::destruct(m_columns);
+    TelEngine::destruct(m_queue);
+}
+
+void CdrFileHandler::init(const char *fname, const NamedList& params)
+{
+    unsigned int interval = params.getIntValue("commit_interval",1000,0,60000);
+    if (!interval)
+	stop();
+    Lock flock(m_fileMutex);
     Lock lock(this);
-    if (m_file >= 0) {
-	::close(m_file);
-	m_file = -1;
+    String name = fname;
+    if (name != m_name) {
+	closeFile();
+	m_name = name;
     }
-    m_format = format;
+    m_tabs = params.getBoolValue("tabs",true);
+    m_format = params.getValue("format");
     if (m_format.null())
-	m_format = tabsep
+	m_format = m_tabs
 	    ? "${time}\t${billid}\t${chan}\t${address}\t${caller}\t${called}\t${billtime}\t${ringtime}\t${duration}\t${direction}\t${status}\t${reason}"
 	    : "${time},\"${billid}\",\"${chan}\",\"${address}\",\"${caller}\",\"${called}\",${billtime},${ringtime},${duration},\"${direction}\",\"${status}\",\"${reason}\"";
-    if (fname) {
-	m_file = ::open(fname,O_WRONLY|O_CREAT|O_APPEND|O_LARGEFILE,0640);
-	if (m_file < 0)
+    TelEngine::destruct(m_columns);
+    m_header.clear();
+    const String& columns = params["columns"];
+    if (columns) {
+	m_columns = columns.split(',',false);
+	char sep = m_tabs ? '\t' : ',';
+	for (ObjList* o = m_columns->skipNull(); o; o = o->skipNext()) {
+	    String* col = static_cast<String*>(o->get());
+	    col->trimBlanks();
+	    if (m_header)
+		m_header << sep;
+	    appendField(m_header,*col,sep);
+	}
+	m_header << EOLN;
+    }
+    m_commitRecords = params.getIntValue("commit_records",100,1,100000);
+    m_maxQueue = params.getIntValue("max_queue",100000,0);
+    m_sync = params.getBoolValue("sync",false);
+    m_rotateSize = 1024 * (u_int64_t)params.getIntValue("rotate_size",0,0);
+    unsigned int rotate = params.getIntValue("rotate_interval",0,0);
+    if (rotate != m_rotateInterval) {
+	m_rotateInterval = rotate;
+	m_rotateAt = 0;
+	if (rotate)
+	    m_rotateAt = (Time::secNow() / rotate + 1) * rotate;
+    }
+    m_interval = interval;
+    if (m_name && (m_file < 0))
+	openFile();
+    if (m_interval && !m_writer) {
+	m_writer = new CdrWriter(this);
+	if (!m_writer->startup()) {
+	    Debug(DebugWarn,"Failed to start CDR writer thread, writing synchronously");
+	    delete m_writer;
+	    m_writer = 0;
+	}
+    }
+}
+
+// Stop the writer thread and write out any queued records
+void CdrFileHandler::stop()
+{
+    lock();
+    CdrWriter* writer = m_writer;
+    if (writer)
+	writer->cancel(false);
+    unlock();
+    if (writer) {
+	m_wake.unlock();
+	while (m_writer)
+	    Thread::idle();
+    }
+    commit();
+}
+
+void CdrFileHandler::formatRecord(const Message& msg, String& str) const
+{
+    if (m_columns) {
+	char sep = m_tabs ? '\t' : ',';
+	bool first = true;
+	for (ObjList* o = m_columns->skipNull(); o; o = o->skipNext()) {
+	    if (first)
+		first = false;
+	    else
+		str << sep;
+	    appendField(str,msg[o->get()->toString()],sep);
+	}
+    }
+    else {
+	str = m_format;
+	msg.replaceParams(str);
+    }
+    str += EOLN;
+}
+
+bool CdrFileHandler::openFile()
+{
+    if (m_name.null())
+	return false;
+    m_file = ::open(m_name,O_WRONLY|O_CREAT|O_APPEND|O_LARGEFILE,0640);
+    if (m_file < 0) {
+	if (!m_failed)
 	    Debug(DebugWarn,"Failed to open or create '%s': %s (%d)",
-		fname,::strerror(errno),errno);
+		m_name.c_str(),::strerror(errno),errno);
+	m_failed = true;
+	return false;
     }
+    off_t pos = ::lseek(m_file,0,SEEK_END);
+    m_size = (pos > 0) ? pos : 0;
+    if (!m_size && m_header) {
+	if (::write(m_file,m_header.c_str(),m_header.length()) > 0)
+	    m_size = m_header.length();
+    }
+    return true;
+}
+
+void CdrFileHandler::closeFile()
+{
+    if (m_file >= 0) {
+	::close(m_file);
+	m_file = -1;
+    }
+}
+
+// Rename the current file and start a new one if size or time limit is reached
+// Called with the file mutex held
+void CdrFileHandler::checkRotate()
+{
+    unsigned int now = Time::secNow();
+    bool timeout = m_rotateAt && (now >= m_rotateAt);
+    if (timeout)
+	m_rotateAt = (now / m_rotateInterval + 1) * m_rotateInterval;
+    if ((m_file < 0) || !m_size)
+	return;
+    if (!(timeout || (m_rotateSize && (m_size >= m_rotateSize))))
+	return;
+    int year = 0;
+    unsigned int month = 0, day = 0, hour = 0, minute = 0, sec = 0;
+    Time::toDateTime(now,year,month,day,hour,minute,sec);
+    char buf[32];
+    ::snprintf(buf,sizeof(buf),".%04d%02u%02u-%02u%02u%02u",year,month,day,hour,minute,sec);
+    String name = m_name + buf;
+    for (int i = 1; File::exists(name); i++) {
+	name = m_name + buf;
+	name << "-" << i;
+    }
+    closeFile();
+    int err = 0;
+    if (File::rename(m_name,name,&err))
+	Debug(DebugInfo,"Rotated CDR file '%s' to '%s'",m_name.c_str(),name.c_str());
+    else
+	Debug(DebugWarn,"Failed to rename '%s' to '%s': %s (%d)",
+	    m_name.c_str(),name.c_str(),::strerror(err),err);
+    openFile();
+}
+
+// Write queued records to file, return false if some were kept for retry
+bool CdrFileHandler::commit()
+{
+    Lock flock(m_fileMutex);
+    checkRotate();
+    lock();
+    if (!m_queued) {
+	unlock();
+	return true;
+    }
+    ObjList* queue = m_queue;
+    unsigned int records = m_queued;
+    m_queue = m_last = new ObjList;
+    m_queued = 0;
+    unlock();
+    // Gather the records in a single block so they are written at once
+    unsigned int total = 0;
+    for (ObjList* o = queue->skipNull(); o; o = o->skipNext())
+	total += static_cast<DataBlock*>(o->get())->length();
+    DataBlock data(0,total);
+    unsigned char* buf = (unsigned char*)data.data();
+    for (ObjList* o = queue->skipNull(); o; o = o->skipNext()) {
+	const DataBlock* rec = static_cast<DataBlock*>(o->get());
+	::memcpy(buf,rec->data(),rec->length());
+	buf += rec->length();
+    }
+    buf = (unsigned char*)data.data();
+    unsigned int len = total;
+    if ((m_file >= 0) || openFile()) {
+	while (len) {
+	    int w = ::write(m_file,buf,len);
+	    if (w < 0) {
+		if (errno == EINTR)
+		    continue;
+		break;
+	    }
+	    buf += w;
+	    len -= w;
+	}
+	m_size += total - len;
+    }
+    if (len) {
+	if (!m_failed && (m_file >= 0))
+	    Debug(DebugWarn,"Failed to write CDR file '%s': %s (%d)",
+		m_name.c_str(),::strerror(errno),errno);
+	m_failed = true;
+	// Drop the written records, keep the unwritten part of a partial one
+	unsigned int written = total - len;
+	while (const DataBlock* rec = static_cast<DataBlock*>(queue->get())) {
+	    if (written < rec->length()) {
+		if (written) {
+		    DataBlock* rest = new DataBlock((char*)rec->data() + written,
+			rec->length() - written);
+		    queue->set(rest);
+		}
+		break;
+	    }
+	    written -= rec->length();
+	    queue->remove();
+	    records--;
+	    m_written++;
+	}
+	// Put the records queued meanwhile after the ones kept for retry
+	lock();
+	ObjList* last = queue->last();
+	for (ObjList* o = m_queue->skipNull(); o; o = o->skipNext()) {
+	    last = last->append(o->get());
+	    o->setDelete(false);
+	}
+	TelEngine::destruct(m_queue);
+	m_queue = queue;
+	m_last = last;
+	m_queued += records;
+	unlock();
+	return false;
+    }
+    TelEngine::destruct(queue);
+#ifndef _WINDOWS
+    if (m_sync)
+	::fdatasync(m_file);
+#endif
+    if (m_failed) {
+	Debug(DebugNote,"Writing CDR file '%s' recovered",m_name.c_str());
+	m_failed = false;
+    }
+    m_written += records;
+    return true;
 }
 
 bool CdrFileHandler::received(Message &msg)
@@ -94,12 +403,23 @@ bool CdrFileHandler::received(Message &msg)
         return false;
 
     Lock lock(this);
-    if ((m_file >= 0) && m_format) {
-	String str = m_format;
-	str += EOLN;
-	msg.replaceParams(str);
-	::write(m_file,str.c_str(),str.length());
+    if (m_name.null())
+	return false;
+    if (m_maxQueue && (m_queued >= m_maxQueue)) {
+	if (!(m_dropped++ % 1000))
+	    Debug(DebugWarn,"CDR queue full, dropped " FMT64U " records so far",m_dropped);
+	return false;
     }
+    String str;
+    formatRecord(msg,str);
+    m_last = m_last->append(new DataBlock((void*)str.c_str(),str.length()));
+    m_queued++;
+    if (!m_writer) {
+	lock.drop();
+	commit();
+    }
+    else if (m_queued >= m_commitRecords)
+	m_wake.unlock();
     return false;
 };
 
@@ -123,6 +443,8 @@ CdrFilePlugin::CdrFilePlugin()
 CdrFilePlugin::~CdrFilePlugin()
 {
     Output("Unloading module CdrFile");
+    if (m_handler)
+	m_handler->stop();
 }
 
 void CdrFilePlugin::initialize()
@@ -136,7 +458,7 @@ void CdrFilePlugin::initialize()
 	Engine::install(m_handler);
     }
     if (m_handler)
-	m_handler->init(file,cfg.getBoolValue("general","tabs",true),cfg.getValue("general","format"));
+	m_handler->init(file,*cfg.createSection("general"));
 }
 
 INIT_PLUGIN(CdrFilePlugin);
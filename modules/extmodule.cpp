@@ -42,6 +42,15 @@
 #include <fcntl.h>
 #include <signal.h>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#ifdef SYS_memfd_create
+#define EXTMOD_SHM
+#endif
+#endif
+
 
 using namespace TelEngine;
 namespace { // anonymous
@@ -49,21 +58,48 @@ namespace { // anonymous
 // Maximum length of an incoming line
 #define MAX_INCOMING_LINE 8192
 
+// Maximum length of an incoming binary frame
+#define MAX_INCOMING_FRAME 65536
+
 // Default message timeout in milliseconds
 #define MSG_TIMEOUT 10000
 
 // Safety wait time after we flushed watchers, relays or messages (in ms)
 #define WAIT_FLUSH 5
 
+// Data size of shared memory audio rings, must be a power of 2
+#define SHM_AUDIO_SIZE 16384
+
+// Identifier at start of shared memory audio rings
+#define SHM_MAGIC 0x5973686d
+
+// Interval in milliseconds between polls of shared memory audio sources
+#define SHM_PUMP_INTERVAL 10
+
 static Configuration s_cfg;
 static ObjList s_chans;
 static ObjList s_modules;
+static ObjList s_pools;
 static Mutex s_mutex(true,"ExtModule");
 static int s_waitFlush = WAIT_FLUSH;
 static int s_timeout = MSG_TIMEOUT;
 static bool s_timebomb = false;
+static bool s_async = false;
+static bool s_shmAudio = false;
+
+// Audio transport counters and the shared memory sources list
+static Mutex s_audioMutex(false,"ExtModAudio");
+static ObjList s_shmSources;
+static bool s_shmPump = false;
+static u_int64_t s_pipeFrames = 0;
+static u_int64_t s_pipeCalls = 0;
+static u_int64_t s_shmFrames = 0;
+static u_int64_t s_shmCalls = 0;
 static bool s_pluginSafe = true;
 
+// Names of the messages that may be handled asynchronously
+static ObjList s_asyncNames;
+
 static const char* s_cmds[] = {
     "info",
     "start",
@@ -75,6 +111,7 @@ static const char* s_cmds[] = {
 
 class ExtModReceiver;
 class ExtModChan;
+class ExtModPool;
 
 class ExtModSource : public ThreadedSource
 {
@@ -100,6 +137,75 @@ private:
     unsigned m_total;
 };
 
+// Header of a shared memory audio ring, the script maps the ring from the
+//  descriptor it received instead of a pipe. The counters hold total bytes
+//  written and read, the data position is the counter modulo size
+struct ShmHeader
+{
+    u_int32_t magic;
+    u_int32_t size;
+    volatile u_int32_t head;
+    volatile u_int32_t tail;
+    // set by a reader waiting on the notification descriptor
+    volatile u_int32_t sleeping;
+    u_int32_t reserved[11];
+};
+
+// Single producer, single consumer ring buffer in shared memory
+class ShmRing
+{
+public:
+    static ShmRing* create(const char* name, File*& fd);
+    ~ShmRing();
+    bool put(const void* data, unsigned int len);
+    unsigned int get(void* data, unsigned int len);
+    inline bool sleeping() const
+	{ return m_hdr->sleeping != 0; }
+private:
+    ShmRing(ShmHeader* hdr, unsigned int len);
+    ShmHeader* m_hdr;
+    unsigned char* m_data;
+    unsigned int m_len;
+};
+
+// Audio consumer writing to a shared memory ring
+class ExtModShmConsumer : public DataConsumer
+{
+public:
+    ExtModShmConsumer(ShmRing* ring, File* notify);
+    ~ExtModShmConsumer();
+    virtual unsigned long Consume(const DataBlock& data, unsigned long timestamp, unsigned long flags);
+private:
+    ShmRing* m_ring;
+    File* m_notify;
+    unsigned m_total;
+    unsigned m_overruns;
+};
+
+// Audio source reading from a shared memory ring, polled by the pump thread
+class ExtModShmSource : public DataSource
+{
+public:
+    ExtModShmSource(ShmRing* ring);
+    ~ExtModShmSource();
+    void pump(u_int64_t now);
+private:
+    ShmRing* m_ring;
+    u_int64_t m_tpos;
+    unsigned m_brate;
+    unsigned m_total;
+};
+
+// Single thread forwarding the audio of all shared memory sources
+class ExtModShmPump : public Thread
+{
+public:
+    inline ExtModShmPump()
+	: Thread("ExtMod Shm Pump")
+	{ }
+    virtual void run();
+};
+
 class ExtModChan : public CallEndpoint
 {
 public:
@@ -111,7 +217,7 @@ public:
 	DataBoth
     };
     ExtModChan(ExtModReceiver* recv);
-    static ExtModChan* build(const char* file, const char* args, int type);
+    static ExtModChan* build(const char* file, const char* args, int type, bool shm = false);
     ~ExtModChan();
     virtual void disconnected(bool final, const char* reason);
     inline ExtModReceiver* receiver() const
@@ -137,7 +243,9 @@ public:
     inline void waiting(bool wait)
 	{ m_waiting = wait; }
 private:
-    ExtModChan(const char* file, const char* args, int type);
+    ExtModChan(const char* file, const char* args, int type, bool shm);
+    bool shmConsumer(File*& reader, File*& notify);
+    bool shmSource(File*& writer);
     ExtModReceiver *m_recv;
     const Message* m_waitRet;
     int m_type;
@@ -162,6 +270,8 @@ public:
 	{ return m_receiver == recv; }
     inline int decode(const char* str)
 	{ return Message::decode(str,m_id); }
+    inline int decodeFrame(const void* data, unsigned int len)
+	{ return Message::decodeFrame(data,len,m_id); }
     inline const String& id() const
 	{ return m_id; }
 private:
@@ -170,16 +280,63 @@ private:
     bool m_accepted;
 };
 
+// A copy of a message handled asynchronously, dispatched again if not handled
+class ParkedMessage : public Message
+{
+    YCLASS(ParkedMessage,Message)
+public:
+    inline ParkedMessage(const Message& original, ExtModReceiver* recv)
+	: Message(original), m_receiver(recv)
+	{ userData(original.userData()); }
+    // The receiver pointer is only compared, never dereferenced
+    inline bool belongsTo(ExtModReceiver* recv) const
+	{ return m_receiver == recv; }
+private:
+    ExtModReceiver* m_receiver;
+};
+
 class MsgHolder : public GenObject, public Semaphore
 {
 public:
-    MsgHolder(Message &msg);
+    MsgHolder(Message &msg, ParkedMessage* parked = 0, u_int64_t expires = 0);
+    virtual ~MsgHolder();
+    virtual const String& toString() const
+	{ return m_id; }
     Message &m_msg;
     bool m_ret;
     String m_id;
     bool decode(const char *s);
+    bool decodeFrame(const void* data, unsigned int len);
+    void resume();
+    static bool canPark(const String& name);
     inline const Message* msg() const
 	{ return &m_msg; }
+    inline bool parked() const
+	{ return m_parked != 0; }
+    inline u_int64_t expires() const
+	{ return m_expires; }
+private:
+    ParkedMessage* m_parked;
+    u_int64_t m_expires;
+};
+
+// A slot in a pool of identical global scripts, outlives the script instances
+class PoolMember : public GenObject
+{
+public:
+    inline PoolMember(ExtModPool* pool, unsigned int index)
+	: m_pool(pool), m_index(index), m_recv(0), m_pending(0),
+	  m_count(0), m_usec(0), m_maxUsec(0), m_starts(0), m_restarts(0)
+	{ }
+    ExtModPool* m_pool;
+    unsigned int m_index;
+    ExtModReceiver* m_recv;
+    unsigned int m_pending;
+    u_int64_t m_count;
+    u_int64_t m_usec;
+    u_int64_t m_maxUsec;
+    unsigned int m_starts;
+    unsigned int m_restarts;
 };
 
 // Yet Another of Maciek's ideas
@@ -207,14 +364,22 @@ public:
 	RoleGlobal,
 	RoleChannel
     };
+    // Relay identifiers
+    enum {
+	RelaySync = 1,
+	RelayAsync = 2
+    };
     static ExtModReceiver* build(const char *script, const char *args, bool ref = false,
-	File* ain = 0, File* aout = 0, ExtModChan *chan = 0);
+	File* ain = 0, File* aout = 0, ExtModChan *chan = 0, File* aevent = 0);
     static ExtModReceiver* build(const char* name, Stream* io, ExtModChan* chan = 0, int role = RoleUnknown);
+    static ExtModReceiver* build(const char* script, const char* args, PoolMember* member);
     static ExtModReceiver* find(const String& script);
     ~ExtModReceiver();
     virtual bool received(Message& msg, int id);
     bool processLine(const char* line);
+    bool processFrames(DataBlock& frames);
     bool outputLine(const char* line);
+    bool outputMessage(const Message& msg, const char* id);
     void reportError(const char* line);
     void returnMsg(const Message* msg, const char* id, bool accepted);
     bool addWatched(const String& name);
@@ -223,8 +388,9 @@ public:
     void run();
     void cleanup();
     bool flush();
+    void expire();
     void die(bool clearChan = true);
-    void use();
+    bool use();
     bool unuse();
     inline const String& scriptFile() const
 	{ return m_script; }
@@ -238,12 +404,15 @@ public:
 
 private:
     ExtModReceiver(const char* script, const char* args,
-	File* ain, File* aout, ExtModChan* chan);
+	File* ain, File* aout, ExtModChan* chan, File* aevent = 0);
     ExtModReceiver(const char* name, Stream* io, ExtModChan* chan, int role);
     bool create(const char* script, const char* args);
     void closeIn();
     void closeOut();
     void closeAudio();
+    bool outputData(const void* data, unsigned int len);
+    void answer(const String& id, const char* line, const void* frame = 0, unsigned int len = 0);
+    void startMessage(ExtMessage* m);
     int m_role;
     bool m_dead;
     int m_use;
@@ -252,6 +421,7 @@ private:
     Stream* m_out;
     File* m_ain;
     File* m_aout;
+    File* m_aevent;
     ExtModChan* m_chan;
     MsgWatcher* m_watcher;
     bool m_selfWatch;
@@ -260,8 +430,12 @@ private:
     int m_timeout;
     bool m_timebomb;
     bool m_restart;
+    bool m_async;
+    bool m_binary;
+    PoolMember* m_member;
+    u_int64_t m_nextExpire;
     String m_script, m_args;
-    ObjList m_waiting;
+    HashList m_waiting;
     ObjList m_relays;
     String m_reason;
 };
@@ -296,6 +470,51 @@ private:
     bool complete(const String& partLine, const String& partWord, String& rval) const;
 };
 
+// Handler installed once for all the pool members that requested it
+class PoolHandler : public MessageHandler
+{
+public:
+    inline PoolHandler(ExtModPool* pool, const char* name, unsigned prio, int relayId)
+	: MessageHandler(name,prio), m_pool(pool), m_relayId(relayId)
+	{ }
+    virtual bool received(Message& msg);
+    inline int relayId() const
+	{ return m_relayId; }
+    // Pool members that installed the handler, not owned
+    ObjList m_members;
+private:
+    ExtModPool* m_pool;
+    int m_relayId;
+};
+
+// A pool of identical global scripts sharing the load of their handlers
+class ExtModPool : public GenObject, public Mutex
+{
+public:
+    ExtModPool(const char* name, const NamedList& sect);
+    virtual ~ExtModPool();
+    virtual const String& toString() const
+	{ return m_name; }
+    void start();
+    void restart(PoolMember* member);
+    bool install(PoolMember* member, const String& name, int prio,
+	const String& fname, const String& fvalue, int relayId);
+    bool uninstall(PoolMember* member, const String& name, int& prio);
+    void detach(PoolMember* member, ExtModReceiver* recv);
+    bool dispatch(Message& msg, const PoolHandler& handler);
+    void describe(String& rval);
+    static ExtModPool* build(const char* name, const NamedList& sect);
+private:
+    String m_name;
+    String m_script;
+    String m_args;
+    String m_sticky;
+    unsigned int m_count;
+    unsigned int m_next;
+    ObjList m_members;
+    ObjList m_handlers;
+};
+
 class ExtListener : public Thread
 {
 public:
@@ -323,6 +542,44 @@ private:
 };
 
 
+// Count audio frames moved and system calls made to move them
+static void audioStats(bool shm, unsigned int frames, unsigned int calls)
+{
+    Lock lock(s_audioMutex);
+    if (shm) {
+	s_shmFrames += frames;
+	s_shmCalls += calls;
+    }
+    else {
+	s_pipeFrames += frames;
+	s_pipeCalls += calls;
+    }
+}
+
+// Append audio transport counters and their rates since the previous call
+static void audioStatus(String& rval)
+{
+    static u_int64_t s_last[4] = { 0, 0, 0, 0 };
+    static u_int64_t s_lastTime = 0;
+    Lock lock(s_audioMutex);
+    u_int64_t crt[4] = { s_pipeFrames, s_pipeCalls, s_shmFrames, s_shmCalls };
+    u_int64_t now = Time::now();
+    u_int64_t usec = s_lastTime ? (now - s_lastTime) : 0;
+    u_int64_t rate[4];
+    for (int i = 0; i < 4; i++) {
+	rate[i] = usec ? ((crt[i] - s_last[i]) * 1000000 / usec) : 0;
+	s_last[i] = crt[i];
+    }
+    s_lastTime = now;
+    lock.drop();
+    char buf[256];
+    ::snprintf(buf,sizeof(buf),
+	"Audio pipe: frames=" FMT64U " (" FMT64U "/s), syscalls=" FMT64U " (" FMT64U "/s)\r\n"
+	"Audio shm: frames=" FMT64U " (" FMT64U "/s), syscalls=" FMT64U " (" FMT64U "/s)\r\n",
+	crt[0],rate[0],crt[1],rate[1],crt[2],rate[2],crt[3],rate[3]);
+    rval << buf;
+}
+
 static bool runProgram(const char *script, const char *args)
 {
 #ifdef _WINDOWS
@@ -407,6 +664,7 @@ void ExtModSource::run()
 	    continue;
 	}
 	r = m_str->readData(data,sizeof(data));
+	audioStats(false,(r > 0) ? 1 : 0,1);
 	if (r < 0) {
 	    if (errno == EINTR) {
 		r = 1;
@@ -419,6 +677,7 @@ void ExtModSource::run()
 	if (dly > 0) {
 	    XDebug("ExtModSource",DebugAll,"Sleeping for " FMT64 " usec",dly);
 	    Thread::usleep((unsigned long)dly);
+	    audioStats(false,0,1);
 	}
 	if (r <= 0)
 	    continue;
@@ -453,6 +712,7 @@ unsigned long ExtModConsumer::Consume(const DataBlock& data, unsigned long times
 {
     if ((m_str) && !data.null()) {
 	m_str->writeData(data);
+	audioStats(false,1,1);
 	m_total += data.length();
 	return invalidStamp();
     }
@@ -460,9 +720,211 @@ unsigned long ExtModConsumer::Consume(const DataBlock& data, unsigned long times
 }
 
 
-ExtModChan* ExtModChan::build(const char* file, const char* args, int type)
+ShmRing* ShmRing::create(const char* name, File*& fd)
+{
+#ifdef EXTMOD_SHM
+    unsigned int len = sizeof(ShmHeader) + SHM_AUDIO_SIZE;
+    int h = ::syscall(SYS_memfd_create,name,0);
+    if (h < 0)
+	return 0;
+    void* mem = MAP_FAILED;
+    if (!::ftruncate(h,len))
+	mem = ::mmap(0,len,PROT_READ|PROT_WRITE,MAP_SHARED,h,0);
+    if (mem == MAP_FAILED) {
+	::close(h);
+	return 0;
+    }
+    ShmHeader* hdr = static_cast<ShmHeader*>(mem);
+    ::memset(hdr,0,sizeof(ShmHeader));
+    hdr->magic = SHM_MAGIC;
+    hdr->size = SHM_AUDIO_SIZE;
+    fd = new File(h);
+    return new ShmRing(hdr,len);
+#else
+    return 0;
+#endif
+}
+
+ShmRing::ShmRing(ShmHeader* hdr, unsigned int len)
+    : m_hdr(hdr), m_data(reinterpret_cast<unsigned char*>(hdr + 1)), m_len(len)
+{
+}
+
+ShmRing::~ShmRing()
+{
+#ifdef EXTMOD_SHM
+    ::munmap(m_hdr,m_len);
+#endif
+}
+
+// Write all the data or nothing if there is not enough space
+bool ShmRing::put(const void* data, unsigned int len)
 {
-    ExtModChan* chan = new ExtModChan(file,args,type);
+#ifdef EXTMOD_SHM
+    u_int32_t head = m_hdr->head;
+    u_int32_t tail = m_hdr->tail;
+    if (SHM_AUDIO_SIZE - (head - tail) < len)
+	return false;
+    unsigned int offs = head % SHM_AUDIO_SIZE;
+    unsigned int n = SHM_AUDIO_SIZE - offs;
+    if (n > len)
+	n = len;
+    ::memcpy(m_data + offs,data,n);
+    if (n < len)
+	::memcpy(m_data,static_cast<const unsigned char*>(data) + n,len - n);
+    // make the data visible before advancing the counter
+    __sync_synchronize();
+    m_hdr->head = head + len;
+    __sync_synchronize();
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Read up to len bytes, return how many were available
+unsigned int ShmRing::get(void* data, unsigned int len)
+{
+#ifdef EXTMOD_SHM
+    u_int32_t tail = m_hdr->tail;
+    u_int32_t avail = m_hdr->head - tail;
+    if (avail > SHM_AUDIO_SIZE)
+	return 0;
+    if (len > avail)
+	len = avail;
+    if (!len)
+	return 0;
+    __sync_synchronize();
+    unsigned int offs = tail % SHM_AUDIO_SIZE;
+    unsigned int n = SHM_AUDIO_SIZE - offs;
+    if (n > len)
+	n = len;
+    ::memcpy(data,m_data + offs,n);
+    if (n < len)
+	::memcpy(static_cast<unsigned char*>(data) + n,m_data,len - n);
+    __sync_synchronize();
+    m_hdr->tail = tail + len;
+    return len;
+#else
+    return 0;
+#endif
+}
+
+
+ExtModShmConsumer::ExtModShmConsumer(ShmRing* ring, File* notify)
+    : m_ring(ring), m_notify(notify), m_total(0), m_overruns(0)
+{
+    Debug(DebugAll,"ExtModShmConsumer::ExtModShmConsumer(%p,%p) [%p]",ring,notify,this);
+}
+
+ExtModShmConsumer::~ExtModShmConsumer()
+{
+    Debug(DebugAll,"ExtModShmConsumer::~ExtModShmConsumer() [%p] total=%u overruns=%u",
+	this,m_total,m_overruns);
+    delete m_ring;
+    delete m_notify;
+}
+
+unsigned long ExtModShmConsumer::Consume(const DataBlock& data, unsigned long timestamp, unsigned long flags)
+{
+    if (data.null())
+	return 0;
+    if (!m_ring->put(data.data(),data.length())) {
+	// the script is not reading fast enough
+	m_overruns++;
+	return 0;
+    }
+    unsigned int calls = 0;
+    if (m_ring->sleeping()) {
+	// wake up the script waiting for data
+	u_int64_t one = 1;
+	m_notify->writeData(&one,sizeof(one));
+	calls = 1;
+    }
+    audioStats(true,1,calls);
+    m_total += data.length();
+    return invalidStamp();
+}
+
+
+ExtModShmSource::ExtModShmSource(ShmRing* ring)
+    : m_ring(ring), m_tpos(0), m_brate(16000), m_total(0)
+{
+    Debug(DebugAll,"ExtModShmSource::ExtModShmSource(%p) [%p]",ring,this);
+    Lock lock(s_audioMutex);
+    s_shmSources.append(this)->setDelete(false);
+    if (!s_shmPump) {
+	ExtModShmPump* pump = new ExtModShmPump;
+	s_shmPump = pump->startup();
+	if (!s_shmPump)
+	    Debug(DebugWarn,"Failed to start shared memory audio pump thread");
+    }
+}
+
+ExtModShmSource::~ExtModShmSource()
+{
+    Debug(DebugAll,"ExtModShmSource::~ExtModShmSource() [%p] total=%u",this,m_total);
+    s_audioMutex.lock();
+    s_shmSources.remove(this,false);
+    s_audioMutex.unlock();
+    delete m_ring;
+}
+
+// Forward the data that is due by now
+void ExtModShmSource::pump(u_int64_t now)
+{
+    if (!m_tpos)
+	m_tpos = now;
+    char data[320];
+    unsigned int frames = 0;
+    while (m_tpos <= now) {
+	unsigned int r = m_ring->get(data,sizeof(data));
+	if (!r) {
+	    // nothing written, don't burst later to catch up
+	    m_tpos = now;
+	    break;
+	}
+	DataBlock buf(data,r,false);
+	Forward(buf,m_total/2);
+	buf.clear(false);
+	m_total += r;
+	m_tpos += (r*(u_int64_t)1000000/m_brate);
+	frames++;
+    }
+    if (frames)
+	audioStats(true,frames,0);
+}
+
+
+void ExtModShmPump::run()
+{
+    for (;;) {
+	Thread::msleep(SHM_PUMP_INTERVAL);
+	ObjList sources;
+	s_audioMutex.lock();
+	s_shmCalls++;
+	if (!s_shmSources.skipNull()) {
+	    s_shmPump = false;
+	    s_audioMutex.unlock();
+	    break;
+	}
+	for (ObjList* l = s_shmSources.skipNull(); l; l = l->skipNext()) {
+	    ExtModShmSource* src = static_cast<ExtModShmSource*>(l->get());
+	    // skip sources that are being destroyed
+	    if (src->ref())
+		sources.append(src);
+	}
+	s_audioMutex.unlock();
+	u_int64_t now = Time::now();
+	for (ObjList* l = sources.skipNull(); l; l = l->skipNext())
+	    static_cast<ExtModShmSource*>(l->get())->pump(now);
+    }
+}
+
+
+ExtModChan* ExtModChan::build(const char* file, const char* args, int type, bool shm)
+{
+    ExtModChan* chan = new ExtModChan(file,args,type,shm);
     if (!chan->m_recv) {
 	chan->destruct();
 	return 0;
@@ -470,18 +932,19 @@ ExtModChan* ExtModChan::build(const char* file, const char* args, int type)
     return chan;
 }
 
-ExtModChan::ExtModChan(const char* file, const char* args, int type)
+ExtModChan::ExtModChan(const char* file, const char* args, int type, bool shm)
     : CallEndpoint("ExtModule"),
       m_recv(0), m_waitRet(0), m_type(type),
       m_running(false), m_disconn(false), m_waiting(false)
 {
-    Debug(DebugAll,"ExtModChan::ExtModChan(%d) [%p]",type,this);
+    Debug(DebugAll,"ExtModChan::ExtModChan(%d,%s) [%p]",type,String::boolText(shm),this);
     File* reader = 0;
     File* writer = 0;
+    File* notify = 0;
     switch (m_type) {
 	case DataWrite:
 	case DataBoth:
-	    {
+	    if (!(shm && shmConsumer(reader,notify))) {
 		reader = new File;
 		File* tmp = new File;
 		if (File::createPipe(*reader,*tmp)) {
@@ -495,7 +958,7 @@ ExtModChan::ExtModChan(const char* file, const char* args, int type)
     switch (m_type) {
 	case DataRead:
 	case DataBoth:
-	    {
+	    if (!(shm && shmSource(writer))) {
 		writer = new File;
 		File* tmp = new File;
 		if (File::createPipe(*tmp,*writer)) {
@@ -509,7 +972,49 @@ ExtModChan::ExtModChan(const char* file, const char* args, int type)
     s_mutex.lock();
     s_chans.append(this);
     s_mutex.unlock();
-    m_recv = ExtModReceiver::build(file,args,true,reader,writer,this);
+    m_recv = ExtModReceiver::build(file,args,true,reader,writer,this,notify);
+}
+
+// Set up a shared memory ring and notification for audio sent to the script
+bool ExtModChan::shmConsumer(File*& reader, File*& notify)
+{
+#ifdef EXTMOD_SHM
+    int ev = ::eventfd(0,0);
+    if (ev < 0) {
+	Debug(DebugNote,"Could not create audio notification, using a pipe: %s",strerror(errno));
+	return false;
+    }
+    ShmRing* ring = ShmRing::create("yate-record",reader);
+    if (!ring) {
+	Debug(DebugNote,"Could not create shared memory audio, using a pipe: %s",strerror(errno));
+	::close(ev);
+	return false;
+    }
+    int dup = ::dup(ev);
+    notify = new File(dup);
+    setConsumer(new ExtModShmConsumer(ring,new File(ev)));
+    getConsumer()->deref();
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Set up a shared memory ring for audio received from the script
+bool ExtModChan::shmSource(File*& writer)
+{
+#ifdef EXTMOD_SHM
+    ShmRing* ring = ShmRing::create("yate-play",writer);
+    if (!ring) {
+	Debug(DebugNote,"Could not create shared memory audio, using a pipe: %s",strerror(errno));
+	return false;
+    }
+    setSource(new ExtModShmSource(ring));
+    getSource()->deref();
+    return true;
+#else
+    return false;
+#endif
 }
 
 ExtModChan::ExtModChan(ExtModReceiver* recv)
@@ -559,13 +1064,20 @@ void ExtModChan::disconnected(bool final, const char *reason)
 }
 
 
-MsgHolder::MsgHolder(Message &msg)
-    : m_msg(msg), m_ret(false)
+MsgHolder::MsgHolder(Message &msg, ParkedMessage* parked, u_int64_t expires)
+    : m_msg(msg), m_ret(false), m_parked(parked), m_expires(expires)
 {
     // the address of this object should be unique
     char buf[64];
     ::sprintf(buf,"%p.%ld",this,Random::random());
     m_id = buf;
+    // start with the semaphore taken so the waiter blocks until answered
+    Semaphore::lock(0);
+}
+
+MsgHolder::~MsgHolder()
+{
+    TelEngine::destruct(m_parked);
 }
 
 bool MsgHolder::decode(const char *s)
@@ -573,6 +1085,30 @@ bool MsgHolder::decode(const char *s)
     return (m_msg.decode(s,m_ret,m_id) == -2);
 }
 
+bool MsgHolder::decodeFrame(const void* data, unsigned int len)
+{
+    return (m_msg.decodeFrame(data,len,m_ret,m_id) == -2);
+}
+
+// Check if a message may be parked, only the configured ones are
+bool MsgHolder::canPark(const String& name)
+{
+    Lock lock(s_mutex);
+    return (s_asyncNames.find(name) != 0);
+}
+
+// Dispatch again a parked message that was not handled by the script
+void MsgHolder::resume()
+{
+    if (!m_parked)
+	return;
+    if (!m_ret)
+	Engine::enqueue(m_parked);
+    else
+	TelEngine::destruct(m_parked);
+    m_parked = 0;
+}
+
 
 ExtMessage::~ExtMessage()
 {
@@ -652,9 +1188,9 @@ bool MsgWatcher::delWatched(const String& name)
 
 
 ExtModReceiver* ExtModReceiver::build(const char* script, const char* args, bool ref,
-				      File* ain, File* aout, ExtModChan* chan)
+				      File* ain, File* aout, ExtModChan* chan, File* aevent)
 {
-    ExtModReceiver* recv = new ExtModReceiver(script,args,ain,aout,chan);
+    ExtModReceiver* recv = new ExtModReceiver(script,args,ain,aout,chan,aevent);
     if (ref) {
 	recv->use();
 	if (recv->start())
@@ -671,6 +1207,14 @@ ExtModReceiver* ExtModReceiver::build(const char* name, Stream* io, ExtModChan*
     return recv->start() ? recv : 0;
 }
 
+ExtModReceiver* ExtModReceiver::build(const char* script, const char* args, PoolMember* member)
+{
+    ExtModReceiver* recv = new ExtModReceiver(script,args,0,0,0);
+    recv->m_member = member;
+    member->m_recv = recv;
+    return recv->start() ? recv : 0;
+}
+
 ExtModReceiver* ExtModReceiver::find(const String& script)
 {
     Lock lock(s_mutex);
@@ -683,12 +1227,14 @@ ExtModReceiver* ExtModReceiver::find(const String& script)
     return 0;
 }
 
-void ExtModReceiver::use()
+bool ExtModReceiver::use()
 {
     lock();
-    if (m_use > 0)
+    bool ok = (m_use > 0);
+    if (ok)
 	++m_use;
     unlock();
+    return ok;
 }
 
 bool ExtModReceiver::unuse()
@@ -701,12 +1247,14 @@ bool ExtModReceiver::unuse()
     return (u <= 0);
 }
 
-ExtModReceiver::ExtModReceiver(const char* script, const char* args, File* ain, File* aout, ExtModChan* chan)
+ExtModReceiver::ExtModReceiver(const char* script, const char* args,
+    File* ain, File* aout, ExtModChan* chan, File* aevent)
     : Mutex(true,"ExtModReceiver"),
       m_role(RoleUnknown), m_dead(false), m_use(1), m_pid(-1),
-      m_in(0), m_out(0), m_ain(ain), m_aout(aout),
+      m_in(0), m_out(0), m_ain(ain), m_aout(aout), m_aevent(aevent),
       m_chan(chan), m_watcher(0), m_selfWatch(false), m_reenter(false), m_setdata(true),
       m_timeout(s_timeout), m_timebomb(s_timebomb), m_restart(false),
+      m_async(s_async), m_binary(false), m_member(0), m_nextExpire(0),
       m_script(script), m_args(args)
 {
     Debug(DebugAll,"ExtModReceiver::ExtModReceiver(\"%s\",\"%s\") [%p]",script,args,this);
@@ -721,9 +1269,10 @@ ExtModReceiver::ExtModReceiver(const char* script, const char* args, File* ain,
 ExtModReceiver::ExtModReceiver(const char* name, Stream* io, ExtModChan* chan, int role)
     : Mutex(true,"ExtModReceiver"),
       m_role(role), m_dead(false), m_use(1), m_pid(-1),
-      m_in(io), m_out(io), m_ain(0), m_aout(0),
+      m_in(io), m_out(io), m_ain(0), m_aout(0), m_aevent(0),
       m_chan(chan), m_watcher(0), m_selfWatch(false), m_reenter(false), m_setdata(true),
       m_timeout(s_timeout), m_timebomb(s_timebomb), m_restart(false),
+      m_async(s_async), m_binary(false), m_member(0), m_nextExpire(0),
       m_script(name)
 {
     Debug(DebugAll,"ExtModReceiver::ExtModReceiver(\"%s\",%p,%p) [%p]",name,io,chan,this);
@@ -788,6 +1337,10 @@ void ExtModReceiver::closeAudio()
 	delete m_aout;
 	m_aout = 0;
     }
+    if (m_aevent) {
+	delete m_aevent;
+	m_aevent = 0;
+    }
 }
 
 bool ExtModReceiver::start()
@@ -808,6 +1361,8 @@ bool ExtModReceiver::start()
 
 bool ExtModReceiver::flush()
 {
+    if (m_member)
+	m_member->m_pool->detach(m_member,this);
     lock();
     bool needWait = (0 != m_watcher);
     TelEngine::destruct(m_watcher);
@@ -821,12 +1376,24 @@ bool ExtModReceiver::flush()
 	    p->setDelete(false);
     }
     bool flushed = false;
-    if (m_waiting.get()) {
-	Debug(DebugInfo,"ExtModReceiver releasing %u pending messages [%p]",
-	    m_waiting.count(),this);
+    unsigned int n = m_waiting.count();
+    if (n) {
+	Debug(DebugInfo,"ExtModReceiver releasing %u pending messages [%p]",n,this);
+	for (unsigned int i = 0; i < m_waiting.length(); i++) {
+	    for (ObjList* l = m_waiting.getList(i); l; l = l->next()) {
+		MsgHolder* h = static_cast<MsgHolder*>(l->get());
+		if (!h)
+		    continue;
+		if (h->parked())
+		    h->resume();
+		else
+		    h->unlock();
+	    }
+	}
 	m_waiting.clear();
 	needWait = flushed = true;
     }
+    m_nextExpire = 0;
     unlock();
     if (needWait && s_pluginSafe) {
 	int ms = s_waitFlush;
@@ -839,6 +1406,43 @@ bool ExtModReceiver::flush()
     return flushed;
 }
 
+// Release parked messages the script did not answer in time
+void ExtModReceiver::expire()
+{
+    Lock mylock(this);
+    if (!m_nextExpire)
+	return;
+    u_int64_t now = Time::now();
+    if (now < m_nextExpire)
+	return;
+    m_nextExpire = 0;
+    bool fail = false;
+    for (unsigned int i = 0; i < m_waiting.length(); i++) {
+	ObjList* l = m_waiting.getList(i);
+	while (l) {
+	    MsgHolder* h = static_cast<MsgHolder*>(l->get());
+	    if (!(h && h->parked() && h->expires())) {
+		l = l->next();
+		continue;
+	    }
+	    if (h->expires() > now) {
+		if (!m_nextExpire || (m_nextExpire > h->expires()))
+		    m_nextExpire = h->expires();
+		l = l->next();
+		continue;
+	    }
+	    Debug(DebugWarn,"Parked message %p '%s' did not return in %d msec [%p]",
+		h->msg(),h->msg()->c_str(),m_timeout,this);
+	    h->resume();
+	    l->remove();
+	    fail = true;
+	}
+    }
+    mylock.drop();
+    if (fail && m_timebomb)
+	die();
+}
+
 void ExtModReceiver::die(bool clearChan)
 {
 #ifdef DEBUG
@@ -889,7 +1493,10 @@ void ExtModReceiver::die(bool clearChan)
 	chan->disconnect(m_reason);
     if (m_restart && !Engine::exiting()) {
 	Debug(DebugMild,"Restarting external '%s' '%s'",m_script.safe(),m_args.safe());
-	ExtModReceiver::build(m_script,m_args);
+	if (m_member)
+	    m_member->m_pool->restart(m_member);
+	else
+	    ExtModReceiver::build(m_script,m_args);
     }
     unuse();
 }
@@ -898,9 +1505,17 @@ bool ExtModReceiver::received(Message &msg, int id)
 {
     if (m_dead)
 	return false;
+    // check before locking, the module mutex is taken while holding receivers
+    bool park = (RelayAsync == id) && MsgHolder::canPark(msg);
     lock();
     // check if we are no longer running
     bool ok = (m_pid > 0) && m_in && m_out && !m_dead;
+    if (ok) {
+	// never handle again a message we already parked and resumed
+	ParkedMessage* p = YOBJECT(ParkedMessage,&msg);
+	if (p && p->belongsTo(this))
+	    ok = false;
+    }
     if (ok && !m_reenter) {
 	// check if the message was generated by ourselves - avoid reentrance
 	ExtMessage* m = YOBJECT(ExtMessage,&msg);
@@ -912,11 +1527,30 @@ bool ExtModReceiver::received(Message &msg, int id)
 	return false;
     }
 
+    u_int64_t tout = (m_timeout > 0) ? Time::now() + 1000 * m_timeout : 0;
+    if (park) {
+	// park a copy of the message and release the dispatching thread
+	ParkedMessage* p = new ParkedMessage(msg,this);
+	MsgHolder* h = new MsgHolder(*p,p,tout);
+	ok = outputMessage(*p,h->m_id);
+	if (ok) {
+	    m_waiting.append(h);
+	    if (tout && (!m_nextExpire || (m_nextExpire > tout)))
+		m_nextExpire = tout;
+	    DDebug(DebugAll,"ExtMod parked message %p '%s' as %p [%p]",&msg,msg.c_str(),p,this);
+	}
+	else {
+	    Debug(DebugWarn,"ExtMod could not queue message %p '%s' [%p]",&msg,msg.c_str(),this);
+	    TelEngine::destruct(h);
+	}
+	unlock();
+	return ok;
+    }
+
     use();
     bool fail = false;
-    u_int64_t tout = (m_timeout > 0) ? Time::now() + 1000 * m_timeout : 0;
     MsgHolder h(msg);
-    if (outputLine(msg.encode(h.m_id))) {
+    if (outputMessage(msg,h.m_id)) {
 	m_waiting.append(&h)->setDelete(false);
 	DDebug(DebugAll,"ExtMod queued message %p '%s' [%p]",&msg,msg.c_str(),this);
     }
@@ -926,14 +1560,17 @@ bool ExtModReceiver::received(Message &msg, int id)
 	fail = true;
     }
     unlock();
-    // would be nice to lock the MsgHolder and wait for it to unlock from some
-    //  other thread - unfortunately this does not work with all mutexes
-    // sorry, Maciek - have to do it work in Windows too :-(
+    // the reader thread signals the holder when the answer arrives
     while (ok) {
-	h.lock(Thread::idleUsec());
+	long maxwait = -1;
+	if (tout) {
+	    u_int64_t now = Time::now();
+	    maxwait = (tout > now) ? (long)(tout - now) : 0;
+	}
+	h.lock(maxwait);
 	lock();
 	ok = (m_waiting.find(&h) != 0);
-	if (ok && tout && (Time::now() > tout)) {
+	if (ok && tout && (Time::now() >= tout)) {
 	    Debug(DebugWarn,"Message %p '%s' did not return in %d msec [%p]",
 		&msg,msg.c_str(),m_timeout,this);
 	    m_waiting.remove(&h,false);
@@ -1002,8 +1639,12 @@ bool ExtModReceiver::create(const char *script, const char *args)
 	    ::dup2(m_aout->handle(), STDERR_FILENO+2);
 	else
 	    ::close(STDERR_FILENO+2);
+	if (m_aevent && m_aevent->valid())
+	    ::dup2(m_aevent->handle(), STDERR_FILENO+3);
+	else
+	    ::close(STDERR_FILENO+3);
 	// Blindly close everything but stdin/out/err/audio
-	for (x=STDERR_FILENO+3;x<1024;x++) 
+	for (x=STDERR_FILENO+4;x<1024;x++) 
 	    ::close(x);
 	// Execute script
 	if (debugAt(DebugInfo))
@@ -1073,6 +1714,8 @@ void ExtModReceiver::run()
     char buffer[MAX_INCOMING_LINE];
     int posinbuf = 0;
     bool invalid = true;
+    // incoming data once the binary protocol was negotiated
+    DataBlock frames;
     DDebug(DebugAll,"ExtModReceiver::run() entering loop [%p]",this);
     for (;;) {
 	use();
@@ -1097,6 +1740,7 @@ void ExtModReceiver::run()
 	    Lock mylock(this);
 	    if (m_in && m_in->canRetry()) {
 		mylock.drop();
+		expire();
 		Thread::idle();
 		continue;
 	    }
@@ -1104,6 +1748,12 @@ void ExtModReceiver::run()
 	    break;
 	}
 	XDebug(DebugAll,"ExtModReceiver::run() read %d",readsize);
+	if (m_binary) {
+	    frames.append(buffer,readsize);
+	    if (processFrames(frames))
+		return;
+	    continue;
+	}
 	int totalsize = readsize + posinbuf;
 	buffer[totalsize]=0;
 	for (;;) {
@@ -1116,7 +1766,12 @@ void ExtModReceiver::run()
 	    if ((eoline > buffer) && (eoline[-1] == '\r'))
 		eoline[-1] = 0;
 	    if (buffer[0]) {
-		invalid = invalid && (buffer[0] != '%' || buffer[1] != '%');
+		if (invalid && (buffer[0] == '%') && (buffer[1] == '%')) {
+		    invalid = false;
+		    // pool members are restarted once they proved they can run
+		    if (m_member)
+			m_restart = true;
+		}
 		use();
 		bool goOut = processLine(buffer);
 		if (unuse() || goOut)
@@ -1124,32 +1779,143 @@ void ExtModReceiver::run()
 	    }
 	    totalsize -= eoline-buffer+1;
 	    ::memmove(buffer,eoline+1,totalsize+1);
+	    if (m_binary)
+		break;
+	}
+	if (m_binary) {
+	    // the rest of the buffer already holds binary frames
+	    posinbuf = 0;
+	    if (totalsize > 0)
+		frames.append(buffer,totalsize);
+	    if (processFrames(frames))
+		return;
+	    continue;
 	}
 	posinbuf = totalsize;
     }
 }
 
+// Process all complete frames, keep any partial one. Return true to stop reading
+bool ExtModReceiver::processFrames(DataBlock& frames)
+{
+    unsigned int offs = 0;
+    bool goOut = false;
+    while (!goOut) {
+	const unsigned char* p = frames.data(offs,4);
+	if (!p)
+	    break;
+	unsigned int flen = ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+	    ((unsigned int)p[2] << 8) | p[3];
+	if (!flen || (flen > MAX_INCOMING_FRAME)) {
+	    Debug("ExtModule",DebugWarn,"Invalid frame length %u from '%s', closing [%p]",
+		flen,m_script.c_str(),this);
+	    goOut = true;
+	    break;
+	}
+	p = frames.data(offs,flen + 4);
+	if (!p)
+	    break;
+	offs += flen + 4;
+	use();
+	switch (p[4]) {
+	    case '%':
+		{
+		    String line((const char*)p + 5,flen - 1);
+		    goOut = processLine(line);
+		}
+		break;
+	    case '>':
+		{
+		    ExtMessage* m = new ExtMessage;
+		    if (m->decodeFrame(p,flen + 4) == -2)
+			startMessage(m);
+		    else {
+			m->destruct();
+			reportError("binary message");
+		    }
+		}
+		break;
+	    case '<':
+		{
+		    // the answer id follows its length after the type byte
+		    String id;
+		    if (flen >= 5) {
+			unsigned int len = ((unsigned int)p[5] << 24) | ((unsigned int)p[6] << 16) |
+			    ((unsigned int)p[7] << 8) | p[8];
+			if (len <= flen - 5)
+			    id.assign((const char*)p + 9,len);
+		    }
+		    answer(id,0,p,flen + 4);
+		}
+		break;
+	    default:
+		reportError("binary frame");
+	}
+	if (unuse())
+	    return true;
+    }
+    if (offs)
+	frames.cut(-(int)offs);
+    return goOut;
+}
+
 bool ExtModReceiver::outputLine(const char* line)
 {
-    lock();
+    // hold the lock so lines and frames from other threads are not interleaved
+    Lock mylock(this);
     DDebug("ExtModReceiver",DebugAll,"%soutputLine '%s'",
 	((m_out && !m_dead) ? "" : "failing "), line);
+    unsigned int len = ::strlen(line);
+    if (!m_binary) {
+	String tmp(line,len);
+	tmp << "\n";
+	return outputData(tmp.c_str(),tmp.length());
+    }
+    // send the text line wrapped in a frame
+    DataBlock frame(0,len + 5);
+    unsigned char* p = frame.data(0,len + 5);
+    p[0] = (unsigned char)((len + 1) >> 24);
+    p[1] = (unsigned char)((len + 1) >> 16);
+    p[2] = (unsigned char)((len + 1) >> 8);
+    p[3] = (unsigned char)(len + 1);
+    p[4] = '%';
+    ::memcpy(p + 5,line,len);
+    return outputData(frame.data(),frame.length());
+}
+
+bool ExtModReceiver::outputMessage(const Message& msg, const char* id)
+{
+    Lock mylock(this);
+    if (!m_binary)
+	return outputLine(msg.encode(id));
+    DataBlock frame;
+    msg.encodeFrame(frame,id);
+    return outputData(frame.data(),frame.length());
+}
+
+bool ExtModReceiver::outputData(const void* data, unsigned int len)
+{
+    lock();
     if (m_dead || !m_out) {
 	unlock();
 	return false;
     }
+    const char* buf = static_cast<const char*>(data);
     // since m_out can be non-blocking (the socket) we have to loop
-    int len = ::strlen(line);
-    while (m_out && (len > 0) && !m_dead) {
-	int w = m_out->writeData(line,len);
+    while (len > 0) {
+	if (m_dead || !m_out) {
+	    unlock();
+	    return false;
+	}
+	int w = m_out->writeData(buf,len);
 	if (w < 0) {
-	    if (m_dead || !m_out || !m_out->canRetry()) {
+	    if (!m_out->canRetry()) {
 		unlock();
 		return false;
 	    }
 	}
 	else {
-	    line += w;
+	    buf += w;
 	    len -= w;
 	}
 	if (len > 0) {
@@ -1158,23 +1924,8 @@ bool ExtModReceiver::outputLine(const char* line)
 	    lock();
 	}
     }
-    char nl = '\n';
-    for (;;) {
-	if (m_dead || !m_out) {
-	    unlock();
-	    return false;
-	}
-	int w = m_out->writeData(&nl,1);
-	if ((w < 0) && m_out->canRetry())
-	    w = 0;
-	unlock();
-	if (w > 0)
-	    return true;
-	if (w < 0)
-	    return false;
-	Thread::yield();
-	lock();
-    }
+    unlock();
+    return true;
 }
 
 void ExtModReceiver::reportError(const char* line)
@@ -1185,8 +1936,15 @@ void ExtModReceiver::reportError(const char* line)
 
 void ExtModReceiver::returnMsg(const Message* msg, const char* id, bool accepted)
 {
-    String ret(msg->encode(accepted,id));
-    outputLine(ret);
+    Lock mylock(this);
+    if (!m_binary) {
+	String ret(msg->encode(accepted,id));
+	outputLine(ret);
+	return;
+    }
+    DataBlock frame;
+    msg->encodeFrame(frame,accepted,id);
+    outputData(frame.data(),frame.length());
 }
 
 bool ExtModReceiver::addWatched(const String& name)
@@ -1251,24 +2009,12 @@ bool ExtModReceiver::processLine(const char* line)
 	return true;
     }
     else if (id.startsWith("%%<message:")) {
-	Lock mylock(this);
-	ObjList *p = &m_waiting;
-	for (; p; p=p->next()) {
-	    MsgHolder *msg = static_cast<MsgHolder *>(p->get());
-	    if (msg && msg->decode(line)) {
-		DDebug("ExtModReceiver",DebugInfo,"Matched message %p [%p]",msg->msg(),this);
-		if (m_chan && (m_chan->waitMsg() == msg->msg())) {
-		    DDebug("ExtModReceiver",DebugNote,"Entering wait mode on channel %p [%p]",m_chan,this);
-		    m_chan->waitMsg(0);
-		    m_chan->waiting(true);
-		}
-		msg->unlock();
-		p->remove(false);
-		return false;
-	    }
-	}
-	Debug("ExtModReceiver",(m_dead ? DebugInfo : DebugWarn),
-	    "Unmatched%s message: %s [%p]",(m_dead ? " dead" : ""),line,this);
+	// keep the index in substr in sync with length of "%%<message:"
+	int sep = id.find(':',11);
+	String mid;
+	if (sep > 11)
+	    mid = id.substr(11,sep - 11).msgUnescape();
+	answer(mid,line);
 	return false;
     }
     else if (id.startSkip("%%>install:",false)) {
@@ -1284,20 +2030,28 @@ bool ExtModReceiver::processLine(const char* line)
 	    id = id.matchString(1);
 	}
 	// sanity checks
-	lock();
-	bool ok = id && !m_dead && !m_relays.find(id);
-	if (ok) {
-	    MessageRelay *r = new MessageRelay(id,this,0,prio);
-	    if (fname)
-		r->setFilter(fname,fvalue);
-	    m_relays.append(r);
-	    Engine::install(r);
+	bool ok = false;
+	if (m_member)
+	    ok = id && !m_dead && m_member->m_pool->install(m_member,id,prio,fname,fvalue,
+		(m_async ? RelayAsync : RelaySync));
+	else {
+	    lock();
+	    ok = id && !m_dead && !m_relays.find(id);
+	    if (ok) {
+		MessageRelay *r = new MessageRelay(id,this,(m_async ? RelayAsync : RelaySync),prio);
+		if (fname)
+		    r->setFilter(fname,fvalue);
+		m_relays.append(r);
+		Engine::install(r);
+	    }
+	    unlock();
 	}
-	unlock();
 	if (debugAt(DebugAll)) {
 	    String tmp;
 	    if (fname)
 		tmp << "filter: '" << fname << "'='" << fvalue << "' ";
+	    if (m_async)
+		tmp << "async ";
 	    tmp << (ok ? "ok" : "failed");
 	    Debug("ExtModReceiver",DebugAll,"Install '%s', prio %d %s",
 		id.c_str(),prio,tmp.c_str());
@@ -1310,18 +2064,22 @@ bool ExtModReceiver::processLine(const char* line)
     else if (id.startSkip("%%>uninstall:",false)) {
 	int prio = 0;
 	bool ok = false;
-	lock();
-	ObjList *p = &m_relays;
-	for (; p; p=p->next()) {
-	    MessageRelay *r = static_cast<MessageRelay *>(p->get());
-	    if (r && (*r == id)) {
-		prio = r->priority();
-		p->remove();
-		ok = true;
-		break;
+	if (m_member)
+	    ok = m_member->m_pool->uninstall(m_member,id,prio);
+	else {
+	    lock();
+	    ObjList *p = &m_relays;
+	    for (; p; p=p->next()) {
+		MessageRelay *r = static_cast<MessageRelay *>(p->get());
+		if (r && (*r == id)) {
+		    prio = r->priority();
+		    p->remove();
+		    ok = true;
+		    break;
+		}
 	    }
+	    unlock();
 	}
-	unlock();
 	Debug("ExtModReceiver",DebugAll,"Uninstall '%s' %s", id.c_str(),ok ? "ok" : "failed");
 	String out("%%<uninstall:");
 	out << prio << ":" << id << ":" << ok;
@@ -1358,6 +2116,7 @@ bool ExtModReceiver::processLine(const char* line)
 	    Lock mylock(this);
 	    if (m_dead)
 		return false;
+	    bool binary = m_binary;
 	    if (m_chan && (id == "id")) {
 		if (val.null())
 		    val = m_chan->id();
@@ -1399,6 +2158,18 @@ bool ExtModReceiver::processLine(const char* line)
 		val = m_setdata;
 		ok = true;
 	    }
+	    else if (id == "async") {
+		m_async = val.toBoolean(m_async);
+		val = m_async;
+		ok = true;
+	    }
+	    else if (id == "protocol") {
+		// only switching from text to binary framing is supported
+		if (val == "binary")
+		    binary = true;
+		ok = val.null() || binary || ((val == "text") && !m_binary);
+		val = binary ? "binary" : "text";
+	    }
 	    else if (id == "selfwatch") {
 		m_selfWatch = val.toBoolean(m_selfWatch);
 		val = m_selfWatch;
@@ -1439,6 +2210,8 @@ bool ExtModReceiver::processLine(const char* line)
 	    String out("%%<setlocal:");
 	    out << id << ":" << val << ":" << ok;
 	    outputLine(out);
+	    // the answer is still in the old format, what follows is framed
+	    m_binary = binary;
 	    return false;
 	}
     }
@@ -1449,52 +2222,7 @@ bool ExtModReceiver::processLine(const char* line)
     else {
 	ExtMessage* m = new ExtMessage;
 	if (m->decode(line) == -2) {
-	    DDebug("ExtModReceiver",DebugAll,"Created message %p '%s' [%p]",m,m->c_str(),this);
-	    lock();
-	    bool note = true;
-	    while (!m_dead && m_chan && m_chan->waiting()) {
-		if (note) {
-		    note = false;
-		    Debug("ExtModReceiver",DebugNote,"Waiting before enqueueing new message %p '%s' [%p]",
-			m,m->c_str(),this);
-		}
-		unlock();
-		Thread::yield();
-		if (m_dead) {
-		    m->destruct();
-		    return false;
-		}
-		lock();
-	    }
-	    ExtModChan* chan = 0;
-	    if ((m_role == RoleChannel) && !m_chan && m_setdata && (*m == "call.execute")) {
-		// we delayed channel creation as there was nothing to ref() it
-		chan = new ExtModChan(this);
-		m_chan = chan;
-		m->setParam("id",chan->id());
-	    }
-	    if (m_setdata)
-		m->userData(m_chan);
-	    // now the newly created channel is referenced by the message
-	    if (chan)
-		chan->deref();
-	    id = m->id();
-	    if (id && !chan) {
-		// Copy the user data pointer from waiting message with same id
-		ObjList *p = &m_waiting;
-		for (; p; p=p->next()) {
-		    MsgHolder *h = static_cast<MsgHolder *>(p->get());
-		    if (h && (h->m_id == id)) {
-			RefObject* ud = h->m_msg.userData();
-			Debug("ExtModReceiver",DebugAll,"Copying data pointer %p from %p '%s' [%p]",
-			    ud,h->msg(),h->msg()->c_str(),this);
-			m->userData(ud);
-			break;
-		    }
-		}
-	    }
-	    m->startup(this);
-	    unlock();
+	    startMessage(m);
 	    return false;
 	}
 	m->destruct();
@@ -1503,6 +2231,79 @@ bool ExtModReceiver::processLine(const char* line)
     return false;
 }
 
+// Find the waiting message an answer is for, decode it and release the waiter
+void ExtModReceiver::answer(const String& id, const char* line, const void* frame, unsigned int len)
+{
+    Lock mylock(this);
+    MsgHolder *msg = static_cast<MsgHolder *>(m_waiting[id]);
+    if (msg && (frame ? msg->decodeFrame(frame,len) : msg->decode(line))) {
+	DDebug("ExtModReceiver",DebugInfo,"Matched message %p [%p]",msg->msg(),this);
+	if (msg->parked()) {
+	    msg->resume();
+	    m_waiting.remove(msg);
+	    return;
+	}
+	if (m_chan && (m_chan->waitMsg() == msg->msg())) {
+	    DDebug("ExtModReceiver",DebugNote,"Entering wait mode on channel %p [%p]",m_chan,this);
+	    m_chan->waitMsg(0);
+	    m_chan->waiting(true);
+	}
+	m_waiting.remove(msg,false);
+	msg->unlock();
+	return;
+    }
+    Debug("ExtModReceiver",(m_dead ? DebugInfo : DebugWarn),
+	"Unmatched%s message: %s [%p]",(m_dead ? " dead" : ""),
+	(line ? line : id.c_str()),this);
+}
+
+// Enqueue a message received from the script
+void ExtModReceiver::startMessage(ExtMessage* m)
+{
+    DDebug("ExtModReceiver",DebugAll,"Created message %p '%s' [%p]",m,m->c_str(),this);
+    lock();
+    bool note = true;
+    while (!m_dead && m_chan && m_chan->waiting()) {
+	if (note) {
+	    note = false;
+	    Debug("ExtModReceiver",DebugNote,"Waiting before enqueueing new message %p '%s' [%p]",
+		m,m->c_str(),this);
+	}
+	unlock();
+	Thread::yield();
+	if (m_dead) {
+	    m->destruct();
+	    return;
+	}
+	lock();
+    }
+    ExtModChan* chan = 0;
+    if ((m_role == RoleChannel) && !m_chan && m_setdata && (*m == "call.execute")) {
+	// we delayed channel creation as there was nothing to ref() it
+	chan = new ExtModChan(this);
+	m_chan = chan;
+	m->setParam("id",chan->id());
+    }
+    if (m_setdata)
+	m->userData(m_chan);
+    // now the newly created channel is referenced by the message
+    if (chan)
+	chan->deref();
+    const String& id = m->id();
+    if (id && !chan) {
+	// Copy the user data pointer from waiting message with same id
+	MsgHolder *h = static_cast<MsgHolder *>(m_waiting[id]);
+	if (h) {
+	    RefObject* ud = h->m_msg.userData();
+	    Debug("ExtModReceiver",DebugAll,"Copying data pointer %p from %p '%s' [%p]",
+		ud,h->msg(),h->msg()->c_str(),this);
+	    m->userData(ud);
+	}
+    }
+    m->startup(this);
+    unlock();
+}
+
 void ExtModReceiver::describe(String& rval) const
 {
     rval << "\t";
@@ -1526,12 +2327,213 @@ void ExtModReceiver::describe(String& rval) const
 	rval << ", has channel";
     if (m_restart)
 	rval << ", autorestart";
+    if (m_binary)
+	rval << ", binary";
+    if (m_member)
+	rval << ", pool=" << m_member->m_pool->toString() << "#" << m_member->m_index;
     if (m_pid > 0)
 	rval << ", pid=" << m_pid;
     rval << "\r\n";
 }
 
 
+bool PoolHandler::received(Message& msg)
+{
+    return m_pool->dispatch(msg,*this);
+}
+
+
+ExtModPool::ExtModPool(const char* name, const NamedList& sect)
+    : Mutex(true,"ExtModPool"),
+      m_name(name), m_script(sect.getValue("script")), m_args(sect.getValue("args")),
+      m_sticky(sect.getValue("sticky")), m_count(1), m_next(0)
+{
+    int n = sect.getIntValue("count",2);
+    if (n > 1)
+	m_count = (n > 64) ? 64 : n;
+    m_script.trimBlanks();
+    for (unsigned int i = 0; i < m_count; i++)
+	m_members.append(new PoolMember(this,i));
+    Debug(DebugAll,"ExtModPool '%s' script '%s' count=%u sticky='%s' [%p]",
+	m_name.c_str(),m_script.c_str(),m_count,m_sticky.c_str(),this);
+}
+
+ExtModPool::~ExtModPool()
+{
+    Debug(DebugAll,"ExtModPool::~ExtModPool() '%s' [%p]",m_name.c_str(),this);
+    m_handlers.clear();
+}
+
+ExtModPool* ExtModPool::build(const char* name, const NamedList& sect)
+{
+    if (null(name))
+	return 0;
+    ExtModPool* pool = new ExtModPool(name,sect);
+    if (pool->m_script.null()) {
+	Debug(DebugWarn,"No script set in pool '%s'",name);
+	TelEngine::destruct(pool);
+	return 0;
+    }
+    s_mutex.lock();
+    s_pools.append(pool);
+    s_mutex.unlock();
+    pool->start();
+    return pool;
+}
+
+// Start the script instances of all the slots
+void ExtModPool::start()
+{
+    for (ObjList* l = m_members.skipNull(); l; l = l->skipNext())
+	restart(static_cast<PoolMember*>(l->get()));
+}
+
+// Start a script instance in an empty slot
+void ExtModPool::restart(PoolMember* member)
+{
+    lock();
+    if (member->m_recv) {
+	unlock();
+	return;
+    }
+    if (member->m_starts++)
+	member->m_restarts++;
+    unlock();
+    Debug(DebugInfo,"ExtModPool '%s' starting member %u [%p]",m_name.c_str(),member->m_index,this);
+    ExtModReceiver::build(m_script,m_args,member);
+}
+
+// Add a member to the handler matching all the install arguments
+bool ExtModPool::install(PoolMember* member, const String& name, int prio,
+    const String& fname, const String& fvalue, int relayId)
+{
+    Lock mylock(this);
+    for (ObjList* l = m_handlers.skipNull(); l; l = l->skipNext()) {
+	PoolHandler* h = static_cast<PoolHandler*>(l->get());
+	if (h->m_members.find(member) && (*h == name))
+	    return false;
+    }
+    PoolHandler* handler = 0;
+    for (ObjList* l = m_handlers.skipNull(); l; l = l->skipNext()) {
+	PoolHandler* h = static_cast<PoolHandler*>(l->get());
+	if ((*h != name) || (h->priority() != (unsigned int)prio) || (h->relayId() != relayId))
+	    continue;
+	const NamedString* f = h->filter();
+	if (fname ? (f && (f->name() == fname) && (*f == fvalue)) : !f) {
+	    handler = h;
+	    break;
+	}
+    }
+    if (!handler) {
+	handler = new PoolHandler(this,name,prio,relayId);
+	if (fname)
+	    handler->setFilter(fname,fvalue);
+	m_handlers.append(handler);
+	Engine::install(handler);
+    }
+    handler->m_members.append(member)->setDelete(false);
+    return true;
+}
+
+// Remove a member from a handler, the handler is kept installed even if empty
+bool ExtModPool::uninstall(PoolMember* member, const String& name, int& prio)
+{
+    Lock mylock(this);
+    for (ObjList* l = m_handlers.skipNull(); l; l = l->skipNext()) {
+	PoolHandler* h = static_cast<PoolHandler*>(l->get());
+	if ((*h == name) && h->m_members.remove(member,false)) {
+	    prio = h->priority();
+	    return true;
+	}
+    }
+    return false;
+}
+
+// Detach a dead script instance from its slot and from all handlers
+void ExtModPool::detach(PoolMember* member, ExtModReceiver* recv)
+{
+    Lock mylock(this);
+    if (member->m_recv != recv)
+	return;
+    member->m_recv = 0;
+    for (ObjList* l = m_handlers.skipNull(); l; l = l->skipNext())
+	static_cast<PoolHandler*>(l->get())->m_members.remove(member,false);
+}
+
+// Pass a message to the member with least pending messages
+bool ExtModPool::dispatch(Message& msg, const PoolHandler& handler)
+{
+    lock();
+    PoolMember* member = 0;
+    ExtModReceiver* recv = 0;
+    unsigned int n = handler.m_members.count();
+    if (n && m_count && m_sticky) {
+	// keep messages of the same call on the same pool slot, even if the
+	//  slot was restarted meanwhile, as long as it handles this message
+	const String& key = msg[m_sticky];
+	if (key) {
+	    member = static_cast<PoolMember*>(m_members[key.hash() % m_count]);
+	    if (member && member->m_recv && handler.m_members.find(member) &&
+		member->m_recv->use())
+		recv = member->m_recv;
+	}
+    }
+    if (!recv && n) {
+	// rotate the starting point so members with equal load take turns
+	unsigned int start = m_next++ % n;
+	unsigned int bestRank = 0;
+	unsigned int i = 0;
+	member = 0;
+	for (ObjList* l = handler.m_members.skipNull(); l; l = l->skipNext(), i++) {
+	    PoolMember* m = static_cast<PoolMember*>(l->get());
+	    if (!m->m_recv)
+		continue;
+	    unsigned int rank = (i + n - start) % n;
+	    if (!member || (m->m_pending < member->m_pending) ||
+		((m->m_pending == member->m_pending) && (rank < bestRank))) {
+		member = m;
+		bestRank = rank;
+	    }
+	}
+	if (member && member->m_recv->use())
+	    recv = member->m_recv;
+    }
+    if (!recv) {
+	unlock();
+	return false;
+    }
+    member->m_pending++;
+    unlock();
+    u_int64_t t = Time::now();
+    bool ok = recv->received(msg,handler.relayId());
+    t = Time::now() - t;
+    lock();
+    member->m_pending--;
+    member->m_count++;
+    member->m_usec += t;
+    if (member->m_maxUsec < t)
+	member->m_maxUsec = t;
+    unlock();
+    recv->unuse();
+    return ok;
+}
+
+void ExtModPool::describe(String& rval)
+{
+    Lock mylock(this);
+    rval << "Pool " << m_name << ": " << m_script << " " << m_args << "\r\n";
+    for (ObjList* l = m_members.skipNull(); l; l = l->skipNext()) {
+	PoolMember* m = static_cast<PoolMember*>(l->get());
+	char buf[160];
+	::snprintf(buf,sizeof(buf),
+	    "\t#%u %s, pending=%u, requests=" FMT64U ", avgusec=" FMT64U ", maxusec=" FMT64U ", restarts=%u\r\n",
+	    m->m_index,(m->m_recv ? "running" : "stopped"),m->m_pending,m->m_count,
+	    (m->m_count ? m->m_usec / m->m_count : (u_int64_t)0),m->m_maxUsec,m->m_restarts);
+	rval << buf;
+    }
+}
+
+
 bool ExtModHandler::received(Message& msg)
 {
     String dest(msg.getValue("callto"));
@@ -1564,12 +2566,13 @@ bool ExtModHandler::received(Message& msg)
 						  true);
 	if (!r)
 	    return false;
-	bool ok = r->received(msg,1);
+	bool ok = r->received(msg,ExtModReceiver::RelaySync);
 	r->unuse();
 	return ok;
     }
     ExtModChan *em = ExtModChan::build(dest.matchString(2).c_str(),
-				       dest.matchString(3).c_str(),typ);
+				       dest.matchString(3).c_str(),typ,
+				       msg.getBoolValue("shm_audio",s_shmAudio));
     if (!em) {
 	Debug(DebugGoOn,"Failed to create ExtMod for '%s'",dest.matchString(2).c_str());
 	return false;
@@ -1578,7 +2581,7 @@ bool ExtModHandler::received(Message& msg)
     // new messages must be blocked until connect() returns (if applicable)
     if (ch)
 	em->waitMsg(&msg);
-    if (!(recv && recv->received(msg,1))) {
+    if (!(recv && recv->received(msg,ExtModReceiver::RelaySync))) {
 	em->waitMsg(0);
 	int level = DebugWarn;
 	if (msg.getValue("error") || msg.getValue("reason"))
@@ -1621,6 +2624,11 @@ bool ExtModCommand::received(Message& msg)
 		    r->describe(msg.retValue());
 	    }
 	}
+	if (line) {
+	    for (l = s_pools.skipNull(); l; l = l->skipNext())
+		static_cast<ExtModPool*>(l->get())->describe(msg.retValue());
+	    audioStatus(msg.retValue());
+	}
 	return true;
     }
     int blank = line.find(' ');
@@ -1808,6 +2816,8 @@ ExtModulePlugin::~ExtModulePlugin()
     s_mutex.lock();
     s_pluginSafe = false;
     s_modules.clear();
+    // pools go after their members detached from them
+    s_pools.clear();
     // the receivers destroyed above should also clear chans but better be sure
     s_chans.clear();
     s_mutex.unlock();
@@ -1826,6 +2836,19 @@ void ExtModulePlugin::initialize()
     s_cfg.load();
     s_timeout = s_cfg.getIntValue("general","timeout",MSG_TIMEOUT);
     s_timebomb = s_cfg.getBoolValue("general","timebomb",false);
+    s_async = s_cfg.getBoolValue("general","async",false);
+    ObjList* names = String(s_cfg.getValue("general","async_messages")).split(',',false);
+    s_mutex.lock();
+    s_asyncNames.clear();
+    for (ObjList* l = names->skipNull(); l; l = l->skipNext()) {
+	String* name = static_cast<String*>(l->get());
+	name->trimBlanks();
+	if (*name && !s_asyncNames.find(*name))
+	    s_asyncNames.append(new String(*name));
+    }
+    s_mutex.unlock();
+    TelEngine::destruct(names);
+    s_shmAudio = s_cfg.getBoolValue("general","shm_audio",false);
     int wf = s_cfg.getIntValue("general","waitflush",WAIT_FLUSH);
     if (wf < 1)
 	wf = 1;
@@ -1846,7 +2869,16 @@ void ExtModulePlugin::initialize()
 	    if (s.startSkip("listener",true) && s)
 		ExtListener::build(s,*sect);
 	}
-	// start any scripts only after the listeners
+	// pools of identical scripts are started along with the other scripts
+	for (int i = 0; i < n; i++) {
+	    sect = s_cfg.getSection(i);
+	    if (!sect)
+		continue;
+	    String s(*sect);
+	    if (s.startSkip("pool",true) && s)
+		ExtModPool::build(s,*sect);
+	}
+	// start any other scripts only after the listeners
 	sect = s_cfg.getSection("scripts");
 	if (sect) {
 	    unsigned int len = sect->length();
@@ -25,6 +25,8 @@
 #include <yatepbx.h>
 #include <yatescript.h>
 
+#include <stdio.h>
+
 using namespace TelEngine;
 namespace { // anonymous
 
@@ -45,10 +47,16 @@ public:
     inline JsParser& parser()
 	{ return m_assistCode; }
 protected:
+    virtual void statusParams(String& str);
     virtual bool commandExecute(String& retVal, const String& line);
     virtual bool commandComplete(Message& msg, const String& partLine, const String& partWord);
 private:
+    JsObject* buildShared();
     JsParser m_assistCode;
+    JsObject* m_shared;
+    unsigned int m_setups;
+    u_int64_t m_setupTime;
+    u_int64_t m_setupSize;
 };
 
 class JsAssist : public ChanAssist
@@ -66,7 +74,7 @@ public:
     virtual bool msgPreroute(Message& msg);
     virtual bool msgRoute(Message& msg);
     virtual bool msgDisconnect(Message& msg, const String& reason);
-    bool init();
+    bool init(bool shared);
 private:
     bool runFunction(const char* name, Message& msg);
     ScriptRun* m_runner;
@@ -93,6 +101,9 @@ public:
 	    params().addParam(new ExpFunction("Output"));
 	    params().addParam(new ExpFunction("Debug"));
 	}
+    // shared read-only between contexts, a plain copy would lose the methods
+    virtual JsObject* copy(Mutex* mtx) const
+	{ return 0; }
     static void initialize(ScriptContext* context);
 protected:
     bool runNative(ObjList& stack, const ExpOperation& oper, GenObject* context);
@@ -122,6 +133,8 @@ public:
 	{
 	    XDebug(DebugAll,"JsMessage::~JsMessage() [%p]",this);
 	}
+    virtual JsObject* copy(Mutex* mtx) const
+	{ return 0; }
     static void initialize(ScriptContext* context);
 protected:
     bool runNative(ObjList& stack, const ExpOperation& oper, GenObject* context);
@@ -137,6 +150,8 @@ public:
 	{
 	    params().addParam(new ExpFunction("id"));
 	}
+    virtual JsObject* copy(Mutex* mtx) const
+	{ return 0; }
     static void initialize(ScriptContext* context, JsAssist* assist);
 protected:
     bool runNative(ObjList& stack, const ExpOperation& oper, GenObject* context);
@@ -271,10 +286,15 @@ JsAssist::~JsAssist()
     TelEngine::destruct(m_runner);
 }
 
-bool JsAssist::init()
+bool JsAssist::init(bool shared)
 {
     if (!m_runner)
 	return false;
+    if (shared) {
+	// globals were already evaluated in the shared state
+	JsChannel::initialize(m_runner->context(),this);
+	return true;
+    }
     JsObject::initialize(m_runner->context());
     JsEngine::initialize(m_runner->context());
     JsChannel::initialize(m_runner->context(),this);
@@ -342,8 +362,24 @@ bool JsAssist::msgDisconnect(Message& msg, const String& reason)
 }
 
 
+// Approximate memory used by the properties of an object, shared objects excluded
+static unsigned int objectSize(const NamedList& params, unsigned int depth = 0)
+{
+    unsigned int size = sizeof(NamedList) + params.length();
+    NamedIterator iter(params);
+    while (const NamedString* ns = iter.get()) {
+	size += sizeof(ObjList) + sizeof(ExpOperation) + ns->name().length() + ns->length();
+	const JsObject* jso = YOBJECT(JsObject,ns);
+	if (jso && !jso->shared() && depth < 4)
+	    size += sizeof(JsObject) + objectSize(jso->params(),depth + 1);
+    }
+    return size;
+}
+
+
 JsModule::JsModule()
-    : ChanAssistList("javascript",true)
+    : ChanAssistList("javascript",true),
+      m_shared(0), m_setups(0), m_setupTime(0), m_setupSize(0)
 {
     Output("Loaded module Javascript");
 }
@@ -351,6 +387,29 @@ JsModule::JsModule()
 JsModule::~JsModule()
 {
     Output("Unloading module Javascript");
+    TelEngine::destruct(m_shared);
+}
+
+// Report channel script setup costs and the property inline cache counters
+void JsModule::statusParams(String& str)
+{
+    ChanAssistList::statusParams(str);
+    lock();
+    bool shared = (m_shared != 0);
+    unsigned int setups = m_setups;
+    unsigned int setupTime = setups ? (unsigned int)(m_setupTime / setups) : 0;
+    unsigned int setupSize = setups ? (unsigned int)(m_setupSize / setups) : 0;
+    unlock();
+    str.append("shared=",",") << String::boolText(shared);
+    str << ",setups=" << setups << ",setupusec=" << setupTime << ",setupbytes=" << setupSize;
+    u_int64_t hits = 0;
+    u_int64_t misses = 0;
+    ScriptContext::cacheStats(hits,misses);
+    u_int64_t total = hits + misses;
+    char buf[96];
+    ::snprintf(buf,sizeof(buf),"cachehits=" FMT64U ",cachemisses=" FMT64U ",hitrate=%u",
+	hits,misses,(unsigned int)(total ? (hits * 100 / total) : 0));
+    str.append(buf,",");
 }
 
 bool JsModule::commandExecute(String& retVal, const String& line)
@@ -467,19 +526,57 @@ bool JsModule::received(Message& msg, int id, ChanAssist* assist)
 
 ChanAssist* JsModule::create(Message& msg, const String& id)
 {
+    u_int64_t start = Time::now();
     lock();
-    ScriptRun* runner = m_assistCode.createRunner();
+    JsObject* shared = m_shared;
+    ScriptContext* ctxt = shared ? m_assistCode.createContext(shared) : 0;
+    ScriptRun* runner = m_assistCode.createRunner(ctxt);
     unlock();
+    TelEngine::destruct(ctxt);
     if (!runner)
 	return 0;
     DDebug(this,DebugInfo,"Creating Javascript for '%s'",id.c_str());
     JsAssist* ca = new JsAssist(this,id,runner);
-    if (ca->init())
+    if (ca->init(shared != 0)) {
+	const ScriptContext* c = runner->context();
+	unsigned int size = c ? objectSize(c->params()) : 0;
+	u_int64_t usec = Time::now() - start;
+	lock();
+	m_setups++;
+	m_setupTime += usec;
+	m_setupSize += size;
+	unlock();
 	return ca;
+    }
     TelEngine::destruct(ca);
     return 0;
 }
 
+// Evaluate the global code of the routing script once, in a state shared by all channels
+JsObject* JsModule::buildShared()
+{
+    lock();
+    ScriptRun* runner = m_assistCode.createRunner();
+    unlock();
+    if (!runner)
+	return 0;
+    JsObject::initialize(runner->context());
+    JsEngine::initialize(runner->context());
+    JsMessage::initialize(runner->context());
+    JsObject* shared = 0;
+    if (ScriptRun::Succeeded == runner->run()) {
+	shared = YOBJECT(JsObject,runner->context());
+	if (shared && shared->ref())
+	    shared->share();
+	else
+	    shared = 0;
+    }
+    else
+	Debug(this,DebugWarn,"Failed to evaluate shared globals of routing script");
+    TelEngine::destruct(runner);
+    return shared;
+}
+
 bool JsModule::unload()
 {
     uninstallRelays();
@@ -503,11 +600,23 @@ void JsModule::initialize()
     m_assistCode.basePath(tmp);
     tmp = cfg.getValue("scripts","routing");
     m_assistCode.adjustPath(tmp);
-    if (m_assistCode.parseFile(tmp))
+    bool ok = m_assistCode.parseFile(tmp);
+    if (ok)
 	Debug(this,DebugInfo,"Parsed routing script: %s",tmp.c_str());
     else if (tmp)
 	Debug(this,DebugWarn,"Failed to parse script: %s",tmp.c_str());
+    JsObject* old = m_shared;
+    m_shared = 0;
+    unlock();
+    TelEngine::destruct(old);
+    if (!(ok && cfg.getBoolValue("general","shared_globals")))
+	return;
+    JsObject* shared = buildShared();
+    lock();
+    old = m_shared;
+    m_shared = shared;
     unlock();
+    TelEngine::destruct(old);
 }
 
 void JsModule::init(int priority)
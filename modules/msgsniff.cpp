@@ -3,6 +3,7 @@
  * This file is part of the YATE Project http://YATE.null.ro
  *
  * A sample message sniffer that inserts a wildcard message handler
+ * Can also sample messages into a binary trace buffer, see tools/msgtrace.pl
  *
  * Yet Another Telephony Engine - a fully featured software PBX and IVR
  * Copyright (C) 2004-2006 Null Team
@@ -24,6 +25,8 @@
 
 #include <yatengine.h>
 
+#include <string.h>
+
 using namespace TelEngine;
 namespace { // anonymous
 
@@ -38,6 +41,16 @@ static const char* s_debugs[] =
     "yes",
     "no",
     "filter",
+    "trace",
+    0
+};
+
+static const char* s_traces[] =
+{
+    "on",
+    "off",
+    "dump",
+    "clear",
     0
 };
 
@@ -64,10 +77,211 @@ public:
     virtual void dispatched(const Message& msg, bool handled);
 };
 
+// Circular buffer holding whole binary trace records
+// Each record starts with its length so the oldest ones can be discarded
+class TraceRing : public Mutex
+{
+public:
+    TraceRing();
+    ~TraceRing();
+    void resize(unsigned int size);
+    void clear();
+    void put(const DataBlock& rec);
+    bool dump(const String& file, String& error);
+    inline unsigned int records() const
+	{ return m_records; }
+    inline unsigned int dropped() const
+	{ return m_dropped; }
+private:
+    void copyIn(const unsigned char* data, unsigned int len);
+    unsigned int peekLength(unsigned int pos) const;
+    unsigned char* m_buf;
+    unsigned int m_size;
+    unsigned int m_head;
+    unsigned int m_used;
+    unsigned int m_records;
+    unsigned int m_dropped;
+};
+
 static bool s_active = true;
 static Regexp s_filter;
 static Mutex s_mutex(false,"FilterSniff");
 
+// Trace sampling settings
+static bool s_trace = false;
+static unsigned int s_sample = 100;
+static String s_traceKey;
+static String s_traceFile;
+static unsigned int s_sampleCount = 0;
+static TraceRing s_ring;
+
+// Trace file header, version 1 uses big endian (network order) integers
+static const char s_traceMagic[] = "YTRC\0\0\0\1";
+
+static void putInt(DataBlock& buf, u_int64_t val, unsigned int len)
+{
+    unsigned char tmp[8];
+    for (int i = len - 1; i >= 0; i--) {
+	tmp[i] = (unsigned char)(val & 0xff);
+	val >>= 8;
+    }
+    buf.append(tmp,len);
+}
+
+static void putStr(DataBlock& buf, const char* str)
+{
+    unsigned int len = str ? ::strlen(str) : 0;
+    if (len > 0xffff)
+	len = 0xffff;
+    putInt(buf,len,2);
+    if (len)
+	buf.append((void*)str,len);
+}
+
+// Decide if a message is sampled, either 1 in N messages or 1 in N calls
+//  when the key parameter is present so whole calls are traced
+static bool sampled(const Message& msg)
+{
+    if (s_sample <= 1)
+	return true;
+    if (s_traceKey) {
+	const String* key = msg.getParam(s_traceKey);
+	if (key && *key)
+	    return (key->hash() % s_sample) == 0;
+    }
+    // counter races only skew the sampling rate a little
+    return (++s_sampleCount % s_sample) == 0;
+}
+
+static void traceMessage(const Message& msg, bool handled)
+{
+    DataBlock rec;
+    // placeholder for the record length
+    putInt(rec,0,4);
+    putInt(rec,(handled ? 1 : 0) | (msg.broadcast() ? 2 : 0),1);
+    putInt(rec,msg.msgTime().usec(),8);
+    putInt(rec,Time::now(),8);
+    putStr(rec,msg);
+    if (handled && (msg == YSTRING("user.auth")) && msg.retValue() && (msg.retValue() != "-"))
+	putStr(rec,"(hidden)");
+    else
+	putStr(rec,msg.retValue());
+    putStr(rec,Thread::currentName());
+    unsigned int n = msg.length();
+    unsigned int cnt = 0;
+    for (unsigned int i = 0; i < n; i++)
+	if (msg.getParam(i))
+	    cnt++;
+    if (cnt > 0xffff)
+	cnt = 0xffff;
+    putInt(rec,cnt,2);
+    for (unsigned int i = 0; cnt && (i < n); i++) {
+	const NamedString* s = msg.getParam(i);
+	if (!s)
+	    continue;
+	putStr(rec,s->name());
+	putStr(rec,(s->name() == YSTRING("password")) ? "(hidden)" : s->c_str());
+	cnt--;
+    }
+    unsigned char* p = (unsigned char*)rec.data();
+    unsigned int len = rec.length();
+    p[0] = (unsigned char)(len >> 24);
+    p[1] = (unsigned char)(len >> 16);
+    p[2] = (unsigned char)(len >> 8);
+    p[3] = (unsigned char)len;
+    s_ring.put(rec);
+}
+
+
+TraceRing::TraceRing()
+    : Mutex(false,"TraceSniff"),
+      m_buf(0), m_size(0), m_head(0), m_used(0), m_records(0), m_dropped(0)
+{
+}
+
+TraceRing::~TraceRing()
+{
+    delete[] m_buf;
+}
+
+void TraceRing::resize(unsigned int size)
+{
+    Lock lock(this);
+    if (size == m_size)
+	return;
+    delete[] m_buf;
+    m_buf = size ? new unsigned char[size] : 0;
+    m_size = size;
+    m_head = m_used = m_records = 0;
+}
+
+void TraceRing::clear()
+{
+    Lock lock(this);
+    m_head = m_used = m_records = m_dropped = 0;
+}
+
+unsigned int TraceRing::peekLength(unsigned int pos) const
+{
+    unsigned int len = 0;
+    for (int i = 0; i < 4; i++)
+	len = (len << 8) | m_buf[(pos + i) % m_size];
+    return len;
+}
+
+void TraceRing::copyIn(const unsigned char* data, unsigned int len)
+{
+    unsigned int first = m_size - m_head;
+    if (first > len)
+	first = len;
+    ::memcpy(m_buf + m_head,data,first);
+    if (len > first)
+	::memcpy(m_buf,data + first,len - first);
+    m_head = (m_head + len) % m_size;
+    m_used += len;
+}
+
+void TraceRing::put(const DataBlock& rec)
+{
+    Lock lock(this);
+    unsigned int len = rec.length();
+    if (!m_buf || (len > m_size)) {
+	m_dropped++;
+	return;
+    }
+    // discard oldest records until the new one fits
+    while (m_used + len > m_size) {
+	unsigned int tail = (m_head + m_size - m_used) % m_size;
+	m_used -= peekLength(tail);
+	m_records--;
+	m_dropped++;
+    }
+    copyIn((const unsigned char*)rec.data(),len);
+    m_records++;
+}
+
+bool TraceRing::dump(const String& file, String& error)
+{
+    File f;
+    if (!f.openPath(file,true,false,true,false,true)) {
+	error << "cannot create " << file;
+	return false;
+    }
+    Lock lock(this);
+    unsigned int tail = m_size ? (m_head + m_size - m_used) % m_size : 0;
+    unsigned int first = m_size - tail;
+    if (first > m_used)
+	first = m_used;
+    bool ok = (f.writeData(s_traceMagic,8) == 8);
+    if (ok && first)
+	ok = (f.writeData(m_buf + tail,first) == (int)first);
+    if (ok && (m_used > first))
+	ok = (f.writeData(m_buf,m_used - first) == (int)(m_used - first));
+    if (!ok)
+	error << "write error on " << file;
+    return ok;
+}
+
 static void dumpParams(const Message &msg, String& par)
 {
     unsigned n = msg.length();
@@ -91,6 +305,33 @@ bool SniffHandler::received(Message &msg)
 	static const String name("sniffer");
 	String line(msg.getValue(YSTRING("line")));
 	if (line.startSkip(name)) {
+	    if (line.startSkip("trace")) {
+		if (line.startSkip("dump")) {
+		    if (line.null())
+			line = s_traceFile;
+		    String error;
+		    if (line.null())
+			msg.retValue() << "No trace file name\r\n";
+		    else if (s_ring.dump(line,error))
+			msg.retValue() << "Dumped " << s_ring.records() << " trace records to " << line << "\r\n";
+		    else
+			msg.retValue() << "Trace dump failed: " << error << "\r\n";
+		    return true;
+		}
+		if (line.startSkip("clear"))
+		    s_ring.clear();
+		else {
+		    line >> s_trace;
+		    line.trimSpaces();
+		    int n = line.toInteger(-1);
+		    if (n > 0)
+			s_sample = n;
+		}
+		msg.retValue() << "Message tracer is " << (s_trace ? "on" : "off")
+		    << " sample 1/" << s_sample << " records " << s_ring.records()
+		    << " dropped " << s_ring.dropped() << "\r\n";
+		return true;
+	    }
 	    line >> s_active;
 	    line.trimSpaces();
 	    if (line.startSkip("filter")) {
@@ -115,6 +356,12 @@ bool SniffHandler::received(Message &msg)
 		if (line.null() || String(*b).startsWith(line))
 		    msg.retValue().append(*b,"\t");
 	}
+	else if (line == YSTRING("sniffer trace")) {
+	    line = msg.getValue(YSTRING("partword"));
+	    for (const char** b = s_traces; *b; b++)
+		if (line.null() || String(*b).startsWith(line))
+		    msg.retValue().append(*b,"\t");
+	}
     }
     if (!s_active)
 	return false;
@@ -140,7 +387,17 @@ bool SniffHandler::received(Message &msg)
 
 void HookHandler::dispatched(const Message& msg, bool handled)
 {
-    if ((!s_active) || (msg == YSTRING("engine.timer")))
+    if (msg == YSTRING("engine.timer"))
+	return;
+    if (s_trace && sampled(msg)) {
+	// sample first so unsampled messages never touch the filter lock
+	Lock lock(s_mutex);
+	if (!(s_filter && !s_filter.matches(msg))) {
+	    lock.drop();
+	    traceMessage(msg,handled);
+	}
+    }
+    if (!s_active)
 	return;
     Lock lock(s_mutex);
     if (s_filter && !s_filter.matches(msg))
@@ -185,6 +442,19 @@ void MsgSniff::initialize()
 	s_mutex.lock();
 	s_filter = Engine::config().getValue("general","filtersniff");
 	s_mutex.unlock();
+	s_sample = Engine::config().getIntValue("general","tracesample",100);
+	if (s_sample < 1)
+	    s_sample = 1;
+	s_traceKey = Engine::config().getValue("general","tracekey","billid");
+	s_traceFile = Engine::config().getValue("general","tracefile");
+	Engine::runParams().replaceParams(s_traceFile);
+	int size = Engine::config().getIntValue("general","tracebuffer",1024);
+	if (size < 16)
+	    size = 16;
+	else if (size > 262144)
+	    size = 262144;
+	s_ring.resize(1024 * size);
+	s_trace = Engine::config().getBoolValue("general","msgtrace",false);
 	Engine::install(new SniffHandler);
 	Engine::self()->setHook(new HookHandler);
     }
@@ -24,15 +24,23 @@
 
 #include <yatephone.h>
 
+#include <string.h>
+
+#ifndef _WINDOWS
+#include <sys/mman.h>
+#endif
+
 
 using namespace TelEngine;
 namespace { // anonymous
 
 class CacheItem;                         // A cache item
+class CachePending;                      // An item load in progress
 class Cache;                             // A cache hash list
 class CacheThread;                       // Base class for cache threads
-class CacheExpireThread;                 // Cache expire thread
+class CacheExpireThread;                 // Cache expire and snapshot thread
 class CacheLoadThread;                   // Cache load thread
+class CacheSnapshotThread;               // Cache snapshot load thread
 class EngineHandler;                     // engine.start/stop handler
 class CacheModule;
 
@@ -40,28 +48,83 @@ class CacheModule;
 #define EXPIRE_CHECK_MAX 300
 // Min value for cache reload interval in seconds
 #define CACHE_RELOAD_MIN 10
-
-class CacheItem : public NamedList
+// Default time (in milliseconds) to wait for an item load started by another thread
+#define CACHE_MISS_WAIT 5000
+// Maximum number of distinct parameters (columns) stored in a cache
+#define CACHE_MAX_COLUMNS 255
+// Maximum hash list size of a cache when growing automatically
+#define CACHE_HASH_MAX 16777213
+// Minimum snapshot interval (in seconds)
+#define SNAPSHOT_MIN 10
+// Snapshot file format version
+#define SNAPSHOT_VERSION 1
+
+// A cache item
+// Parameter values are kept in a single buffer as a sequence of column index
+//  (one byte, index in cache column names) followed by the NUL terminated value
+class CacheItem : public GenObject
 {
     friend class Cache;
 public:
-    inline CacheItem(const String& id, const NamedList& p, const String& copy,
-	u_int64_t expires)
-	: NamedList(id), m_expires(0)
-	{ update(p,copy,expires); }
-    inline void update(const NamedList& p, const String& copy, u_int64_t expires) {
-	    m_expires = expires;
-	    if (copy)
-		copyParams(p,copy);
-	    else
-		copyParams(p);
-	}
+    inline CacheItem(const String& id, u_int64_t expires)
+	: m_id(id), m_expires(expires), m_data(0), m_length(0),
+	m_lruPrev(0), m_lruNext(0), m_heapPos(-1), m_negative(false)
+	{}
+    ~CacheItem()
+	{ delete[] m_data; }
+    virtual const String& toString() const
+	{ return m_id; }
     inline u_int64_t expires() const
 	{ return m_expires; }
     inline bool timeout(const Time& time) const
 	{ return m_expires && m_expires < time; }
+    // Check if this item only remembers that the id was not found in database
+    inline bool negative() const
+	{ return m_negative; }
+    // Retrieve the approximate memory used by this item, including the list entry
+    inline unsigned int memory() const
+	{ return sizeof(CacheItem) + sizeof(ObjList) + m_id.length() + 1 + m_length; }
+    // Find the value of a column, return NULL if not set
+    const char* value(unsigned int column) const;
 protected:
+    String m_id;
     u_int64_t m_expires;
+    char* m_data;                        // Column values buffer
+    unsigned int m_length;               // Buffer length
+    CacheItem* m_lruPrev;                // More recently used item
+    CacheItem* m_lruNext;                // Less recently used item
+    int m_heapPos;                       // Position in cache expire heap, -1 if not there
+    bool m_negative;
+};
+
+// An item being loaded from database
+// Other threads missing the same item wait for the load result instead of
+//  sending their own query
+class CachePending : public RefObject
+{
+public:
+    inline CachePending(const String& id)
+	: m_id(id), m_done(1,"CachePending"), m_finished(false)
+	{ m_done.lock(0); }
+    virtual const String& toString() const
+	{ return m_id; }
+    // Wait for the load to finish. Return false on timeout
+    inline bool wait(long maxwait) {
+	    if (!m_done.lock(maxwait))
+		return m_finished;
+	    // Wake up the next waiting thread
+	    m_done.unlock();
+	    return true;
+	}
+    // Signal waiting threads that the load has finished
+    inline void finish() {
+	    m_finished = true;
+	    m_done.unlock();
+	}
+private:
+    String m_id;
+    Semaphore m_done;
+    bool m_finished;
 };
 
 class Cache : public RefObject, public Mutex
@@ -74,12 +137,16 @@ public:
     // Retrieve the cache TTL
     inline u_int64_t cacheTtl() const
 	{ return m_cacheTtl; }
+    // Append item counters to a status buffer. This method is not thread safe
+    inline void statusCounters(String& buf) const {
+	    buf << "|" << m_hits << "|" << m_misses << "|" << m_coalesced << "|" << m_negativeHits;
+	    buf << "|" << (unsigned int)(m_memory / 1024) << "|" << m_evicted;
+	    buf << "|" << (m_snapshotTime ? Time::secNow() - m_snapshotTime : 0);
+	    buf << "|" << m_loadRows << "|" << m_loading;
+	}
     // Check if the cache has reload set
     inline bool canReload()
 	{ return m_loadInterval != 0 || m_reload != 0; }
-    // Retrieve the mutex protecting a given list
-    inline unsigned int index(const String& str) const
-	{ return str.hash() % m_list.length(); }
     // Safely retrieve the id matching parameter
     inline void getIdParam(String& param) {
 	    Lock lck(this);
@@ -111,6 +178,23 @@ public:
     bool startLoad();
     // Reset the loading flag. Set the next re-load time if we have an interval
     void endLoad(bool triggerReload);
+    // Account rows loaded from database
+    inline void loadProgress(unsigned int rows) {
+	    Lock lock(this);
+	    m_loadRows += rows;
+	}
+    // Check if the cache has a snapshot file
+    inline bool hasSnapshot() const
+	{ return !m_snapshotFile.null(); }
+    // Save the cache snapshot if changed and due or forced. Return true on success
+    bool saveSnapshot(bool force);
+    // Load the cache snapshot. Return the number of loaded items
+    unsigned int loadSnapshot();
+    // Allow saving the snapshot after loading it
+    inline void snapshotLoaded() {
+	    Lock lock(this);
+	    m_snapshotLoading = false;
+	}
     // Copy params from cache item. Return true if found
     bool copyParams(const String& id, NamedList& list, const String* cpParams);
     // Add an item to the cache. Remove an existing one
@@ -137,6 +221,8 @@ public:
     virtual const String& toString() const;
     // Dump the cache to output if XDEBUG is defined
     void dump(const char* oper);
+    // Copy all item parameters to a list. This method is not thread safe
+    void itemParams(const CacheItem& item, NamedList& list) const;
     // Set chunk limit and offset to a query
     // Return the number of replaced params
     static int setLimits(String& query, unsigned int chunk, unsigned int offset);
@@ -151,15 +237,54 @@ protected:
     CacheItem* addUnsafe(Array& array, int row, int cols);
     // Find a cache item. This method is not thread safe
     CacheItem* find(const String& id);
-    // Adjust cache length to limit
+    // Remove least recently used items until the cache fits its limits
     void adjustToLimit(CacheItem* skipAdded);
+    // Retrieve the index of a column, optionally add it if not found
+    // Return -1 if not found or there are too many columns
+    int column(const String& name, bool add);
+    // Set item parameters from a list. Copy all parameters if the copy list is empty
+    void setItemData(CacheItem& item, const NamedList& params, const String& copy);
+    // Copy item parameters listed in a comma separated list
+    void copyItem(const CacheItem& item, NamedList& list, const String& copy) const;
+    // Detach an item from expire heap and LRU list, update counters
+    // The caller must remove the item from hash list
+    void detachUnsafe(CacheItem* item);
+    // Insert a new item in hash list, LRU list and expire heap, update counters
+    void insertUnsafe(CacheItem* item);
+    // Detach and destroy an item
+    inline void removeUnsafe(CacheItem* item) {
+	    detachUnsafe(item);
+	    m_list.remove(item);
+	}
+    // Move an item to the head of the LRU list
+    void lruTouch(CacheItem* item);
+    // Expire heap helpers
+    void heapRemove(CacheItem* item);
+    void heapUp(unsigned int pos);
+    void heapDown(unsigned int pos);
+    inline void heapSet(unsigned int pos, CacheItem* item) {
+	    m_heap[pos] = item;
+	    item->m_heapPos = pos;
+	}
+    // Load an item from database, remember it if not found. This method is not thread safe
+    CacheItem* loadItemUnsafe(const String& id);
 
     String m_name;                       // Cache name
     HashList m_list;                     // The list holding the cache
+    unsigned int m_size;                 // Initial hash list size, the list grows by itself
     u_int64_t m_cacheTtl;                // Cache item TTL (in us)
     unsigned int m_count;                // Current number of items
     unsigned int m_limit;                // Limit the number of cache items
-    unsigned int m_limitOverflow;        // Allowed limit overflow
+    u_int64_t m_maxMemory;               // Limit the memory used by cache items (in bytes)
+    u_int64_t m_memory;                  // Memory used by cache items
+    unsigned int m_evicted;              // Items removed to keep the cache in limits
+    ObjList m_columns;                   // Stored parameter names
+    unsigned int m_columnCount;          // Number of stored parameter names
+    CacheItem* m_lruHead;                // Most recently used item
+    CacheItem* m_lruTail;                // Least recently used item
+    CacheItem** m_heap;                  // Items with expire time ordered by it
+    unsigned int m_heapLen;              // Number of items in heap
+    unsigned int m_heapAlloc;            // Allocated heap length
     unsigned int m_loadChunk;            // The number of items to load in each DB load query
     Thread::Priority m_loadPrio;         // Load thread priority
     bool m_loading;                      // Cache is loading from database
@@ -177,6 +302,21 @@ protected:
     String m_queryLoadItemCmd;           // Database load item on command query
     String m_querySave;                  // Database save query
     String m_queryExpire;                // Database expire query
+    unsigned int m_negativeTtl;          // Time (in seconds) to remember items not found in database
+    long m_missWait;                     // Time (in microseconds) to wait for an item load in progress
+    ObjList m_pending;                   // Items being loaded from database
+    unsigned int m_hits;                 // Items found in cache
+    unsigned int m_misses;               // Items not found in cache
+    unsigned int m_coalesced;            // Misses that waited for a load already in progress
+    unsigned int m_negativeHits;         // Items known to be missing from database
+    String m_snapshotFile;               // Snapshot file
+    unsigned int m_snapshotInterval;     // Snapshot save interval (in seconds)
+    u_int32_t m_snapshotTime;            // Time of the data in last saved or loaded snapshot
+    unsigned int m_changes;              // Changes since last snapshot
+    bool m_snapshotLoading;              // Snapshot is being loaded
+    bool m_loadDelta;                    // Next full load may use the delta query
+    String m_queryLoadDelta;             // Database load changes since snapshot query
+    unsigned int m_loadRows;             // Rows loaded by current or last database load
 };
 
 class CacheThread : public Thread, public GenObject
@@ -189,6 +329,7 @@ public:
     static ObjList s_threads;
 };
 
+// Expire cache items, save cache snapshots periodically and on exit
 class CacheExpireThread : public CacheThread
 {
 public:
@@ -198,6 +339,29 @@ public:
     virtual void run();
 };
 
+// Buffered writer for cache snapshot files
+class SnapshotWriter
+{
+public:
+    inline SnapshotWriter(File& file)
+	: m_file(file), m_len(0), m_ok(true)
+	{}
+    inline bool ok() const
+	{ return m_ok; }
+    void write(const void* data, unsigned int len);
+    inline void write(const String& str) {
+	    u_int16_t len = (str.length() > 0xffff) ? 0xffff : str.length();
+	    write(&len,sizeof(len));
+	    write(str.c_str(),len);
+	}
+    bool flush();
+private:
+    File& m_file;
+    char m_buf[65536];
+    unsigned int m_len;
+    bool m_ok;
+};
+
 class CacheLoadThread : public CacheThread
 {
 public:
@@ -213,6 +377,19 @@ private:
     ObjList* m_items;
 };
 
+// Load a cache snapshot while requests are already served, then load from database
+class CacheSnapshotThread : public CacheThread
+{
+public:
+    inline CacheSnapshotThread(const String name)
+	: CacheThread("CacheSnapshotThread"),
+	m_cache(name)
+	{}
+    virtual void run();
+private:
+    String m_cache;
+};
+
 class EngineHandler : public MessageHandler
 {
 public:
@@ -293,11 +470,13 @@ static bool s_lnpStoreNpdiBefore = true; // Store LNP when already done
 static bool s_cnamStoreEmpty = false;    // Store empty caller name in CNAM cache
 static unsigned int s_size = 0;          // The number of listst in each cache
 static unsigned int s_limit = 0;         // Default cache limit
+static int s_maxMemory = 0;              // Default cache memory limit (in kilobytes)
 static unsigned int s_loadChunk = 0;     // The number of cache items to load in each DB load query
 static unsigned int s_maxChunks = 1000;  // Maximum number of chunks to load in a cache
 static Thread::Priority s_loadPrio = Thread::Normal; // Cache load thread priority
 static unsigned int s_cacheTtlSec = 0;   // Default cache item time to live (in seconds)
 static u_int64_t s_checkToutInterval = 0;// Interval to check cache timeout
+static int s_snapshotInterval = 300;     // Default snapshot interval (in seconds)
 
 // Used strings: avoid allocation
 static const String s_id = "id";
@@ -370,8 +549,10 @@ static inline unsigned int adjustedCacheLoadChunk(int val)
 static inline void dumpItem(Cache& c, CacheItem& item, const char* oper)
 {
 #ifdef XDEBUG
+    NamedList p(item.toString());
+    c.itemParams(item,p);
     String tmp;
-    item.dump(tmp," ");
+    p.dump(tmp," ");
     Debug(&__plugin,DebugAll,"Cache(%s) %s %p %s expires=%u [%p]",
 	c.toString().c_str(),oper,&item,tmp.c_str(),
 	(unsigned int)(item.expires()/1000000),&c);
@@ -400,16 +581,24 @@ static void fillList(NamedList& list, String& buf)
  */
 Cache::Cache(const String& name, int size, const NamedList& params)
     : Mutex(false,"Cache"),
-    m_name(name), m_list(size), m_cacheTtl(0), m_count(0), m_limit(0),
-    m_limitOverflow(0), m_loadChunk(0), m_loadPrio(Thread::Normal),
+    m_name(name), m_list(size), m_size(m_list.length()), m_cacheTtl(0), m_count(0), m_limit(0),
+    m_maxMemory(0), m_memory(0), m_evicted(0), m_columnCount(0),
+    m_lruHead(0), m_lruTail(0), m_heap(0), m_heapLen(0), m_heapAlloc(0),
+    m_loadChunk(0), m_loadPrio(Thread::Normal),
     m_loading(false), m_loadInterval(0), m_nextLoad(0),
-    m_reload(0), m_reloadItems(0)
+    m_reload(0), m_reloadItems(0), m_negativeTtl(0), m_missWait(0),
+    m_hits(0), m_misses(0), m_coalesced(0), m_negativeHits(0),
+    m_snapshotInterval(0), m_snapshotTime(0), m_changes(0), m_snapshotLoading(false),
+    m_loadDelta(false),
+    m_loadRows(0)
 
 {
     Debug(&__plugin,DebugInfo,"Cache(%s) size=%u [%p]",
 	m_name.c_str(),m_list.length(),this);
+    m_list.autoResize(4,CACHE_HASH_MAX);
     m_expireParam << "cache_" << m_name << "_expires";
     doUpdate(params,true);
+    m_snapshotLoading = hasSnapshot();
 }
 
 // Reload the cache if not currently loading and set it to reload
@@ -470,6 +659,7 @@ bool Cache::startLoad()
     if (m_loading)
 	return false;
     m_loading = true;
+    m_loadRows = 0;
     return true;
 }
 
@@ -488,40 +678,94 @@ bool Cache::copyParams(const String& id, NamedList& list, const String* cpParams
 {
     lock();
     CacheItem* item = find(id);
-    if (!item && m_account && m_queryLoadItem) {
-	// Load from database
-	String query = m_queryLoadItem;
-	NamedList p("");
-	p.addParam("id",id);
-	p.replaceParams(query);
-	Message m("database");
-	m.addParam("account",m_account);
-	m.addParam("query",query);
-	unlock();
-	bool ok = Engine::dispatch(m);
-	lock();
-	const char* error = m.getValue("error");
-	if (ok && !error) {
-	    Array* a = static_cast<Array*>(m.userObject("Array"));
-	    int rows = a ? a->getRows() : 0;
-	    if (rows > 0)
-		item = addUnsafe(*a,1,a->getColumns());
-	    else
-		DDebug(&__plugin,DebugAll,"Cache(%s) item '%s' not found in database [%p]",
-		    m_name.c_str(),id.c_str(),this);
+    if (item && item->negative()) {
+	if (!item->timeout(Time())) {
+	    // Known to be missing from database
+	    m_negativeHits++;
+	    unlock();
+	    return false;
 	}
-	else
-	    Debug(&__plugin,DebugNote,"Cache(%s) failed to load item '%s' %s [%p]",
-		m_name.c_str(),id.c_str(),TelEngine::c_safe(error),this);
+	item = 0;
+    }
+    if (item) {
+	m_hits++;
+	lruTouch(item);
+    }
+    else {
+	m_misses++;
+	if (m_account && m_queryLoadItem)
+	    item = loadItemUnsafe(id);
     }
     if (item) {
-	list.copyParams(*item,!cpParams ? m_copyParams : *cpParams);
+	copyItem(*item,list,!cpParams ? m_copyParams : *cpParams);
 	dumpItem(*this,*item,"found in cache");
     }
     unlock();
     return item != 0;
 }
 
+// Load an item from database, remember it if not found. This method is not thread safe
+CacheItem* Cache::loadItemUnsafe(const String& id)
+{
+    RefPointer<CachePending> pending = static_cast<CachePending*>(m_pending[id]);
+    if (pending) {
+	// Someone else is already loading it: wait for the result
+	m_coalesced++;
+	long maxwait = m_missWait;
+	unlock();
+	bool ok = pending->wait(maxwait);
+	pending = 0;
+	lock();
+	if (!ok) {
+	    DDebug(&__plugin,DebugMild,"Cache(%s) timed out waiting for item '%s' load [%p]",
+		m_name.c_str(),id.c_str(),this);
+	    return 0;
+	}
+	CacheItem* item = find(id);
+	return (item && !item->negative()) ? item : 0;
+    }
+    CachePending* p = new CachePending(id);
+    m_pending.append(p);
+    pending = p;
+    CacheItem* item = 0;
+    String query = m_queryLoadItem;
+    NamedList params("");
+    params.addParam("id",id);
+    params.replaceParams(query);
+    Message m("database");
+    m.addParam("account",m_account);
+    m.addParam("query",query);
+    unlock();
+    bool ok = Engine::dispatch(m);
+    lock();
+    const char* error = m.getValue("error");
+    if (ok && !error) {
+	Array* a = static_cast<Array*>(m.userObject("Array"));
+	// First row holds the column names
+	int rows = a ? a->getRows() : 0;
+	if (rows > 1)
+	    item = addUnsafe(*a,1,a->getColumns());
+	else {
+	    DDebug(&__plugin,DebugAll,"Cache(%s) item '%s' not found in database [%p]",
+		m_name.c_str(),id.c_str(),this);
+	    if (m_negativeTtl) {
+		NamedList tmp(id);
+		tmp.addParam("expires",String(m_negativeTtl));
+		// Copy only the id (not a parameter): the item holds no data
+		CacheItem* neg = addUnsafe(id,tmp,&s_id,false);
+		if (neg)
+		    neg->m_negative = true;
+	    }
+	}
+    }
+    else
+	Debug(&__plugin,DebugNote,"Cache(%s) failed to load item '%s' %s [%p]",
+	    m_name.c_str(),id.c_str(),TelEngine::c_safe(error),this);
+    m_pending.remove(p);
+    pending->finish();
+    return item;
+}
+
 // Safely retrieve DB load info
 void Cache::getDbLoad(String& account, String& query, unsigned int& loadChunk,
     Thread::Priority& loadPrio)
@@ -531,6 +775,21 @@ void Cache::getDbLoad(String& account, String& query, unsigned int& loadChunk,
     query = m_queryLoadCache;
     loadChunk = m_loadChunk;
     loadPrio = m_loadPrio;
+    if (!m_loadDelta)
+	return;
+    // Warm started from snapshot: load only the changes since it was saved
+    m_loadDelta = false;
+    if (!(m_queryLoadDelta && m_snapshotTime))
+	return;
+    query = m_queryLoadDelta;
+    NamedList p("");
+    p.addParam("since",String(m_snapshotTime));
+    p.replaceParams(query);
+    String tmp = query;
+    if (loadChunk && setLimits(tmp,loadChunk,0) < 2)
+	loadChunk = 0;
+    Debug(&__plugin,DebugInfo,"Cache(%s) loading changes since %u [%p]",
+	m_name.c_str(),m_snapshotTime,this);
 }
 
 void Cache::getDbLoadItemCmd(String& account, String& query, Thread::Priority& loadPrio)
@@ -606,22 +865,11 @@ void Cache::expire(const Time& time)
 	Engine::enqueue(m);
     }
     unsigned int oldCount = m_count;
-    for (unsigned int i = 0; i < m_list.length(); i++) {
-	if (exiting())
-	    break;
-	ObjList* list = m_list.getHashList(i);
-	if (list)
-	    list = list->skipNull();
-	// Stop when found a non timed out item:
-	//  we put them in the list in ascending order of timeout
-	for (; list; list = list->skipNull()) {
-	    CacheItem* item = static_cast<CacheItem*>(list->get());
-	    if (!item->timeout(time))
-		break;
-	    dumpItem(*this,*item,"removing timed out");
-	    list->remove();
-	    m_count--;
-	}
+    // Items are kept in a heap ordered by their expire time
+    while (m_heapLen && m_heap[0]->timeout(time)) {
+	CacheItem* item = m_heap[0];
+	dumpItem(*this,*item,"removing timed out");
+	removeUnsafe(item);
     }
     if (oldCount != m_count)
 	dump("Cache::expire()");
@@ -721,6 +969,11 @@ unsigned int Cache::clear()
     m_list.clear();
     unsigned int n = m_count;
     m_count = 0;
+    m_memory = 0;
+    m_lruHead = m_lruTail = 0;
+    m_heapLen = 0;
+    if (n)
+	m_changes++;
     return n;
 }
 
@@ -731,33 +984,30 @@ unsigned int Cache::remove(const String& id, bool regexp)
 	return 0;
     if (!regexp) {
 	Lock lck(this);
-	ObjList* list = m_list.getHashList(id);
-	GenObject* gen = list ? list->remove(id,false) : 0;
-	if (!gen)
+	CacheItem* item = find(id);
+	if (!item)
 	    return 0;
-	CacheItem* item = static_cast<CacheItem*>(gen);
 	dumpItem(*this,*item,"removed");
-	m_count--;
-	TelEngine::destruct(item);
+	removeUnsafe(item);
 	return 1;
     }
     unsigned int removed = 0;
     for (unsigned int i = 0; i < m_list.length(); i++) {
 	Lock lck(this);
-	ObjList* list = m_list.getHashList(i);
+	ObjList* list = m_list.getList(i);
 	if (list)
 	    list = list->skipNull();
 	while (list) {
 	    CacheItem* item = static_cast<CacheItem*>(list->get());
-	    if (!id.matches(*item)) {
+	    if (!id.matches(item->toString())) {
 		list = list->skipNext();
 		continue;
 	    }
 	    dumpItem(*this,*item,"removed");
+	    detachUnsafe(item);
 	    list->remove();
 	    list = list->skipNull();
 	    removed++;
-	    m_count--;
 	}
 	lck.drop();
 	if (exiting())
@@ -785,7 +1035,7 @@ void Cache::dump(const char* oper)
     unsigned int n = 0;
     int64_t now = (int64_t)Time::now();
     for (unsigned int i = 0; i < m_list.length(); i++) {
-	ObjList* list = m_list.getHashList(i);
+	ObjList* list = m_list.getList(i);
 	if (list)
 	    list = list->skipNull();
 	String rowData;
@@ -793,8 +1043,10 @@ void Cache::dump(const char* oper)
 	for (; list; list = list->skipNext()) {
 	    rn++;
 	    CacheItem* item = static_cast<CacheItem*>(list->get());
+	    NamedList p(item->toString());
+	    itemParams(*item,p);
 	    String tmp;
-	    item->dump(tmp," ");
+	    p.dump(tmp," ");
 	    int ttl = (int)(((int64_t)item->expires() - now) / 1000);
 	    rowData << "\r\n  " << ttl / 1000 << "." << ttl % 1000 << " " << tmp;
 	}
@@ -823,6 +1075,9 @@ void Cache::destroyed()
 {
     Debug(&__plugin,DebugInfo,"Cache(%s) destroyed [%p]",m_name.c_str(),this);
     clear();
+    delete[] m_heap;
+    m_heap = 0;
+    m_heapAlloc = 0;
     TelEngine::destruct(m_reloadItems);
     RefObject::destroyed();
 }
@@ -838,12 +1093,13 @@ void Cache::doUpdate(const NamedList& params, bool first)
     if (first) {
 	int ttl = safeValue(params.getIntValue("ttl",s_cacheTtlSec));
 	m_cacheTtl = (u_int64_t)adjustedCacheTtl(ttl) * 1000000;
+	m_snapshotFile = params.getValue("snapshot");
+	Engine::runParams().replaceParams(m_snapshotFile);
     }
-    m_limit = adjustedCacheLimit(params.getIntValue("limit",s_limit),m_list.length());
-    if (m_limit)
-	m_limitOverflow = m_limit + (m_limit / 100);
-    else
-	m_limitOverflow = 0;
+    int interval = params.getIntValue("snapshot_interval",s_snapshotInterval);
+    m_snapshotInterval = (interval <= 0) ? 0 : ((interval < SNAPSHOT_MIN) ? SNAPSHOT_MIN : interval);
+    m_limit = adjustedCacheLimit(params.getIntValue("limit",s_limit),m_size);
+    m_maxMemory = (u_int64_t)safeValue(params.getIntValue("max_memory",s_maxMemory)) * 1024;
     m_loadChunk = adjustedCacheLoadChunk(params.getIntValue("loadchunk",s_loadChunk));
     m_loadPrio = Thread::priority(params.getValue("loadcache_priority"),s_loadPrio);
     m_idParam = params.getValue("id_param");
@@ -851,10 +1107,14 @@ void Cache::doUpdate(const NamedList& params, bool first)
     m_account = params.getValue("account",account);
     m_accountLoadCache = params.getValue("account_loadcache",accountLoadCache);
     m_queryLoadCache = params.getValue("query_loadcache");
+    m_queryLoadDelta = params.getValue("query_loadcache_delta");
     m_queryLoadItem = params.getValue("query_loaditem");
     m_queryLoadItemCmd = params.getValue("query_loaditem_command",m_queryLoadItem);
     m_querySave = params.getValue("query_save");
     m_queryExpire = params.getValue("query_expire");
+    m_negativeTtl = safeValue(params.getIntValue("negative_ttl"));
+    int wait = params.getIntValue("miss_wait",CACHE_MISS_WAIT);
+    m_missWait = (wait > 0) ? (long)wait * 1000 : 0;
     // Minimum sanity check for cache load
     if (m_loadChunk && m_queryLoadCache) {
 	String tmp = m_queryLoadCache;
@@ -888,9 +1148,10 @@ void Cache::doUpdate(const NamedList& params, bool first)
     }
 #endif
     Debug(&__plugin,DebugInfo,
-	"Cache(%s) updated ttl=%u limit=%u reload_interval=%u copyparams='%s'%s [%p]",
-	m_name.c_str(),(unsigned int)(m_cacheTtl / 1000000),m_limit,m_loadInterval,
-	m_copyParams.safe(),all.safe(),this);
+	"Cache(%s) updated ttl=%u limit=%u max_memory=%uk reload_interval=%u negative_ttl=%u copyparams='%s'%s [%p]",
+	m_name.c_str(),(unsigned int)(m_cacheTtl / 1000000),m_limit,
+	(unsigned int)(m_maxMemory / 1024),m_loadInterval,
+	m_negativeTtl,m_copyParams.safe(),all.safe(),this);
 }
 
 // Add an item to the cache. Remove an existing one
@@ -899,10 +1160,6 @@ CacheItem* Cache::addUnsafe(const String& id, const NamedList& params, const Str
 {
     XDebug(&__plugin,DebugAll,"Cache::add(%s,%p,'%s',%u) [%p]",
 	id.c_str(),&params,TelEngine::c_safe(cpParams),dbSave,this);
-    unsigned int idx = index(id);
-    ObjList* list = m_list.getHashList(idx);
-    if (list)
-	list = list->skipNull();
     u_int64_t expires = m_cacheTtl;
     if (dbSave) {
 	int tmp = params.getIntValue(m_expireParam);
@@ -924,44 +1181,22 @@ CacheItem* Cache::addUnsafe(const String& id, const NamedList& params, const Str
     }
     if (expires)
 	expires += Time::now();
-    // Search for insert/add point and existing item
-    ObjList* insert = 0;
-    bool found = false;
-    while (list) {
-	CacheItem* crt = static_cast<CacheItem*>(list->get());
-	if (!insert && crt->expires() > expires) {
-	    insert = list;
-	    if (found)
-		break;
-	}
-	if (!found && id == crt->toString()) {
-	    if (crt->expires() > expires) {
-		// Deny update for oldest item
-		return crt;
-	    }
-	    if (insert == list)
-		insert = 0;
-	    list->remove();
-	    found = true;
-	    if (insert)
-		break;
+    CacheItem* item = find(id);
+    bool found = (item != 0);
+    if (item) {
+	if (item->expires() > expires && !item->negative()) {
+	    // Deny update for oldest item
+	    return item;
 	}
-	ObjList* next = list->skipNext();
-	if (next)
-	    list = next;
-	else
-	    break;
+	removeUnsafe(item);
     }
-    CacheItem* item = new CacheItem(id,params,cpParams ? *cpParams : m_copyParams,expires);
-    if (insert)
-	insert->insert(item);
-    else if (list)
-	list->append(item);
-    else
-	m_list.append(item);
+    item = new CacheItem(id,expires);
+    setItemData(*item,params,cpParams ? *cpParams : m_copyParams);
+    insertUnsafe(item);
     if (dbSave && m_account && m_querySave) {
 	String query = m_querySave;
-	NamedList p(*item);
+	NamedList p(item->toString());
+	itemParams(*item,p);
 	p.setParam("id",item->toString());
 	p.setParam("expires",String((unsigned int)(m_cacheTtl / 1000000)));
 	p.replaceParams(query);
@@ -972,10 +1207,7 @@ CacheItem* Cache::addUnsafe(const String& id, const NamedList& params, const Str
 	Engine::enqueue(m);
     }
     dumpItem(*this,*item,!found ? "added" : "updated");
-    if (found)
-	return item;
-    m_count++;
-    if (m_limitOverflow && m_count > m_limitOverflow)
+    if ((m_limit && m_count > m_limit) || (m_maxMemory && m_memory > m_maxMemory))
 	adjustToLimit(item);
     return item;
 }
@@ -1007,37 +1239,550 @@ CacheItem* Cache::find(const String& id)
     return o ? static_cast<CacheItem*>(o->get()) : 0;
 }
 
-// Adjust cache length to limit
+// Remove least recently used items until the cache fits its limits
 void Cache::adjustToLimit(CacheItem* skipAdded)
 {
-    if (!m_limit || m_count <= m_limit)
+    XDebug(&__plugin,DebugAll,"Cache(%s) adjusting to limit %u count=%u memory=%u [%p]",
+	m_name.c_str(),m_limit,m_count,(unsigned int)m_memory,this);
+    while ((m_limit && m_count > m_limit) || (m_maxMemory && m_memory > m_maxMemory)) {
+	CacheItem* item = m_lruTail;
+	if (item == skipAdded)
+	    item = item->m_lruPrev;
+	if (!item)
+	    break;
+	dumpItem(*this,*item,"removing least recently used");
+	removeUnsafe(item);
+	m_evicted++;
+    }
+}
+
+// Retrieve the index of a column, optionally add it if not found
+int Cache::column(const String& name, bool add)
+{
+    int idx = 0;
+    for (ObjList* o = m_columns.skipNull(); o; o = o->skipNext(), idx++)
+	if (name == *static_cast<String*>(o->get()))
+	    return idx;
+    if (!add || m_columnCount >= CACHE_MAX_COLUMNS)
+	return -1;
+    m_columns.append(new String(name));
+    return m_columnCount++;
+}
+
+// Set item parameters from a list. Copy all parameters if the copy list is empty
+void Cache::setItemData(CacheItem& item, const NamedList& params, const String& copy)
+{
+    const String* values[CACHE_MAX_COLUMNS];
+    for (unsigned int i = 0; i < CACHE_MAX_COLUMNS; i++)
+	values[i] = 0;
+    if (copy) {
+	ObjList* names = copy.split(',',false);
+	for (ObjList* o = names->skipNull(); o; o = o->skipNext()) {
+	    String name = o->get()->toString();
+	    name.trimBlanks();
+	    const NamedString* ns = name ? params.getParam(name) : 0;
+	    int idx = ns ? column(ns->name(),true) : -1;
+	    if (idx >= 0)
+		values[idx] = ns;
+	}
+	TelEngine::destruct(names);
+    }
+    else {
+	NamedIterator iter(params);
+	for (const NamedString* ns = 0; 0 != (ns = iter.get());) {
+	    int idx = column(ns->name(),true);
+	    if (idx >= 0)
+		values[idx] = ns;
+	}
+    }
+    unsigned int len = 0;
+    for (unsigned int i = 0; i < m_columnCount; i++)
+	if (values[i])
+	    len += values[i]->length() + 2;
+    delete[] item.m_data;
+    item.m_data = 0;
+    item.m_length = len;
+    if (!len)
+	return;
+    item.m_data = new char[len];
+    char* d = item.m_data;
+    for (unsigned int i = 0; i < m_columnCount; i++) {
+	if (!values[i])
+	    continue;
+	*d++ = (char)i;
+	::memcpy(d,values[i]->c_str(),values[i]->length());
+	d += values[i]->length();
+	*d++ = '\0';
+    }
+}
+
+// Copy item parameters listed in a comma separated list
+void Cache::copyItem(const CacheItem& item, NamedList& list, const String& copy) const
+{
+    ObjList* names = copy.split(',',false);
+    for (ObjList* o = names->skipNull(); o; o = o->skipNext()) {
+	String name = o->get()->toString();
+	name.trimBlanks();
+	if (!name)
+	    continue;
+	// Same as NamedList::copyParam(): clear the parameter if not set in item
+	const char* val = 0;
+	int idx = 0;
+	for (ObjList* c = m_columns.skipNull(); c; c = c->skipNext(), idx++) {
+	    if (name == *static_cast<String*>(c->get())) {
+		val = item.value(idx);
+		break;
+	    }
+	}
+	if (val)
+	    list.setParam(name,val);
+	else
+	    list.clearParam(name);
+    }
+    TelEngine::destruct(names);
+}
+
+// Copy all item parameters to a list. This method is not thread safe
+void Cache::itemParams(const CacheItem& item, NamedList& list) const
+{
+    const char* d = item.m_data;
+    const char* end = d + item.m_length;
+    while (d < end) {
+	unsigned int idx = (unsigned char)*d++;
+	const String* name = static_cast<const String*>(m_columns[(int)idx]);
+	if (name)
+	    list.addParam(*name,d);
+	d += ::strlen(d) + 1;
+    }
+}
+
+// Insert a new item in hash list, LRU list and expire heap, update counters
+void Cache::insertUnsafe(CacheItem* item)
+{
+    m_list.append(item);
+    m_count++;
+    m_changes++;
+    m_memory += item->memory();
+    // Insert at LRU list head
+    item->m_lruNext = m_lruHead;
+    if (m_lruHead)
+	m_lruHead->m_lruPrev = item;
+    else
+	m_lruTail = item;
+    m_lruHead = item;
+    if (!item->m_expires)
 	return;
-    Debug(&__plugin,DebugAll,"Cache(%s) adjusting to limit %u count=%u [%p]",
-	m_name.c_str(),m_limit,m_count,this);
-    while (m_count > m_limit) {
-	CacheItem* found = 0;
-	for (unsigned int i = 0; i < m_list.length(); i++) {
-	    ObjList* list = m_list.getHashList(i);
-	    if (list)
-		list = list->skipNull();
-	    CacheItem* item = list ? static_cast<CacheItem*>(list->get()) : 0;
-	    if (!item || item == skipAdded)
+    if (m_heapLen >= m_heapAlloc) {
+	unsigned int len = m_heapAlloc ? m_heapAlloc * 2 : 64;
+	CacheItem** heap = new CacheItem*[len];
+	for (unsigned int i = 0; i < m_heapLen; i++)
+	    heap[i] = m_heap[i];
+	delete[] m_heap;
+	m_heap = heap;
+	m_heapAlloc = len;
+    }
+    heapSet(m_heapLen,item);
+    heapUp(m_heapLen++);
+}
+
+// Detach an item from expire heap and LRU list, update counters
+void Cache::detachUnsafe(CacheItem* item)
+{
+    heapRemove(item);
+    if (item->m_lruPrev)
+	item->m_lruPrev->m_lruNext = item->m_lruNext;
+    else
+	m_lruHead = item->m_lruNext;
+    if (item->m_lruNext)
+	item->m_lruNext->m_lruPrev = item->m_lruPrev;
+    else
+	m_lruTail = item->m_lruPrev;
+    item->m_lruPrev = item->m_lruNext = 0;
+    m_memory -= item->memory();
+    m_count--;
+    m_changes++;
+}
+
+// Move an item to the head of the LRU list
+void Cache::lruTouch(CacheItem* item)
+{
+    if (item == m_lruHead)
+	return;
+    // Not head: it has a previous item
+    item->m_lruPrev->m_lruNext = item->m_lruNext;
+    if (item->m_lruNext)
+	item->m_lruNext->m_lruPrev = item->m_lruPrev;
+    else
+	m_lruTail = item->m_lruPrev;
+    item->m_lruPrev = 0;
+    item->m_lruNext = m_lruHead;
+    m_lruHead->m_lruPrev = item;
+    m_lruHead = item;
+}
+
+void Cache::heapRemove(CacheItem* item)
+{
+    int pos = item->m_heapPos;
+    if (pos < 0)
+	return;
+    item->m_heapPos = -1;
+    m_heapLen--;
+    if ((unsigned int)pos == m_heapLen)
+	return;
+    heapSet(pos,m_heap[m_heapLen]);
+    heapUp(pos);
+    heapDown(m_heap[pos]->m_heapPos);
+}
+
+void Cache::heapUp(unsigned int pos)
+{
+    CacheItem* item = m_heap[pos];
+    while (pos) {
+	unsigned int parent = (pos - 1) / 2;
+	if (m_heap[parent]->m_expires <= item->m_expires)
+	    break;
+	heapSet(pos,m_heap[parent]);
+	pos = parent;
+    }
+    heapSet(pos,item);
+}
+
+void Cache::heapDown(unsigned int pos)
+{
+    CacheItem* item = m_heap[pos];
+    for (;;) {
+	unsigned int child = pos * 2 + 1;
+	if (child >= m_heapLen)
+	    break;
+	if (child + 1 < m_heapLen && m_heap[child + 1]->m_expires < m_heap[child]->m_expires)
+	    child++;
+	if (item->m_expires <= m_heap[child]->m_expires)
+	    break;
+	heapSet(pos,m_heap[child]);
+	pos = child;
+    }
+    heapSet(pos,item);
+}
+
+// Save the cache snapshot if changed and due or forced. Return true on success
+// File layout (native byte order):
+//  "YCSN", version (4 bytes), save time (4 bytes), number of parameter names (4 bytes),
+//  parameter names (2 bytes length + name), then for each item: id (2 bytes length + id),
+//  expire time in usec (8 bytes), flags (1 byte), data length (4 bytes) and data
+bool Cache::saveSnapshot(bool force)
+{
+    lock();
+    u_int32_t now = Time::secNow();
+    bool due = m_snapshotInterval && (now >= m_snapshotTime + m_snapshotInterval);
+    // Don't overwrite the snapshot with a partial cache while loading it
+    bool ok = m_snapshotFile && m_changes && !m_snapshotLoading && (force || due);
+    String file = m_snapshotFile;
+    unsigned int changes = m_changes;
+    unlock();
+    if (!ok)
+	return false;
+    String tmp = file + ".tmp";
+    File f;
+    if (!f.openPath(tmp,true,false,true)) {
+	Debug(&__plugin,DebugWarn,"Cache(%s) failed to create snapshot file '%s': %d [%p]",
+	    m_name.c_str(),tmp.c_str(),f.error(),this);
+	return false;
+    }
+    u_int64_t start = Time::now();
+    SnapshotWriter w(f);
+    w.write("YCSN",4);
+    u_int32_t val = SNAPSHOT_VERSION;
+    w.write(&val,sizeof(val));
+    w.write(&now,sizeof(now));
+    lock();
+    // Parameter names are only appended so it's safe to save them first
+    val = m_columnCount;
+    w.write(&val,sizeof(val));
+    for (ObjList* o = m_columns.skipNull(); o; o = o->skipNext())
+	w.write(o->get()->toString());
+    // Items must stay in their hash list while the lock is released between
+    //  lists: finish a pending growth and don't start another one until done
+    if (m_list.resizing())
+	m_list.resync();
+    m_list.autoResize(0);
+    unlock();
+    unsigned int n = 0;
+    bool stopped = false;
+    for (unsigned int i = 0; w.ok(); i++) {
+	Lock lck(this);
+	if (i >= m_list.length())
+	    break;
+	for (ObjList* l = m_list.getList(i); l; l = l->skipNext()) {
+	    CacheItem* item = static_cast<CacheItem*>(l->get());
+	    if (!item)
 		continue;
-	    if (!found || found->m_expires > item->m_expires)
-		found = item;
+	    w.write(item->toString());
+	    w.write(&item->m_expires,sizeof(item->m_expires));
+	    u_int8_t flags = item->negative() ? 1 : 0;
+	    w.write(&flags,sizeof(flags));
+	    val = item->m_length;
+	    w.write(&val,sizeof(val));
+	    w.write(item->m_data,item->m_length);
+	    n++;
+	}
+	lck.drop();
+	if (exiting() && !force) {
+	    stopped = true;
+	    break;
 	}
-	if (found) {
-	    dumpItem(*this,*found,"removing oldest");
-	    m_list.remove(found);
-	    m_count--;
+    }
+    lock();
+    m_list.autoResize(4,CACHE_HASH_MAX);
+    unlock();
+    ok = !stopped && w.flush();
+    f.terminate();
+    if (stopped) {
+	File::remove(tmp);
+	return false;
+    }
+    if (!(ok && File::rename(tmp,file))) {
+	Debug(&__plugin,DebugWarn,"Cache(%s) failed to write snapshot file '%s' [%p]",
+	    m_name.c_str(),file.c_str(),this);
+	File::remove(tmp);
+	return false;
+    }
+    Debug(&__plugin,DebugInfo,"Cache(%s) saved %u items to '%s' in " FMT64U " usec [%p]",
+	m_name.c_str(),n,file.c_str(),Time::now() - start,this);
+    lock();
+    m_snapshotTime = now;
+    m_changes -= changes;
+    unlock();
+    return true;
+}
+
+// Check snapshot item data: column index followed by a NUL terminated value
+//  for each field, at most one field for each of the saved columns
+static bool checkItemData(const char* data, u_int32_t dlen, unsigned int cols)
+{
+    if (!dlen)
+	return true;
+    if (data[dlen - 1])
+	return false;
+    const char* end = data + dlen;
+    unsigned int fields = 0;
+    while (data < end) {
+	if ((unsigned char)*data++ >= cols || ++fields > cols)
+	    return false;
+	const char* nul = (const char*)::memchr(data,0,end - data);
+	if (!nul)
+	    return false;
+	data = nul + 1;
+    }
+    return true;
+}
+
+// Check all items of a snapshot before loading any of them
+static bool checkSnapshotItems(const char* d, const char* end, unsigned int cols)
+{
+    while (d < end) {
+	u_int16_t l = 0;
+	u_int32_t dlen = 0;
+	if (d + 2 > end)
+	    return false;
+	::memcpy(&l,d,2);
+	d += 2 + l;
+	if (d + 13 > end)
+	    return false;
+	::memcpy(&dlen,d + 9,4);
+	d += 13;
+	if (dlen > (u_int32_t)(end - d) || !checkItemData(d,dlen,cols))
+	    return false;
+	d += dlen;
+    }
+    return true;
+}
+
+// Load the cache snapshot. Return the number of loaded items
+unsigned int Cache::loadSnapshot()
+{
+    if (!m_snapshotFile)
+	return 0;
+    File f;
+    if (!f.openPath(m_snapshotFile)) {
+	Debug(&__plugin,DebugNote,"Cache(%s) could not open snapshot file '%s' [%p]",
+	    m_name.c_str(),m_snapshotFile.c_str(),this);
+	return 0;
+    }
+    int64_t flen = f.length();
+    if (flen < 16 || flen > 0x7fffffff) {
+	Debug(&__plugin,DebugWarn,"Cache(%s) invalid snapshot file '%s' length " FMT64 " [%p]",
+	    m_name.c_str(),m_snapshotFile.c_str(),flen,this);
+	return 0;
+    }
+    unsigned int len = (unsigned int)flen;
+#ifdef _WINDOWS
+    DataBlock block(0,len);
+    if (f.readData(block.data(),len) != (int)len)
+	return 0;
+    const char* map = (const char*)block.data();
+#else
+    // Map the file, items are built directly from the mapped data
+    void* mapped = ::mmap(0,len,PROT_READ,MAP_PRIVATE,f.handle(),0);
+    if (mapped == MAP_FAILED) {
+	Debug(&__plugin,DebugWarn,"Cache(%s) failed to map snapshot file '%s' [%p]",
+	    m_name.c_str(),m_snapshotFile.c_str(),this);
+	return 0;
+    }
+    const char* map = (const char*)mapped;
+#endif
+    u_int64_t start = Time::now();
+    const char* end = map + len;
+    const char* d = map + 16;
+    u_int32_t version = 0;
+    u_int32_t saved = 0;
+    u_int32_t cols = 0;
+    ::memcpy(&version,map + 4,4);
+    ::memcpy(&saved,map + 8,4);
+    ::memcpy(&cols,map + 12,4);
+    unsigned int loaded = 0;
+    unsigned int skipped = 0;
+    bool ok = !::memcmp(map,"YCSN",4) && version == SNAPSHOT_VERSION && cols <= CACHE_MAX_COLUMNS;
+    // Map snapshot parameter name indexes to cache ones
+    unsigned char remap[CACHE_MAX_COLUMNS];
+    bool same = true;
+    lock();
+    for (unsigned int i = 0; ok && i < cols; i++) {
+	u_int16_t l = 0;
+	if (d + 2 > end) {
+	    ok = false;
+	    break;
+	}
+	::memcpy(&l,d,2);
+	d += 2;
+	if (d + l > end) {
+	    ok = false;
+	    break;
+	}
+	int idx = column(String(d,l),true);
+	d += l;
+	if (idx < 0)
+	    ok = false;
+	else {
+	    remap[i] = idx;
+	    same = same && ((unsigned int)idx == i);
+	}
+    }
+    // Reject the whole file if any item is truncated or corrupt
+    if (ok) {
+	unlock();
+	ok = checkSnapshotItems(d,end,cols);
+	lock();
+    }
+    u_int64_t now = Time::now();
+    while (ok && d < end) {
+	u_int16_t l = 0;
+	u_int64_t expires = 0;
+	u_int32_t dlen = 0;
+	if (d + 2 > end)
+	    break;
+	::memcpy(&l,d,2);
+	const char* id = d + 2;
+	d = id + l;
+	if (d + 13 > end)
+	    break;
+	::memcpy(&expires,d,8);
+	bool negative = (d[8] & 1) != 0;
+	::memcpy(&dlen,d + 9,4);
+	d += 13;
+	if (d + dlen > end)
+	    break;
+	const char* data = d;
+	d += dlen;
+	String sid(id,l);
+	if (!sid || (expires && expires <= now) || find(sid)) {
+	    skipped++;
 	    continue;
 	}
-	Debug(&__plugin,DebugGoOn,
-	    "Cache(%s) can't find the oldest item count=%u limit=%u [%p]",
-	    m_name.c_str(),m_count,m_limit,this);
-	m_count = m_list.count();
-	break;
+	CacheItem* item = new CacheItem(sid,expires);
+	item->m_negative = negative;
+	if (dlen) {
+	    item->m_data = new char[dlen];
+	    item->m_length = dlen;
+	    ::memcpy(item->m_data,data,dlen);
+	    if (!same) {
+		for (char* p = item->m_data; p < item->m_data + dlen; p += ::strlen(p) + 1) {
+		    unsigned int idx = (unsigned char)*p;
+		    if (idx < cols)
+			*p = (char)remap[idx];
+		    p++;
+		}
+	    }
+	}
+	insertUnsafe(item);
+	loaded++;
+	// Let others use the cache from time to time
+	if (0 == (loaded % 1000)) {
+	    unlock();
+	    lock();
+	}
+    }
+    if (loaded) {
+	m_snapshotTime = saved;
+	m_loadDelta = true;
+	// Snapshot content is already saved
+	m_changes = 0;
+    }
+    if (m_limit || m_maxMemory)
+	adjustToLimit(0);
+    unlock();
+#ifndef _WINDOWS
+    ::munmap(mapped,len);
+#endif
+    if (d < end || !ok)
+	Debug(&__plugin,DebugWarn,"Cache(%s) snapshot file '%s' is truncated or invalid [%p]",
+	    m_name.c_str(),m_snapshotFile.c_str(),this);
+    Debug(&__plugin,DebugInfo,"Cache(%s) loaded %u items (skipped %u) from '%s' in " FMT64U " usec [%p]",
+	m_name.c_str(),loaded,skipped,m_snapshotFile.c_str(),Time::now() - start,this);
+    return loaded;
+}
+
+
+/*
+ * SnapshotWriter
+ */
+void SnapshotWriter::write(const void* data, unsigned int len)
+{
+    if (!(m_ok && len))
+	return;
+    if (m_len + len > sizeof(m_buf) && !flush())
+	return;
+    if (len > sizeof(m_buf)) {
+	m_ok = (m_file.writeData(data,len) == (int)len);
+	return;
     }
+    ::memcpy(m_buf + m_len,data,len);
+    m_len += len;
+}
+
+bool SnapshotWriter::flush()
+{
+    if (m_ok && m_len)
+	m_ok = (m_file.writeData(m_buf,m_len) == (int)m_len);
+    m_len = 0;
+    return m_ok;
+}
+
+
+/*
+ * CacheItem
+ */
+// Find the value of a column, return NULL if not set
+const char* CacheItem::value(unsigned int column) const
+{
+    const char* d = m_data;
+    const char* end = d + m_length;
+    while (d < end) {
+	bool match = ((unsigned char)*d++ == column);
+	if (match)
+	    return d;
+	d += ::strlen(d) + 1;
+    }
+    return 0;
 }
 
 
@@ -1076,12 +1821,22 @@ void CacheExpireThread::run()
 	for (int i = 0; s_caches[i]; i++) {
 	    RefPointer<Cache> cache;
 	    __plugin.getCache(cache,s_caches[i]);
-	    if (cache)
+	    if (cache) {
 		cache->expire(time);
+		cache->saveSnapshot(false);
+	    }
 	    cache = 0;
 	}
 	nextCheck = time + s_checkToutInterval;
     }
+    // Final snapshot of changed caches
+    for (int i = 0; s_caches[i]; i++) {
+	RefPointer<Cache> cache;
+	__plugin.getCache(cache,s_caches[i]);
+	if (cache)
+	    cache->saveSnapshot(true);
+	cache = 0;
+    }
     Debug(&__plugin,DebugAll,"%s stopped [%p]",currentName(),this);
 }
 
@@ -1101,6 +1856,33 @@ void CacheLoadThread::run()
 }
 
 
+/*
+ * CacheSnapshotThread
+ */
+void CacheSnapshotThread::run()
+{
+    Debug(&__plugin,DebugAll,"%s start running cache=%s [%p]",
+	currentName(),m_cache.c_str(),this);
+    RefPointer<Cache> cache;
+    __plugin.getCache(cache,m_cache);
+    if (!cache)
+	return;
+    // Keep database loads away until the snapshot is loaded
+    bool load = cache->startLoad();
+    if (load)
+	cache->loadSnapshot();
+    cache->snapshotLoaded();
+    if (load)
+	cache->endLoad(false);
+    cache = 0;
+    // Database load requested by engine start was refused while loading
+    if (load && s_engineStarted && !exiting())
+	__plugin.loadCache(m_cache,false);
+    Debug(&__plugin,DebugAll,"%s stopped cache=%s [%p]",
+	currentName(),m_cache.c_str(),this);
+}
+
+
 /*
  * EngineHandler
  */
@@ -1162,7 +1944,10 @@ void CacheModule::setupCache(const String& name, const NamedList& params)
 	    installRelay(CnamBefore,"call.preroute",params.getIntValue("routebefore",25));
 	    installRelay(CnamAfter,"call.preroute",params.getIntValue("routeafter",75));
 	}
-	if (s_engineStarted)
+	// Serve requests from the snapshot until loaded from database
+	if ((*c)->hasSnapshot())
+	    (new CacheSnapshotThread(name))->startup();
+	else if (s_engineStarted)
 	    loadCache(name);
 	lck.drop();
 	updateCacheReload();
@@ -1290,6 +2075,7 @@ void CacheModule::loadCache(const String& name, bool async, ObjList* items)
 	offset += loadedRows;
 	loaded += loadedRows;
 	unsigned int added = cache->addRows(*a);
+	cache->loadProgress(loadedRows);
 	cache = 0;
 	if (added < loadedRows)
 	    failed += loadedRows - added;
@@ -1322,6 +2108,7 @@ void CacheModule::initialize()
     // Globals
     s_size = adjustedCacheSize(cfg.getIntValue("general","size",17));
     s_limit = adjustedCacheLimit(cfg.getIntValue("general","limit",s_limit),s_size);
+    s_maxMemory = safeValue(cfg.getIntValue("general","max_memory"));
     s_loadChunk = adjustedCacheLoadChunk(cfg.getIntValue("general","loadchunk"));
     s_maxChunks = safeValue(cfg.getIntValue("general","maxchunks",1000));
     if (!s_maxChunks)
@@ -1330,6 +2117,7 @@ void CacheModule::initialize()
 	s_maxChunks = 10000;
     s_loadPrio = Thread::priority(cfg.getValue("general","loadcache_priority"));
     s_cacheTtlSec = adjustedCacheTtl(cfg.getIntValue("general","ttl"));
+    s_snapshotInterval = cfg.getIntValue("general","snapshot_interval",300);
     unsigned int tmp = safeValue(cfg.getIntValue("general","expire_check_interval",10));
     if (tmp > s_cacheTtlSec)
 	tmp = s_cacheTtlSec;
@@ -1388,10 +2176,10 @@ void CacheModule::initialize()
 	}
     }
     if (!s_init && s_createExpire) {
-	// Create expire thread if we have a cache with non 0 TTL
+	// Create expire thread if we have a cache with non 0 TTL or snapshot
 	lock();
-	bool ok = (m_lnpCache && m_lnpCache->cacheTtl()) ||
-	    (m_cnamCache && m_cnamCache->cacheTtl());
+	bool ok = (m_lnpCache && (m_lnpCache->cacheTtl() || m_lnpCache->hasSnapshot())) ||
+	    (m_cnamCache && (m_cnamCache->cacheTtl() || m_cnamCache->hasSnapshot()));
 	unlock();
 	if (ok) {
 	    DDebug(this,DebugAll,"Creating expire thread");
@@ -1429,7 +2217,7 @@ bool CacheModule::received(Message& msg, int id)
 
 void CacheModule::statusModule(String& buf)
 {
-    static const String s_params = "format=Count";
+    static const String s_params = "format=Count|Hits|Misses|Coalesced|NegativeHits|MemoryKB|Evicted|SnapshotAge|LoadedRows|Loading";
     Module::statusModule(buf);
     buf.append(s_params,",");
 }
@@ -1559,7 +2347,10 @@ void CacheModule::addCacheDetail(String& buf, Cache* cache)
     if (!cache)
 	return;
     Lock lock(cache);
-    buf.append(cache->toString() + "=" + String(cache->count()),";");
+    String tmp;
+    tmp << cache->toString() << "=" << cache->count();
+    cache->statusCounters(tmp);
+    buf.append(tmp,";");
 }
 
 // Handle messages for LNP
@@ -25,6 +25,7 @@
 #include <yatephone.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <mysql.h>
 
 #ifndef CLIENT_MULTI_STATEMENTS
@@ -41,7 +42,13 @@
 #endif
 
 #define MIN_CONNECTIONS		1
-#define MAX_CONNECTIONS 	10
+#define MAX_CONNECTIONS 	32
+
+// Server errors after which prepared statements must be prepared again
+#define ERR_UNKNOWN_STMT	1243
+#define ERR_NEED_REPREPARE	1615
+#define ERR_SERVER_GONE		2006
+#define ERR_SERVER_LOST		2013
 
 using namespace TelEngine;
 namespace { // anonymous
@@ -50,13 +57,31 @@ class DbThread;
 class DbQuery;
 class DbQueryList;
 class MySqlConn;
+class MyStmt;
 class MyAcct;
 class InitThread;
 
+// Upper limits (in milliseconds) of the query latency histogram buckets
+static const unsigned int s_buckets[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 };
+#define HIST_BUCKETS (sizeof(s_buckets) / sizeof(s_buckets[0]) + 1)
+
 static ObjList s_conns;
 static unsigned int s_failedConns;
 Mutex s_acctMutex(false,"MySQL::accts");
 
+/**
+  * Class MyStmt
+  * A prepared statement cached on a connection
+  */
+class MyStmt : public String
+{
+public:
+    MyStmt(const String& tmpl, MYSQL_STMT* stmt);
+    ~MyStmt();
+    MYSQL_STMT* m_stmt;
+    ObjList m_names;
+};
+
 /**
   * Class MyConn
   * A MySQL connection
@@ -71,20 +96,26 @@ public:
     inline MyConn(const String& name, MyAcct* conn)
 	: String(name),
 	  m_conn(0), m_owner(conn),
-	  m_thread(0), m_init(false)
+	  m_thread(0), m_init(false), m_connId(0)
 	{}
     ~MyConn();
 
     void closeConn();
     void runQueries();
     int queryDbInternal(DbQuery* query);
+    int queryStmtInternal(DbQuery* query);
 
 private:
     MYSQL* m_conn;
     MyAcct* m_owner;
     DbThread* m_thread;
     bool testDb();
+    MyStmt* getStmt(const String& tmpl);
+    int execStmt(MyStmt* stmt, DbQuery* query);
+    void clearStmts();
     bool m_init;
+    unsigned long m_connId;
+    ObjList m_stmts;
 };
 
 /**
@@ -105,6 +136,8 @@ public:
 	{ return 0 != m_connections.skipNull(); }
 
     void appendQuery(DbQuery* query);
+    void dequeued(DbQuery* query);
+    void finished(DbQuery* query);
 
     void incTotal();
     void incFailed();
@@ -127,9 +160,16 @@ public:
     inline u_int64_t retryWhen()
 	{ return m_retryWhen; }
     inline bool shouldRetryInit()
-	{ return m_retryTime && m_connections.count() < (unsigned int)m_poolSize; }
+	{ return (m_retryTime || !m_retryWhen) && m_connections.count() < (unsigned int)m_poolSize; }
     inline int poolSize()
 	{ return m_poolSize; }
+    inline unsigned int stmtCache() const
+	{ return m_stmtCache; }
+    inline unsigned int conns()
+	{ return m_connections.count(); }
+    unsigned int queued();
+    unsigned int queueTime();
+    void histogram(String& str);
 private:
     unsigned int m_timeout;
     // interval at which connection initialization should be tried
@@ -147,6 +187,9 @@ private:
     String m_encoding;
 
     int m_poolSize;
+    int m_maxPoolSize;
+    unsigned int m_growWait;
+    unsigned int m_stmtCache;
     ObjList m_connections;
     ObjList m_queryQueue;
 
@@ -159,6 +202,9 @@ private:
     unsigned int m_errorQueries;
     u_int64_t m_queryTime;
     unsigned int m_failedConns;
+    u_int64_t m_waitTime;
+    unsigned int m_waitCount;
+    unsigned int m_histogram[HIST_BUCKETS];
     Mutex m_incMutex;
 };
 
@@ -239,17 +285,24 @@ private:
 class DbQuery : public String, public Semaphore
 {
     friend class MyConn;
+    friend class MyAcct;
 public:
     inline DbQuery(const String& query, Message* msg)
 	: String(query),
 	  Semaphore(1,"MySQL::query"),
-	  m_msg(msg), m_finished(false)
+	  m_msg(msg), m_finished(false), m_binds(0), m_queued(Time::now())
 	{ DDebug( DebugAll, "DbQuery object [%p] created for query '%s'", this, c_str()); }
 
+    DbQuery(const String& tmpl, Message* msg, const NamedList& params);
+
     inline ~DbQuery()
 	{ m_msg = 0;
+	  delete m_binds;
 	  DDebug( DebugAll, "DbQuery object [%p] with query '%s' was destroyed", this, c_str()); }
 
+    inline bool prepared() const
+	{ return 0 != m_binds; }
+
     inline bool finished()
 	{ return m_finished; }
 
@@ -262,12 +315,84 @@ public:
 private:
     Message* m_msg;
     bool m_finished;
+    NamedList* m_binds;
+    u_int64_t m_queued;
 };
 
 static MyModule module;
 static Mutex s_libMutex(false,"MySQL::lib");
 static int s_libCounter = 0;
 
+// Split a statement template in the list of ${name} parameters and the text
+//  with ? placeholders, or with quoted values if values are provided
+static void parseTemplate(const String& tmpl, String* stmt, ObjList* names,
+    const NamedList* values = 0)
+{
+    int pos = 0;
+    while (true) {
+	int start = tmpl.find("${",pos);
+	int end = (start >= 0) ? tmpl.find('}',start + 2) : -1;
+	if (end < 0) {
+	    if (stmt)
+		*stmt << tmpl.substr(pos);
+	    break;
+	}
+	String name = tmpl.substr(start + 2,end - start - 2);
+	name.trimBlanks();
+	if (stmt) {
+	    *stmt << tmpl.substr(pos,start - pos);
+	    if (!values)
+		*stmt << "?";
+	    else {
+		const NamedString* v = values->getParam(name);
+		if (v)
+		    *stmt << "'" << v->sqlEscape() << "'";
+		else
+		    *stmt << "NULL";
+	    }
+	}
+	if (names)
+	    names->append(new String(name));
+	pos = end + 1;
+    }
+}
+
+/**
+  * DbQuery
+  */
+DbQuery::DbQuery(const String& tmpl, Message* msg, const NamedList& params)
+    : String(tmpl),
+      Semaphore(1,"MySQL::query"),
+      m_msg(msg), m_finished(false), m_binds(new NamedList("")), m_queued(Time::now())
+{
+    // keep a copy of the values as the message may be gone when executing
+    ObjList names;
+    parseTemplate(tmpl,0,&names);
+    for (ObjList* l = names.skipNull(); l; l = l->skipNext()) {
+	const String& name = *static_cast<String*>(l->get());
+	if (m_binds->getParam(name))
+	    continue;
+	const NamedString* v = params.getParam(name);
+	if (v)
+	    m_binds->addParam(name,*v);
+    }
+    DDebug(DebugAll,"DbQuery object [%p] created for statement '%s'",this,c_str());
+}
+
+/**
+  * MyStmt
+  */
+MyStmt::MyStmt(const String& tmpl, MYSQL_STMT* stmt)
+    : String(tmpl), m_stmt(stmt)
+{
+}
+
+MyStmt::~MyStmt()
+{
+    if (m_stmt)
+	mysql_stmt_close(m_stmt);
+}
+
 /**
   * MyConn
   */
@@ -283,6 +408,7 @@ void MyConn::closeConn()
     DDebug(&module,DebugInfo,"Database connection '%s' trying to close %p",c_str(),m_conn);
     if (!m_conn)
 	return;
+    clearStmts();
     MYSQL* tmp = m_conn;
     m_conn = 0;
     mysql_close(tmp);
@@ -303,6 +429,7 @@ void MyConn::runQueries()
 	    continue;
 	m_owner->incTotal();
 	mylock.drop();
+	m_owner->dequeued(query);
 
 	DDebug(&module,DebugAll,"Connection '%s' will try to execute '%s'",
 	    c_str(),query->c_str());
@@ -310,6 +437,7 @@ void MyConn::runQueries()
 	int res = queryDbInternal(query);
 	if ((res < 0) && query->m_msg)
 	    query->m_msg->setParam("error","failure");
+	m_owner->finished(query);
 
 	query->unlock();
 	query->setFinished();
@@ -319,7 +447,257 @@ void MyConn::runQueries()
 
 bool MyConn::testDb()
 {
-     return m_conn && !mysql_ping(m_conn);
+    if (!(m_conn && !mysql_ping(m_conn)))
+	return false;
+    // an automatic reconnect drops all prepared statements
+    unsigned long id = mysql_thread_id(m_conn);
+    if (id != m_connId) {
+	if (m_connId)
+	    clearStmts();
+	m_connId = id;
+    }
+    return true;
+}
+
+void MyConn::clearStmts()
+{
+    DDebug(&module,DebugInfo,"Dropping %u prepared statements of '%s'",m_stmts.count(),c_str());
+    m_stmts.clear();
+}
+
+// find a prepared statement or prepare it
+//  return 0 if the connection failed, a statement with no handle if it cannot be prepared
+MyStmt* MyConn::getStmt(const String& tmpl)
+{
+    ObjList* o = m_stmts.find(tmpl);
+    if (o) {
+	MyStmt* st = static_cast<MyStmt*>(o->get());
+	// keep the most recently used statements first
+	if (o != m_stmts.skipNull()) {
+	    o->remove(false);
+	    m_stmts.insert(st);
+	}
+	return st;
+    }
+    MyStmt* st = new MyStmt(tmpl,0);
+    String text;
+    parseTemplate(tmpl,&text,&st->m_names);
+    MYSQL_STMT* stmt = mysql_stmt_init(m_conn);
+    if (!stmt) {
+	Debug(&module,DebugWarn,"Could not allocate statement for '%s'",c_str());
+	TelEngine::destruct(st);
+	return 0;
+    }
+    if (mysql_stmt_prepare(stmt,text.safe(),text.length())) {
+	unsigned int err = mysql_stmt_errno(stmt);
+	Debug(&module,DebugMild,"Could not prepare '%s' for '%s': %s",
+	    text.c_str(),c_str(),mysql_stmt_error(stmt));
+	mysql_stmt_close(stmt);
+	if ((ERR_SERVER_GONE == err) || (ERR_SERVER_LOST == err)) {
+	    TelEngine::destruct(st);
+	    return 0;
+	}
+	// remember it so it will be sent as text from now on
+	stmt = 0;
+    }
+    else if (mysql_stmt_param_count(stmt) != st->m_names.count()) {
+	Debug(&module,DebugMild,"Statement '%s' for '%s' has %u parameters, expected %u",
+	    text.c_str(),c_str(),(unsigned int)mysql_stmt_param_count(stmt),st->m_names.count());
+	mysql_stmt_close(stmt);
+	stmt = 0;
+    }
+    else {
+	my_bool update = 1;
+	mysql_stmt_attr_set(stmt,STMT_ATTR_UPDATE_MAX_LENGTH,(const void*)&update);
+	DDebug(&module,DebugAll,"Prepared '%s' for '%s'",text.c_str(),c_str());
+    }
+    st->m_stmt = stmt;
+    m_stmts.insert(st);
+    // drop the least recently used statements
+    while (m_stmts.count() > m_owner->stmtCache()) {
+	ObjList* last = 0;
+	for (ObjList* l = m_stmts.skipNull(); l; l = l->skipNext())
+	    last = l;
+	if (!last || (last->get() == st))
+	    break;
+	last->remove();
+    }
+    return st;
+}
+
+// execute a prepared statement, fill the message with data
+//  return number of rows, -1 for error, -2 if the statement can't be prepared
+int MyConn::queryStmtInternal(DbQuery* query)
+{
+    for (int retry = 0; ; retry++) {
+	MyStmt* st = getStmt(*query);
+	if (!st) {
+	    m_owner->lostConn();
+	    m_owner->incFailed();
+	    return -1;
+	}
+	if (!st->m_stmt)
+	    return -2;
+	u_int64_t start = Time::now();
+	int res = execStmt(st,query);
+	m_owner->incQueryTime(Time::now() - start);
+	if (res >= 0)
+	    return res;
+	unsigned int err = mysql_stmt_errno(st->m_stmt);
+	Debug(&module,DebugWarn,"Statement for '%s' failed: %s",c_str(),mysql_stmt_error(st->m_stmt));
+	bool reprepare = (ERR_UNKNOWN_STMT == err) || (ERR_NEED_REPREPARE == err) ||
+	    (ERR_SERVER_GONE == err) || (ERR_SERVER_LOST == err);
+	if (retry || !reprepare) {
+	    m_owner->incErrorred();
+	    return -1;
+	}
+	// the server lost the statement, prepare it again
+	clearStmts();
+	if (!testDb()) {
+	    m_owner->lostConn();
+	    m_owner->incFailed();
+	    return -1;
+	}
+    }
+}
+
+// bind the parameters and execute a prepared statement
+int MyConn::execStmt(MyStmt* st, DbQuery* query)
+{
+    MYSQL_STMT* stmt = st->m_stmt;
+    unsigned int n = st->m_names.count();
+    bool ok = true;
+    if (n) {
+	MYSQL_BIND* binds = new MYSQL_BIND[n];
+	unsigned long* lens = new unsigned long[n];
+	::memset(binds,0,n * sizeof(MYSQL_BIND));
+	unsigned int i = 0;
+	for (ObjList* l = st->m_names.skipNull(); l && (i < n); l = l->skipNext(), i++) {
+	    const NamedString* v = query->m_binds->getParam(*static_cast<String*>(l->get()));
+	    if (!v) {
+		binds[i].buffer_type = MYSQL_TYPE_NULL;
+		continue;
+	    }
+	    lens[i] = v->length();
+	    binds[i].buffer_type = MYSQL_TYPE_STRING;
+	    binds[i].buffer = (void*)v->safe();
+	    binds[i].buffer_length = lens[i];
+	    binds[i].length = &lens[i];
+	}
+	ok = !mysql_stmt_bind_param(stmt,binds) && !mysql_stmt_execute(stmt);
+	delete[] binds;
+	delete[] lens;
+    }
+    else
+	ok = !mysql_stmt_execute(stmt);
+    if (!ok)
+	return -1;
+
+    int total = 0;
+    unsigned int warns = mysql_warning_count(m_conn);
+    MYSQL_RES* meta = mysql_stmt_result_metadata(stmt);
+    if (meta) {
+	if (mysql_stmt_store_result(stmt)) {
+	    mysql_free_result(meta);
+	    return -1;
+	}
+	unsigned int cols = mysql_num_fields(meta);
+	unsigned int rows = (unsigned int)mysql_stmt_num_rows(stmt);
+	Debug(&module,DebugAll,"Got statement result rows=%u cols=%u",rows,cols);
+	total = rows;
+	if (query->m_msg) {
+	    MYSQL_FIELD* fields = mysql_fetch_fields(meta);
+	    query->m_msg->setParam("columns",String(cols));
+	    query->m_msg->setParam("rows",String(rows));
+	    Array *a = new Array(cols,rows+1);
+	    unsigned int c;
+	    ObjList** columns = new ObjList*[cols];
+	    MYSQL_BIND* res = new MYSQL_BIND[cols];
+	    unsigned long* len = new unsigned long[cols];
+	    my_bool* nulls = new my_bool[cols];
+	    char** bufs = new char*[cols];
+	    ::memset(res,0,cols * sizeof(MYSQL_BIND));
+	    // get top of columns, add field names and result buffers
+	    for (c = 0; c < cols; c++) {
+		columns[c] = a->getColumn(c);
+		if (columns[c])
+		    columns[c]->set(new String(fields[c].name));
+		else
+		    Debug(&module,DebugGoOn,"No array for column %u",c);
+		unsigned long size = fields[c].max_length + 1;
+		if (size < 64)
+		    size = 64;
+		bufs[c] = new char[size];
+		res[c].buffer_type = MYSQL_TYPE_STRING;
+		res[c].buffer = bufs[c];
+		res[c].buffer_length = size;
+		res[c].length = &len[c];
+		res[c].is_null = &nulls[c];
+	    }
+	    // and now data row by row
+	    if (!mysql_stmt_bind_result(stmt,res)) {
+		for (unsigned int r = 1; r <= rows; r++) {
+		    int f = mysql_stmt_fetch(stmt);
+		    if ((1 == f) || (MYSQL_NO_DATA == f))
+			break;
+		    for (c = 0; c < cols; c++) {
+			// advance pointer in each column
+			if (columns[c])
+			    columns[c] = columns[c]->next();
+			if (!columns[c] || nulls[c])
+			    continue;
+			char* data = bufs[c];
+			if (len[c] >= res[c].buffer_length) {
+			    // value was truncated, fetch it again in a larger buffer
+			    data = new char[len[c] + 1];
+			    MYSQL_BIND b;
+			    ::memset(&b,0,sizeof(b));
+			    b.buffer_type = MYSQL_TYPE_STRING;
+			    b.buffer = data;
+			    b.buffer_length = len[c] + 1;
+			    mysql_stmt_fetch_column(stmt,&b,c,0);
+			}
+			bool binary = false;
+			switch (fields[c].type) {
+			    case MYSQL_TYPE_STRING:
+			    case MYSQL_TYPE_VAR_STRING:
+			    case MYSQL_TYPE_BLOB:
+				// field may hold binary data
+				binary = (63 == fields[c].charsetnr);
+			    default:
+				break;
+			}
+			if (binary)
+			    columns[c]->set(new DataBlock(data,len[c]));
+			else
+			    columns[c]->set(new String(data,len[c]));
+			if (data != bufs[c])
+			    delete[] data;
+		    }
+		}
+	    }
+	    else
+		Debug(&module,DebugWarn,"Could not bind result for '%s': %s",
+		    c_str(),mysql_stmt_error(stmt));
+	    for (c = 0; c < cols; c++)
+		delete[] bufs[c];
+	    delete[] bufs;
+	    delete[] nulls;
+	    delete[] len;
+	    delete[] res;
+	    delete[] columns;
+	    query->m_msg->userData(a);
+	    a->deref();
+	}
+	mysql_stmt_free_result(stmt);
+	mysql_free_result(meta);
+    }
+    if (query->m_msg) {
+	query->m_msg->setParam("affected",String((unsigned int)mysql_stmt_affected_rows(stmt)));
+	if (warns)
+	    query->m_msg->setParam("warnings",String(warns));
+    }
+    return total;
 }
 
 // perform the query, fill the message with data
@@ -332,9 +710,21 @@ int MyConn::queryDbInternal(DbQuery* query)
 	return -1;
     }
     m_owner->resetConn();
+
+    String text;
+    if (query->prepared()) {
+	if (m_owner->stmtCache()) {
+	    int res = queryStmtInternal(query);
+	    if (res != -2)
+		return res;
+	}
+	// statements that can't be prepared are sent as text
+	parseTemplate(*query,&text,0,query->m_binds);
+    }
+    const String& sql = query->prepared() ? text : *query;
     u_int64_t start = Time::now();
 
-    if (mysql_real_query(m_conn,query->safe(),query->length())) {
+    if (mysql_real_query(m_conn,sql.safe(),sql.length())) {
 	Debug(&module,DebugWarn,"Query for '%s' failed: %s",c_str(),mysql_error(m_conn));
 	u_int64_t duration = Time::now() - start;
 	m_owner->incQueryTime(duration);
@@ -437,6 +827,7 @@ MyAcct::MyAcct(const NamedList* sect)
       m_queueMutex(false,"MySQL::queue"),
       m_totalQueries(0), m_failedQueries(0), m_errorQueries(0),
       m_queryTime(0), m_failedConns(0),
+      m_waitTime(0), m_waitCount(0),
       m_incMutex(false,"MySQL::inc")
 {
     int tout = sect->getIntValue("timeout",10000);
@@ -459,8 +850,19 @@ MyAcct::MyAcct(const NamedList* sect)
 	m_poolSize = MIN_CONNECTIONS;
     else if (m_poolSize > MAX_CONNECTIONS)
 	m_poolSize = MAX_CONNECTIONS;
-    Debug(&module, DebugNote, "For account '%s' connection pool size is %d",
-	c_str(),m_poolSize);
+    m_maxPoolSize = sect->getIntValue("maxpoolsize",m_poolSize);
+    if (m_maxPoolSize < m_poolSize)
+	m_maxPoolSize = m_poolSize;
+    else if (m_maxPoolSize > MAX_CONNECTIONS)
+	m_maxPoolSize = MAX_CONNECTIONS;
+    int tmp = sect->getIntValue("growwait",100);
+    m_growWait = (tmp > 0) ? tmp : 0;
+    tmp = sect->getIntValue("stmtcache",32);
+    m_stmtCache = (tmp > 0) ? ((tmp > 1000) ? 1000 : tmp) : 0;
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+	m_histogram[i] = 0;
+    Debug(&module, DebugNote, "For account '%s' connection pool size is %d, maximum %d",
+	c_str(),m_poolSize,m_maxPoolSize);
     
     m_retryTime = sect->getIntValue("initretry",10); // default value is 10 seconds
     setRetryWhen(); // set retry interval
@@ -583,7 +985,18 @@ void MyAcct::dropDb()
 	if (c)
 	    c->closeConn();
     }
-    m_queryQueue.clear();
+    // fail the queries a handler is waiting for, the others have no owner
+    m_queueMutex.lock();
+    while (DbQuery* q = static_cast<DbQuery*>(m_queryQueue.remove(false))) {
+	if (!q->m_msg) {
+	    TelEngine::destruct(q);
+	    continue;
+	}
+	q->m_msg->setParam("error","failure");
+	q->unlock();
+	q->setFinished();
+    }
+    m_queueMutex.unlock();
     Debug(&module,DebugNote,"Database account '%s' closed",c_str());
 
     s_libMutex.lock();
@@ -648,6 +1061,64 @@ void MyAcct::resetConn()
     m_incMutex.unlock();
 }
 
+// account the time a query waited in queue, add a connection if it's too long
+void MyAcct::dequeued(DbQuery* query)
+{
+    u_int64_t wait = Time::now() - query->m_queued;
+    bool grow = false;
+    m_incMutex.lock();
+    m_waitTime += wait;
+    m_waitCount++;
+    if (m_growWait && (wait > (u_int64_t)m_growWait * 1000) && (m_poolSize < m_maxPoolSize)
+	&& (m_connections.count() >= (unsigned int)m_poolSize)) {
+	m_poolSize++;
+	grow = true;
+    }
+    m_incMutex.unlock();
+    if (!grow)
+	return;
+    Debug(&module,DebugInfo,"Query waited %u ms for '%s', growing pool to %d connections",
+	(unsigned int)(wait / 1000),c_str(),m_poolSize);
+    m_retryWhen = 0;
+    module.startInitThread();
+}
+
+// account the total time spent by a query in the latency histogram
+void MyAcct::finished(DbQuery* query)
+{
+    unsigned int ms = (unsigned int)((Time::now() - query->m_queued) / 1000);
+    unsigned int i = 0;
+    for (; i < HIST_BUCKETS - 1; i++)
+	if (ms < s_buckets[i])
+	    break;
+    m_incMutex.lock();
+    m_histogram[i]++;
+    m_incMutex.unlock();
+}
+
+unsigned int MyAcct::queued()
+{
+    Lock mylock(m_queueMutex);
+    return m_queryQueue.count();
+}
+
+// average time in milliseconds spent by queries waiting in queue
+unsigned int MyAcct::queueTime()
+{
+    Lock mylock(m_incMutex);
+    return m_waitCount ? (unsigned int)(m_waitTime / m_waitCount / 1000) : 0;
+}
+
+void MyAcct::histogram(String& str)
+{
+    Lock mylock(m_incMutex);
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+	if (i)
+	    str << "/";
+	str << m_histogram[i];
+    }
+}
+
 void MyAcct::appendQuery(DbQuery* query)
 {
     DDebug(&module, DebugAll, "Account '%s' received a new query %p",c_str(),query);
@@ -698,23 +1169,23 @@ bool MyHandler::received(Message& msg)
     MyAcct* db = findDb(*str);
     if (!(db && db->ok()))
 	return false;
-    Lock lo(db);
-    lock.drop();
 
+    // a statement template is prepared and its parameters bound from message
+    const String* stmt = msg.getParam("statement");
     str = msg.getParam("query");
-    if (!TelEngine::null(str)) {
-	if (msg.getBoolValue("results",true)) {
-	    DbQuery* q = new DbQuery(*str,&msg);
-	    db->appendQuery(q);
-
+    if (!(TelEngine::null(stmt) && TelEngine::null(str))) {
+	Message* dest = msg.getBoolValue("results",true) ? &msg : 0;
+	DbQuery* q = TelEngine::null(stmt) ? new DbQuery(*str,dest) : new DbQuery(*stmt,dest,msg);
+	db->appendQuery(q);
+	// don't keep the account locked, other connections may serve queries
+	lock.drop();
+	if (dest) {
 	    while (!q->finished()) {
 		Thread::check();
 		q->lock(Thread::idleUsec());
 	    }
 	    TelEngine::destruct(q);
 	}
-	else
-	    db->appendQuery(new DbQuery(*str,0));
     }
     msg.setParam("dbtype","mysqldb");
     return true;
@@ -794,13 +1265,17 @@ MyModule::~MyModule()
 void MyModule::statusModule(String& str)
 {
     Module::statusModule(str);
-    str.append("format=Total|Failed|Errors|AvgExecTime",",");
+    str.append("format=Total|Failed|Errors|AvgExecTime|Conns|Queued|AvgQueueTime|Latency",",");
 }
 
 void MyModule::statusParams(String& str)
 {
     str.append("conns=",",") << s_conns.count();
     str.append("failed=",",") << s_failedConns;
+    str.append("latency=",",");
+    for (unsigned int i = 0; i < HIST_BUCKETS - 1; i++)
+	str << s_buckets[i] << "/";
+    str << "+ms";
 }
 
 void MyModule::statusDetail(String& str)
@@ -812,6 +1287,8 @@ void MyModule::statusDetail(String& str)
 	    str << (acc->queryTime() / (acc->total() - acc->failed()) / 1000); //miliseconds
         else
 	    str << "0";
+	str << "|" << acc->conns() << "|" << acc->queued() << "|" << acc->queueTime() << "|";
+	acc->histogram(str);
     }
 }
 
@@ -868,6 +1345,8 @@ void MyModule::genUpdate(Message& msg)
 	msg.setParam(String("errorred.") << index,String(acc->errorred()));
 	msg.setParam(String("hasconn.") << index,String::boolText(acc->hasConn()));
 	msg.setParam(String("querytime.") << index,String(acc->queryTime()));
+	msg.setParam(String("conns.") << index,String(acc->conns()));
+	msg.setParam(String("queued.") << index,String(acc->queued()));
 	index++;
     }
     msg.setParam("count",String(index));
@@ -30,23 +30,75 @@
 using namespace TelEngine;
 namespace { // anonymous
 
+// Upper limits (in milliseconds) of the query latency histogram buckets
+static const unsigned int s_buckets[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000 };
+#define HIST_BUCKETS (sizeof(s_buckets) / sizeof(s_buckets[0]) + 1)
+
+// Maximum number of connections of an account
+#define MAX_CONNS 64
+
+// Maximum number of queries sent in a pipeline
+#define MAX_PIPELINE 100
+
 static ObjList s_conns;
 Mutex s_conmutex(false,"PgSQL::conn");
 static unsigned int s_failedConns;
 
-class PgConn : public RefObject, public Mutex
+class PgQuery;                           // A query waiting to be executed
+class PgAccount;                         // A database account and its connection pool
+class PgConn;                            // A database connection serving an account
+
+class PgQuery : public RefObject
 {
 public:
-    PgConn(const NamedList* sect);
-    ~PgConn();
+    PgQuery(const String& query, bool results, const char* notify);
+    ~PgQuery();
+    inline const String& query() const
+	{ return m_query; }
+    inline bool results() const
+	{ return m_results; }
+    inline NamedList& params()
+	{ return m_params; }
+    inline u_int64_t queued() const
+	{ return m_queued; }
+    inline bool finished() const
+	{ return m_finished; }
+    void setData(Array* a);
+    void finish();
+    bool wait(long maxwait);
+    void fill(Message& msg);
+    void notify(const String& account);
+
+private:
+    String m_query;
+    bool m_results;
+    String m_notify;
+    NamedList m_params;
+    Array* m_data;
+    u_int64_t m_queued;
+    bool m_finished;
+    Semaphore m_done;
+};
+
+class PgAccount : public RefObject, public Mutex
+{
+    friend class PgConn;
+public:
+    PgAccount(const NamedList* sect);
+    ~PgAccount();
     virtual const String& toString() const
 	{ return m_name; }
     virtual void destroyed();
 
     bool ok();
-    int queryDb(const char* query, Message* dest = 0);
-    bool initDb(int retry = 0);
+    bool initDb();
+    bool queueQuery(PgQuery* query);
+    bool cancelQuery(PgQuery* query);
 
+    inline bool async() const
+	{ return m_async; }
+    inline u_int64_t timeout() const
+	{ return m_timeout; }
     inline unsigned int total()
 	{ return m_totalQueries; }
     inline unsigned int failed()
@@ -55,28 +107,71 @@ public:
 	{ return m_errorQueries; }
     inline unsigned int queryTime()
         { return (unsigned int) m_queryTime; }
-    inline void setConn(bool conn = true)
-	{ m_hasConn = conn; }
+    inline unsigned int conns()
+	{ return m_conns; }
+    inline unsigned int queued()
+	{ return m_queue.count(); }
     inline bool hasConn()
-	{ return m_hasConn; }
+	{ return m_connected > 0; }
+    void histogram(String& str);
 
 private:
-    void dropDb();
-    bool testDb();
-    bool startDb();
-    int queryDbInternal(const char* query, Message* dest);
+    bool startConn();
+    unsigned int getQueries(ObjList& dest, unsigned int count);
+    bool dropIdle();
+    void finished(PgQuery* query, bool failed);
     String m_name,m_connection;
     String m_encoding;
     int m_retry;
     u_int64_t m_timeout;
-    PGconn *m_conn;
+    unsigned int m_minConns;
+    unsigned int m_maxConns;
+    unsigned int m_pipeline;
+    unsigned int m_idleTime;
+    bool m_async;
+
+    // query queue and connections
+    ObjList m_queue;
+    Semaphore m_wake;
+    unsigned int m_conns;
+    unsigned int m_idle;
+    unsigned int m_starting;
+    unsigned int m_connected;
 
     // stat counters
     unsigned int m_totalQueries;
     unsigned int m_failedQueries;
     unsigned int m_errorQueries;
     u_int64_t m_queryTime;
-    bool m_hasConn;
+    unsigned int m_histogram[HIST_BUCKETS];
+};
+
+class PgConn : public Thread
+{
+public:
+    PgConn(PgAccount* account);
+    ~PgConn();
+    virtual void run();
+    bool initDb(int retry = 0);
+    inline bool ok()
+	{ return testDb(); }
+
+private:
+    void dropDb();
+    bool testDb();
+    bool startDb();
+    bool waitSocket(bool write, u_int64_t timeout);
+    bool flushDb(u_int64_t timeout);
+    bool getResult(PGresult*& res, u_int64_t timeout);
+    void addResult(PgQuery& query, PGresult* res, int& totalRows, int& affectedRows);
+    void endQuery(PgQuery& query, int totalRows, int affectedRows);
+    int queryDbInternal(PgQuery& query);
+    void queryDb(PgQuery& query);
+    bool pipelineDb(ObjList& queries);
+    void failSent(ObjList& queries, unsigned int sent);
+    RefPointer<PgAccount> m_account;
+    PGconn *m_conn;
+    bool m_connected;
 };
 
 class PgHandler : public MessageHandler
@@ -105,11 +200,77 @@ private:
 
 static PgModule module;
 
-PgConn::PgConn(const NamedList* sect)
-    : Mutex(true,"PgConn"),
-      m_name(*sect), m_conn(0),
+
+PgQuery::PgQuery(const String& query, bool results, const char* notify)
+    : m_query(query), m_results(results), m_notify(notify),
+      m_params(""), m_data(0), m_queued(Time::now()), m_finished(false),
+      m_done(1,"PgQuery")
+{
+    // take the initial count so waiting blocks until finished
+    m_done.lock(0);
+}
+
+PgQuery::~PgQuery()
+{
+    TelEngine::destruct(m_data);
+}
+
+void PgQuery::setData(Array* a)
+{
+    TelEngine::destruct(m_data);
+    m_data = a;
+}
+
+// mark the query as executed and release the waiting thread
+void PgQuery::finish()
+{
+    m_finished = true;
+    m_done.unlock();
+}
+
+// wait for the query to be executed
+bool PgQuery::wait(long maxwait)
+{
+    if (m_finished)
+	return true;
+    return m_done.lock(maxwait) || m_finished;
+}
+
+// copy the results to the message
+void PgQuery::fill(Message& msg)
+{
+    unsigned int n = m_params.length();
+    for (unsigned int i = 0; i < n; i++) {
+	const NamedString* s = m_params.getParam(i);
+	if (s)
+	    msg.setParam(s->name(),*s);
+    }
+    if (m_data)
+	msg.userData(m_data);
+}
+
+// notify the completion of an asynchronous query
+void PgQuery::notify(const String& account)
+{
+    if (m_notify.null())
+	return;
+    Message* m = new Message("database.result");
+    m->addParam("id",m_notify);
+    m->addParam("account",account);
+    m->addParam("query",m_query);
+    fill(*m);
+    m->setParam("dbtype","pgsqldb");
+    Engine::enqueue(m);
+}
+
+
+PgAccount::PgAccount(const NamedList* sect)
+    : Mutex(true,"PgAccount"),
+      m_name(*sect),
+      m_wake(MAX_CONNS,"PgAccount"),
+      m_conns(0), m_idle(0), m_starting(0), m_connected(0),
       m_totalQueries(0), m_failedQueries(0),
-      m_errorQueries(0), m_queryTime(0), m_hasConn(false)
+      m_errorQueries(0), m_queryTime(0)
 {
     m_connection = sect->getValue("connection");
     if (m_connection.null()) {
@@ -132,31 +293,242 @@ PgConn::PgConn(const NamedList* sect)
 	m_timeout = 500000;
     m_retry = sect->getIntValue("retry",5);
     m_encoding = sect->getValue("encoding");
+    int n = sect->getIntValue("poolsize",1);
+    m_minConns = (n < 1) ? 1 : ((n > MAX_CONNS) ? MAX_CONNS : n);
+    n = sect->getIntValue("maxpoolsize",m_minConns);
+    m_maxConns = ((unsigned int)n < m_minConns) ? m_minConns : ((n > MAX_CONNS) ? MAX_CONNS : n);
+    n = sect->getIntValue("pipeline",1);
+    m_pipeline = (n < 1) ? 1 : ((n > MAX_PIPELINE) ? MAX_PIPELINE : n);
+#ifndef LIBPQ_HAS_PIPELINING
+    if (m_pipeline > 1) {
+	Debug(&module,DebugWarn,"Pipeline mode not supported by libpq, disabled for '%s'",
+	    m_name.c_str());
+	m_pipeline = 1;
+    }
+#endif
+    n = sect->getIntValue("idletime",60);
+    m_idleTime = (n < 1) ? 1 : n;
+    m_async = sect->getBoolValue("async",false);
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+	m_histogram[i] = 0;
 }
 
-PgConn::~PgConn()
+PgAccount::~PgAccount()
 {
 }
 
-void PgConn::destroyed()
+void PgAccount::destroyed()
 {
     s_conmutex.lock();
     s_conns.remove(this,false);
     s_conmutex.unlock();
-    dropDb();
     Debug(&module,DebugInfo,"Database account '%s' destroyed",m_name.c_str());
 }
 
-// initialize the database connection and handler data
+// check if at least one connection is up
+bool PgAccount::ok()
+{
+    Lock mylock(this,m_timeout);
+    return mylock.locked() && (m_connected > 0);
+}
+
+// create the first connection, start the minimum number of connections
+bool PgAccount::initDb()
+{
+    PgConn* conn = new PgConn(this);
+    if (!conn->initDb()) {
+	delete conn;
+	return false;
+    }
+    lock();
+    m_conns++;
+    m_starting++;
+    unlock();
+    if (!conn->startup()) {
+	Debug(&module,DebugWarn,"Failed to start connection thread for '%s'",m_name.c_str());
+	lock();
+	m_conns--;
+	m_starting--;
+	unlock();
+	delete conn;
+	return false;
+    }
+    for (unsigned int i = 1; i < m_minConns; i++)
+	if (!startConn())
+	    break;
+    return true;
+}
+
+// start a new connection thread
+bool PgAccount::startConn()
+{
+    Lock mylock(this);
+    if (m_conns >= m_maxConns)
+	return false;
+    PgConn* conn = new PgConn(this);
+    m_conns++;
+    m_starting++;
+    if (conn->startup()) {
+	Debug(&module,DebugInfo,"Starting connection %u for '%s'",m_conns,m_name.c_str());
+	return true;
+    }
+    Debug(&module,DebugWarn,"Failed to start connection thread for '%s'",m_name.c_str());
+    m_conns--;
+    m_starting--;
+    delete conn;
+    return false;
+}
+
+// append a query to the queue, add a connection if the queue grows
+bool PgAccount::queueQuery(PgQuery* query)
+{
+    if (!(query && query->ref()))
+	return false;
+    Lock mylock(this);
+    m_queue.append(query);
+    m_totalQueries++;
+    if ((m_queue.count() > m_idle + m_starting) || !m_conns)
+	startConn();
+    mylock.drop();
+    m_wake.unlock();
+    module.changed();
+    return true;
+}
+
+// remove a query from queue if it was not taken by a connection yet
+bool PgAccount::cancelQuery(PgQuery* query)
+{
+    Lock mylock(this);
+    if (!m_queue.remove(query,false))
+	return false;
+    mylock.drop();
+    query->deref();
+    return true;
+}
+
+// move at most count queries from queue to the destination list
+unsigned int PgAccount::getQueries(ObjList& dest, unsigned int count)
+{
+    Lock mylock(this);
+    unsigned int n = 0;
+    while (n < count) {
+	GenObject* q = m_queue.remove(false);
+	if (!q)
+	    break;
+	dest.append(q);
+	n++;
+    }
+    return n;
+}
+
+// check if an idle connection can be dropped, account it as gone if so
+bool PgAccount::dropIdle()
+{
+    Lock mylock(this);
+    if (m_conns <= m_minConns)
+	return false;
+    m_conns--;
+    return true;
+}
+
+// update statistics after a query was executed
+void PgAccount::finished(PgQuery* query, bool failed)
+{
+    u_int64_t time = Time::now() - query->queued();
+    unsigned int ms = (unsigned int)(time / 1000);
+    unsigned int i = 0;
+    for (; i < HIST_BUCKETS - 1; i++)
+	if (ms < s_buckets[i])
+	    break;
+    lock();
+    if (failed)
+	m_failedQueries++;
+    else
+	m_queryTime += time;
+    m_histogram[i]++;
+    unlock();
+    module.changed();
+}
+
+void PgAccount::histogram(String& str)
+{
+    Lock mylock(this);
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+	if (i)
+	    str << "/";
+	str << m_histogram[i];
+    }
+}
+
+
+PgConn::PgConn(PgAccount* account)
+    : Thread("PgSQL Conn"),
+      m_account(account), m_conn(0), m_connected(false)
+{
+}
+
+PgConn::~PgConn()
+{
+    dropDb();
+    m_account = 0;
+}
+
+// serve queries from the account queue until idle for too long
+void PgConn::run()
+{
+    PgAccount* acc = m_account;
+    acc->lock();
+    acc->m_starting--;
+    acc->m_idle++;
+    acc->unlock();
+    u_int64_t idle = Time::now() + (u_int64_t)acc->m_idleTime * 1000000;
+    while (!(Engine::exiting() || check(false))) {
+	ObjList queries;
+	if (!acc->getQueries(queries,acc->m_pipeline)) {
+	    if (Time::now() > idle) {
+		if (acc->dropIdle()) {
+		    Debug(&module,DebugInfo,"Dropping idle connection of '%s'",acc->toString().c_str());
+		    acc->lock();
+		    acc->m_idle--;
+		    acc->unlock();
+		    return;
+		}
+		idle = Time::now() + (u_int64_t)acc->m_idleTime * 1000000;
+	    }
+	    acc->m_wake.lock(Thread::idleUsec() * 20);
+	    continue;
+	}
+	acc->lock();
+	acc->m_idle--;
+	acc->unlock();
+	if ((queries.count() < 2) || !pipelineDb(queries)) {
+	    for (ObjList* l = queries.skipNull(); l; l = l->skipNext()) {
+		PgQuery* q = static_cast<PgQuery*>(l->get());
+		if (!q->finished())
+		    queryDb(*q);
+	    }
+	}
+	acc->lock();
+	acc->m_idle++;
+	acc->unlock();
+	idle = Time::now() + (u_int64_t)acc->m_idleTime * 1000000;
+    }
+    acc->lock();
+    acc->m_idle--;
+    acc->m_conns--;
+    acc->unlock();
+}
+
+// initialize the database connection
 bool PgConn::initDb(int retry)
 {
-    Lock lock(this);
+    PgAccount* acc = m_account;
     // allow specifying the raw connection string
-    Debug(&module,DebugAll,"Initiating connection \"%s\" retry %d",m_connection.c_str(),retry);
-    u_int64_t timeout = Time::now() + m_timeout;
-    m_conn = PQconnectStart(m_connection.c_str());
+    Debug(&module,DebugAll,"Initiating connection \"%s\" retry %d",acc->m_connection.c_str(),retry);
+    u_int64_t timeout = Time::now() + acc->m_timeout;
+    m_conn = PQconnectStart(acc->m_connection.c_str());
     if (!m_conn) {
-	Debug(&module,DebugGoOn,"Could not start connection for '%s'",m_name.c_str());
+	Debug(&module,DebugGoOn,"Could not start connection for '%s'",acc->toString().c_str());
 	return false;
     }
     PQsetnonblocking(m_conn,1);
@@ -165,37 +537,33 @@ bool PgConn::initDb(int retry)
     while (Time::now() < timeout) {
 	if (PGRES_POLLING_WRITING == polling || PGRES_POLLING_READING == polling) {
 	    // the Postgres library should have done all this internally...
-	    SOCKET s = PQsocket(m_conn);
-	    struct timeval tm;
-	    Time::toTimeval(&tm,Thread::idleUsec());
-	    fd_set fs;
-	    FD_ZERO(&fs);
-	    FD_SET(s,&fs);
-	    ::select(s+1,
-		((PGRES_POLLING_READING == polling) ? &fs : 0),
-		((PGRES_POLLING_WRITING == polling) ? &fs : 0),
-		0,&tm);
-	    if (!FD_ISSET(s,&fs))
+	    if (!waitSocket(PGRES_POLLING_WRITING == polling,Time::now() + Thread::idleUsec()))
 		continue;
 	}
 	polling = PQconnectPoll(m_conn);
 	switch (PQstatus(m_conn)) {
 	    case CONNECTION_BAD:
-		Debug(&module,DebugWarn,"Connection for '%s' failed: %s",m_name.c_str(),PQerrorMessage(m_conn));
+		Debug(&module,DebugWarn,"Connection for '%s' failed: %s",acc->toString().c_str(),PQerrorMessage(m_conn));
 		dropDb();
 		return false;
 	    case CONNECTION_OK:
-		Debug(&module,DebugAll,"Connection for '%s' succeeded",m_name.c_str());
-		if (m_encoding && PQsetClientEncoding(m_conn,m_encoding))
+		Debug(&module,DebugAll,"Connection for '%s' succeeded",acc->toString().c_str());
+		if (acc->m_encoding && PQsetClientEncoding(m_conn,acc->m_encoding))
 		    Debug(&module,DebugWarn,"Failed to set encoding '%s' on connection '%s'",
-			m_encoding.c_str(),m_name.c_str());
+			acc->m_encoding.c_str(),acc->toString().c_str());
+		if (!m_connected) {
+		    m_connected = true;
+		    acc->lock();
+		    acc->m_connected++;
+		    acc->unlock();
+		}
 		return true;
 	    default:
 		break;
 	}
 	Thread::idle();
     }
-    Debug(&module,DebugWarn,"Connection timed out for '%s'",m_name.c_str());
+    Debug(&module,DebugWarn,"Connection timed out for '%s'",acc->toString().c_str());
     dropDb();
     return false;
 }
@@ -203,14 +571,16 @@ bool PgConn::initDb(int retry)
 // drop the connection
 void PgConn::dropDb()
 {
-    if (!m_conn)
-	return;
-    Lock mylock(this);
+    if (m_connected) {
+	m_connected = false;
+	m_account->lock();
+	m_account->m_connected--;
+	m_account->unlock();
+    }
     if (!m_conn)
 	return;
     PGconn* tmp = m_conn;
     m_conn = 0;
-    mylock.drop();
     PQfinish(tmp);
 }
 
@@ -220,189 +590,315 @@ bool PgConn::testDb()
     return m_conn && (CONNECTION_OK == PQstatus(m_conn));
 }
 
-// public, thread safe version
-bool PgConn::ok()
-{
-    Lock mylock(this,m_timeout);
-    return mylock.locked() && testDb();
-}
-
 // try to get up the connection, retry if we have to
 bool PgConn::startDb()
 {
-    setConn(true);
     if (testDb())
 	return true;
-    for (int i = 0; i < m_retry; i++) {
+    dropDb();
+    for (int i = 0; i < m_account->m_retry; i++) {
 	if (initDb(i))
 	    return true;
 	Thread::yield();
 	if (testDb())
 	    return true;
     }
-    setConn(false);
     return false;
 }
 
-// perform the query, fill the message with data
-//  return number of rows, -1 for non-retryable errors and -2 to retry
-int PgConn::queryDbInternal(const char* query, Message* dest)
+// wait until the connection socket is readable or writable
+bool PgConn::waitSocket(bool write, u_int64_t timeout)
 {
-    Lock mylock(this,m_timeout);
-    if (!mylock.locked()) {
-	Debug(&module,DebugWarn,"Failed to lock '%s' for " FMT64U " usec",
-	    m_name.c_str(),m_timeout);
-	return -1;
+    SOCKET s = PQsocket(m_conn);
+    if (s < 0)
+	return false;
+    u_int64_t now = Time::now();
+    if (timeout <= now)
+	return false;
+    struct timeval tm;
+    Time::toTimeval(&tm,timeout - now);
+    fd_set fs;
+    FD_ZERO(&fs);
+    FD_SET(s,&fs);
+    return (::select(s+1,(write ? 0 : &fs),(write ? &fs : 0),0,&tm) > 0) && FD_ISSET(s,&fs);
+}
+
+// send all queued output to the server
+bool PgConn::flushDb(u_int64_t timeout)
+{
+    while (true) {
+	int res = PQflush(m_conn);
+	if (!res)
+	    return true;
+	if (res < 0)
+	    return false;
+	// data is still pending - wait until we can write or read more
+	if (Time::now() >= timeout)
+	    return false;
+	waitSocket(true,timeout);
+	if (!PQconsumeInput(m_conn))
+	    return false;
     }
+}
+
+// wait until a result is available and get it
+bool PgConn::getResult(PGresult*& res, u_int64_t timeout)
+{
+    res = 0;
+    while (PQisBusy(m_conn)) {
+	if (Time::now() >= timeout)
+	    return false;
+	waitSocket(false,timeout);
+	if (!PQconsumeInput(m_conn))
+	    return false;
+    }
+    res = PQgetResult(m_conn);
+    return true;
+}
+
+// collect the data of a query result
+void PgConn::addResult(PgQuery& query, PGresult* res, int& totalRows, int& affectedRows)
+{
+    ExecStatusType stat = PQresultStatus(res);
+    switch (stat) {
+	case PGRES_TUPLES_OK:
+	    // we got some data - but maybe zero rows or binary...
+	    {
+		affectedRows += String(PQcmdTuples(res)).toInteger();
+		int columns = PQnfields(res);
+		int rows = PQntuples(res);
+		if (rows > 0) {
+		    totalRows += rows;
+		    query.params().setParam("columns",String(columns));
+		    if (query.results() && !PQbinaryTuples(res)) {
+			Array *a = new Array(columns,rows+1);
+			for (int k = 0; k < columns; k++) {
+			    ObjList* column = a->getColumn(k);
+			    if (column)
+				column->set(new String(PQfname(res,k)));
+			    else {
+				Debug(&module,DebugGoOn,"No array column for %d",k);
+				continue;
+			    }
+			    for (int j = 0; j < rows; j++) {
+				column = column->next();
+				if (!column) {
+				    // Stop now: we won't get the next row
+				    Debug(&module,DebugGoOn,"No array row %d in column %d",j + 1,k);
+				    break;
+				}
+				// skip over NULL values
+				if (PQgetisnull(res,j,k))
+				    continue;
+				GenObject* v = 0;
+				if (PQfformat(res,k))
+				    v = new DataBlock(PQgetvalue(res,j,k),PQgetlength(res,j,k));
+				else
+				    v = new String(PQgetvalue(res,j,k));
+				column->set(v);
+			    }
+			}
+			query.setData(a);
+		    }
+		}
+	    }
+	    break;
+	case PGRES_COMMAND_OK:
+	    affectedRows += String(PQcmdTuples(res)).toInteger();
+	    // no data returned
+	    break;
+	case PGRES_COPY_IN:
+	case PGRES_COPY_OUT:
+	    // data transfers - ignore them
+	    break;
+	default:
+	    Debug(&module,DebugWarn,"Query error: %s",PQresultErrorMessage(res));
+	    query.params().setParam("error",PQresultErrorMessage(res));
+	    m_account->lock();
+	    m_account->m_errorQueries++;
+	    m_account->unlock();
+	    module.changed();
+    }
+}
+
+// last result already received and processed
+void PgConn::endQuery(PgQuery& query, int totalRows, int affectedRows)
+{
+    Debug(&module,DebugAll,"Query for '%s' returned %d rows, %d affected",
+	m_account->toString().c_str(),totalRows,affectedRows);
+    query.params().setParam("rows",String(totalRows));
+    query.params().setParam("affected",String(affectedRows));
+}
+
+// perform the query, fill the query results
+//  return number of rows, -1 for non-retryable errors and -2 to retry
+int PgConn::queryDbInternal(PgQuery& query)
+{
     if (!startDb())
 	// no retry - startDb already tried and failed...
 	return -1;
 
-    u_int64_t timeout = Time::now() + m_timeout;
-    if (!PQsendQuery(m_conn,query)) {
+    u_int64_t timeout = Time::now() + m_account->m_timeout;
+    if (!PQsendQuery(m_conn,query.query())) {
 	// a connection failure cannot be detected at this point so any
 	//  error must be caused by the query itself - bad syntax or so
 	Debug(&module,DebugWarn,"Query \"%s\" for '%s' failed: %s",
-	    query,m_name.c_str(),PQerrorMessage(m_conn));
-	dest->setParam("error",PQerrorMessage(m_conn));
+	    query.query().c_str(),m_account->toString().c_str(),PQerrorMessage(m_conn));
+	query.params().setParam("error",PQerrorMessage(m_conn));
 	// non-retryable, query should be fixed
 	return -1;
     }
 
-    if (PQflush(m_conn)) {
+    if (!flushDb(timeout)) {
 	Debug(&module,DebugWarn,"Flush for '%s' failed: %s",
-	    m_name.c_str(),PQerrorMessage(m_conn));
+	    m_account->toString().c_str(),PQerrorMessage(m_conn));
+	query.params().setParam("error",PQerrorMessage(m_conn));
 	dropDb();
-	dest->setParam("error",PQerrorMessage(m_conn));
 	return -2;
     }
 
     int totalRows = 0;
     int affectedRows = 0;
-    while (Time::now() < timeout) {
-	PQconsumeInput(m_conn);
-	if (PQisBusy(m_conn)) {
-	    Thread::yield();
-	    continue;
-	}
-	PGresult* res = PQgetResult(m_conn);
+    PGresult* res = 0;
+    while (getResult(res,timeout)) {
 	if (!res) {
-	    // last result already received and processed - exit successfully
-	    Debug(&module,DebugAll,"Query for '%s' returned %d rows, %d affected",m_name.c_str(),totalRows,affectedRows);
-	    if (dest) {
-		dest->setParam("rows",String(totalRows));
-		dest->setParam("affected",String(affectedRows));
-	    }
+	    endQuery(query,totalRows,affectedRows);
 	    return totalRows;
 	}
-	ExecStatusType stat = PQresultStatus(res);
-	switch (stat) {
-	    case PGRES_TUPLES_OK:
-		// we got some data - but maybe zero rows or binary...
-		if (dest) {
-		    affectedRows += String(PQcmdTuples(res)).toInteger();
-		    int columns = PQnfields(res);
-		    int rows = PQntuples(res);
-		    if (rows > 0) {
-			totalRows += rows;
-			dest->setParam("columns",String(columns));
-			if (dest->getBoolValue("results",true) && !PQbinaryTuples(res)) {
-			    Array *a = new Array(columns,rows+1);
-			    for (int k = 0; k < columns; k++) {
-				ObjList* column = a->getColumn(k);
-				if (column)
-				    column->set(new String(PQfname(res,k)));
-				else {
-				    Debug(&module,DebugGoOn,"No array column for %d",k);
-				    continue;
-				}
-				for (int j = 0; j < rows; j++) {
-				    column = column->next();
-				    if (!column) {
-					// Stop now: we won't get the next row
-					Debug(&module,DebugGoOn,"No array row %d in column %d",j + 1,k);
-					break;
-				    }
-				    // skip over NULL values
-				    if (PQgetisnull(res,j,k))
-					continue;
-				    GenObject* v = 0;
-				    if (PQfformat(res,k))
-					v = new DataBlock(PQgetvalue(res,j,k),PQgetlength(res,j,k));
-				    else
-					v = new String(PQgetvalue(res,j,k));
-				    column->set(v);
-				}
-			    }
-			    dest->userData(a);
-			    a->deref();
-			}
-		    }
-		}
-		break;
-	    case PGRES_COMMAND_OK:
-		if (dest)
-		    affectedRows += String(PQcmdTuples(res)).toInteger();
-		// no data returned
-		break;
-	    case PGRES_COPY_IN:
-	    case PGRES_COPY_OUT:
-		// data transfers - ignore them
-		break;
-	    default:
-		Debug(&module,DebugWarn,"Query error: %s",PQresultErrorMessage(res));
-		dest->setParam("error",PQresultErrorMessage(res));
-		m_errorQueries++;
-		module.changed();
-	}
+	addResult(query,res,totalRows,affectedRows);
 	PQclear(res);
     }
-    Debug(&module,DebugWarn,"Query timed out for '%s'",m_name.c_str());
-    dest->setParam("error","query timeout");
+    Debug(&module,DebugWarn,"Query timed out for '%s'",m_account->toString().c_str());
+    query.params().setParam("error","query timeout");
     dropDb();
     return -2;
 }
 
-static bool failure(Message* m)
+static bool failure(NamedList* m)
 {
     if (m)
 	m->setParam("error","failure");
     return false;
 }
 
-int PgConn::queryDb(const char* query, Message* dest)
+// fail the unfinished queries among the first sent ones of a broken pipeline
+//  the server may have executed them so they must not be retried
+void PgConn::failSent(ObjList& queries, unsigned int sent)
 {
-    if (TelEngine::null(query))
-	return -1;
-    Debug(&module,DebugAll,"Performing query \"%s\" for '%s'",
-	query,m_name.c_str());
-    m_totalQueries++;
-    module.changed();
-    u_int64_t start = Time::now();
-    for (int i = 0; i < m_retry; i++) {
-	int res = queryDbInternal(query,dest);
-	if (res > -2) {
-	    if (res < 0) {
-		failure(dest);
-		m_failedQueries++;
-		module.changed();
+    for (ObjList* l = queries.skipNull(); l && sent; l = l->skipNext(), sent--) {
+	PgQuery* q = static_cast<PgQuery*>(l->get());
+	if (q->finished())
+	    continue;
+	failure(&q->params());
+	m_account->finished(q,true);
+	q->finish();
+	q->notify(m_account->toString());
+    }
+}
+
+// send several queries at once in pipeline mode and collect their results
+//  return false if the unfinished queries must be executed one by one,
+//  queries already sent when the pipeline breaks are failed instead
+bool PgConn::pipelineDb(ObjList& queries)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+    if (!startDb())
+	return false;
+    if (!PQenterPipelineMode(m_conn)) {
+	Debug(&module,DebugMild,"Failed to enter pipeline mode for '%s': %s",
+	    m_account->toString().c_str(),PQerrorMessage(m_conn));
+	return false;
+    }
+    u_int64_t timeout = Time::now() + m_account->m_timeout;
+    bool ok = true;
+    unsigned int sent = 0;
+    ObjList* l = queries.skipNull();
+    for (; l; l = l->skipNext()) {
+	PgQuery* q = static_cast<PgQuery*>(l->get());
+	if (!PQsendQueryParams(m_conn,q->query(),0,0,0,0,0,0)) {
+	    ok = false;
+	    break;
+	}
+	sent++;
+	// each query gets its own sync point so an error does not abort the others
+	if (!PQpipelineSync(m_conn)) {
+	    ok = false;
+	    break;
+	}
+    }
+    if (ok)
+	ok = flushDb(timeout);
+    if (!ok) {
+	Debug(&module,DebugWarn,"Pipeline for '%s' failed: %s",
+	    m_account->toString().c_str(),PQerrorMessage(m_conn));
+	dropDb();
+	failSent(queries,sent);
+	return false;
+    }
+    Debug(&module,DebugAll,"Sent %u queries in pipeline for '%s'",
+	queries.count(),m_account->toString().c_str());
+    for (l = queries.skipNull(); l; l = l->skipNext()) {
+	PgQuery* q = static_cast<PgQuery*>(l->get());
+	int totalRows = 0;
+	int affectedRows = 0;
+	PGresult* res = 0;
+	while ((ok = getResult(res,timeout))) {
+	    // a null result marks the end of the query results, the sync follows
+	    if (!res)
+		continue;
+	    if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+		PQclear(res);
+		break;
 	    }
-	    // ok or non-retryable error, get out of here
-	    u_int64_t finish = Time::now() - start;
-	    m_queryTime += finish;
-	    module.changed();
-	    return res;
+	    addResult(*q,res,totalRows,affectedRows);
+	    PQclear(res);
+	}
+	if (!ok) {
+	    // connection lost or timed out, the rest were sent and may have been executed
+	    Debug(&module,DebugWarn,"Pipeline timed out for '%s'",m_account->toString().c_str());
+	    dropDb();
+	    failSent(queries,sent);
+	    return false;
 	}
+	endQuery(*q,totalRows,affectedRows);
+	m_account->finished(q,false);
+	q->finish();
+	q->notify(m_account->toString());
     }
-    failure(dest);
-    return -2;
+    if (!PQexitPipelineMode(m_conn)) {
+	Debug(&module,DebugWarn,"Failed to exit pipeline mode for '%s': %s",
+	    m_account->toString().c_str(),PQerrorMessage(m_conn));
+	dropDb();
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void PgConn::queryDb(PgQuery& query)
+{
+    Debug(&module,DebugAll,"Performing query \"%s\" for '%s'",
+	query.query().c_str(),m_account->toString().c_str());
+    int res = -2;
+    for (int i = 0; i < m_account->m_retry; i++) {
+	res = queryDbInternal(query);
+	if (res > -2)
+	    // ok or non-retryable error, get out of here
+	    break;
+    }
+    if (res < 0)
+	failure(&query.params());
+    m_account->finished(&query,res < 0);
+    query.finish();
+    query.notify(m_account->toString());
 }
 
-static PgConn* findDb(const String& account)
+static PgAccount* findDb(const String& account)
 {
     if (account.null())
 	return 0;
-    return static_cast<PgConn*>(s_conns[account]);
+    return static_cast<PgAccount*>(s_conns[account]);
 }
 
 bool PgHandler::received(Message& msg)
@@ -411,13 +907,33 @@ bool PgHandler::received(Message& msg)
     if (TelEngine::null(str))
 	return false;
     s_conmutex.lock();
-    RefPointer<PgConn> db = findDb(*str);
+    RefPointer<PgAccount> db = findDb(*str);
     s_conmutex.unlock();
     if (!db)
 	return false;
     str = msg.getParam("query");
-    if (!TelEngine::null(str))
-	db->queryDb(*str,&msg);
+    if (!TelEngine::null(str)) {
+	bool results = msg.getBoolValue("results",true);
+	bool async = !results && msg.getBoolValue("async",db->async());
+	PgQuery* q = new PgQuery(*str,results,async ? msg.getValue("notify") : 0);
+	if (!db->queueQuery(q))
+	    failure(&msg);
+	else if (!async) {
+	    // wait for the query to be executed by one of the connections
+	    if (q->wait((long)(db->timeout() * 2)) || !db->cancelQuery(q)) {
+		while (!q->wait(-1))
+		    ;
+		q->fill(msg);
+	    }
+	    else {
+		Debug(&module,DebugWarn,"Query timed out in queue of '%s'",db->toString().c_str());
+		failure(&msg);
+	    }
+	}
+	else
+	    msg.setParam("queued",String::boolText(true));
+	TelEngine::destruct(q);
+    }
     msg.setParam("dbtype","pgsqldb");
     return true;
 }
@@ -437,7 +953,7 @@ PgModule::~PgModule()
 void PgModule::statusModule(String& str)
 {
     Module::statusModule(str);
-    str.append("format=Total|Failed|Errors|AvgExecTime",",");
+    str.append("format=Total|Failed|Errors|AvgExecTime|Conns|Queued|Latency",",");
 }
 
 void PgModule::statusParams(String& str)
@@ -446,19 +962,25 @@ void PgModule::statusParams(String& str)
     str.append("conns=",",") << s_conns.count();
     str.append("failed=",",") << s_failedConns;
     s_conmutex.unlock();
+    str.append("latency=",",");
+    for (unsigned int i = 0; i < HIST_BUCKETS - 1; i++)
+	str << s_buckets[i] << "/";
+    str << "+ms";
 }
 
 void PgModule::statusDetail(String& str)
 {
     s_conmutex.lock();
     for (unsigned int i = 0; i < s_conns.count(); i++) {
-	PgConn* conn = static_cast<PgConn*>(s_conns[i]);
+	PgAccount* conn = static_cast<PgAccount*>(s_conns[i]);
 	str.append(conn->toString().c_str(),",") << "=" << conn->total() << "|" << conn->failed()
 			<< "|" << conn->errorred() << "|";
 	if (conn->total() - conn->failed() > 0)
 	    str << (conn->queryTime() / (conn->total() - conn->failed()) / 1000); //miliseconds
         else
 	    str << "0";
+	str << "|" << conn->conns() << "|" << conn->queued() << "|";
+	conn->histogram(str);
     }
     s_conmutex.unlock();
 }
@@ -477,15 +999,18 @@ void PgModule::initialize()
 	NamedList* sec = cfg.getSection(i);
 	if (!sec || (*sec == "general"))
 	    continue;
-	PgConn* conn = new PgConn(sec);
+	PgAccount* conn = new PgAccount(sec);
 	if (sec->getBoolValue("autostart",true))
 	    conn->initDb();
 	s_conmutex.lock();
-	if (conn->ok())
+	if (conn->ok()) {
 	    s_conns.insert(conn);
+	    conn = 0;
+	}
 	else
 	    s_failedConns++;
 	s_conmutex.unlock();
+	TelEngine::destruct(conn);
     }
 
 }
@@ -494,13 +1019,15 @@ void PgModule::genUpdate(Message& msg)
 {
     unsigned int index = 0;
     for (ObjList* o = s_conns.skipNull(); o; o = o->next()) {
-	PgConn* conn = static_cast<PgConn*>(o->get());
+	PgAccount* conn = static_cast<PgAccount*>(o->get());
 	msg.setParam(String("database.") << index,conn->toString());
 	msg.setParam(String("total.") << index,String(conn->total()));
 	msg.setParam(String("failed.") << index,String(conn->failed()));
 	msg.setParam(String("errorred.") << index,String(conn->errorred()));
 	msg.setParam(String("hasconn.") << index,String::boolText(conn->hasConn()));
 	msg.setParam(String("querytime.") << index,String(conn->queryTime()));
+	msg.setParam(String("conns.") << index,String(conn->conns()));
+	msg.setParam(String("queued.") << index,String(conn->queued()));
 	index++;
     }
     msg.setParam("count",String(index));
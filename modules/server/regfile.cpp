@@ -359,7 +359,7 @@ bool ExpireHandler::received(Message &msg)
 	   i++;
     }
     if (s_accounts)
-	s_accounts.save();
+	s_accounts.saveChanges();
     return false;
 }
 
@@ -443,6 +443,7 @@ void RegfilePlugin::initialize()
 	Engine::self()->runParams().replaceParams(conf);
 	if (conf) {
 	    s_accounts = conf;
+	    s_accounts.setJournal(s_cfg.getIntValue("general","journal",0,0));
 	    s_accounts.load();
 	}
 	Engine::install(new AuthHandler("user.auth",s_cfg.getIntValue("general","auth",100)));
@@ -37,6 +37,28 @@ static ObjList s_handlers;
 static NamedList s_statusaccounts("StatusAccounts");
 static HashList s_fallbacklist;
 
+// Write-behind batching of database write queries
+static Mutex s_batchMutex(false,"RegisterBatch");
+static Semaphore s_batchWake(1,"RegisterBatchWake");
+static ObjList s_batches;
+static unsigned int s_batchSize = 0;
+static unsigned int s_batchInterval = 1000;
+static bool s_batchJoin = false;
+static bool s_batchHalt = false;
+static unsigned int s_batchQueued = 0;
+static unsigned int s_batchFlushed = 0;
+static unsigned int s_batchSent = 0;
+static unsigned int s_batchFailed = 0;
+static u_int64_t s_batchLatency = 0;
+static u_int64_t s_batchLatencyMax = 0;
+
+// Short lived cache of user.auth query results
+static Mutex s_authMutex(false,"RegisterAuthCache");
+static HashList s_authCache(101);
+static unsigned int s_authCount = 0;
+static unsigned int s_authHits = 0;
+static unsigned int s_authMisses = 0;
+
 class AAAHandler : public MessageHandler
 {
     YCLASS(AAAHandler,MessageHandler)
@@ -67,10 +89,18 @@ public:
 
 protected:
     void indirectQuery(String& query);
+    void loadBatch(const char* key, String& batch, String& row);
+    bool authCached(Message& msg, const String& account, const String& query);
+    void authStore(const String& account, const String& query, Array* a);
     int m_type;
     String m_query;
     String m_result;
     String m_account;
+    bool m_batch;
+    String m_queryBatch;
+    String m_queryRow;
+    unsigned int m_cacheTtl;
+    unsigned int m_cacheMax;
 };
 
 class CDRHandler : public AAAHandler
@@ -86,6 +116,10 @@ protected:
     String m_name;
     String m_queryInitialize;
     String m_queryUpdate;
+    String m_initializeBatch;
+    String m_initializeRow;
+    String m_updateBatch;
+    String m_updateRow;
     bool m_critical;
 };
 
@@ -167,6 +201,62 @@ protected:
     String m_queryExpire;
 };
 
+// A write query waiting to be sent, a row if it has a multi-row statement
+class BatchItem : public String
+{
+public:
+    inline BatchItem(const String& query, const String& batch, bool critical)
+	: String(query), m_batch(batch), m_critical(critical)
+	{}
+    String m_batch;                      // Multi-row statement template
+    bool m_critical;                     // Failure is critical
+};
+
+// Write queries of a database account, kept in the order they were queued
+class QueryBatch : public String
+{
+public:
+    inline QueryBatch(const String& account)
+	: String(account), m_count(0), m_due(0)
+	{}
+    inline unsigned int count() const
+	{ return m_count; }
+    inline u_int64_t due() const
+	{ return m_due; }
+    void append(BatchItem* item);
+    QueryBatch* take();
+    void flush();
+private:
+    void addStatement(ObjList& queries, const String& batch, const String& rows, unsigned int count);
+    ObjList m_items;
+    unsigned int m_count;
+    u_int64_t m_due;
+};
+
+// Thread sending the queued write queries
+class BatchWriter : public Thread
+{
+public:
+    inline BatchWriter()
+	: Thread("Register Batch")
+	{}
+    virtual void run();
+    static void flush(bool all);
+    static void stop();
+    static BatchWriter* s_writer;
+};
+
+// A cached user.auth query result
+class AuthCacheItem : public String
+{
+public:
+    inline AuthCacheItem(const String& key, Array* a, u_int64_t expires)
+	: String(key), m_array(a), m_expires(expires)
+	{}
+    RefPointer<Array> m_array;
+    u_int64_t m_expires;
+};
+
 class AccountsModule;
 class FallBackHandler;
 class RegistModule : public Module
@@ -179,6 +269,7 @@ protected:
     virtual void statusParams(String& str);
     virtual bool received(Message& msg, int id);
 private:
+    static void expireAuthCache(u_int64_t now);
     static int getPriority(const String& name);
     static void addHandler(const char *name, int type);
     static void addHandler(AAAHandler* handler);
@@ -320,8 +411,193 @@ static bool copyParams(Message &msg, Array *a, const String& resultName)
 }
 
 
+// queue a write query, or a row of a multi-row statement, for batched execution
+
+static void queueWrite(const Message& msg, const String& account, const String& query,
+    const String& batch, const String& row, bool critical)
+{
+    BatchItem* item = 0;
+    if (batch && row) {
+	String r(row);
+	msg.replaceParams(r,true);
+	item = new BatchItem(r,batch,critical);
+    }
+    else
+	item = new BatchItem(query,String::empty(),critical);
+    Lock lck(s_batchMutex);
+    QueryBatch* b = static_cast<QueryBatch*>(s_batches[account]);
+    if (!b) {
+	b = new QueryBatch(account);
+	s_batches.append(b);
+    }
+    b->append(item);
+    s_batchQueued++;
+    bool full = b->count() >= s_batchSize;
+    lck.drop();
+    XDebug(&module,DebugAll,"On account '%s' queued '%s'",account.c_str(),item->c_str());
+    if (full)
+	s_batchWake.unlock();
+}
+
+
+void QueryBatch::append(BatchItem* item)
+{
+    if (!m_count)
+	m_due = Time::now() + (u_int64_t)s_batchInterval * 1000;
+    m_items.append(item);
+    m_count++;
+}
+
+// move all queued items to a new batch
+QueryBatch* QueryBatch::take()
+{
+    QueryBatch* b = new QueryBatch(toString());
+    while (GenObject* o = m_items.remove(false))
+	b->m_items.append(o);
+    b->m_count = m_count;
+    b->m_due = m_due;
+    m_count = 0;
+    m_due = 0;
+    return b;
+}
+
+void QueryBatch::addStatement(ObjList& queries, const String& batch, const String& rows, unsigned int count)
+{
+    String* query = new String(batch);
+    NamedList params("");
+    params.addParam("values",rows);
+    params.addParam("count",String(count));
+    params.replaceParams(*query);
+    queries.append(query);
+}
+
+// build the statements, consecutive rows of same template are merged, and send them
+void QueryBatch::flush()
+{
+    if (!m_count)
+	return;
+    u_int64_t start = Time::now();
+    ObjList queries;
+    bool critical = false;
+    const String* batch = 0;
+    String rows;
+    unsigned int count = 0;
+    for (ObjList* l = m_items.skipNull(); l; l = l->skipNext()) {
+	BatchItem* item = static_cast<BatchItem*>(l->get());
+	critical = critical || item->m_critical;
+	if (batch && ((*batch != item->m_batch) || (count >= s_batchSize))) {
+	    addStatement(queries,*batch,rows,count);
+	    batch = 0;
+	    rows.clear();
+	    count = 0;
+	}
+	if (item->m_batch) {
+	    batch = &item->m_batch;
+	    rows.append(*item,",");
+	    count++;
+	}
+	else
+	    queries.append(new String(*item));
+    }
+    if (batch)
+	addStatement(queries,*batch,rows,count);
+    if (s_batchJoin) {
+	// send all statements in a single query
+	String* all = new String;
+	for (ObjList* l = queries.skipNull(); l; l = l->skipNext())
+	    all->append(*static_cast<String*>(l->get()),"; ");
+	queries.clear();
+	queries.append(all);
+    }
+    unsigned int sent = 0;
+    unsigned int failed = 0;
+    for (ObjList* l = queries.skipNull(); l; l = l->skipNext()) {
+	Message m("database");
+	AAAHandler::prepareQuery(m,*this,*static_cast<String*>(l->get()),false);
+	sent++;
+	if (!Engine::dispatch(m) || m.getParam("error"))
+	    failed++;
+    }
+    u_int64_t latency = Time::now() - start;
+    Debug(&module,failed ? DebugWarn : DebugAll,
+	"Flushed %u queued queries in %u statements on account '%s', %u failed in " FMT64U " usec",
+	m_count,sent,c_str(),failed,latency);
+    s_batchMutex.lock();
+    s_batchFlushed += m_count;
+    s_batchSent += sent;
+    s_batchFailed += failed;
+    s_batchLatency = latency;
+    if (s_batchLatencyMax < latency)
+	s_batchLatencyMax = latency;
+    s_batchMutex.unlock();
+    // failure while accounting is critical
+    if (critical && (s_critical != (failed != 0))) {
+	s_critical = (failed != 0);
+	module.changed();
+    }
+}
+
+
+BatchWriter* BatchWriter::s_writer = 0;
+
+void BatchWriter::run()
+{
+    Debug(&module,DebugAll,"%s start running [%p]",currentName(),this);
+    while (true) {
+	s_batchMutex.lock();
+	bool halt = s_batchHalt;
+	long wait = (long)s_batchInterval * 1000;
+	s_batchMutex.unlock();
+	if (halt || Engine::exiting() || check(false))
+	    break;
+	s_batchWake.lock(wait);
+	flush(false);
+    }
+    // send everything that was queued before exiting
+    flush(true);
+    s_batchMutex.lock();
+    s_writer = 0;
+    s_batchMutex.unlock();
+    Debug(&module,DebugAll,"%s stopped [%p]",currentName(),this);
+}
+
+// send the batches that are full or due, all of them if requested
+void BatchWriter::flush(bool all)
+{
+    ObjList work;
+    s_batchMutex.lock();
+    u_int64_t now = Time::now();
+    for (ObjList* l = s_batches.skipNull(); l; l = l->skipNext()) {
+	QueryBatch* b = static_cast<QueryBatch*>(l->get());
+	if (b->count() && (all || (b->count() >= s_batchSize) || (b->due() <= now)))
+	    work.append(b->take());
+    }
+    s_batchMutex.unlock();
+    for (ObjList* l = work.skipNull(); l; l = l->skipNext())
+	static_cast<QueryBatch*>(l->get())->flush();
+}
+
+// ask the writer to send what is queued and wait for it to finish
+void BatchWriter::stop()
+{
+    s_batchMutex.lock();
+    s_batchHalt = true;
+    s_batchMutex.unlock();
+    s_batchWake.unlock();
+    for (unsigned int i = 0; i < 500; i++) {
+	Lock lck(s_batchMutex);
+	if (!s_writer)
+	    return;
+	lck.drop();
+	Thread::idle();
+    }
+    Debug(&module,DebugWarn,"Batch writer did not stop in time");
+}
+
+
 AAAHandler::AAAHandler(const char* hname, int type, int prio)
-    : MessageHandler(hname,prio),m_type(type)
+    : MessageHandler(hname,prio),m_type(type),
+      m_batch(false),m_cacheTtl(0),m_cacheMax(0)
 {
 }
 
@@ -334,6 +610,17 @@ void AAAHandler::loadAccount()
 {
     m_result = s_cfg.getValue(name(),"result");
     m_account = s_cfg.getValue(name(),"account",s_cfg.getValue("default","account"));
+    switch (m_type) {
+	case UnRegist:
+	case Cdr:
+	    // registration needs the query result so it is never batched
+	    m_batch = s_batchSize && s_cfg.getBoolValue(name(),"batch");
+	    break;
+	case Auth:
+	    m_cacheTtl = s_cfg.getIntValue(name(),"cache_ttl",0);
+	    m_cacheMax = s_cfg.getIntValue(name(),"cache_max",1000);
+	    break;
+    }
 }
 
 const String& AAAHandler::name() const
@@ -345,9 +632,70 @@ bool AAAHandler::loadQuery()
 {
     m_query = s_cfg.getValue(name(),"query");
     indirectQuery(m_query);
+    loadBatch("query",m_queryBatch,m_queryRow);
     return !m_query.null();
 }
 
+// load the multi-row statement and row templates of a batched query
+void AAAHandler::loadBatch(const char* key, String& batch, String& row)
+{
+    batch.clear();
+    row.clear();
+    if (!m_batch)
+	return;
+    String tmp(key);
+    batch = s_cfg.getValue(name(),tmp + "_batch");
+    row = s_cfg.getValue(name(),tmp + "_row");
+    if (batch.null() == row.null())
+	return;
+    Debug(&module,DebugMild,"Both '%s_batch' and '%s_row' must be set in '%s'",
+	key,key,name().c_str());
+    batch.clear();
+    row.clear();
+}
+
+// copy parameters from a cached user.auth result, return true if found
+bool AAAHandler::authCached(Message& msg, const String& account, const String& query)
+{
+    String key(account);
+    key << ":" << query;
+    u_int64_t now = Time::now();
+    Lock lck(s_authMutex);
+    AuthCacheItem* item = static_cast<AuthCacheItem*>(s_authCache[key]);
+    if (item && (item->m_expires <= now)) {
+	s_authCache.remove(item);
+	s_authCount--;
+	item = 0;
+    }
+    if (!item) {
+	s_authMisses++;
+	return false;
+    }
+    s_authHits++;
+    RefPointer<Array> a = item->m_array;
+    lck.drop();
+    return copyParams(msg,a,m_result);
+}
+
+// remember a user.auth result for a short time
+void AAAHandler::authStore(const String& account, const String& query, Array* a)
+{
+    if (!a)
+	return;
+    String key(account);
+    key << ":" << query;
+    Lock lck(s_authMutex);
+    AuthCacheItem* item = static_cast<AuthCacheItem*>(s_authCache[key]);
+    if (item) {
+	s_authCache.remove(item);
+	s_authCount--;
+    }
+    else if (s_authCount >= m_cacheMax)
+	return;
+    s_authCache.append(new AuthCacheItem(key,a,Time::now() + (u_int64_t)m_cacheTtl * 1000));
+    s_authCount++;
+}
+
 // replace a "@query" with the result of that query
 void AAAHandler::indirectQuery(String& query)
 {
@@ -441,6 +789,8 @@ bool AAAHandler::received(Message& msg)
 	{
 	    if (!msg.getBoolValue("auth_register",true))
 		return false;
+	    if (m_cacheTtl && authCached(msg,account,query))
+		return true;
 	    Message m("database");
 	    prepareQuery(m,account,query,true);
 	    if (Engine::dispatch(m))
@@ -452,6 +802,8 @@ bool AAAHandler::received(Message& msg)
 			msg.setParam("error","failure");
 			return false;
 		    }
+		    if (m_cacheTtl)
+			authStore(account,query,a);
 		    return true;
 		}
 	    return false;
@@ -501,6 +853,10 @@ bool AAAHandler::received(Message& msg)
 	case UnRegist:
 	{
 	    // no error check needed on unregister - we return false
+	    if (m_batch) {
+		queueWrite(msg,account,query,m_queryBatch,m_queryRow,false);
+		break;
+	    }
 	    Message m("database");
 	    prepareQuery(m,account,query,true);
 	    // we don't enqueue the message because we must assure ourselves that this message is processed synchronously
@@ -550,6 +906,9 @@ bool CDRHandler::loadQuery()
     indirectQuery(m_queryInitialize);
     indirectQuery(m_queryUpdate);
     indirectQuery(m_query);
+    loadBatch("cdr_initialize",m_initializeBatch,m_initializeRow);
+    loadBatch("cdr_update",m_updateBatch,m_updateRow);
+    loadBatch("cdr_finalize",m_queryBatch,m_queryRow);
     return m_queryInitialize || m_queryUpdate || m_query;
 }
 
@@ -563,10 +922,18 @@ bool CDRHandler::received(Message& msg)
     if (!msg.getBoolValue("cdrwrite",true))
 	return false;
     String query(msg.getValue("operation"));
-    if (query == "initialize")
+    const String* batch = &m_queryBatch;
+    const String* row = &m_queryRow;
+    if (query == "initialize") {
 	query = m_queryInitialize;
-    else if (query == "update")
+	batch = &m_initializeBatch;
+	row = &m_initializeRow;
+    }
+    else if (query == "update") {
 	query = m_queryUpdate;
+	batch = &m_updateBatch;
+	row = &m_updateRow;
+    }
     else if (query == "finalize")
 	query = m_query;
     else
@@ -580,6 +947,10 @@ bool CDRHandler::received(Message& msg)
     if (query.null() || account.null())
 	return false;
 
+    if (m_batch) {
+	queueWrite(msg,account,query,*batch,*row,m_critical);
+	return false;
+    }
     // failure while accounting is critical
     Message m("database");
     prepareQuery(m,account,query,true);
@@ -917,6 +1288,23 @@ void RegistModule::statusParams(String& str)
 {
     NamedString* names;
     str.append("critical=",",") << s_critical;
+    if (s_batchSize) {
+	Lock lck(s_batchMutex);
+	unsigned int pending = s_batchQueued - s_batchFlushed;
+	str << ",batch_pending=" << pending;
+	str << ",batch_queries=" << s_batchFlushed;
+	str << ",batch_sent=" << s_batchSent;
+	str << ",batch_saved=" << (s_batchFlushed - s_batchSent);
+	str << ",batch_failed=" << s_batchFailed;
+	str << ",flush_usec=" << (unsigned int)s_batchLatency;
+	str << ",flush_max_usec=" << (unsigned int)s_batchLatencyMax;
+    }
+    if (s_authHits || s_authMisses) {
+	Lock lck(s_authMutex);
+	str << ",auth_cached=" << s_authCount;
+	str << ",auth_hits=" << s_authHits;
+	str << ",auth_misses=" << s_authMisses;
+    }
     for (unsigned int i=0; i < s_statusaccounts.count(); i++) {
 	names = s_statusaccounts.getParam(i);
 	if (names)
@@ -937,9 +1325,33 @@ bool RegistModule::received(Message& msg, int id)
 	}
 	return false;
     }
+    if (id == Timer)
+	expireAuthCache(msg.msgTime().usec());
+    else if (id == Halt && BatchWriter::s_writer)
+	BatchWriter::stop();
     return Module::received(msg,id);
 }
 
+// remove the expired user.auth results
+void RegistModule::expireAuthCache(u_int64_t now)
+{
+    Lock lck(s_authMutex);
+    if (!s_authCount)
+	return;
+    for (unsigned int i = 0; i < s_authCache.length(); i++) {
+	ObjList* l = s_authCache.getList(i);
+	while (l) {
+	    AuthCacheItem* item = static_cast<AuthCacheItem*>(l->get());
+	    if (item && (item->m_expires <= now)) {
+		l->remove();
+		s_authCount--;
+		continue;
+	    }
+	    l = l->next();
+	}
+    }
+}
+
 int RegistModule::getPriority(const String& name)
 {
     bool fb = (name == "chan.disconnected") || (name == "call.answered") || (name == "chan.hangup");
@@ -1011,6 +1423,25 @@ void RegistModule::initialize()
     Output("Initializing module Register for database");
     s_expire = s_cfg.getIntValue("general","expires",s_expire);
     s_errOffline = s_cfg.getBoolValue("call.route","offlineauto",true);
+    int batch = s_cfg.getIntValue("general","batch_size",0);
+    if (batch > 0) {
+	s_batchSize = (batch > 1000) ? 1000 : batch;
+	int interval = s_cfg.getIntValue("general","batch_interval",s_batchInterval);
+	if (interval < 10)
+	    interval = 10;
+	else if (interval > 60000)
+	    interval = 60000;
+	s_batchInterval = interval;
+	s_batchJoin = s_cfg.getBoolValue("general","batch_join",false);
+	installRelay(Halt);
+	BatchWriter::s_writer = new BatchWriter;
+	if (!BatchWriter::s_writer->startup()) {
+	    Debug(this,DebugWarn,"Failed to start batch writer thread, batching disabled");
+	    delete BatchWriter::s_writer;
+	    BatchWriter::s_writer = 0;
+	    s_batchSize = 0;
+	}
+    }
     Engine::install(new MessageRelay("engine.start",this,Private,150));
     addHandler("call.cdr",AAAHandler::Cdr);
     addHandler("linetracker",AAAHandler::Cdr);
@@ -0,0 +1,981 @@
+/**
+ * regstore.cpp
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * In-memory sharded registration location store with database write-behind.
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2011 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <yatephone.h>
+
+
+using namespace TelEngine;
+namespace { // anonymous
+
+class RegBinding;                        // A registered location
+class RegShard;                          // A shard of the location store
+class RegPending;                        // A pending database operation
+class RegWriter;                         // Database write-behind and snapshot thread
+class RegStoreModule;
+
+// Limits for the number of store shards
+#define SHARDS_MIN 1
+#define SHARDS_MAX 1024
+// Initial number of hash lists in each shard, they grow automatically
+#define SHARD_HASH 1021
+// Maximum number of rows put in a single database query
+#define BATCH_MAX 1000
+// Limits for the database flush interval (in milliseconds)
+#define FLUSH_MIN 50
+#define FLUSH_MAX 60000
+// Minimum snapshot interval (in seconds)
+#define SNAPSHOT_MIN 10
+
+// A registered location, the list name is the AOR (username)
+class RegBinding : public NamedList
+{
+    friend class RegShard;
+public:
+    inline RegBinding(const String& aor)
+	: NamedList(aor), m_expires(0), m_heapPos(-1)
+	{}
+    // Registration expire time (seconds), 0 if never expiring
+    inline u_int32_t expires() const
+	{ return m_expires; }
+private:
+    u_int32_t m_expires;
+    int m_heapPos;                       // Position in shard expire heap, -1 if not there
+};
+
+// A shard of the location store
+// Holds hashed bindings and a min-heap of bindings ordered by expire time
+class RegShard : public Mutex
+{
+public:
+    RegShard();
+    ~RegShard();
+    // Retrieve the number of bindings
+    inline unsigned int count() const
+	{ return m_count; }
+    // Find a binding. This method is not thread safe
+    inline RegBinding* find(const String& aor) const
+	{ return static_cast<RegBinding*>(m_bindings[aor]); }
+    // Find or create a binding. This method is not thread safe
+    RegBinding* create(const String& aor);
+    // Set the expire time of a binding. This method is not thread safe
+    void setExpires(RegBinding* binding, u_int32_t expires);
+    // Remove a binding. This method is not thread safe
+    bool remove(const String& aor);
+    // Remove bindings expired at given time, move them to a list
+    // Return the number of removed bindings. This method is not thread safe
+    unsigned int expire(u_int32_t sec, ObjList& expired);
+    // Remove bindings registered on a given connection, move them to a list
+    // Return the number of removed bindings. This method is not thread safe
+    unsigned int dropConnection(const String& conn, ObjList& removed);
+    // Append all bindings to a snapshot buffer. This method is not thread safe
+    void snapshot(String& buf) const;
+    // Remove all bindings. This method is not thread safe
+    void clear();
+    // Retrieve the earliest expire time, 0 if none. This method is not thread safe
+    inline u_int32_t nextExpire() const
+	{ return m_heapLen ? m_heap[0]->m_expires : 0; }
+    // Retrieve hash distribution statistics. This method is not thread safe
+    inline void stats(unsigned int& buckets, unsigned int& used, unsigned int& longest) const
+	{ m_bindings.stats(buckets,used,longest); }
+private:
+    // Detach a binding from the heap
+    void heapRemove(RegBinding* binding);
+    // Restore the heap property for an item
+    void heapUp(unsigned int pos);
+    void heapDown(unsigned int pos);
+    // Put an item at a given heap position
+    inline void heapSet(unsigned int pos, RegBinding* binding) {
+	    m_heap[pos] = binding;
+	    binding->m_heapPos = pos;
+	}
+
+    HashList m_bindings;                 // Bindings indexed by AOR
+    unsigned int m_count;                // Number of bindings
+    RegBinding** m_heap;                 // Expire heap
+    unsigned int m_heapLen;              // Number of items in heap
+    unsigned int m_heapAlloc;            // Allocated heap length
+};
+
+// A pending database operation, the list name is the AOR
+// Parameters are the ones of the binding at the time it was queued
+class RegPending : public NamedList
+{
+public:
+    inline RegPending(const NamedList& binding, bool regist)
+	: NamedList(binding), m_register(regist)
+	{ setParam("username",binding); }
+    inline bool isRegister() const
+	{ return m_register; }
+    inline void update(const NamedList& binding, bool regist) {
+	    clearParams();
+	    copyParams(binding);
+	    setParam("username",binding);
+	    m_register = regist;
+	}
+private:
+    bool m_register;
+};
+
+// Database write-behind and periodic snapshot thread
+class RegWriter : public Thread
+{
+public:
+    inline RegWriter()
+	: Thread("RegStore Writer")
+	{}
+    ~RegWriter();
+    virtual void run();
+};
+
+class RegStoreModule : public Module
+{
+    friend class RegWriter;
+public:
+    enum Relays {
+	Register = Private,
+	Unregister = Private << 1,
+    };
+    RegStoreModule();
+    ~RegStoreModule();
+    // Retrieve the shard holding an AOR
+    // The hash is divided by the initial list count so shards don't select
+    //  on the same low bits as the lists inside a shard. Shard lists grow by
+    //  themselves so the two only start out independent, distribution inside
+    //  a shard is kept even by its growth
+    inline RegShard& shard(const String& aor) const
+	{ return *m_shards[(aor.hash() / SHARD_HASH) % m_shardCount]; }
+    // Flush pending database operations
+    void flushDb();
+    // Save the store snapshot. Return true on success
+    bool saveSnapshot(bool force);
+    // Wait for pending database work or snapshot interval
+    inline void waitWork(long maxwait)
+	{ m_wake.lock(maxwait); }
+protected:
+    virtual void initialize();
+    virtual bool received(Message& msg, int id);
+    virtual bool msgRoute(Message& msg);
+    virtual void statusParams(String& str);
+    virtual bool commandExecute(String& retVal, const String& line);
+    virtual bool commandComplete(Message& msg, const String& partLine, const String& partWord);
+private:
+    // Handle user.register
+    bool regist(Message& msg);
+    // Handle user.unregister
+    bool unregist(Message& msg);
+    // Expire bindings
+    void expire(u_int32_t sec);
+    // Queue a database operation for a binding
+    void queueDb(const NamedList& binding, bool regist);
+    // Send a database query, return true on success
+    bool queryDb(const String& account, const String& query, unsigned int rows);
+    // Build and send queries for a list of operations
+    void flushList(ObjList& ops, const String& account, const String& query,
+	const String& row, unsigned int batch);
+    // Load the store snapshot
+    void loadSnapshot();
+    // Stop the writer thread
+    void stopWriter();
+
+    RegShard** m_shards;                 // Store shards
+    unsigned int m_shardCount;           // Number of shards
+    Mutex m_dbMutex;                     // Protects pending operations and counters
+    HashList m_pending;                  // Pending database operations indexed by AOR
+    unsigned int m_pendingCount;         // Number of pending operations
+    Semaphore m_wake;                    // Writer thread wake up
+    RegWriter* m_writer;                 // Writer thread
+    bool m_halting;                      // Engine halting, writer must exit
+    unsigned int m_changes;              // Changes since last snapshot
+    u_int32_t m_snapshotTime;            // Last snapshot time
+    // Statistics
+    unsigned int m_registered;           // Processed registrations
+    unsigned int m_expired;              // Expired bindings
+    unsigned int m_dbQueries;            // Sent database queries
+    unsigned int m_dbRows;               // Rows written to database
+    unsigned int m_dbFailed;             // Failed database queries
+};
+
+
+INIT_PLUGIN(RegStoreModule);
+
+// Database configuration, changed only with database mutex locked
+static bool s_writeDb = false;           // Write changes to database
+static String s_account;                 // Database account
+static String s_queryRegister;           // Register query, may hold ${values}
+static String s_rowRegister;             // Register row template
+static String s_queryUnregister;         // Unregister query, may hold ${values}
+static String s_rowUnregister;           // Unregister row template
+static unsigned int s_batch = 100;       // Pending operations triggering a flush
+static unsigned int s_flushInterval = 1000; // Database flush interval in msec
+// Snapshot configuration, changed only with module locked
+static String s_snapshotFile;            // Snapshot file
+static unsigned int s_snapshotInterval = 300; // Snapshot interval in seconds
+
+static const String s_data = "data";
+static const String s_driver = "driver";
+static const String s_expires = "expires";
+static const String s_routeParams = "route_params";
+static const String s_connId = "connection_id";
+
+// Commands
+static const String s_cmds[] = {"snapshot", "flush", ""};
+
+// Check if application or current thread are terminating
+static inline bool exiting()
+{
+    return Engine::exiting() || Thread::check(false);
+}
+
+// Copy route parameters from a binding to a list
+static inline void copyRouteParams(NamedList& dest, const NamedList& src)
+{
+    String s = src[s_routeParams];
+    s.append(s_driver,",");
+    dest.copyParams(src,s);
+}
+
+
+/*
+ * RegShard
+ */
+RegShard::RegShard()
+    : Mutex(false,"RegShard"),
+    m_bindings(SHARD_HASH), m_count(0), m_heap(0), m_heapLen(0), m_heapAlloc(0)
+{
+    m_bindings.autoResize();
+}
+
+RegShard::~RegShard()
+{
+    clear();
+    delete[] m_heap;
+}
+
+RegBinding* RegShard::create(const String& aor)
+{
+    RegBinding* b = find(aor);
+    if (b)
+	return b;
+    b = new RegBinding(aor);
+    m_bindings.append(b);
+    m_count++;
+    return b;
+}
+
+void RegShard::setExpires(RegBinding* binding, u_int32_t expires)
+{
+    if (!binding || binding->m_expires == expires)
+	return;
+    u_int32_t old = binding->m_expires;
+    binding->m_expires = expires;
+    if (!expires) {
+	heapRemove(binding);
+	return;
+    }
+    if (binding->m_heapPos >= 0) {
+	if (expires < old)
+	    heapUp(binding->m_heapPos);
+	else
+	    heapDown(binding->m_heapPos);
+	return;
+    }
+    if (m_heapLen >= m_heapAlloc) {
+	unsigned int len = m_heapAlloc ? m_heapAlloc * 2 : 64;
+	RegBinding** heap = new RegBinding*[len];
+	for (unsigned int i = 0; i < m_heapLen; i++)
+	    heap[i] = m_heap[i];
+	delete[] m_heap;
+	m_heap = heap;
+	m_heapAlloc = len;
+    }
+    heapSet(m_heapLen,binding);
+    heapUp(m_heapLen++);
+}
+
+bool RegShard::remove(const String& aor)
+{
+    RegBinding* b = find(aor);
+    if (!b)
+	return false;
+    heapRemove(b);
+    m_bindings.remove(b);
+    m_count--;
+    return true;
+}
+
+unsigned int RegShard::expire(u_int32_t sec, ObjList& expired)
+{
+    unsigned int n = 0;
+    while (m_heapLen && m_heap[0]->m_expires <= sec) {
+	RegBinding* b = m_heap[0];
+	heapRemove(b);
+	m_bindings.remove(b,false);
+	m_count--;
+	expired.append(b);
+	n++;
+    }
+    return n;
+}
+
+unsigned int RegShard::dropConnection(const String& conn, ObjList& removed)
+{
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < m_bindings.length(); i++) {
+	ObjList* l = m_bindings.getList(i);
+	if (l)
+	    l = l->skipNull();
+	while (l) {
+	    RegBinding* b = static_cast<RegBinding*>(l->get());
+	    if ((*b)[s_connId] != conn) {
+		l = l->skipNext();
+		continue;
+	    }
+	    heapRemove(b);
+	    l->remove(false);
+	    removed.append(b);
+	    m_count--;
+	    n++;
+	    l = l->skipNull();
+	}
+    }
+    return n;
+}
+
+void RegShard::snapshot(String& buf) const
+{
+    for (unsigned int i = 0; i < m_bindings.length(); i++) {
+	for (ObjList* l = m_bindings.getList(i); l; l = l->skipNext()) {
+	    const RegBinding* b = static_cast<const RegBinding*>(l->get());
+	    if (!b)
+		continue;
+	    buf << b->msgEscape() << ":" << b->m_expires;
+	    unsigned int n = b->length();
+	    for (unsigned int j = 0; j < n; j++) {
+		const NamedString* ns = b->getParam(j);
+		if (ns)
+		    buf << ":" << ns->name().msgEscape('=') << "=" << ns->msgEscape();
+	    }
+	    buf << "\n";
+	}
+    }
+}
+
+void RegShard::clear()
+{
+    for (unsigned int i = 0; i < m_heapLen; i++)
+	m_heap[i]->m_heapPos = -1;
+    m_heapLen = 0;
+    m_bindings.clear();
+    m_count = 0;
+}
+
+void RegShard::heapRemove(RegBinding* binding)
+{
+    int pos = binding->m_heapPos;
+    if (pos < 0)
+	return;
+    binding->m_heapPos = -1;
+    if ((unsigned int)pos == --m_heapLen)
+	return;
+    RegBinding* last = m_heap[m_heapLen];
+    heapSet(pos,last);
+    heapUp(pos);
+    if (last->m_heapPos == pos)
+	heapDown(pos);
+}
+
+void RegShard::heapUp(unsigned int pos)
+{
+    RegBinding* b = m_heap[pos];
+    while (pos) {
+	unsigned int parent = (pos - 1) / 2;
+	if (m_heap[parent]->m_expires <= b->m_expires)
+	    break;
+	heapSet(pos,m_heap[parent]);
+	pos = parent;
+    }
+    heapSet(pos,b);
+}
+
+void RegShard::heapDown(unsigned int pos)
+{
+    RegBinding* b = m_heap[pos];
+    while (true) {
+	unsigned int child = 2 * pos + 1;
+	if (child >= m_heapLen)
+	    break;
+	if (child + 1 < m_heapLen && m_heap[child + 1]->m_expires < m_heap[child]->m_expires)
+	    child++;
+	if (b->m_expires <= m_heap[child]->m_expires)
+	    break;
+	heapSet(pos,m_heap[child]);
+	pos = child;
+    }
+    heapSet(pos,b);
+}
+
+
+/*
+ * RegWriter
+ */
+RegWriter::~RegWriter()
+{
+    Lock lck(__plugin);
+    if (__plugin.m_writer == this)
+	__plugin.m_writer = 0;
+}
+
+void RegWriter::run()
+{
+    Debug(&__plugin,DebugAll,"%s start running [%p]",currentName(),this);
+    while (true) {
+	__plugin.m_dbMutex.lock();
+	long wait = (long)s_flushInterval * 1000;
+	__plugin.m_dbMutex.unlock();
+	__plugin.lock();
+	bool halting = __plugin.m_halting;
+	__plugin.unlock();
+	if (!halting)
+	    __plugin.waitWork(wait);
+	__plugin.flushDb();
+	if (halting || exiting())
+	    break;
+	__plugin.saveSnapshot(false);
+    }
+    // Final flush of what was queued while exiting and full snapshot
+    __plugin.flushDb();
+    __plugin.saveSnapshot(true);
+    Debug(&__plugin,DebugAll,"%s stopped [%p]",currentName(),this);
+}
+
+
+/*
+ * RegStoreModule
+ */
+RegStoreModule::RegStoreModule()
+    : Module("regstore","misc"),
+    m_shards(0), m_shardCount(0),
+    m_dbMutex(false,"RegStoreDb"), m_pending(SHARD_HASH), m_pendingCount(0),
+    m_wake(1,"RegStoreWake"), m_writer(0), m_halting(false),
+    m_changes(0), m_snapshotTime(0),
+    m_registered(0), m_expired(0), m_dbQueries(0), m_dbRows(0), m_dbFailed(0)
+{
+    Output("Loaded module Registration Store");
+}
+
+RegStoreModule::~RegStoreModule()
+{
+    Output("Unloading module Registration Store");
+    if (m_shards) {
+	for (unsigned int i = 0; i < m_shardCount; i++)
+	    delete m_shards[i];
+	delete[] m_shards;
+    }
+}
+
+void RegStoreModule::initialize()
+{
+    Output("Initializing module Registration Store");
+    Configuration cfg(Engine::configFile("regstore"));
+    m_dbMutex.lock();
+    s_account = cfg.getValue("database","account");
+    s_queryRegister = cfg.getValue("database","query_register");
+    s_rowRegister = cfg.getValue("database","row_register");
+    s_queryUnregister = cfg.getValue("database","query_unregister");
+    s_rowUnregister = cfg.getValue("database","row_unregister");
+    int tmp = cfg.getIntValue("database","batch",100);
+    s_batch = (tmp < 1) ? 1 : ((tmp > BATCH_MAX) ? BATCH_MAX : tmp);
+    tmp = cfg.getIntValue("database","flush_interval",1000);
+    s_flushInterval = (tmp < FLUSH_MIN) ? FLUSH_MIN : ((tmp > FLUSH_MAX) ? FLUSH_MAX : tmp);
+    s_writeDb = !s_account.null();
+    m_dbMutex.unlock();
+    lock();
+    tmp = cfg.getIntValue("general","snapshot_interval",300);
+    s_snapshotInterval = (tmp <= 0) ? 0 : ((tmp < SNAPSHOT_MIN) ? SNAPSHOT_MIN : tmp);
+    bool first = !m_shards;
+    if (first && !cfg.getBoolValue("general","enabled",false)) {
+	// don't take over registrations and routing unless asked to
+	unlock();
+	Debug(this,DebugInfo,"Registration store is disabled");
+	return;
+    }
+    if (first) {
+	s_snapshotFile = cfg.getValue("general","snapshot");
+	Engine::runParams().replaceParams(s_snapshotFile);
+	tmp = cfg.getIntValue("general","shards",31);
+	m_shardCount = (tmp < SHARDS_MIN) ? SHARDS_MIN : ((tmp > SHARDS_MAX) ? SHARDS_MAX : tmp);
+	m_shards = new RegShard*[m_shardCount];
+	for (unsigned int i = 0; i < m_shardCount; i++)
+	    m_shards[i] = new RegShard;
+    }
+    unlock();
+    if (!first)
+	return;
+    loadSnapshot();
+    setup();
+    installRelay(Halt);
+    int prio = cfg.getIntValue("general","register",100);
+    installRelay(Register,"user.register",prio);
+    installRelay(Unregister,"user.unregister",prio);
+    installRelay(Route,cfg.getIntValue("general","route",100));
+    m_writer = new RegWriter;
+    if (!m_writer->startup()) {
+	Debug(this,DebugWarn,"Failed to start writer thread");
+	delete m_writer;
+    }
+}
+
+bool RegStoreModule::received(Message& msg, int id)
+{
+    switch (id) {
+	case Register:
+	    return regist(msg);
+	case Unregister:
+	    return unregist(msg);
+	case Timer:
+	    expire(msg.msgTime().sec());
+	    break;
+	case Halt:
+	    stopWriter();
+	    break;
+    }
+    return Module::received(msg,id);
+}
+
+bool RegStoreModule::regist(Message& msg)
+{
+    const String& aor = msg["username"];
+    const String& data = msg[s_data];
+    if (!(aor && data))
+	return false;
+    int exp = msg.getIntValue(s_expires,0);
+    NamedList saved(aor);
+    RegShard& sh = shard(aor);
+    sh.lock();
+    bool created = !sh.find(aor);
+    RegBinding* b = sh.create(aor);
+    const String* driver = msg.getParam(s_driver);
+    if (driver)
+	b->setParam(s_driver,*driver);
+    b->setParam(s_data,data);
+    // Clear existing route parameters
+    const String* params = b->getParam(s_routeParams);
+    if (params) {
+	ObjList* l = params->split(',',false);
+	for (ObjList* o = l->skipNull(); o; o = o->skipNext())
+	    b->clearParam(o->get()->toString());
+	TelEngine::destruct(l);
+	b->clearParam(s_routeParams);
+    }
+    const String& route = msg[s_routeParams];
+    if (route) {
+	b->copyParams(msg,route);
+	b->setParam(s_routeParams,route);
+    }
+    b->clearParam("connection",'_');
+    b->copyParams(msg,"connection",'_');
+    u_int32_t expires = exp > 0 ? msg.msgTime().sec() + exp : 0;
+    sh.setExpires(b,expires);
+    b->setParam(s_expires,String(expires));
+    bool db = s_writeDb;
+    if (db)
+	saved.copyParams(*b);
+    sh.unlock();
+    Debug(this,DebugAll,"%s user %s via %s expires=%d",
+	(created ? "Registered" : "Refreshed"),aor.c_str(),data.c_str(),exp);
+    lock();
+    m_registered++;
+    m_changes++;
+    unlock();
+    if (db)
+	queueDb(saved,true);
+    return true;
+}
+
+bool RegStoreModule::unregist(Message& msg)
+{
+    const String& aor = msg["username"];
+    if (aor) {
+	RegShard& sh = shard(aor);
+	sh.lock();
+	bool ok = sh.remove(aor);
+	sh.unlock();
+	if (!ok)
+	    return false;
+	Debug(this,DebugAll,"Removing user %s, reason unregistered",aor.c_str());
+	lock();
+	m_changes++;
+	unlock();
+	queueDb(NamedList(aor),false);
+	return true;
+    }
+    const String& conn = msg[s_connId];
+    if (!conn)
+	return false;
+    ObjList removed;
+    for (unsigned int i = 0; i < m_shardCount; i++) {
+	Lock lck(m_shards[i]);
+	m_shards[i]->dropConnection(conn,removed);
+    }
+    for (ObjList* o = removed.skipNull(); o; o = o->skipNext()) {
+	RegBinding* b = static_cast<RegBinding*>(o->get());
+	Debug(this,DebugAll,"Removing user %s, reason connection down",b->c_str());
+	queueDb(*b,false);
+	lock();
+	m_changes++;
+	unlock();
+    }
+    return false;
+}
+
+bool RegStoreModule::msgRoute(Message& msg)
+{
+    const String& aor = msg["called"];
+    if (!aor)
+	return false;
+    RegShard& sh = shard(aor);
+    Lock lck(sh);
+    RegBinding* b = sh.find(aor);
+    if (!b)
+	return false;
+    msg.retValue() = (*b)[s_data];
+    copyRouteParams(msg,*b);
+    lck.drop();
+    Debug(this,DebugInfo,"Routed '%s' via '%s'",aor.c_str(),msg.retValue().c_str());
+    return true;
+}
+
+void RegStoreModule::expire(u_int32_t sec)
+{
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < m_shardCount; i++) {
+	RegShard* sh = m_shards[i];
+	ObjList expired;
+	sh->lock();
+	u_int32_t next = sh->nextExpire();
+	if (next && next <= sec)
+	    n += sh->expire(sec,expired);
+	sh->unlock();
+	for (ObjList* o = expired.skipNull(); o; o = o->skipNext()) {
+	    RegBinding* b = static_cast<RegBinding*>(o->get());
+	    DDebug(this,DebugAll,"Removing user %s, reason registration expired",b->c_str());
+	    queueDb(*b,false);
+	}
+    }
+    if (!n)
+	return;
+    Debug(this,DebugInfo,"Expired %u registrations",n);
+    lock();
+    m_expired += n;
+    m_changes += n;
+    unlock();
+}
+
+void RegStoreModule::queueDb(const NamedList& binding, bool regist)
+{
+    Lock lck(m_dbMutex);
+    if (!s_account)
+	return;
+    // Coalesce operations on the same AOR, the last one wins
+    RegPending* op = static_cast<RegPending*>(m_pending[binding]);
+    if (op) {
+	op->update(binding,regist);
+	return;
+    }
+    m_pending.append(new RegPending(binding,regist));
+    if (++m_pendingCount >= s_batch)
+	m_wake.unlock();
+}
+
+void RegStoreModule::flushDb()
+{
+    ObjList regs;
+    ObjList unregs;
+    m_dbMutex.lock();
+    for (unsigned int i = 0; i < m_pending.length(); i++) {
+	ObjList* l = m_pending.getList(i);
+	if (l)
+	    l = l->skipNull();
+	while (l) {
+	    RegPending* op = static_cast<RegPending*>(l->remove(false));
+	    if (op->isRegister())
+		regs.append(op);
+	    else
+		unregs.append(op);
+	    l = l->skipNull();
+	}
+    }
+    m_pendingCount = 0;
+    String account = s_account;
+    String qReg = s_queryRegister;
+    String rReg = s_rowRegister;
+    String qUnreg = s_queryUnregister;
+    String rUnreg = s_rowUnregister;
+    unsigned int batch = s_batch;
+    m_dbMutex.unlock();
+    if (!(account && (regs.skipNull() || unregs.skipNull())))
+	return;
+    u_int64_t start = Time::now();
+    flushList(regs,account,qReg,rReg,batch);
+    flushList(unregs,account,qUnreg,rUnreg,batch);
+    Debug(this,DebugAll,"Flushed %u registrations, %u removals in " FMT64U " usec",
+	regs.count(),unregs.count(),Time::now() - start);
+}
+
+void RegStoreModule::flushList(ObjList& ops, const String& account, const String& query,
+    const String& row, unsigned int batch)
+{
+    if (!query)
+	return;
+    ObjList* o = ops.skipNull();
+    if (!row) {
+	// No row template: one query per operation
+	for (; o; o = o->skipNext()) {
+	    String q = query;
+	    static_cast<NamedList*>(o->get())->replaceParams(q,true);
+	    queryDb(account,q,1);
+	}
+	return;
+    }
+    while (o) {
+	String values;
+	unsigned int n = 0;
+	for (; o && n < batch; o = o->skipNext(), n++) {
+	    String r = row;
+	    static_cast<NamedList*>(o->get())->replaceParams(r,true);
+	    values.append(r,",");
+	}
+	NamedList p("");
+	p.addParam("values",values);
+	p.addParam("count",String(n));
+	String q = query;
+	p.replaceParams(q);
+	queryDb(account,q,n);
+    }
+}
+
+bool RegStoreModule::queryDb(const String& account, const String& query, unsigned int rows)
+{
+    Message m("database");
+    m.addParam("account",account);
+    m.addParam("query",query);
+    m.addParam("results",String::boolText(false));
+    bool ok = Engine::dispatch(m) && !m.getParam("error");
+    if (!ok)
+	Debug(this,DebugWarn,"Failed to write %u rows to database account '%s': %s",
+	    rows,account.c_str(),m.getValue("error","not handled"));
+    Lock lck(m_dbMutex);
+    m_dbQueries++;
+    if (ok)
+	m_dbRows += rows;
+    else
+	m_dbFailed++;
+    return ok;
+}
+
+bool RegStoreModule::saveSnapshot(bool force)
+{
+    lock();
+    String file = s_snapshotFile;
+    u_int32_t now = Time::secNow();
+    bool due = s_snapshotInterval && (now >= m_snapshotTime + s_snapshotInterval);
+    bool ok = file && m_changes && (force || due);
+    unsigned int changes = m_changes;
+    unlock();
+    if (!ok)
+	return false;
+    String tmp = file + ".tmp";
+    File f;
+    if (!f.openPath(tmp,true,false,true)) {
+	Debug(this,DebugWarn,"Failed to create snapshot file '%s': %d",tmp.c_str(),f.error());
+	return false;
+    }
+    u_int64_t start = Time::now();
+    unsigned int n = 0;
+    for (unsigned int i = 0; ok && i < m_shardCount; i++) {
+	String buf;
+	m_shards[i]->lock();
+	n += m_shards[i]->count();
+	m_shards[i]->snapshot(buf);
+	m_shards[i]->unlock();
+	if (buf && f.writeData(buf.c_str(),buf.length()) != (int)buf.length())
+	    ok = false;
+    }
+    f.terminate();
+    if (!(ok && File::rename(tmp,file))) {
+	Debug(this,DebugWarn,"Failed to write snapshot file '%s'",file.c_str());
+	File::remove(tmp);
+	return false;
+    }
+    Debug(this,DebugInfo,"Saved %u registrations to '%s' in " FMT64U " usec",
+	n,file.c_str(),Time::now() - start);
+    lock();
+    m_snapshotTime = now;
+    m_changes -= changes;
+    unlock();
+    return true;
+}
+
+void RegStoreModule::loadSnapshot()
+{
+    m_snapshotTime = Time::secNow();
+    if (!s_snapshotFile)
+	return;
+    File f;
+    if (!f.openPath(s_snapshotFile)) {
+	Debug(this,DebugNote,"Could not open snapshot file '%s'",s_snapshotFile.c_str());
+	return;
+    }
+    u_int32_t now = Time::secNow();
+    unsigned int loaded = 0;
+    unsigned int skipped = 0;
+    String line;
+    char buf[8192];
+    while (true) {
+	int rd = f.readData(buf,sizeof(buf));
+	if (rd <= 0)
+	    break;
+	line += String(buf,rd);
+	int start = 0;
+	int pos = 0;
+	while ((pos = line.find('\n',start)) >= 0) {
+	    ObjList* l = line.substr(start,pos - start).split(':');
+	    start = pos + 1;
+	    ObjList* o = l->skipNull();
+	    String aor = o ? o->get()->toString().msgUnescape() : String::empty();
+	    o = o ? o->skipNext() : 0;
+	    u_int32_t expires = o ? o->get()->toString().toInteger(0,10,0) : 0;
+	    if (!aor || (expires && expires <= now)) {
+		TelEngine::destruct(l);
+		skipped++;
+		continue;
+	    }
+	    RegShard& sh = shard(aor);
+	    Lock lck(sh);
+	    RegBinding* b = sh.create(aor);
+	    for (o = o->skipNext(); o; o = o->skipNext()) {
+		const String& s = o->get()->toString();
+		int eq = s.find('=');
+		if (eq > 0)
+		    b->setParam(s.substr(0,eq).msgUnescape(0,'='),s.substr(eq + 1).msgUnescape());
+	    }
+	    sh.setExpires(b,expires);
+	    lck.drop();
+	    TelEngine::destruct(l);
+	    loaded++;
+	}
+	line = line.substr(start);
+    }
+    Debug(this,DebugInfo,"Loaded %u registrations (skipped %u) from '%s'",
+	loaded,skipped,s_snapshotFile.c_str());
+}
+
+void RegStoreModule::stopWriter()
+{
+    lock();
+    m_halting = true;
+    unlock();
+    m_wake.unlock();
+    // Give the writer a chance to flush and save the snapshot
+    for (unsigned int i = 0; i < 500; i++) {
+	Lock lck(this);
+	if (!m_writer)
+	    return;
+	lck.drop();
+	Thread::idle();
+    }
+    Debug(this,DebugWarn,"Writer thread did not stop in time");
+}
+
+void RegStoreModule::statusParams(String& str)
+{
+    unsigned int n = 0;
+    unsigned int buckets = 0;
+    unsigned int used = 0;
+    unsigned int longest = 0;
+    for (unsigned int i = 0; i < m_shardCount; i++) {
+	unsigned int b = 0;
+	unsigned int u = 0;
+	unsigned int l = 0;
+	Lock lck(m_shards[i]);
+	n += m_shards[i]->count();
+	m_shards[i]->stats(b,u,l);
+	lck.drop();
+	buckets += b;
+	used += u;
+	if (longest < l)
+	    longest = l;
+    }
+    str.append("shards=",",") << m_shardCount;
+    str << ",users=" << n;
+    str << ",buckets=" << buckets;
+    str << ",usedbuckets=" << used;
+    str << ",longestchain=" << longest;
+    str << ",registered=" << m_registered;
+    str << ",expired=" << m_expired;
+    if (s_snapshotFile)
+	str << ",snapshot=" << (m_snapshotTime ? Time::secNow() - m_snapshotTime : 0);
+    Lock lck(m_dbMutex);
+    str << ",pending=" << m_pendingCount;
+    str << ",queries=" << m_dbQueries;
+    str << ",rows=" << m_dbRows;
+    str << ",failed=" << m_dbFailed;
+}
+
+bool RegStoreModule::commandExecute(String& retVal, const String& line)
+{
+    String l = line;
+    if (!l.startSkip(name()))
+	return Module::commandExecute(retVal,line);
+    l.trimBlanks();
+    if (l == s_cmds[0]) {
+	if (saveSnapshot(true))
+	    retVal << "Snapshot saved\r\n";
+	else
+	    retVal << "Snapshot not saved\r\n";
+	return true;
+    }
+    if (l == s_cmds[1]) {
+	flushDb();
+	retVal << "Database queue flushed\r\n";
+	return true;
+    }
+    return false;
+}
+
+bool RegStoreModule::commandComplete(Message& msg, const String& partLine, const String& partWord)
+{
+    if (!partLine || partLine == YSTRING("help"))
+	itemComplete(msg.retValue(),name(),partWord);
+    else if (partLine == name()) {
+	for (int i = 0; s_cmds[i]; i++)
+	    itemComplete(msg.retValue(),s_cmds[i],partWord);
+	return false;
+    }
+    return Module::commandComplete(msg,partLine,partWord);
+}
+
+}; // anonymous namespace
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -0,0 +1,219 @@
+/**
+ * lockbench.cpp
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Mutex throughput benchmark comparing the platform and adaptive mutexes
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2006 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <yatengine.h>
+
+#include <stdio.h>
+
+using namespace TelEngine;
+namespace { // anonymous
+
+// One benchmark run: a number of threads locking the same mutex
+class BenchRun : public Mutex
+{
+public:
+    BenchRun();
+    void worker();
+    bool run(Mutex& mutex, unsigned int threads, unsigned int msec);
+    inline u_int64_t ops() const
+	{ return m_ops; }
+private:
+    Mutex* m_mutex;
+    volatile bool m_go;
+    volatile bool m_stop;
+    unsigned int m_running;
+    u_int64_t m_ops;
+    unsigned int m_shared;
+};
+
+class BenchThread : public Thread
+{
+public:
+    inline BenchThread(BenchRun* bench)
+	: Thread("LockBench"), m_bench(bench)
+	{ }
+    virtual void run()
+	{ m_bench->worker(); }
+private:
+    BenchRun* m_bench;
+};
+
+class BenchHandler : public MessageHandler
+{
+public:
+    BenchHandler()
+	: MessageHandler("engine.command",100)
+	{ }
+    virtual bool received(Message &msg);
+};
+
+class LockBench : public Plugin
+{
+public:
+    LockBench();
+    virtual ~LockBench();
+    virtual void initialize();
+private:
+    BenchHandler* m_handler;
+};
+
+INIT_PLUGIN(LockBench);
+
+static const char s_cmd[] = "lockbench";
+
+
+BenchRun::BenchRun()
+    : Mutex(false,"LockBench"),
+      m_mutex(0), m_go(false), m_stop(false), m_running(0), m_ops(0), m_shared(0)
+{
+}
+
+void BenchRun::worker()
+{
+    lock();
+    m_running++;
+    unlock();
+    while (!m_go)
+	Thread::yield();
+    u_int64_t ops = 0;
+    while (!m_stop) {
+	// very short critical section, like most engine locks
+	for (int i = 0; i < 100; i++) {
+	    m_mutex->lock();
+	    m_shared++;
+	    m_mutex->unlock();
+	}
+	ops += 100;
+    }
+    lock();
+    m_ops += ops;
+    m_running--;
+    unlock();
+}
+
+bool BenchRun::run(Mutex& mutex, unsigned int threads, unsigned int msec)
+{
+    m_mutex = &mutex;
+    m_go = m_stop = false;
+    m_ops = 0;
+    unsigned int started = 0;
+    for (; started < threads; started++) {
+	BenchThread* t = new BenchThread(this);
+	if (!t->startup()) {
+	    delete t;
+	    break;
+	}
+    }
+    // wait for all threads to be ready
+    for (;;) {
+	Lock mylock(this);
+	if (m_running >= started)
+	    break;
+	mylock.drop();
+	Thread::msleep(1);
+    }
+    m_go = true;
+    Thread::msleep(msec);
+    m_stop = true;
+    for (;;) {
+	Lock mylock(this);
+	if (!m_running)
+	    break;
+	mylock.drop();
+	Thread::msleep(1);
+    }
+    return started == threads;
+}
+
+
+// Command: lockbench [duration_ms] [max_threads]
+bool BenchHandler::received(Message &msg)
+{
+    String line(msg.getValue(YSTRING("line")));
+    if (!line.startSkip(s_cmd)) {
+	line = msg.getValue(YSTRING("partline"));
+	if (line.null() && String(s_cmd).startsWith(msg.getValue(YSTRING("partword"))))
+	    msg.retValue().append(s_cmd,"\t");
+	return false;
+    }
+    unsigned int msec = 200;
+    unsigned int maxThreads = 64;
+    int tmp = -1;
+    line >> tmp;
+    if (tmp > 0)
+	msec = (tmp > 10000) ? 10000 : tmp;
+    line.trimSpaces();
+    tmp = line.toInteger(-1);
+    if (tmp > 0)
+	maxThreads = (tmp > 256) ? 256 : tmp;
+    bool haveAdaptive = Mutex::adaptiveSupported();
+    Mutex plain(false,"LockBenchPlain",false);
+    Mutex fast(false,"LockBenchAdaptive",true);
+    String& ret = msg.retValue();
+    ret << "Threads  Platform (ops/s)  Adaptive (ops/s)\r\n";
+    for (unsigned int n = 1; n <= maxThreads; n *= 2) {
+	BenchRun bench;
+	bool ok = bench.run(plain,n,msec);
+	char buf[64];
+	::snprintf(buf,sizeof(buf),"%7u  %16u",n,(unsigned int)(bench.ops() * 1000 / msec));
+	String res(buf);
+	if (haveAdaptive) {
+	    ok = bench.run(fast,n,msec) && ok;
+	    ::snprintf(buf,sizeof(buf),"  %16u",(unsigned int)(bench.ops() * 1000 / msec));
+	    res << buf;
+	}
+	else
+	    res << "  not supported";
+	if (!ok)
+	    res << "  (not all threads started)";
+	ret << res << "\r\n";
+    }
+    return true;
+}
+
+
+LockBench::LockBench()
+    : Plugin("lockbench"),
+      m_handler(0)
+{
+    Output("Loaded module LockBench");
+}
+
+LockBench::~LockBench()
+{
+    Output("Unloading module LockBench");
+}
+
+void LockBench::initialize()
+{
+    if (!m_handler) {
+	Output("Initializing module LockBench");
+	m_handler = new BenchHandler;
+	Engine::install(m_handler);
+    }
+}
+
+}; // anonymous namespace
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -0,0 +1,190 @@
+/**
+ * msgbench.cpp
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * External message codec benchmark comparing text and binary frame encoding
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2006 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <yatengine.h>
+
+#include <stdio.h>
+
+using namespace TelEngine;
+namespace { // anonymous
+
+class BenchHandler : public MessageHandler
+{
+public:
+    BenchHandler()
+	: MessageHandler("engine.command",100)
+	{ }
+    virtual bool received(Message &msg);
+};
+
+class MsgBench : public Plugin
+{
+public:
+    MsgBench();
+    virtual ~MsgBench();
+    virtual void initialize();
+private:
+    BenchHandler* m_handler;
+};
+
+INIT_PLUGIN(MsgBench);
+
+static const char s_cmd[] = "msgbench";
+
+// Parameters similar to the ones of a routed call
+static const char* s_params[] = {
+    "id", "sip/1234",
+    "module", "sip",
+    "status", "incoming",
+    "address", "192.168.1.10:5060",
+    "billid", "1234567890-12",
+    "caller", "4001",
+    "callername", "John Doe",
+    "called", "123456789",
+    "username", "4001",
+    "sip_uri", "sip:123456789@example.com",
+    "sip_from", "\"John Doe\" <sip:4001@example.com>;tag=1234",
+    "sip_to", "<sip:123456789@example.com>",
+    "sip_callid", "a84b4c76e66710@pc33.example.com",
+    "sip_contact", "<sip:4001@192.168.1.10:5060>",
+    "sip_user-agent", "YATE/2.0.0",
+    "device", "YATE/2.0.0",
+    "formats", "alaw,mulaw,gsm",
+    "media", "yes",
+    "rtp_addr", "192.168.1.10",
+    "rtp_port", "16384",
+    0
+};
+
+
+// Compute operations per second from the time spent
+static unsigned int rate(unsigned int count, u_int64_t usec)
+{
+    if (!usec)
+	usec = 1;
+    return (unsigned int)(count * (u_int64_t)1000000 / usec);
+}
+
+// Command: msgbench [iterations]
+bool BenchHandler::received(Message &msg)
+{
+    String line(msg.getValue(YSTRING("line")));
+    if (!line.startSkip(s_cmd)) {
+	line = msg.getValue(YSTRING("partline"));
+	if (line.null() && String(s_cmd).startsWith(msg.getValue(YSTRING("partword"))))
+	    msg.retValue().append(s_cmd,"\t");
+	return false;
+    }
+    unsigned int count = 100000;
+    int tmp = line.toInteger(-1);
+    if (tmp > 0)
+	count = (tmp > 10000000) ? 10000000 : tmp;
+    Message m("call.route");
+    for (int i = 0; s_params[i]; i += 2)
+	m.addParam(s_params[i],s_params[i+1]);
+    m.retValue() = "sip/sip:123456789@10.0.0.1";
+    static const char id[] = "0x12345678.987654321";
+
+    // text protocol
+    String text;
+    u_int64_t start = Time::now();
+    for (unsigned int i = 0; i < count; i++)
+	text = m.encode(id);
+    u_int64_t textEnc = Time::now() - start;
+    bool textOk = true;
+    start = Time::now();
+    for (unsigned int i = 0; i < count; i++) {
+	Message d("");
+	String did;
+	if (d.decode(text,did) != -2)
+	    textOk = false;
+    }
+    u_int64_t textDec = Time::now() - start;
+
+    // binary frames
+    DataBlock frame;
+    start = Time::now();
+    for (unsigned int i = 0; i < count; i++) {
+	frame.clear();
+	m.encodeFrame(frame,id);
+    }
+    u_int64_t binEnc = Time::now() - start;
+    bool binOk = true;
+    start = Time::now();
+    for (unsigned int i = 0; i < count; i++) {
+	Message d("");
+	String did;
+	if (d.decodeFrame(frame.data(),frame.length(),did) != -2)
+	    binOk = false;
+    }
+    u_int64_t binDec = Time::now() - start;
+
+    // check both codecs decode to the same message
+    Message t(""), b("");
+    String tid, bid;
+    t.decode(text,tid);
+    b.decodeFrame(frame.data(),frame.length(),bid);
+    String dt, db;
+    t.dump(dt,"|");
+    b.dump(db,"|");
+
+    String& ret = msg.retValue();
+    ret << "Codec   Bytes  Encode (msg/s)  Decode (msg/s)\r\n";
+    char buf[80];
+    ::snprintf(buf,sizeof(buf),"text   %6u  %14u  %14u",text.length(),
+	rate(count,textEnc),rate(count,textDec));
+    ret << buf << (textOk ? "" : "  (decode failed)") << "\r\n";
+    ::snprintf(buf,sizeof(buf),"binary %6u  %14u  %14u",frame.length(),
+	rate(count,binEnc),rate(count,binDec));
+    ret << buf << (binOk ? "" : "  (decode failed)") << "\r\n";
+    if (dt != db || tid != bid)
+	ret << "Decoded messages differ!\r\n";
+    return true;
+}
+
+
+MsgBench::MsgBench()
+    : Plugin("msgbench"),
+      m_handler(0)
+{
+    Output("Loaded module MsgBench");
+}
+
+MsgBench::~MsgBench()
+{
+    Output("Unloading module MsgBench");
+}
+
+void MsgBench::initialize()
+{
+    if (!m_handler) {
+	Output("Initializing module MsgBench");
+	m_handler = new BenchHandler;
+	Engine::install(m_handler);
+    }
+}
+
+}; // anonymous namespace
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -0,0 +1,274 @@
+/**
+ * scriptbench.cpp
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Script evaluation benchmark comparing interpreted and bytecode scripts
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2006 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <yatengine.h>
+#include <yatescript.h>
+
+#include <stdio.h>
+
+using namespace TelEngine;
+namespace { // anonymous
+
+// Fields of a routed call, resolved by name like script objects do
+class BenchFields : public ExpExtender
+{
+public:
+    BenchFields();
+    void reset();
+    virtual bool runField(ObjList& stack, const ExpOperation& oper, GenObject* context);
+    virtual bool runAssign(ObjList& stack, const ExpOperation& oper, GenObject* context);
+private:
+    NamedList m_params;
+};
+
+class BenchHandler : public MessageHandler
+{
+public:
+    BenchHandler()
+	: MessageHandler("engine.command",100)
+	{ }
+    virtual bool received(Message &msg);
+};
+
+class ScriptBench : public Plugin
+{
+public:
+    ScriptBench();
+    virtual ~ScriptBench();
+    virtual void initialize();
+private:
+    BenchHandler* m_handler;
+};
+
+INIT_PLUGIN(ScriptBench);
+
+static const char s_cmd[] = "scriptbench";
+
+// Expressions similar to the ones used when routing calls
+static const char* s_scripts[] = {
+    "called == '123456789' && caller != '' && billid > 1000",
+    "(billid % 100) * 3 + duration / 2 - 7 >= 50",
+    "'sip/' . called . '@' . domain",
+    "x = called + 1, y = x * 2 + x, y > 100",
+    "count += 1, called . '-' . count",
+    "caller != '' && caller == called || duration < 5 && !(billid & 1)",
+    0
+};
+
+// Javascript routing scripts using the fields of a 'message' object
+static const char* s_jsScripts[] = {
+    "if (message.called == '123456789') { route = 'sip/' + message.called + '@' + message.domain; }",
+    "route = ''; if (message.caller != '' && message.billid > 1000) { route = 'tdm/span1/' + message.called; }",
+    "prefix = message.called % 1000; if (prefix == 789 && message.duration < 60) { route = 'sip/gw1'; }",
+    "n = 0; i = 0; while (i < 10) { n = n + message.duration; i = i + 1; }",
+    0
+};
+
+
+BenchFields::BenchFields()
+    : m_params("")
+{
+    reset();
+}
+
+void BenchFields::reset()
+{
+    m_params.clearParams();
+    m_params.addParam("called","123456789");
+    m_params.addParam("caller","4001");
+    m_params.addParam("domain","example.com");
+    m_params.addParam("billid","1234567");
+    m_params.addParam("duration","42");
+    m_params.addParam("count","0");
+}
+
+bool BenchFields::runField(ObjList& stack, const ExpOperation& oper, GenObject* context)
+{
+    const String* val = m_params.getParam(oper.name());
+    if (!val)
+	return false;
+    ExpEvaluator::pushOne(stack,new ExpOperation(*val,oper.name(),true));
+    return true;
+}
+
+bool BenchFields::runAssign(ObjList& stack, const ExpOperation& oper, GenObject* context)
+{
+    m_params.setParam(oper.name(),oper);
+    return true;
+}
+
+
+// Evaluate an expression a number of times, return evaluations per second
+static unsigned int bench(ExpEvaluator& eval, unsigned int count, String& result)
+{
+    ObjList stack;
+    u_int64_t start = Time::now();
+    for (unsigned int i = 0; i < count; i++) {
+	if (!eval.evaluate(stack))
+	    return 0;
+    }
+    u_int64_t usec = Time::now() - start;
+    for (ObjList* l = stack.skipNull(); l; l = l->skipNext()) {
+	const ExpOperation* op = static_cast<const ExpOperation*>(l->get());
+	result.append(op->name() + "=" + *op,",");
+    }
+    if (!usec)
+	usec = 1;
+    return (unsigned int)(count * (u_int64_t)1000000 / usec);
+}
+
+// Run a Javascript a number of times, return runs per second
+static unsigned int benchJs(JsParser& parser, unsigned int count, String& result)
+{
+    ScriptContext* ctx = parser.createContext();
+    JsObject* jso = new JsObject;
+    jso->params().addParam("called","123456789");
+    jso->params().addParam("caller","4001");
+    jso->params().addParam("domain","example.com");
+    jso->params().addParam("billid","1234567");
+    jso->params().addParam("duration","42");
+    ctx->params().setParam(new NamedPointer("message",jso,jso->toString()));
+    ScriptRun* runner = parser.createRunner(ctx);
+    TelEngine::destruct(ctx);
+    if (!runner)
+	return 0;
+    u_int64_t start = Time::now();
+    for (unsigned int i = 0; i < count; i++) {
+	if (runner->run() != ScriptRun::Succeeded) {
+	    TelEngine::destruct(runner);
+	    return 0;
+	}
+    }
+    u_int64_t usec = Time::now() - start;
+    for (ObjList* l = runner->stack().skipNull(); l; l = l->skipNext()) {
+	const ExpOperation* op = static_cast<const ExpOperation*>(l->get());
+	result.append(op->name() + "=" + *op,",");
+    }
+    // Variables set by the script
+    const NamedList& vars = runner->context()->params();
+    for (unsigned int i = 0; i < vars.length(); i++) {
+	const NamedString* ns = vars.getParam(i);
+	if (ns && !YOBJECT(NamedPointer,ns))
+	    result.append(ns->name() + "=" + *ns,",");
+    }
+    TelEngine::destruct(runner);
+    if (!usec)
+	usec = 1;
+    return (unsigned int)(count * (u_int64_t)1000000 / usec);
+}
+
+// Append a line with the results of a benchmark
+static void report(String& ret, unsigned int interp, unsigned int code, const char* script,
+    bool compiled, const String& res1, const String& res2)
+{
+    char buf[80];
+    ::snprintf(buf,sizeof(buf),"%21u  %18u  %6.2fx  ",interp,code,
+	interp ? (double)code / interp : 0.0);
+    ret << buf << script;
+    if (!compiled)
+	ret << "  (interpreted)";
+    if (res1 != res2)
+	ret << "  (results differ: '" << res1 << "' '" << res2 << "')";
+    ret << "\r\n";
+}
+
+// Command: scriptbench [iterations]
+bool BenchHandler::received(Message &msg)
+{
+    String line(msg.getValue(YSTRING("line")));
+    if (!line.startSkip(s_cmd)) {
+	line = msg.getValue(YSTRING("partline"));
+	if (line.null() && String(s_cmd).startsWith(msg.getValue(YSTRING("partword"))))
+	    msg.retValue().append(s_cmd,"\t");
+	return false;
+    }
+    unsigned int count = 100000;
+    int tmp = line.toInteger(-1);
+    if (tmp > 0)
+	count = (tmp > 10000000) ? 10000000 : tmp;
+    String& ret = msg.retValue();
+    ret << "Interpreted (evals/s)  Bytecode (evals/s)  Speedup  Expression\r\n";
+    for (int i = 0; s_scripts[i]; i++) {
+	BenchFields fields;
+	ExpEvaluator eval(ExpEvaluator::C);
+	eval.extender(&fields);
+	if (!eval.compile(s_scripts[i])) {
+	    ret << "compile failed: " << s_scripts[i] << "\r\n";
+	    continue;
+	}
+	eval.simplify();
+	String res1;
+	unsigned int interp = bench(eval,count,res1);
+	fields.reset();
+	bool compiled = eval.buildBytecode();
+	String res2;
+	unsigned int code = bench(eval,count,res2);
+	eval.extender(0);
+	report(ret,interp,code,s_scripts[i],compiled,res1,res2);
+    }
+    ret << "Interpreted (runs/s)   Bytecode (runs/s)   Speedup  Javascript\r\n";
+    for (int i = 0; s_jsScripts[i]; i++) {
+	JsParser parser;
+	ExpEvaluator* eval = parser.parse(s_jsScripts[i]) ?
+	    YOBJECT(ExpEvaluator,parser.code()) : 0;
+	if (!eval) {
+	    ret << "parse failed: " << s_jsScripts[i] << "\r\n";
+	    continue;
+	}
+	eval->clearBytecode();
+	String res1;
+	unsigned int interp = benchJs(parser,count,res1);
+	bool compiled = eval->buildBytecode();
+	String res2;
+	unsigned int code = benchJs(parser,count,res2);
+	report(ret,interp,code,s_jsScripts[i],compiled,res1,res2);
+    }
+    return true;
+}
+
+
+ScriptBench::ScriptBench()
+    : Plugin("scriptbench"),
+      m_handler(0)
+{
+    Output("Loaded module ScriptBench");
+}
+
+ScriptBench::~ScriptBench()
+{
+    Output("Unloading module ScriptBench");
+}
+
+void ScriptBench::initialize()
+{
+    if (!m_handler) {
+	Output("Initializing module ScriptBench");
+	m_handler = new BenchHandler;
+	Engine::install(m_handler);
+    }
+}
+
+}; // anonymous namespace
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -0,0 +1,99 @@
+#! /usr/bin/perl
+
+# Decoder for the binary message trace files dumped by the msgsniff module
+# with the "sniffer trace dump [filename]" command
+#
+# Usage: msgtrace.pl [-n name_regexp] [-p] tracefile...
+#   -n  Only show messages whose name matches the regular expression
+#   -p  Do not show the message parameters
+
+use strict;
+use warnings;
+
+my $match;
+my $params = 1;
+while (@ARGV && $ARGV[0] =~ /^-/) {
+    my $opt = shift @ARGV;
+    if ($opt eq "-n") {
+	$match = shift @ARGV;
+    }
+    elsif ($opt eq "-p") {
+	$params = 0;
+    }
+    else {
+	die "Unknown option $opt\nUsage: $0 [-n name_regexp] [-p] tracefile...\n";
+    }
+}
+die "Usage: $0 [-n name_regexp] [-p] tracefile...\n" unless @ARGV;
+
+# Integers are stored in big endian (network) order
+sub u64($$)
+{
+    my ($hi,$lo) = unpack("NN",substr($_[0],$_[1],8));
+    return $hi * 4294967296 + $lo;
+}
+
+sub str($$)
+{
+    my ($buf,$pos) = @_;
+    my $len = unpack("n",substr($buf,$$pos,2));
+    my $s = substr($buf,$$pos + 2,$len);
+    $$pos += 2 + $len;
+    return $s;
+}
+
+sub timestr($)
+{
+    my $t = shift;
+    return sprintf("%u.%06u",int($t / 1000000),$t % 1000000);
+}
+
+foreach my $file (@ARGV) {
+    open(my $fh,"<",$file) or die "Cannot open $file: $!\n";
+    binmode($fh);
+    my $hdr;
+    if ((read($fh,$hdr,8) != 8) || (substr($hdr,0,4) ne "YTRC")) {
+	warn "Not a message trace file: $file\n";
+	close($fh);
+	next;
+    }
+    my $ver = unpack("N",substr($hdr,4,4));
+    if ($ver != 1) {
+	warn "Unsupported trace version $ver in $file\n";
+	close($fh);
+	next;
+    }
+    my $count = 0;
+    my $lbuf;
+    while (read($fh,$lbuf,4) == 4) {
+	my $len = unpack("N",$lbuf);
+	my $rec;
+	if (($len < 4) || (read($fh,$rec,$len - 4) != $len - 4)) {
+	    warn "Truncated record in $file\n";
+	    last;
+	}
+	my $flags = unpack("C",$rec);
+	my $created = u64($rec,1);
+	my $done = u64($rec,9);
+	my $pos = 17;
+	my $name = str($rec,\$pos);
+	my $retval = str($rec,\$pos);
+	my $thread = str($rec,\$pos);
+	my $n = unpack("n",substr($rec,$pos,2));
+	$pos += 2;
+	next if (defined($match) && ($name !~ /$match/));
+	$count++;
+	printf("Returned %s '%s' time=%s delay=%s%s\n  thread='%s'\n  retval='%s'\n",
+	    (($flags & 1) ? "true" : "false"),$name,timestr($created),
+	    timestr($done - $created),(($flags & 2) ? " (broadcast)" : ""),
+	    $thread,$retval);
+	next unless $params;
+	for (my $i = 0; $i < $n; $i++) {
+	    my $pn = str($rec,\$pos);
+	    my $pv = str($rec,\$pos);
+	    print "  param['$pn'] = '$pv'\n";
+	}
+    }
+    close($fh);
+    print STDERR "$file: $count records\n";
+}
@@ -548,6 +548,35 @@ public:
      */
     static void enableOutput(bool enable = true, bool colorize = false);
 
+    /**
+     * Enable or disable asynchronous output.
+     * When enabled messages are put in a lock-free queue and written in
+     *  batches by a dedicated thread. Messages are dropped if the queue is full
+     * @param slots Number of messages that can be queued, zero to write
+     *  synchronously. The queue size is set only on first enable
+     * @return True if asynchronous output is active
+     */
+    static bool setAsync(unsigned int slots);
+
+    /**
+     * Check if asynchronous output is active
+     * @return True if messages are written by the output thread
+     */
+    static bool async();
+
+    /**
+     * Write out all messages still in the asynchronous output queue.
+     * This method can be called from a crash signal handler
+     */
+    static void flush();
+
+    /**
+     * Retrieve asynchronous output counters
+     * @param written Number of messages written by the output thread
+     * @param dropped Number of messages dropped because the queue was full
+     */
+    static void asyncStats(unsigned int& written, unsigned int& dropped);
+
     /**
      * Retrieve the format of timestamps
      * @return The current formatting type for timestamps
@@ -2681,11 +2710,12 @@ public:
     virtual void* getObject(const String& name) const;
 
     /**
-     * Get the number of hash entries
+     * Get the number of hash entries, while a resize is in progress this
+     *  includes the entries of the table being migrated
      * @return Count of hash entries
      */
     inline unsigned int length() const
-	{ return m_size; }
+	{ return m_old ? (m_size + m_oldSize) : m_size; }
 
     /**
      * Get the number of non-null objects in the list
@@ -2700,7 +2730,8 @@ public:
      * @return Pointer to the list or NULL
      */
     inline ObjList* getList(unsigned int index) const
-	{ return (index < m_size) ? m_lists[index] : 0; }
+	{ return (index < m_size) ? m_lists[index] :
+	    ((m_old && (index - m_size) < m_oldSize) ? m_old[index - m_size] : 0); }
 
     /**
      * Retrieve one of the internal object lists knowing the hash value.
@@ -2708,7 +2739,7 @@ public:
      * @return Pointer to the list or NULL if never filled
      */
     inline ObjList* getHashList(unsigned int hash) const
-	{ return getList(hash % m_size); }
+	{ return getList(index(hash)); }
 
     /**
      * Retrieve one of the internal object lists knowing the String value.
@@ -2774,9 +2805,56 @@ public:
      */
     bool resync();
 
+    /**
+     * Enable or disable automatic growth of the hash table. When the average
+     *  number of objects per entry exceeds the maximum load the table is
+     *  grown and objects are moved incrementally to the new entries, a few
+     *  entries on each append. Objects added directly to the lists returned by
+     *  getHashList() are also handled, their order inside a list is kept only
+     *  relative to objects coming from the same old entry
+     * @param maxLoad Maximum average objects per hash entry, zero to disable
+     * @param maxSize Maximum number of hash entries the table can grow to
+     */
+    void autoResize(unsigned int maxLoad = 4, unsigned int maxSize = 65521);
+
+    /**
+     * Retrieve the maximum load that triggers an automatic resize
+     * @return Maximum average objects per hash entry, zero if disabled
+     */
+    inline unsigned int maxLoad() const
+	{ return m_maxLoad; }
+
+    /**
+     * Check if the list is currently moving objects to a larger hash table
+     * @return True if a resize is in progress
+     */
+    inline bool resizing() const
+	{ return m_old != 0; }
+
+    /**
+     * Collect hash distribution statistics
+     * @param buckets Set to the number of hash entries in use by the table
+     * @param used Set to the number of hash entries holding at least one object
+     * @param longest Set to the number of objects in the longest entry
+     * @return Count of non-null objects in the list
+     */
+    unsigned int stats(unsigned int& buckets, unsigned int& used, unsigned int& longest) const;
+
 private:
+    inline unsigned int index(unsigned int hash) const
+	{ return (m_old && (hash % m_oldSize) >= m_moved) ?
+	    m_size + (hash % m_oldSize) : (hash % m_size); }
+    ObjList*& bucket(unsigned int hash);
+    void grow();
+    void migrate(unsigned int entries);
     unsigned int m_size;
     ObjList** m_lists;
+    ObjList** m_old;
+    unsigned int m_oldSize;
+    unsigned int m_moved;
+    unsigned int m_maxLoad;
+    unsigned int m_maxSize;
+    unsigned int m_appends;
 };
 
 /**
@@ -4191,6 +4269,17 @@ public:
      */
     explicit Mutex(bool recursive = false, const char* name = 0);
 
+    /**
+     * Construct a new unlocked mutex of an explicit implementation,
+     *  regardless of the one selected for new mutexes
+     * @param recursive True if the mutex has to be recursive (reentrant),
+     *  false for a normal fast mutex
+     * @param name Static name of the mutex (for debugging purpose only)
+     * @param adaptive True to create an adaptive futex based mutex if
+     *  supported, false for the platform default implementation
+     */
+    Mutex(bool recursive, const char* name, bool adaptive);
+
     /**
      * Copy constructor, creates a shared mutex
      * @param original Reference of the mutex to share
@@ -4258,6 +4347,61 @@ public:
      */
     static bool efficientTimedLock();
 
+    /**
+     * Select the implementation of the mutexes created from now on.
+     * The adaptive mutexes spin a little before sleeping in the kernel and
+     *  support efficient timed locks. Existing mutexes are not affected
+     * @param enable True to use adaptive futex based mutexes, false for the
+     *  platform default implementation
+     * @return True if the requested implementation is available
+     */
+    static bool adaptive(bool enable);
+
+    /**
+     * Check if new mutexes use the adaptive implementation
+     * @return True if adaptive futex based mutexes are created
+     */
+    static bool adaptive();
+
+    /**
+     * Check if adaptive futex based mutexes are supported on this platform
+     * @return True if adaptive mutexes can be created
+     */
+    static bool adaptiveSupported();
+
+    /**
+     * Order of the mutex contention statistics
+     */
+    enum ProfileOrder {
+	ProfileLocks = 0,
+	ProfileContended,
+	ProfileWait,
+	ProfileHold
+    };
+
+    /**
+     * Enable or disable collecting contention statistics of all mutexes.
+     * Statistics are kept per mutex name and updated without a global lock
+     * @param enable True to measure lock wait and hold times
+     * @return True if contention profiling is supported on this platform
+     */
+    static bool profile(bool enable);
+
+    /**
+     * Check if contention statistics are being collected
+     * @return True if mutex contention profiling is active
+     */
+    static bool profile();
+
+    /**
+     * Append the mutex contention statistics to a status string
+     * @param str String to append the statistics to
+     * @param order Column used to sort entries in descending order
+     * @param reset True to clear all counters after retrieving them
+     * @return Number of entries appended
+     */
+    static unsigned int profileStatus(String& str, ProfileOrder order = ProfileWait, bool reset = false);
+
 private:
     MutexPrivate* privDataCopy() const;
     MutexPrivate* m_private;
@@ -4530,6 +4674,143 @@ private:
     inline void* operator new[](size_t);
 };
 
+/**
+ * A hashed object list that can be used from multiple threads. Objects are
+ *  spread by hash over a number of stripes, each being a HashList protected
+ *  by its own mutex so threads working on different stripes never contend.
+ * The number of stripes should be a power of two and the hash size an odd
+ *  number so objects are distributed evenly inside each stripe.
+ * @short A lock striped concurrent hash list
+ */
+class YATE_API SharedHashList : public GenObject
+{
+    YNOCOPY(SharedHashList); // no automatic copies please
+public:
+    /**
+     * Creates a new, empty list
+     * @param size Initial number of hash entries in each stripe
+     * @param stripes Number of independently locked stripes
+     * @param name Static name of the stripe mutexes (for debugging purpose only)
+     */
+    explicit SharedHashList(unsigned int size = 17, unsigned int stripes = 16,
+	const char* name = 0);
+
+    /**
+     * Destroys the list and everything in it
+     */
+    virtual ~SharedHashList();
+
+    /**
+     * Get a pointer to a derived class given that class name
+     * @param name Name of the class we are asking for
+     * @return Pointer to the requested class or NULL if this object doesn't implement it
+     */
+    virtual void* getObject(const String& name) const;
+
+    /**
+     * Get the number of stripes
+     * @return Count of independently locked stripes
+     */
+    inline unsigned int stripes() const
+	{ return m_stripes; }
+
+    /**
+     * Retrieve the stripe index of a String value
+     * @param str String value (toString) of an object
+     * @return Index of the stripe holding objects with that value
+     */
+    inline unsigned int stripe(const String& str) const
+	{ return str.hash() % m_stripes; }
+
+    /**
+     * Retrieve the mutex protecting a stripe
+     * @param index Index of the stripe
+     * @return Valid Mutex pointer
+     */
+    inline Mutex* mutex(unsigned int index) const
+	{ return m_locks.mutex(index); }
+
+    /**
+     * Retrieve the list of a stripe. The list must be accessed only while
+     *  holding the stripe's mutex
+     * @param index Index of the stripe
+     * @return Valid HashList pointer
+     */
+    inline HashList* list(unsigned int index) const
+	{ return m_lists[index % m_stripes]; }
+
+    /**
+     * Enable or disable automatic growth of each stripe
+     * @param maxLoad Maximum average objects per hash entry, zero to disable
+     * @param maxSize Maximum number of hash entries each stripe can grow to
+     */
+    void autoResize(unsigned int maxLoad = 4, unsigned int maxSize = 65521);
+
+    /**
+     * Get the number of non-null objects in all stripes
+     * @return Count of items
+     */
+    unsigned int count() const;
+
+    /**
+     * Appends an object to the list
+     * @param obj Pointer to the object to append
+     * @param autoDelete True to delete the object when removed from list
+     * @return True if the object was appended
+     */
+    bool append(const GenObject* obj, bool autoDelete = true);
+
+    /**
+     * Delete the first object with a given String value
+     * @param str String value (toString) of the object to remove
+     * @param delobj True to delete the object (default)
+     * @return Pointer to the object if not destroyed
+     */
+    GenObject* remove(const String& str, bool delobj = true);
+
+    /**
+     * Delete the list item that holds a given object
+     * @param obj Object to remove from the list
+     * @param delobj True to delete the object (default)
+     * @return Pointer to the object if not destroyed
+     */
+    GenObject* remove(GenObject* obj, bool delobj = true);
+
+    /**
+     * Find an object by String value and get a reference to it
+     * @param str String value (toString) of the object to search for
+     * @return Referenced pointer to the object or NULL if not found or the
+     *  object is not a RefObject
+     */
+    RefObject* find(const String& str) const;
+
+    /**
+     * Check if an object with a given String value is in the list
+     * @param str String value (toString) of the object to search for
+     * @return True if an object was found
+     */
+    bool contains(const String& str) const;
+
+    /**
+     * Clear all stripes and delete the objects that are owned by the list
+     */
+    void clear();
+
+    /**
+     * Collect hash distribution statistics over all stripes
+     * @param buckets Set to the total number of hash entries
+     * @param used Set to the number of hash entries holding at least one object
+     * @param longest Set to the number of objects in the longest entry
+     * @return Count of non-null objects in the list
+     */
+    unsigned int stats(unsigned int& buckets, unsigned int& used, unsigned int& longest) const;
+
+private:
+    MutexPool m_locks;
+    HashList** m_lists;
+    unsigned int m_stripes;
+};
+
 /**
  * This class holds the action to execute a certain task, usually in a
  *  different execution thread.
@@ -4731,6 +5012,44 @@ public:
      */
     static const char* priority(Priority prio);
 
+    /**
+     * Set the CPUs this thread is allowed to run on
+     * @param cpus List of CPU numbers and ranges like "0-3,8", empty for all
+     * @return True if the CPU affinity was set, false if failed or unsupported
+     */
+    bool setAffinity(const String& cpus);
+
+    /**
+     * Retrieve the CPUs this thread is allowed to run on
+     * @param cpus String to fill with the list of CPU numbers and ranges
+     * @return True if the CPU affinity was retrieved
+     */
+    bool getAffinity(String& cpus) const;
+
+    /**
+     * Set the CPUs the calling thread is allowed to run on.
+     * This also works for threads not created by the Thread class
+     * @param cpus List of CPU numbers and ranges like "0-3,8", empty for all
+     * @return True if the CPU affinity was set, false if failed or unsupported
+     */
+    static bool setCurrentAffinity(const String& cpus);
+
+    /**
+     * Set the CPU affinity applied to threads when they start running.
+     * Each parameter name is a thread name, a trailing '*' matches all
+     *  names starting with the text before it. The value is a CPU list
+     * @param map List of thread names and CPUs they are allowed to run on
+     * @param running Also apply the new map to threads already running
+     */
+    static void setAffinityMap(const NamedList& map, bool running = true);
+
+    /**
+     * Append the CPU affinity of threads that have one set to a status string
+     * @param str String to append "name=cpus" items to, CPUs are separated by spaces
+     * @return Number of threads with a CPU affinity set
+     */
+    static unsigned int affinityStatus(String& str);
+
     /**
      * Kills all other running threads. Ouch!
      * Must be called from the main thread or it does nothing.
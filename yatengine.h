@@ -56,6 +56,11 @@ public:
      */
     explicit Configuration(const char* filename, bool warn = true);
 
+    /**
+     * Destructor, releases the section index
+     */
+    ~Configuration();
+
     /**
      * Assignment from string operator
      */
@@ -207,10 +212,49 @@ public:
      */
     bool save() const;
 
+    /**
+     * Enable or disable the change journal.
+     * When enabled the changed sections are remembered and saveChanges() only
+     *  appends them to a journal file next to the configuration file.
+     * The journal is replayed by load() so it must be enabled before loading
+     * @param maxEntries Number of journal entries after which the whole file is
+     *  saved and the journal is discarded, zero to disable the journal
+     */
+    void setJournal(unsigned int maxEntries = 1000);
+
+    /**
+     * Get the number of journal entries that trigger a full save
+     * @return Maximum journal entries, zero if the journal is disabled
+     */
+    inline unsigned int journal() const
+	{ return m_journal; }
+
+    /**
+     * Mark a section as changed so it will be written by saveChanges().
+     * This must be called after directly altering the content of a section
+     *  retrieved by getSection() or createSection()
+     * @param sect Name of the changed or deleted section
+     */
+    void sectionChanged(const String& sect);
+
+    /**
+     * Save the changed sections to the journal file or the whole configuration
+     *  to file if the journal is disabled or grew too large
+     * @return True if successfull, false for failure
+     */
+    bool saveChanges();
+
 private:
-    ObjList *getSectHolder(const String& sect) const;
-    ObjList *makeSectHolder(const String& sect);
+    NamedList* makeSection(const String& sect);
+    void indexSection(NamedList* sect);
+    void unindexSection(NamedList* sect);
+    bool loadFile(const char* file, bool journal);
     ObjList m_sections;
+    HashList* m_index;
+    unsigned int m_indexed;
+    HashList* m_changed;
+    unsigned int m_journal;
+    unsigned int m_entries;
 };
 
 class MessageDispatcher;
@@ -369,6 +413,54 @@ public:
      */
     int decode(const char* str, bool& received, const char* id);
 
+    /**
+     * Encode the message into a binary frame adequate for sending for processing
+     * to an external communication interface.
+     * All integers are 32 bit in network byte order and strings are sent as
+     *  their length followed by the unescaped bytes. A frame holds its length
+     *  (not including itself), the '>' type byte, the identifier, the message
+     *  time in seconds, the name, the return value, the number of parameters
+     *  and the name and value of each parameter
+     * @param frame Data block to append the frame to
+     * @param id Unique identifier to add to the frame
+     */
+    void encodeFrame(DataBlock& frame, const char* id) const;
+
+    /**
+     * Encode the message into a binary frame adequate for sending as answer
+     * to an external communication interface. The frame has the same layout
+     * as the one for processing but with a '<' type byte and the processed
+     * flag (0 or 1) instead of the message time
+     * @param frame Data block to append the frame to
+     * @param received True if message was processed locally
+     * @param id Unique identifier to add to the frame
+     */
+    void encodeFrame(DataBlock& frame, bool received, const char* id) const;
+
+    /**
+     * Decode a binary frame from an external communication interface for
+     * processing in the engine. The message is modified accordingly.
+     * @param data Pointer to the start of a complete frame
+     * @param len Length of available data, must hold at least the frame
+     * @param id A String object in which the identifier is stored
+     * @return -2 for success, -1 if the data was not a binary form of a
+     * message, offset of first erroneous byte if failed
+     */
+    int decodeFrame(const void* data, unsigned int len, String& id);
+
+    /**
+     * Decode a binary frame from an external communication interface that is
+     * an answer to a specific external processing request.
+     * A parameter value with all bits of the length set clears the parameter
+     * @param data Pointer to the start of a complete frame
+     * @param len Length of available data, must hold at least the frame
+     * @param received Pointer to variable to store the dispatch return value
+     * @param id The identifier expected
+     * @return -2 for success, -1 if the data was not the expected answer,
+     * offset of first erroneous byte if failed
+     */
+    int decodeFrame(const void* data, unsigned int len, bool& received, const char* id);
+
 protected:
     /**
      * Notify the message it has been dispatched.
@@ -386,8 +478,12 @@ private:
     RefObject* m_data;
     bool m_notify;
     bool m_broadcast;
+    u_int64_t m_queued;
     void commonEncode(String& str) const;
     int commonDecode(const char* str, int offs);
+    void commonEncode(DataBlock& frame, char type, const char* id, u_int32_t value) const;
+    int commonDecode(const void* data, unsigned int len, char type,
+	const char* expect, String* id, u_int32_t& value);
 };
 
 /**
@@ -459,6 +555,19 @@ public:
      */
     void clearFilter();
 
+    /**
+     * Retrieve the name used to identify the owner of this handler
+     * @return Tracking name of the handler, usually the module name
+     */
+    inline const String& trackName() const
+	{ return m_trackName; }
+
+    /**
+     * Set the name used to identify the owner of this handler in statistics
+     * @param name Tracking name of the handler, usually the module name
+     */
+    void setTrackName(const char* name);
+
 protected:
     /**
      * Remove the handler from its dispatcher, remove any installed filter.
@@ -473,6 +582,8 @@ private:
     int m_unsafe;
     MessageDispatcher* m_dispatcher;
     NamedString* m_filter;
+    String m_trackName;
+    GenObject* m_stats;
 };
 
 /**
@@ -638,11 +749,35 @@ public:
     inline void warnTime(u_int64_t usec)
 	{ m_warnTime = usec; }
 
+    /**
+     * Enable or disable collecting per handler dispatch statistics
+     * @param enable True to measure the time spent in each handler
+     */
+    inline void profile(bool enable)
+	{ m_profile = enable; }
+
+    /**
+     * Check if per handler dispatch statistics are collected
+     * @return True if the time spent in each handler is measured
+     */
+    inline bool profile() const
+	{ return m_profile; }
+
+    /**
+     * Append the per handler dispatch statistics to a status string.
+     * Entries are keyed by message name, handler tracking name and priority
+     *  and are sorted by the total time spent in the handler
+     * @param str String to append the statistics to
+     * @param reset True to clear all counters after retrieving them
+     * @return Number of entries appended
+     */
+    unsigned int profileStatus(String& str, bool reset = false);
+
     /**
      * Clear all the message handlers and post-dispatch hooks
      */
     inline void clear()
-	{ m_handlers.clear(); m_hooks.clear(); }
+	{ m_handlers.clear(); m_hooks.clear(); m_stats.clear(); }
 
     /**
      * Get the number of messages waiting in the queue
@@ -663,12 +798,25 @@ public:
      */
     void setHook(MessagePostHook* hook, bool remove = false);
 
+    /**
+     * Retrieve and reset the statistics of time spent by messages in queue
+     * @param minDelay Shortest time in microseconds a message waited
+     * @param maxDelay Longest time in microseconds a message waited
+     * @return Number of messages dequeued since the previous call
+     */
+    unsigned int queueDelay(u_int64_t& minDelay, u_int64_t& maxDelay);
+
 private:
     ObjList m_handlers;
     ObjList m_messages;
     ObjList m_hooks;
     unsigned int m_changes;
     u_int64_t m_warnTime;
+    unsigned int m_dequeued;
+    u_int64_t m_delayMin;
+    u_int64_t m_delayMax;
+    bool m_profile;
+    HashList m_stats;
 };
 
 /**
@@ -888,6 +1036,15 @@ public:
 	return s_accept;
     }
 
+    /**
+     * Get the call accept status computed by the engine overload control.
+     * This is independent of the status set by setAccept()
+     * @return Overload control call accept status, Accept if not enabled
+     */
+    inline static CallAccept overload() {
+	return s_overload;
+    }
+
     /**
      * Set call accept status
      * @param ca New call accept status as enumerated value
@@ -904,6 +1061,14 @@ public:
 	return s_callAccept;
     }
 
+    /**
+     * Check if a new call should be admitted by the engine overload control.
+     * When the engine is partially congested only a fraction of calls is
+     *  admitted, chosen randomly
+     * @return True if the call can be accepted, false to reject it
+     */
+    static bool admit();
+
     /**
      * Check if the engine is running as telephony client
      * @return True if the engine is running in client mode
@@ -1194,6 +1359,7 @@ private:
     static int s_haltcode;
     static RunMode s_mode;
     static CallAccept s_accept;
+    static CallAccept s_overload;
     static const TokenDict s_callAccept[];
 };
 
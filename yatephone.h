@@ -2185,7 +2185,9 @@ public:
     virtual bool canAccept(bool routers = true);
 
     /**
-     * Check if new incoming connections can be routed
+     * Check if new incoming connections can be routed.
+     * Connections are refused if the engine is congested and a fraction of
+     *  them is refused if the engine is partially congested
      * @return True if at least one new connection can be routed, false if not
      */
     virtual bool canRoute();